@@ -1 +1,6 @@
-gcc -g main.c -o main
\ No newline at end of file
+# sh compile.sh builds ./main for the tests, sh compile.sh bench builds an optimized ./main_bench for ./main_bench suite
+if [ "$1" = "bench" ]; then
+    gcc -O2 -g -pthread main.c -o main_bench
+else
+    gcc -g -pthread main.c -o main
+fi
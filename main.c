@@ -2,722 +2,11768 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-
-// The maximum hash bins for the IOFileHashTable to use
-#define MAX_HASHTABLE_BINS 2
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// The number of IOFile slots in every page of the IOFileTable
+#define IOFILE_TABLE_PAGE_SIZE 1024
+
+// The number of free and of closed fds a thread's fd cache holds, and how many fds it moves to and from the FdBitmap at once
+#define IO_FD_CACHE_SIZE 64
+#define IO_FD_CACHE_BATCH 32
+
+// The number of fds the FdBitmap tracks before it first has to grow
+#define FD_BITMAP_INITIAL_CAPACITY 64
+// Every level summarizes 64 words of the level below it, so 5 levels cover 64^5 fds
+#define FD_BITMAP_MAX_LEVELS 5
+#define FD_BITMAP_MAX_CAPACITY (1 << 30)
+
+// The size and alignment of every slab, objects are found from their slab by masking their address
+#define SLAB_SIZE 16384
+// Filenames and the data of small files are bump allocated from blocks of this size
+#define FS_ARENA_BLOCK_SIZE (1 << 18)
+// Files up to this size keep their data in the data arena instead of chunks of their own
+#define FS_ARENA_MAX_FILE_SIZE 4096
+// The number of files the parallel file arrays of a FileSystem start out with
+#define FS_FILES_INITIAL_CAPACITY 64
+
+// The number of buckets the filename index starts out with, always a power of 2
+#define FS_INDEX_INITIAL_CAPACITY 16
+// The number of old buckets moved into the new table by every insert while the index is resizing
+#define FS_INDEX_MIGRATE_STEP 8
+// The most negative entries the index keeps for names that were looked up and not found
+#define FS_INDEX_MAX_NEGATIVE 4096
+
+// File data is stored in chunks covering FS_CHUNK_SIZE bytes of the file each, a chunk's buffer starts
+// at FS_CHUNK_MIN_CAPACITY bytes and doubles as it is written to until it covers the whole chunk
+#define FS_CHUNK_SIZE 65536
+#define FS_CHUNK_MIN_CAPACITY 32
+// The number of chunk pointers the chunk table of an FSFile starts out with
+#define FS_CHUNK_TABLE_INITIAL_CAPACITY 4
+
+// Files on a backing store are cached in pages of this size, and io_module_init gives the page cache this many bytes
+#define IO_PAGE_SIZE 16384
+#define IO_PAGE_CACHE_DEFAULT_SIZE (32 << 20)
+// The share of the cached pages, in percent, that new pages sit in until they prove they're used again
+#define IO_PAGE_CACHE_PROBATION_PERCENT 25
+// Hits are counted across this many counters so threads hitting different pages don't fight over one cache line
+#define IO_PAGE_CACHE_STRIPES 16
+// The number of times a miss yields to the threads using the pages before giving up when every page is pinned
+#define IO_PAGE_CACHE_MAX_WAITS 1000
+
+// A sequential stream's readahead window starts at the minimum and doubles every time the reader catches up with
+// it, io_module_init caps it at the default maximum
+#define IO_READAHEAD_MIN_WINDOW 65536
+#define IO_READAHEAD_DEFAULT_MAX_WINDOW (1 << 20)
+// The number of readahead requests that can wait for the readahead thread, more are dropped
+#define IO_READAHEAD_QUEUE_SIZE 64
+
+// The number of workers a context runs async calls on unless configured otherwise, and the number of requests a worker's
+// queue and the completion queue start out with room for, they double as needed
+#define IO_ASYNC_DEFAULT_WORKERS 4
+#define IO_ASYNC_INITIAL_QUEUE_SIZE 64
+
+/////////////////////////////////////////
+/* Slab allocator for fixed size objects */
+/////////////////////////////////////////
+// Every cache hands out objects of one size carved out of SLAB_SIZE aligned slabs
+
+// A free object stores the link to the next free object in its own memory
+typedef struct SlabFreeObject {
+    struct SlabFreeObject* next;
+} SlabFreeObject;
+
+// Slab header which sits at the start of the slab's memory
+typedef struct Slab {
+    struct SlabCache* cache;
+    struct SlabFreeObject* free_objects;
+    int in_use;
+    // Every slab the cache owns
+    struct Slab* next;
+    // Slabs which still have free objects
+    struct Slab* next_partial;
+    struct Slab* prev_partial;
+} Slab;
+
+typedef struct SlabCache {
+    size_t object_size;
+    int objects_per_slab;
+    struct Slab* slabs;
+    struct Slab* partial;
+    int num_slabs;
+    int in_use;
+} SlabCache;
+
+// Occupancy of one or more slab caches
+typedef struct SlabStats {
+    int slabs;
+    int objects_in_use;
+    int objects_capacity;
+    int partial_slabs;
+    size_t bytes_reserved;
+    // Fraction of the reserved object space which is not in use
+    double fragmentation;
+} SlabStats;
 
 ///////////////////////////////////////
 /* Simple file system in a directory */
 ///////////////////////////////////////
 
-// File system file model
+// A read-only mmap of a host file, shared by the chunks that point into it and unmapped with the last of them
+typedef struct FSMapping {
+    int refs;
+    void* base;
+    size_t length;
+    // Set for blocks of the data arena, which are malloced instead of mapped and hold their chunks inside them
+    int arena;
+} FSMapping;
+
+// A piece of file data, only the chunk at the end of the file can have less than FS_CHUNK_SIZE capacity.
+// Read views hold a reference on the chunk, so a chunk with more than one reference is copied before it is written
+typedef struct FSChunk {
+    int refs;
+    size_t capacity;
+    char* data;
+    // The mapping the data points into, or NULL if the data follows the chunk. Mapped data is never written in place
+    struct FSMapping* mapping;
+} FSChunk;
+
+// A packed FileSystem image is laid out as an FSImageHeader, a table of index_capacity FSImageEntry buckets,
+// the filenames and then the file data. All offsets are from the start of the image
+#define FS_IMAGE_MAGIC "OSHIMG01"
+#define FS_IMAGE_VERSION 1
+
+typedef struct FSImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_files;
+    // Always a power of 2, buckets are probed linearly from the filename's hash
+    uint32_t index_capacity;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t names_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+} FSImageHeader;
+
+typedef struct FSImageEntry {
+    uint32_t hash;
+    // 0 for an empty bucket, filenames are never empty
+    uint32_t name_length;
+    uint64_t name_offset;
+    uint64_t data_offset;
+    uint64_t size;
+} FSImageEntry;
+
+// A loaded image, its files only get an FSFile the first time they're looked up
+typedef struct FSImage {
+    struct FSMapping* mapping;
+    const FSImageHeader* header;
+    const FSImageEntry* entries;
+    struct FSImage* next;
+} FSImage;
+
+// A chunk table with more than one chunk, clones share it until one of them changes it. The table holds one
+// reference on each of its chunks no matter how many files share it
+typedef struct FSChunkTable {
+    int refs;
+    struct FSChunk* chunks[];
+} FSChunkTable;
+
+// A place slower than memory for file data to live, like a local disk. Objects are opened by name, giving a handle
+// and their size, and read and written through the handle. Reads and writes return the bytes moved or -1 with errno set,
+// and reads only come back short at the end of the object
+typedef struct FSStore {
+    int (*open)(struct FSStore* store, const char* name, uint64_t* handle, size_t* size);
+    ssize_t (*read)(struct FSStore* store, uint64_t handle, void* buf, size_t count, size_t offset);
+    ssize_t (*write)(struct FSStore* store, uint64_t handle, const void* buf, size_t count, size_t offset);
+    void (*close)(struct FSStore* store, uint64_t handle);
+    void (*destroy)(struct FSStore* store);
+} FSStore;
+
+// A store keeping each object in a host file of the same name below root, the handle is the open host fd
+typedef struct FSDiskStore {
+    FSStore store;
+    char* root;
+} FSDiskStore;
+
+// A store in front of another store that waits out a fixed latency before each read and write, to stand in for slow
+// hardware. It owns the store it wraps
+typedef struct FSSlowStore {
+    FSStore store;
+    FSStore* inner;
+    long read_latency_ns;
+    long write_latency_ns;
+} FSSlowStore;
+
+// The object a stored file's data lives in, the id tells its pages apart from other objects' in the page cache
+typedef struct FSStoreObject {
+    struct FSStore* store;
+    uint64_t handle;
+    uint64_t id;
+} FSStoreObject;
+
+// A host directory mounted into the FileSystem, its files are found under root by their filename
+typedef struct FSMount {
+    char* root;
+    struct FSMount* next;
+} FSMount;
+
+// A buffer for vectored reads and writes, like POSIX's struct iovec
+typedef struct IOVec {
+    void* base;
+    size_t length;
+} IOVec;
+
+// Zero-copy view of file data, the data stays valid until the view is released
+typedef struct IOView {
+    const char* data;
+    size_t length;
+    // The chunk the view holds a reference on, NULL when the view is of never written zeros
+    struct FSChunk* chunk;
+    // The page cache frame the view has pinned when the view is of a stored file
+    struct IOPageFrame* frame;
+} IOView;
+
+// File system file model, a NULL chunk has never been written and reads back as zeros.
+// Readers of the file's data share its lock while writers hold it exclusively
 typedef struct FSFile {
     char* filename;
-    char* data;
-    int size;
-    struct FSFile* next;
+    pthread_rwlock_t lock;
+    struct FSChunk** chunks;
+    size_t num_chunks;
+    size_t chunks_capacity;
+    size_t size;
+    // The mount the file's data still has to be mapped in from, NULL once the data is in place
+    struct FSMount* mount;
+    // Where chunks points, either the chunk table of a file with a single chunk so that small files don't need a
+    // table of their own, or a table that can be shared with clones
+    struct FSChunk* first_chunk;
+    struct FSChunkTable* table;
+    // The object on a backing store the file's data lives in instead of chunks, NULL for files kept in memory
+    struct FSStoreObject* stored;
 } FSFile;
 
-// File system container
+// Directory entry of the index, the hash and length let most mismatches be rejected without a strcmp
+typedef struct FSIndexEntry {
+    uint32_t hash;
+    uint32_t length;
+    // The id of the directory the entry is in
+    uint32_t parent;
+    // The entry's name within its directory, it points into the path of the file or directory it names.
+    // A NULL name marks an empty bucket
+    const char* name;
+    // What the name is, an entry with neither is a negative entry recording that the name isn't there
+    struct FSFile* file;
+    struct FSDirectory* directory;
+} FSIndexEntry;
+
+// Open addressing hash of the directory entries keyed by their directory and name, a resize moves the old buckets
+// over a few at a time
+typedef struct FSIndex {
+    struct FSIndexEntry* entries;
+    int capacity;
+    int count;
+    // The entries that are negative, these are counted in count too
+    int negative;
+    // The table being migrated away from while a resize is in progress
+    struct FSIndexEntry* old_entries;
+    int old_capacity;
+    int migrate_pos;
+} FSIndex;
+
+// A directory of a FileSystem, directories are made along with the files below them and never removed
+typedef struct FSDirectory {
+    // The path from the root without a trailing '/', the root's path is empty
+    const char* path;
+    uint32_t path_length;
+    uint32_t id;
+    struct FSDirectory* parent;
+} FSDirectory;
+
+// A block of a bump allocated arena, its data follows it and is only freed along with the file system
+typedef struct FSArenaBlock {
+    struct FSArenaBlock* next;
+    size_t used;
+    size_t capacity;
+} FSArenaBlock;
+
+// File system container, the parallel file arrays keep the files in insertion order.
+// Lookups share the lock while adding a file holds it exclusively
 typedef struct FileSystem {
-    struct FSFile* front;
-    struct FSFile* back;
+    // Every file along with its name's length and hash, so that scans of the names don't touch the FSFiles
+    struct FSFile** files;
+    const char** names;
+    uint32_t* name_lengths;
+    uint32_t* hashes;
+    size_t num_files;
+    size_t files_capacity;
+    struct FSIndex* index;
+    // The directories are allocated from a cache, and their ids are handed out in order starting from the root's 0
+    struct FSDirectory* root;
+    struct SlabCache* directory_cache;
+    uint32_t num_directories;
+    // Tells the file systems apart in the per thread path cache
+    uint64_t id;
+    pthread_rwlock_t lock;
+    struct FSMount* mounts;
+    struct FSImage* images;
+    // The FSFiles are allocated from a cache and their names from an arena
+    struct SlabCache* file_cache;
+    struct FSArenaBlock* name_blocks;
+    // The block of the data arena that small files are currently packed into, and the number of blocks made so far
+    struct FSMapping* data_block;
+    size_t data_block_used;
+    size_t data_blocks;
 } FileSystem;
 
-///////////////////////////////////////////
-/* Free list structures for reusing fd's */
-///////////////////////////////////////////
-// FreeList data queue for reusing inactive fd's
-
-typedef struct FreeListNode {
-    int fd;
-    struct FreeListNode* next; 
-} FreeListNode;
+// How crowded the filename index is, a probe length is the number of buckets a lookup of the file looks at
+typedef struct FSIndexStats {
+    size_t entries;
+    size_t capacity;
+    double load_factor;
+    double mean_probe_length;
+    size_t max_probe_length;
+    // The directories, and the entries for names that were looked up and not found
+    size_t directories;
+    size_t negative_entries;
+    // Set while entries are still being moved over to a bigger table
+    int resizing;
+} FSIndexStats;
+
+// Where the memory of a FileSystem goes, data mapped in from host files and images isn't counted
+typedef struct FSMemoryStats {
+    size_t num_files;
+    // The slabs of FSFiles and the blocks of the name arena
+    size_t file_bytes;
+    size_t name_bytes;
+    // The directory index and the directories, the parallel file arrays and the chunk tables that outgrew their FSFile
+    size_t table_bytes;
+    // The blocks of the data arena and chunks that have an allocation of their own
+    size_t chunk_bytes;
+    // The total size of the files, the rest of the bytes are overhead
+    size_t data_bytes;
+    double overhead_per_file;
+} FSMemoryStats;
 
-typedef struct FreeList {
-    struct FreeListNode* front;
-    struct FreeListNode* back;
-    int length;
-} FreeList;
+///////////////////////////////////////
+/* Page cache for stored files       */
+///////////////////////////////////////
 
-//////////////////////////////////////////////////////////
-/* Hash table for rapid access of file objects (IOFile) */
-//////////////////////////////////////////////////////////
-// This file will possibly be linked to another IOFile who's fd hash is the same as this file's fd hash
+// A page of a stored file held by the page cache. Lookups pin the frame without taking the cache's lock,
+// and a frame can only be handed to another page while nobody has it pinned
+typedef struct IOPageFrame {
+    // The page held, an object id of 0 means the frame holds nothing
+    uint64_t object_id;
+    uint64_t page;
+    // The number of readers using the data, or -1 while the frame is being handed to another page
+    int pins;
+    // Set by hits, the main queue's clock clears it as it sweeps past
+    int referenced;
+    // Set until the data has been read in from the store, error is the errno if that failed
+    int loading;
+    int error;
+    // Set while a page read in ahead of time hasn't been read yet
+    int prefetched;
+    // The bytes of the page the store had when it was read in
+    size_t length;
+    char* data;
+    // The next frame in the same hash bucket, and the frame's neighbours in its queue
+    int hash_next;
+    int queue;
+    int queue_prev;
+    int queue_next;
+} IOPageFrame;
+
+// The queue a frame is in
+#define IO_PAGE_QUEUE_FREE 0
+#define IO_PAGE_QUEUE_PROBATION 1
+#define IO_PAGE_QUEUE_MAIN 2
+
+// A hit counter on a cache line of its own
+typedef struct IOPageCacheStripe {
+    uint64_t hits;
+    char padding[56];
+} IOPageCacheStripe;
+
+// Fixed size cache of the pages of stored files with 2Q replacement. New pages wait in a probation FIFO and only
+// pages missed again soon after falling out of it make it into the main queue, which is swept by a clock.
+// Scanning a big file only cycles the probation queue and leaves the working set in the main queue alone
+typedef struct IOPageCache {
+    IOPageFrame* frames;
+    int num_frames;
+    char* data;
+    // Heads of the hash chains, changed under the lock and followed without it
+    int* buckets;
+    uint32_t bucket_mask;
+    // Keys of the pages recently evicted from probation, a direct mapped table where collisions forget the older page
+    uint64_t* ghosts;
+    uint32_t ghost_mask;
+    // Guards the queues, the hash chains and the ghosts, readers of a page still being read in wait on loaded
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    int free_head;
+    int probation_head;
+    int probation_tail;
+    int probation_count;
+    // The main queue is circular, new pages go in just behind the hand
+    int clock_hand;
+    int main_count;
+    IOPageCacheStripe hit_stripes[IO_PAGE_CACHE_STRIPES];
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t ghost_hits;
+    // Pages read in by readahead, and how many of them were read or evicted without ever being read
+    uint64_t prefetched;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_wasted;
+} IOPageCache;
+
+typedef struct IOPageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Misses on pages that fell out of probation recently, they go straight into the main queue
+    uint64_t ghost_hits;
+    uint64_t prefetched;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_wasted;
+    int num_pages;
+    int probation_pages;
+    int main_pages;
+    double hit_rate;
+} IOPageCacheStats;
+
+//////////////////////////////////////////////////
+/* Bitmap allocator for handing out the lowest fd */
+//////////////////////////////////////////////////
+// Level 0 has a set bit for every fd in use, every level above it has a set bit for every full word below it
+
+typedef struct FdBitmap {
+    uint64_t* levels[FD_BITMAP_MAX_LEVELS];
+    int level_words[FD_BITMAP_MAX_LEVELS];
+    int num_levels;
+    int capacity;
+} FdBitmap;
+
+////////////////////////////////////////////////////////
+/* fd table for rapid access of file objects (IOFile) */
+////////////////////////////////////////////////////////
+// IOFiles are stored inline in fixed size pages of slots indexed by their fd, lookups take no locks
+
+#define IOFILE_STATE_FREE 0
+#define IOFILE_STATE_OPEN 1
+#define IOFILE_STATE_CLOSED 2
 
 typedef struct IOFile {
     int fd;
-    int cursor_pos;
+    int state;
+    size_t cursor_pos;
     unsigned int mode_type;
     struct FSFile* fs_file;
-    struct IOFile* next;
+    // Serializes the reads and writes that move the cursor
+    pthread_mutex_t cursor_lock;
+    // Readahead state, guarded by the cursor lock. Only stored and mapped files are read ahead, a read starting where
+    // the last one ended is sequential, and readahead_end is how far the file has been read ahead of the cursor
+    int readahead;
+    size_t readahead_next;
+    size_t readahead_window;
+    size_t readahead_end;
+    // Link to the next closed fd waiting to be reused and the epoch the fd was closed in
+    int next_retired;
+    uint64_t retire_epoch;
 } IOFile;
 
-// Hash table will consist of array of IOFile pointers
-typedef IOFile** IOFileHashTable;
-
+// Pages never move once allocated, growing the table replaces the directory pointing at them
+typedef struct IOFileDirectory {
+    int num_pages;
+    // Link to the next replaced directory waiting to be freed and the epoch it was replaced in
+    struct IOFileDirectory* next_retired;
+    uint64_t retire_epoch;
+    IOFile* pages[];
+} IOFileDirectory;
+
+typedef struct IOFileTable {
+    struct IOFileDirectory* directory;
+    // Only one thread at a time can replace the directory
+    pthread_mutex_t grow_lock;
+} IOFileTable;
+
+/////////////////////////////////////////
+/* Epochs for reclaiming fds and slots */
+/////////////////////////////////////////
+// A closed fd or replaced directory is only reused or freed once every thread inside an API call has moved 2 epochs past it
+
+// Counters and latency histograms of the API calls, build with -DIO_STATS=0 to compile them out
+#ifndef IO_STATS
+#define IO_STATS 1
+#endif
+
+// A latency histogram has a bucket per power of two nanoseconds, the last bucket also takes anything slower
+#define IO_STATS_BUCKETS 40
+// Every call is counted but only one in this many calls on a thread is timed, it must be a power of two
+#define IO_STATS_SAMPLE_PERIOD 64
+
+// The calls that are counted. IO_STAT_OPEN_LOOKUP and IO_STAT_OPEN_FD time the parts of the timed io_open calls that
+// find the file and allocate its fd
+#define IO_STAT_OPEN 0
+#define IO_STAT_CLOSE 1
+#define IO_STAT_READ 2
+#define IO_STAT_WRITE 3
+#define IO_STAT_OPEN_LOOKUP 4
+#define IO_STAT_OPEN_FD 5
+#define IO_STAT_COUNT 6
+
+// A thread's share of the stats, only the owning thread writes it. Only reads and writes move bytes
+typedef struct IOStatsShard {
+    uint64_t calls[IO_STAT_COUNT];
+    uint64_t errors[IO_STAT_COUNT];
+    uint64_t bytes[IO_STAT_COUNT];
+    uint64_t latency[IO_STAT_COUNT][IO_STATS_BUCKETS];
+} IOStatsShard;
+
+// Every thread's stats added up along with the state of the fd table and the FileSystem
+typedef struct IOStatsSnapshot {
+    uint64_t calls[IO_STAT_COUNT];
+    uint64_t errors[IO_STAT_COUNT];
+    // The timed calls, bucket b holds calls that took from 2^(b-1) up to 2^b ns
+    uint64_t latency[IO_STAT_COUNT][IO_STATS_BUCKETS];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    // Open fds come from the counted opens and closes, allocated fds also take in the fds held by thread caches and the
+    // closed fds waiting to be reused
+    size_t open_fds;
+    size_t allocated_fds;
+    size_t fd_capacity;
+    FSIndexStats index;
+    SlabStats file_pool;
+} IOStatsSnapshot;
+
+typedef struct IOThreadRecord {
+    // The epoch the thread entered an API call in shifted left by one, with the lowest bit set while inside the call
+    uint64_t state;
+    // Cleared when the thread exits so that a new thread can take the record over
+    int in_use;
+    // The io_thread_id of the thread the record was last handed to
+    uint64_t owner;
+    struct IOThreadRecord* next;
+    // The thread's fd cache, fds ready to hand out are popped from the back and closed fds wait for their epoch to pass
+    int free_fds[IO_FD_CACHE_SIZE];
+    int num_free_fds;
+    int closed_fds[IO_FD_CACHE_SIZE];
+    uint64_t closed_epochs[IO_FD_CACHE_SIZE];
+    int num_closed_fds;
+    // Only the owning thread writes these, anyone can read them for stats
+    uint64_t fd_cache_hits;
+    uint64_t fd_cache_misses;
+    uint64_t fd_cache_spills;
+    IOStatsShard stats;
+    // Made the first time the thread is traced
+    struct IOTraceRing* trace_ring;
+} IOThreadRecord;
+
+// The number of contexts a thread keeps its record in without looking it up, it must be a power of two
+#define IO_THREAD_SLOTS 4
+
+// A thread's record in the context with the given id
+typedef struct IOThreadSlot {
+    uint64_t module_id;
+    IOThreadRecord* record;
+} IOThreadSlot;
+
+// Hit rate of the fd caches, a miss takes the fd lock to refill from the FdBitmap and a spill takes it to give fds back
+typedef struct IOFdCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t spills;
+    double hit_rate;
+} IOFdCacheStats;
+
+// Options for io_module_init_with_config and io_ctx_init, io_module_init uses the defaults
+typedef struct IOModuleConfig {
+    // Let every thread keep its own cache of fds. Opening and closing then rarely takes a lock, but fds are
+    // no longer handed out lowest first and a closed fd may sit in one thread's cache while another thread grows the table
+    int fd_cache_enabled;
+    // The bytes of memory the page cache of stored files gets, rounded down to whole pages. With 0 stored files are
+    // read straight from their store
+    size_t page_cache_size;
+    // The most a sequential reader gets read ahead of it, 0 turns readahead off
+    size_t readahead_max_window;
+    // Trace the calls into this file from the start, NULL to only trace between io_trace_start and io_trace_stop
+    const char* trace_path;
+    // The threads running async calls, started with the first one
+    int async_workers;
+} IOModuleConfig;
+
+// A range of a stored file for the readahead thread to read into the page cache
+typedef struct IOReadaheadRequest {
+    struct FSStoreObject* object;
+    uint64_t first_page;
+    uint64_t num_pages;
+} IOReadaheadRequest;
+
+// The calls an async request can make
+#define IO_ASYNC_OP_READ 1
+#define IO_ASYNC_OP_PREAD 2
+#define IO_ASYNC_OP_WRITE 3
+#define IO_ASYNC_OP_PWRITE 4
+
+// Called on a worker once an async call is done with what the call returned, and its errno if it failed or 0
+typedef void (*IOAsyncCallback)(ssize_t result, int error, void* userdata);
+
+// An async call waiting for a worker, it completes through its callback or onto the completion queue if that is NULL
+typedef struct IOAsyncRequest {
+    int op;
+    int fd;
+    char* buf;
+    size_t count;
+    off_t offset;
+    IOAsyncCallback callback;
+    void* userdata;
+} IOAsyncRequest;
+
+// An async call made without a callback that is done, taken off the completion queue by io_async_poll
+typedef struct IOAsyncCompletion {
+    ssize_t result;
+    int error;
+    void* userdata;
+} IOAsyncCompletion;
+
+// A worker's queue of requests, a ring of a power of two size with free running positions. The worker takes requests
+// from the front of its own queue and steals from the front of the others' once it runs dry
+typedef struct IOAsyncQueue {
+    pthread_mutex_t lock;
+    IOAsyncRequest* requests;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    struct IOAsyncPool* pool;
+    int index;
+} IOAsyncQueue;
+
+// The workers running a context's async calls
+typedef struct IOAsyncPool {
+    struct IOModule* io_module;
+    // Makes the call a request asks for, returning what it returned
+    ssize_t (*run)(struct IOModule* io_module, const IOAsyncRequest* request);
+    int num_workers;
+    pthread_t* threads;
+    IOAsyncQueue* queues;
+    // Workers with nothing to run sleep on work_ready, and io_async_wait_idle on idle
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t idle;
+    int sleeping;
+    int stop;
+    // The requests sitting in the queues, and the ones submitted that haven't completed yet
+    uint64_t queued;
+    uint64_t pending;
+    unsigned int next_queue;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stolen;
+    // Completions of calls without a callback. Every such call reserves its slot when it's submitted, so completing
+    // never has to grow the ring
+    pthread_mutex_t completion_lock;
+    pthread_cond_t completion_ready;
+    IOAsyncCompletion* completions;
+    size_t completions_capacity;
+    size_t completions_head;
+    size_t completions_tail;
+    size_t completions_reserved;
+} IOAsyncPool;
+
+// How the async workers are doing
+typedef struct IOAsyncStats {
+    int workers;
+    uint64_t submitted;
+    uint64_t completed;
+    // Requests a worker took from another worker's queue
+    uint64_t stolen;
+    // Completions waiting to be polled
+    size_t completions;
+} IOAsyncStats;
+
+// How readahead is doing. Usefulness is the share of the pages read ahead that were read before being evicted
+typedef struct IOReadaheadStats {
+    // Sequential streams found, and streams that stopped being sequential
+    uint64_t windows_started;
+    uint64_t windows_collapsed;
+    // Ranges read ahead, their bytes, and ranges dropped because the readahead thread was too far behind
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t pages_prefetched;
+    uint64_t pages_used;
+    uint64_t pages_wasted;
+    double usefulness;
+} IOReadaheadStats;
+
+// The calls a trace records
+#define IO_TRACE_OP_OPEN 1
+#define IO_TRACE_OP_CLOSE 2
+#define IO_TRACE_OP_READ 3
+#define IO_TRACE_OP_PREAD 4
+#define IO_TRACE_OP_WRITE 5
+#define IO_TRACE_OP_PWRITE 6
+#define IO_TRACE_OPS 7
+// A record that names a file id rather than recording a call
+#define IO_TRACE_RECORD_FILE 0
+
+// Events each thread can have waiting for the flusher, it's woken early once a ring is half full and a thread that
+// fills its ring writes the rings out itself rather than lose events
+#define IO_TRACE_RING_SIZE 8192
+#define IO_TRACE_FLUSH_INTERVAL_NS 10000000
+
+#define IO_TRACE_MAGIC "OSHTRC01"
+#define IO_TRACE_VERSION 1
+
+// A call as its thread records it, the flusher swaps the FSFile for the file's id in the trace
+typedef struct IOTraceEvent {
+    uint64_t timestamp;
+    uint64_t offset;
+    struct FSFile* file;
+    int64_t result;
+    uint32_t count;
+    int32_t fd;
+    uint32_t op;
+} IOTraceEvent;
+
+// A thread's events waiting to be written out, the thread moves the tail and the flusher moves the head
+typedef struct IOTraceRing {
+    IOTraceEvent events[IO_TRACE_RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    // Times the thread found its ring full and wrote the rings out itself
+    uint64_t stalls;
+    uint32_t thread;
+    struct IOTraceRing* next;
+} IOTraceRing;
+
+// A trace file is a header followed by records, each name record is followed by the name it's count bytes long
+typedef struct IOTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} IOTraceHeader;
+
+// A call or, with op IO_TRACE_RECORD_FILE, the name of file_id and in offset the file's size when it was first seen.
+// Opens also have the size of the file in offset. Timestamps are in ns since the trace started
+typedef struct IOTraceRecord {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t thread;
+    uint32_t file_id;
+    int32_t fd;
+    uint32_t count;
+    uint64_t offset;
+    uint64_t timestamp;
+    int64_t result;
+} IOTraceRecord;
+
+typedef struct IOTraceFileId {
+    struct FSFile* file;
+    uint32_t id;
+} IOTraceFileId;
+
+// What a trace wrote, stalls are the times a thread's ring was full and it had to wait for the rings to be written out
+typedef struct IOTraceStats {
+    uint64_t events;
+    uint64_t stalls;
+    uint64_t files;
+    uint64_t bytes;
+} IOTraceStats;
+
+// The latencies of one kind of call of a replay
+typedef struct IOReplayOpStats {
+    uint64_t calls;
+    uint64_t errors;
+    double mean_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double max_ns;
+} IOReplayOpStats;
+
+// How a replay went. Mismatches are calls whose result differs from the traced one, and skipped calls are on fds that
+// were opened before the trace started
+typedef struct IOReplayStats {
+    IOReplayOpStats ops[IO_TRACE_OPS];
+    uint64_t events;
+    uint64_t files_created;
+    uint64_t mismatches;
+    uint64_t skipped;
+    double seconds;
+} IOReplayStats;
+
+// A context is an fd table with its own epochs, thread records, page cache, readahead and trace, opening files in
+// file_system. Contexts share nothing, so each tenant or core can have its own
 typedef struct IOModule {
-    IOFileHashTable hash_table;
-    FreeList* free_list;
-    int next_fd;
+    uint64_t id;
+    IOModuleConfig config;
+    // NULL for the default context, which opens files in whatever fs_module is at the time
+    FileSystem* file_system;
+    // Stored files opened in the context are read through its own page cache, NULL when config's page_cache_size is 0
+    IOPageCache* page_cache;
+    // The next context in io_modules
+    struct IOModule* next;
+    IOFileTable* file_table;
+    FdBitmap* fd_bitmap;
+    // Guards the fd bitmap and the queues of retired fds and directories
+    pthread_mutex_t fd_lock;
+    uint64_t epoch;
+    struct IOThreadRecord* thread_records;
+    int retired_fds_front;
+    int retired_fds_back;
+    struct IOFileDirectory* retired_directories_front;
+    struct IOFileDirectory* retired_directories_back;
+    // Stored files are read ahead by a thread of their own, fed from a ring of requests
+    pthread_t readahead_thread;
+    int readahead_running;
+    pthread_mutex_t readahead_lock;
+    pthread_cond_t readahead_ready;
+    pthread_cond_t readahead_idle;
+    IOReadaheadRequest readahead_queue[IO_READAHEAD_QUEUE_SIZE];
+    unsigned int readahead_head;
+    unsigned int readahead_tail;
+    int readahead_busy;
+    int readahead_stop;
+    uint64_t readahead_windows_started;
+    uint64_t readahead_windows_collapsed;
+    uint64_t readahead_requests;
+    uint64_t readahead_bytes;
+    uint64_t readahead_dropped;
+    // While tracing the calls go into rings in the thread records, which a flusher thread drains into trace_file
+    int trace_active;
+    FILE* trace_file;
+    pthread_t trace_thread;
+    pthread_mutex_t trace_lock;
+    pthread_cond_t trace_wake;
+    // Held while writing the rings out, by the flusher or by a thread whose ring is full
+    pthread_mutex_t trace_drain_lock;
+    int trace_stop;
+    uint64_t trace_start;
+    struct IOTraceRing* trace_rings;
+    uint32_t trace_num_rings;
+    // The flusher's map of the files named in the trace so far to their ids
+    struct IOTraceFileId* trace_file_ids;
+    size_t trace_file_ids_capacity;
+    IOTraceStats trace_stats;
+    // Async calls run on a pool of workers that the first one starts
+    struct IOAsyncPool* async_pool;
+    pthread_mutex_t async_lock;
 } IOModule;
 
+// Operations that can be queued on an IORing
+#define IO_OP_OPEN 1
+#define IO_OP_CLOSE 2
+#define IO_OP_READ 3
+#define IO_OP_WRITE 4
+
+// Run the operation on the fd from the last IO_OP_OPEN in the same io_ring_submit call instead of the submission's fd
+#define IO_SUBMIT_PREV_FD 0x01
+
+// Reads and writes at this offset use and advance the fd's cursor like io_read and io_write
+#define IO_OFFSET_CURSOR ((off_t)-1)
+
+// The most back to back reads that io_ring_submit will merge into one pass over a file
+#define IO_RING_MAX_COALESCE 64
+
+typedef struct IOSubmission {
+    int opcode;
+    unsigned int flags;
+    int fd;
+    // The file and modes for IO_OP_OPEN
+    const char* filename;
+    unsigned int mode_type;
+    // The buffer for IO_OP_READ and IO_OP_WRITE
+    void* buf;
+    size_t count;
+    off_t offset;
+    // Passed through to the completion untouched
+    uint64_t user_data;
+} IOSubmission;
+
+typedef struct IOCompletion {
+    uint64_t user_data;
+    // What the matching io_* call would have returned, and the errno it would have set when that is -1
+    ssize_t result;
+    int error;
+} IOCompletion;
+
+// A submission queue and a completion queue of the same power of two size, owned by one thread at a time
+typedef struct IORing {
+    IOSubmission* submissions;
+    IOCompletion* completions;
+    unsigned int mask;
+    // Free running positions, the queue index is the position masked
+    unsigned int sq_head;
+    unsigned int sq_tail;
+    unsigned int cq_head;
+    unsigned int cq_tail;
+    // The number of reads that were merged into an earlier read of the same submit
+    uint64_t coalesced_reads;
+    // The context the submissions run in, NULL for whichever is the default context when they're submitted
+    struct IOModule* io_module;
+} IORing;
+
 FileSystem* fs_module = NULL;
-IOModule* io_module = NULL;
+
+// Backing data for views of file data which has never been written
+const char fs_zero_data[FS_CHUNK_SIZE] = { 0 };
+// Ids of the objects opened on backing stores, 0 is never handed out
+uint64_t fs_store_next_id = 1;
+// Ids of the file systems, and the directory the calling thread last found a file in along with the id of its file
+// system. Directories are never removed, so opens under the same directory go straight to it
+uint64_t fs_next_id = 1;
+__thread FSDirectory* fs_path_cache = NULL;
+__thread uint64_t fs_path_cache_id = 0;
+// The context the io_* calls without a context use
+IOModule* io_default_module = NULL;
+// Every live context, so that an exiting thread can give back the records it holds in them
+IOModule* io_modules = NULL;
+pthread_mutex_t io_modules_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The hit counter of the calling thread in every page cache, handed out round robin
+__thread int io_page_cache_stripe = -1;
+int io_page_cache_next_stripe = 0;
+
+// Ids let a thread tell that an IOThreadRecord it remembers belongs to an IOModule that has since been destroyed. A thread
+// remembers its record in a context in the slot picked by the context's id
+uint64_t io_module_next_id = 1;
+__thread IOThreadSlot io_thread_slots[IO_THREAD_SLOTS];
+// Marks the records a thread holds, handed out from 1 on a thread's first call
+uint64_t io_next_thread_id = 1;
+__thread uint64_t io_thread_id = 0;
+// Counts the calling thread's calls to pick the ones to time
+__thread unsigned int io_stats_tick = 0;
+// The queue of the async worker the calling thread is, so that calls it submits from a callback stay on its own queue
+__thread IOAsyncQueue* io_async_worker_queue = NULL;
+
+// Lets a thread give its cached fds back when it exits
+pthread_key_t io_thread_exit_key;
+pthread_once_t io_thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+// Finds the next delimiter for io_getdelim, the fastest scanner the CPU supports is picked when the first context is made
+const char* (*io_scan_delim)(const char* data, size_t length, char delim) = NULL;
+pthread_once_t io_scan_delim_once = PTHREAD_ONCE_INIT;
 
 #define IOFILE_MODE_READ 0x01
 #define IOFILE_MODE_WRITE 0x02
 
+// Where io_lseek measures the offset from, the same values as Linux's SEEK_* constants. IO_SEEK_DATA and IO_SEEK_HOLE
+// move to the next byte at or after the offset that is data or in a hole
+#define IO_SEEK_SET 0
+#define IO_SEEK_CUR 1
+#define IO_SEEK_END 2
+#define IO_SEEK_DATA 3
+#define IO_SEEK_HOLE 4
+
 ///////////////////////////////////////
 /* Implementations                   */
 ///////////////////////////////////////
 
-///////////////////////////////////////
-/* Simple file system in a directory */
-///////////////////////////////////////
+/////////////////////////////////////////
+/* Slab allocator for fixed size objects */
+/////////////////////////////////////////
+// Every cache hands out objects of one size carved out of SLAB_SIZE aligned slabs
 
-// FUNCTIONS FOR FSFile
-// Initialize the FSFile
-FSFile* file_system_file_init(const char* filename) {
-    FSFile* new_file = (FSFile*)malloc(sizeof(FSFile));
-    if (new_file == NULL) {
-        perror("ERROR: Could not allocate data for FSFile\n");
+// Allocate a cache for objects of the given size
+SlabCache* slab_cache_init(size_t object_size) {
+    SlabCache* new_cache = (SlabCache*)malloc(sizeof(SlabCache));
+    if (new_cache == NULL) {
+        perror("ERROR: Could not allocate data for SlabCache\n");
         return NULL;
     }
-    
-    // Initialize file name
-    size_t filename_length = strlen(filename);
-    new_file->filename = (char*)malloc(sizeof(char) * (filename_length + 1));
-    if (new_file == NULL) {
-        perror("ERROR: Could not allocate data for FSFile filename\n");
-        return NULL;
+
+    // Free objects have to be able to hold the free list link and keep it aligned
+    if (object_size < sizeof(SlabFreeObject))
+        object_size = sizeof(SlabFreeObject);
+    object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    new_cache->object_size = object_size;
+    new_cache->objects_per_slab = (SLAB_SIZE - sizeof(Slab)) / object_size;
+    new_cache->slabs = NULL;
+    new_cache->partial = NULL;
+    new_cache->num_slabs = 0;
+    new_cache->in_use = 0;
+
+    return new_cache;
+}
+
+// Release every slab of the cache at once, including the objects still in use
+void slab_cache_destroy(SlabCache** cache_ptr) {
+    SlabCache* cache = *cache_ptr;
+
+    Slab* curr_slab = cache->slabs;
+    Slab* next_slab;
+    while (curr_slab != NULL) {
+        next_slab = curr_slab->next;
+        free(curr_slab);
+
+        curr_slab = next_slab;
     }
 
-    strcpy(new_file->filename, filename);
-    
-    // Initialize the data pointer
-    new_file->data = NULL;
-    new_file->size = 0;
+    free(cache);
+    *cache_ptr = NULL;
+}
 
-    // Initialize the next FSfile pointer
-    new_file->next = NULL;
+// Remove a slab from the list of slabs with free objects
+void slab_cache_unlink_partial(SlabCache* cache, Slab* slab) {
+    if (slab->prev_partial != NULL)
+        slab->prev_partial->next_partial = slab->next_partial;
+    else
+        cache->partial = slab->next_partial;
 
-    return new_file;
+    if (slab->next_partial != NULL)
+        slab->next_partial->prev_partial = slab->prev_partial;
 }
 
-// Deallocate FSFile
-void file_system_file_destroy(FSFile** file_ptr) {
-    FSFile* file = *file_ptr;
-    free(file->filename);
-    free(file->data);
-    free(file);
+// Add a slab to the front of the list of slabs with free objects
+void slab_cache_link_partial(SlabCache* cache, Slab* slab) {
+    slab->prev_partial = NULL;
+    slab->next_partial = cache->partial;
+    if (cache->partial != NULL)
+        cache->partial->prev_partial = slab;
 
-    *file_ptr = NULL;
+    cache->partial = slab;
 }
 
-// Set the data for the given FSFile
-void file_system_file_set_data(FSFile* file, const char* data, size_t size) {
-    if (file->data != NULL) {
-        fprintf(stderr, "ERROR: You cannot set the file data twice\n");
-        return;
+// Allocate a new slab and thread all of its objects onto its free list
+Slab* slab_cache_grow(SlabCache* cache) {
+    Slab* new_slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (new_slab == NULL) {
+        // aligned_alloc will set ENOMEM
+        return NULL;
     }
 
-    // Allocate enough space for data
-    file->data = (char*)malloc(sizeof(char) * size);
-    if (file->data == NULL) {
-        perror("ERROR: Could not allocate space for FSFile data\n");
-        return;
+    new_slab->cache = cache;
+    new_slab->in_use = 0;
+    new_slab->free_objects = NULL;
+
+    // Push the objects in reverse so that they are handed out in address order
+    char* objects = (char*)(new_slab + 1);
+    for (int i = cache->objects_per_slab - 1; i >= 0; i--) {
+        SlabFreeObject* object = (SlabFreeObject*)(objects + i * cache->object_size);
+        object->next = new_slab->free_objects;
+        new_slab->free_objects = object;
     }
-    
-    file->size = size;
 
-    // Copy the data into the buffer
-    strncpy(file->data, data, size);
+    new_slab->next = cache->slabs;
+    cache->slabs = new_slab;
+    cache->num_slabs++;
+
+    slab_cache_link_partial(cache, new_slab);
+
+    return new_slab;
 }
 
-// FUNCTIONS FOR FileSystem
-// Initialize the FileSystem
-FileSystem* file_system_init() {
-    FileSystem* file_system = (FileSystem*)malloc(sizeof(FileSystem));
-    if (file_system == NULL) {
-        perror("ERROR: Could not allocate data for FileSystem\n");
-        return NULL;
+// Allocate one object from the cache
+void* slab_cache_alloc(SlabCache* cache) {
+    // Reuse a free object from a slab that has one before getting a new slab
+    Slab* slab = cache->partial;
+    if (slab == NULL) {
+        slab = slab_cache_grow(cache);
+        if (slab == NULL) {
+            // errno is set by slab_cache_grow
+            return NULL;
+        }
     }
 
-    file_system->front = NULL;
-    file_system->back = NULL;
+    SlabFreeObject* object = slab->free_objects;
+    slab->free_objects = object->next;
+    slab->in_use++;
+    cache->in_use++;
 
-    return file_system;
+    // A slab with no free objects left is no longer a candidate for allocation
+    if (slab->free_objects == NULL)
+        slab_cache_unlink_partial(cache, slab);
+
+    return object;
 }
 
-// Destroy the FileSystem
-void file_system_destroy(FileSystem** file_system_ptr) {
-    FileSystem* file_system = *file_system_ptr;
-    
-    FSFile* curr_file = file_system->front;
-    FSFile* next_file;
-    while (curr_file != NULL) {
-        next_file = curr_file->next;
-        file_system_file_destroy(&curr_file);
+// Give an object back to the slab it was allocated from
+void slab_cache_free(void* ptr) {
+    if (ptr == NULL)
+        return;
 
-        curr_file = next_file;
-    }
+    Slab* slab = (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    SlabCache* cache = slab->cache;
 
-    free(file_system);
-    *file_system_ptr = NULL;
+    // A full slab becomes a candidate for allocation again, empty slabs are kept for reuse
+    if (slab->free_objects == NULL)
+        slab_cache_link_partial(cache, slab);
+
+    SlabFreeObject* object = (SlabFreeObject*)ptr;
+    object->next = slab->free_objects;
+    slab->free_objects = object;
+    slab->in_use--;
+    cache->in_use--;
 }
 
-int file_system_add_file(FileSystem* file_system, const char* filename, const char* data, size_t size) {
-    FSFile* file = file_system_file_init(filename);
-    if (file == NULL) {
-        fprintf(stderr, "ERROR: Failed to add a file to file system\n");
+// Add the occupancy of the cache to the given stats
+void slab_cache_add_stats(SlabCache* cache, SlabStats* stats) {
+    stats->slabs += cache->num_slabs;
+    stats->objects_in_use += cache->in_use;
+    stats->objects_capacity += cache->num_slabs * cache->objects_per_slab;
+    stats->bytes_reserved += (size_t)cache->num_slabs * SLAB_SIZE;
+
+    for (Slab* slab = cache->partial; slab != NULL; slab = slab->next_partial)
+        stats->partial_slabs++;
+
+    if (stats->objects_capacity > 0)
+        stats->fragmentation = 1.0 - (double)stats->objects_in_use / stats->objects_capacity;
+}
+
+///////////////////////////////////////
+/* Backing stores                    */
+///////////////////////////////////////
+
+// FUNCTIONS FOR FSDiskStore
+// Open the host file holding the named object, creating an empty one if there isn't one yet
+int fs_disk_store_open(FSStore* store, const char* name, uint64_t* handle, size_t* size) {
+    FSDiskStore* disk_store = (FSDiskStore*)store;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", disk_store->root, name) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
         return 0;
     }
 
-    // Assign the data to the FSFile
-    file_system_file_set_data(file, data, size);
+    // errno is set by open and fstat if they fail
+    int host_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (host_fd == -1)
+        return 0;
 
-    // Attach the file to the file system
-    if (file_system->front == NULL) {
-        file_system->front = file;
-        file_system->back = file;
-    } else {
-        file_system->back->next = file;
-        file_system->back = file;
+    struct stat host_stat;
+    if (fstat(host_fd, &host_stat) == -1) {
+        close(host_fd);
+        return 0;
     }
 
+    *handle = host_fd;
+    *size = host_stat.st_size;
+
     return 1;
 }
 
-FSFile* file_system_find_file(FileSystem* file_system, const char* filename) {
-    FSFile* curr_file = file_system->front;
-    while (curr_file != NULL) {
-        if (strcmp(filename, curr_file->filename) == 0)
+// Read until count bytes are in or the end of the host file is reached
+ssize_t fs_disk_store_read(FSStore* store, uint64_t handle, void* buf, size_t count, size_t offset) {
+    size_t copied = 0;
+    while (copied < count) {
+        ssize_t bytes_read = pread((int)handle, (char*)buf + copied, count - copied, offset + copied);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read == -1)
+            // errno is set by pread
+            return -1;
+        if (bytes_read == 0)
             break;
 
-        curr_file = curr_file->next;
+        copied += bytes_read;
     }
 
-    if (curr_file == NULL) {
-        errno = ENOENT;
-        return NULL;
+    return copied;
+}
+
+// Write all count bytes to the host file
+ssize_t fs_disk_store_write(FSStore* store, uint64_t handle, const void* buf, size_t count, size_t offset) {
+    size_t written = 0;
+    while (written < count) {
+        ssize_t bytes_written = pwrite((int)handle, (const char*)buf + written, count - written, offset + written);
+        if (bytes_written == -1 && errno == EINTR)
+            continue;
+        if (bytes_written == -1)
+            // errno is set by pwrite, only report it if nothing was written
+            return written == 0 ? -1 : (ssize_t)written;
+
+        written += bytes_written;
     }
 
-    return curr_file;
+    return written;
 }
 
-// FUNCTIONS TO SET UP A BASIC ENVIRONMENT
-// Set up a basic environment
-int fs_environment_init() {
-    fs_module = file_system_init();
-    if (fs_module == NULL) {
-        return 0;
+void fs_disk_store_close(FSStore* store, uint64_t handle) {
+    close((int)handle);
+}
+
+void fs_disk_store_destroy(FSStore* store) {
+    FSDiskStore* disk_store = (FSDiskStore*)store;
+    free(disk_store->root);
+    free(disk_store);
+}
+
+// Make a store that keeps its objects as host files in the directory at root, creating the directory if needed
+FSStore* fs_store_init_disk(const char* root) {
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        // errno is set by mkdir
+        return NULL;
     }
 
-    const char* filename1 = "file1.txt";
-    const char* data1 = "Test Data1";
-    int created = file_system_add_file(fs_module, filename1, data1, 10);
-    if (!created) {
-        file_system_destroy(&fs_module);
-        return 0;
+    FSDiskStore* disk_store = (FSDiskStore*)malloc(sizeof(FSDiskStore));
+    if (disk_store == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
     }
 
-    const char* filename2 = "file2.txt";
-    const char* data2 = "hellogoodbye";
-    created = file_system_add_file(fs_module, filename2, data2, 12);
-    if (!created) {
-        file_system_destroy(&fs_module);
-        return 0;
+    disk_store->root = strdup(root);
+    if (disk_store->root == NULL) {
+        // strdup will set ENOMEM
+        free(disk_store);
+        return NULL;
     }
 
-    return 1;
+    disk_store->store.open = fs_disk_store_open;
+    disk_store->store.read = fs_disk_store_read;
+    disk_store->store.write = fs_disk_store_write;
+    disk_store->store.close = fs_disk_store_close;
+    disk_store->store.destroy = fs_disk_store_destroy;
+
+    return &disk_store->store;
 }
 
-// Tear down the file system environment
-void fs_environment_destroy() {
-    file_system_destroy(&fs_module);
+// FUNCTIONS FOR FSSlowStore
+// Sleep for latency_ns, picking the sleep back up if a signal cuts it short
+void fs_slow_store_wait(long latency_ns) {
+    struct timespec delay = { latency_ns / 1000000000, latency_ns % 1000000000 };
+    while (latency_ns > 0 && nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+}
+
+int fs_slow_store_open(FSStore* store, const char* name, uint64_t* handle, size_t* size) {
+    FSStore* inner = ((FSSlowStore*)store)->inner;
+    return inner->open(inner, name, handle, size);
 }
 
-///////////////////////////////////////////
-/* Free list structures for reusing fd's */
-///////////////////////////////////////////
-// FreeList data queue for reusing inactive fd's
+ssize_t fs_slow_store_read(FSStore* store, uint64_t handle, void* buf, size_t count, size_t offset) {
+    FSSlowStore* slow_store = (FSSlowStore*)store;
+    fs_slow_store_wait(slow_store->read_latency_ns);
 
-// Allocate space for the free list structure
-FreeList* free_list_init() {
-    FreeList* new_free_list = (FreeList*)malloc(sizeof(FreeList));
-    if (new_free_list == NULL) {
-        perror("ERROR: Could not allocate data for free list\n");
-        return NULL;
-    }
+    // errno is set by the inner store if the read fails
+    return slow_store->inner->read(slow_store->inner, handle, buf, count, offset);
+}
 
-    new_free_list->front = NULL;
-    new_free_list->back = NULL;
-    new_free_list->length = 0;
+ssize_t fs_slow_store_write(FSStore* store, uint64_t handle, const void* buf, size_t count, size_t offset) {
+    FSSlowStore* slow_store = (FSSlowStore*)store;
+    fs_slow_store_wait(slow_store->write_latency_ns);
 
-    return new_free_list;
+    // errno is set by the inner store if the write fails
+    return slow_store->inner->write(slow_store->inner, handle, buf, count, offset);
 }
 
-// Deallocate all of the free list's memory
-void free_list_destroy(FreeList** free_list_ptr) {
-    FreeList* free_list = *free_list_ptr;
-    
-    FreeListNode* curr_node = free_list->front;
-    FreeListNode* next_node;
-    // Free all the elements in the free list
-    while (curr_node != NULL) {
-        next_node = curr_node->next;
-        free(curr_node);
+void fs_slow_store_close(FSStore* store, uint64_t handle) {
+    FSStore* inner = ((FSSlowStore*)store)->inner;
+    inner->close(inner, handle);
+}
+
+void fs_slow_store_destroy(FSStore* store) {
+    FSStore* inner = ((FSSlowStore*)store)->inner;
+    inner->destroy(inner);
+    free(store);
+}
 
-        curr_node = next_node;
+// Make a store that adds read_latency_ns to every read and write_latency_ns to every write of inner, which it takes
+// over. inner is destroyed if the store can't be made
+FSStore* fs_store_init_slow(FSStore* inner, long read_latency_ns, long write_latency_ns) {
+    if (inner == NULL) {
+        // errno is set by whatever failed to make inner
+        return NULL;
+    }
+
+    FSSlowStore* slow_store = (FSSlowStore*)malloc(sizeof(FSSlowStore));
+    if (slow_store == NULL) {
+        // malloc will set ENOMEM
+        inner->destroy(inner);
+        return NULL;
     }
 
-    free(free_list);
-    *free_list_ptr = NULL;
+    slow_store->inner = inner;
+    slow_store->read_latency_ns = read_latency_ns;
+    slow_store->write_latency_ns = write_latency_ns;
+    slow_store->store.open = fs_slow_store_open;
+    slow_store->store.read = fs_slow_store_read;
+    slow_store->store.write = fs_slow_store_write;
+    slow_store->store.close = fs_slow_store_close;
+    slow_store->store.destroy = fs_slow_store_destroy;
+
+    return &slow_store->store;
 }
 
-// Peak the value of the first element in the list
-int free_list_peak(FreeList* free_list) {
-    // Ensure that the free list isn't empty
-    if (free_list->length == 0) {
-        fprintf(stderr, "ERROR: Cannot peak first value in list when it is empty\n");
-        return -1;
-    }
+// FUNCTIONS FOR FSStore
+// Destroy a store, every file system with files on it must be destroyed first
+void fs_store_destroy(FSStore** store_ptr) {
+    FSStore* store = *store_ptr;
+    store->destroy(store);
 
-    return free_list->front->fd;
+    *store_ptr = NULL;
 }
 
-// Pop the first element of the list
-void free_list_pop(FreeList* free_list) {
-    // Ensure that the free list isn't empty
-    if (free_list->length == 0) {
-        fprintf(stderr, "ERROR: Cannot pop element when list is empty\n");
-        return;
+// Open the named object on the store, the caller holds the only reference to it
+FSStoreObject* fs_store_object_open(FSStore* store, const char* name, size_t* size) {
+    FSStoreObject* object = (FSStoreObject*)malloc(sizeof(FSStoreObject));
+    if (object == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
     }
 
-    // Remove the front node
-    FreeListNode* front_node = free_list->front;
-    if (front_node->next == NULL)
-        free_list->back = NULL;
-
-    free_list->front = front_node->next;
+    if (!store->open(store, name, &object->handle, size)) {
+        // errno is set by the store
+        free(object);
+        return NULL;
+    }
 
-    free(front_node);
+    object->store = store;
+    object->id = __atomic_fetch_add(&fs_store_next_id, 1, __ATOMIC_RELAXED);
 
-    free_list->length--;
+    return object;
 }
 
-// Push an fd to the back of the list
-int free_list_push(FreeList* free_list, int fd){
-    FreeListNode* new_node = (FreeListNode*)malloc(sizeof(FreeListNode));
-    if (new_node == NULL) {
-        // errno is set by malloc
-        return 0;
-    }
+// Close the object, any of its pages left in the page cache can't be found again and age out
+void fs_store_object_close(FSStoreObject** object_ptr) {
+    FSStoreObject* object = *object_ptr;
+    object->store->close(object->store, object->handle);
+    free(object);
 
-    new_node->fd = fd;
-    new_node->next = NULL;
+    *object_ptr = NULL;
+}
 
-    // Add in the new free list node
-    if (free_list->front == NULL) {
-        free_list->front = new_node;
-        free_list->back = new_node;
-    } else {
-        free_list->back->next = new_node;
-        free_list->back = new_node;
-    }
+///////////////////////////////////////
+/* Page cache for stored files       */
+///////////////////////////////////////
 
-    free_list->length++;
+// Mix the page's object id and index into a key, which is never 0 so that 0 can mark an empty ghost slot.
+// The high half of the key picks the hash bucket and ghost slot
+uint64_t io_page_cache_key(uint64_t object_id, uint64_t page) {
+    uint64_t key = object_id * 0x9E3779B97F4A7C15ULL ^ (page + 1) * 0xC2B2AE3D27D4EB4FULL;
+    key ^= key >> 29;
 
-    return 1;
+    return key | 1;
 }
 
-//////////////////////////////////////////////////////////
-/* Hash table for rapid access of file objects (IOFile) */
-//////////////////////////////////////////////////////////
-// This file will possibly be linked to another IOFile who's fd hash is the same as this file's fd hash
+// Allocate a cache with as many pages as fit in size bytes
+IOPageCache* io_page_cache_init(size_t size) {
+    int num_frames = size / IO_PAGE_SIZE;
+    if (num_frames == 0 || size / IO_PAGE_SIZE > INT_MAX / 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The hit counters need cache lines of their own
+    IOPageCache* cache = (IOPageCache*)aligned_alloc(64, (sizeof(IOPageCache) + 63) & ~(size_t)63);
+    if (cache == NULL) {
+        // aligned_alloc will set ENOMEM
+        return NULL;
+    }
 
-// Allocate enough space to store all of the pointer to the IOFile buckets
-IOFileHashTable io_file_hash_table_init() {
-    IOFileHashTable new_hash_table = (IOFileHashTable)malloc(sizeof(IOFile*) * MAX_HASHTABLE_BINS);
-    if (new_hash_table == NULL) {
-        perror("ERROR: Could not allocate data for new IOFileHashTable\n");
+    uint32_t num_buckets = 1;
+    while (num_buckets < (uint32_t)num_frames)
+        num_buckets <<= 1;
+
+    // The page data is only touched as pages are read in
+    cache->frames = (IOPageFrame*)malloc(sizeof(IOPageFrame) * num_frames);
+    cache->data = (char*)malloc((size_t)num_frames * IO_PAGE_SIZE);
+    cache->buckets = (int*)malloc(sizeof(int) * num_buckets);
+    // Twice as many ghost slots as buckets keeps collisions from forgetting too many pages
+    cache->ghosts = (uint64_t*)calloc(2 * (size_t)num_buckets, sizeof(uint64_t));
+    if (cache->frames == NULL || cache->data == NULL || cache->buckets == NULL || cache->ghosts == NULL) {
+        // malloc and calloc will set ENOMEM
+        free(cache->frames);
+        free(cache->data);
+        free(cache->buckets);
+        free(cache->ghosts);
+        free(cache);
         return NULL;
     }
 
-    // Initialize all the buckets to contain no IOFiles
-    for (int i = 0; i < MAX_HASHTABLE_BINS; i++)
-        new_hash_table[i] = NULL;
+    cache->num_frames = num_frames;
+    cache->bucket_mask = num_buckets - 1;
+    cache->ghost_mask = 2 * num_buckets - 1;
+    for (uint32_t i = 0; i < num_buckets; i++)
+        cache->buckets[i] = -1;
+
+    // Every frame starts out on the free list
+    for (int i = 0; i < num_frames; i++) {
+        IOPageFrame* frame = &cache->frames[i];
+        frame->object_id = 0;
+        frame->page = 0;
+        frame->pins = 0;
+        frame->referenced = 0;
+        frame->loading = 0;
+        frame->error = 0;
+        frame->prefetched = 0;
+        frame->length = 0;
+        frame->data = cache->data + (size_t)i * IO_PAGE_SIZE;
+        frame->hash_next = -1;
+        frame->queue = IO_PAGE_QUEUE_FREE;
+        frame->queue_prev = -1;
+        frame->queue_next = i + 1 < num_frames ? i + 1 : -1;
+    }
 
-    return new_hash_table;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    cache->free_head = 0;
+    cache->probation_head = -1;
+    cache->probation_tail = -1;
+    cache->probation_count = 0;
+    cache->clock_hand = -1;
+    cache->main_count = 0;
+    memset(cache->hit_stripes, 0, sizeof(cache->hit_stripes));
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->ghost_hits = 0;
+    cache->prefetched = 0;
+    cache->prefetch_hits = 0;
+    cache->prefetch_wasted = 0;
+
+    return cache;
 }
 
-// Deallocate any memory used for the IOFileHashTable structure
-void io_file_hash_table_destroy(IOFileHashTable* hash_table_ptr) {
-    IOFileHashTable hash_table = *hash_table_ptr;
+// Deallocate the cache, no page may still be pinned
+void io_page_cache_destroy(IOPageCache** cache_ptr) {
+    IOPageCache* cache = *cache_ptr;
 
-    for (int i = 0; i < MAX_HASHTABLE_BINS; i++) {
-        // Only clean up the bucket if it was at some point in use
-        IOFile* curr_file = hash_table[i];
-        if (curr_file != NULL) {
-            IOFile* next_file;
-            
-            // Clean up all the IOFile structures in this bucket
-            while (curr_file != NULL) {
-                next_file = curr_file->next;
-                free(curr_file);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache->frames);
+    free(cache->data);
+    free(cache->buckets);
+    free(cache->ghosts);
+    free(cache);
 
-                curr_file = next_file;
-            }
+    *cache_ptr = NULL;
+}
+
+// Take a frame out of the queue it's in, the cache's lock must be held
+void io_page_cache_unlink_queue(IOPageCache* cache, int index) {
+    IOPageFrame* frame = &cache->frames[index];
+    if (frame->queue == IO_PAGE_QUEUE_PROBATION) {
+        if (frame->queue_prev != -1)
+            cache->frames[frame->queue_prev].queue_next = frame->queue_next;
+        else
+            cache->probation_head = frame->queue_next;
+        if (frame->queue_next != -1)
+            cache->frames[frame->queue_next].queue_prev = frame->queue_prev;
+        else
+            cache->probation_tail = frame->queue_prev;
+        cache->probation_count--;
+    } else if (frame->queue == IO_PAGE_QUEUE_MAIN) {
+        if (frame->queue_next == index) {
+            cache->clock_hand = -1;
+        } else {
+            cache->frames[frame->queue_prev].queue_next = frame->queue_next;
+            cache->frames[frame->queue_next].queue_prev = frame->queue_prev;
+            if (cache->clock_hand == index)
+                cache->clock_hand = frame->queue_next;
         }
+        cache->main_count--;
     }
 
-    // Free the data allocated for the whole hash table
-    free(hash_table);
-    *hash_table_ptr = NULL;
+    frame->queue = IO_PAGE_QUEUE_FREE;
+    frame->queue_prev = -1;
+    frame->queue_next = -1;
 }
 
-// The hash function for choosing a bucket for the IOFile in the hashtable
-int io_file_hash_table_hash(int fd) {
-    return fd % MAX_HASHTABLE_BINS;
+// Put a frame at the back of the probation queue, the cache's lock must be held
+void io_page_cache_push_probation(IOPageCache* cache, int index) {
+    IOPageFrame* frame = &cache->frames[index];
+    frame->queue = IO_PAGE_QUEUE_PROBATION;
+    frame->queue_prev = cache->probation_tail;
+    frame->queue_next = -1;
+    if (cache->probation_tail != -1)
+        cache->frames[cache->probation_tail].queue_next = index;
+    else
+        cache->probation_head = index;
+    cache->probation_tail = index;
+    cache->probation_count++;
 }
 
-// Add a new IOFile to the hashtable with its assigned fd and FSFile pointer
-void io_file_hash_table_new_file(IOFileHashTable hash_table, int fd, unsigned int mode_type, FSFile* fs_file) {
-    IOFile* new_io_file = (IOFile*)malloc(sizeof(IOFile));
-    if (new_io_file == NULL) {
-        // malloc will set ENOMEM
-        return;
+// Put a frame into the main queue just behind the clock hand so that it's swept last, the cache's lock must be held
+void io_page_cache_push_main(IOPageCache* cache, int index) {
+    IOPageFrame* frame = &cache->frames[index];
+    frame->queue = IO_PAGE_QUEUE_MAIN;
+    if (cache->clock_hand == -1) {
+        frame->queue_prev = index;
+        frame->queue_next = index;
+        cache->clock_hand = index;
+    } else {
+        IOPageFrame* hand = &cache->frames[cache->clock_hand];
+        frame->queue_prev = hand->queue_prev;
+        frame->queue_next = cache->clock_hand;
+        cache->frames[hand->queue_prev].queue_next = index;
+        hand->queue_prev = index;
     }
+    cache->main_count++;
+}
 
-    // Initialize the new IOFile
-    new_io_file->fd = fd;
-    new_io_file->cursor_pos = 0;
-    new_io_file->mode_type = mode_type;
-    new_io_file->fs_file = fs_file;
+// Make the frame findable under its page, the cache's lock must be held
+void io_page_cache_link_hash(IOPageCache* cache, int index) {
+    IOPageFrame* frame = &cache->frames[index];
+    int* bucket = &cache->buckets[(uint32_t)(io_page_cache_key(frame->object_id, frame->page) >> 32) & cache->bucket_mask];
 
-    // Place the IOFile into its own bucket
-    int hash = io_file_hash_table_hash(fd);
-    new_io_file->next = hash_table[hash];
-    hash_table[hash] = new_io_file;
+    // Readers walking the chain see either the old head or the fully linked frame
+    __atomic_store_n(&frame->hash_next, *bucket, __ATOMIC_RELAXED);
+    __atomic_store_n(bucket, index, __ATOMIC_RELEASE);
 }
 
-// Get the IOFile pertaining to the given fd
-IOFile* io_file_hash_table_get_file(IOFileHashTable hash_table, int fd) {
-    // Get the bucket for the IOFile
-    int hash = io_file_hash_table_hash(fd);
+// Stop the frame from being found under its page, the cache's lock must be held. The frame keeps its own link so that
+// readers standing on it can still walk off the end of the chain
+void io_page_cache_unlink_hash(IOPageCache* cache, int index) {
+    IOPageFrame* frame = &cache->frames[index];
+    int* link = &cache->buckets[(uint32_t)(io_page_cache_key(frame->object_id, frame->page) >> 32) & cache->bucket_mask];
+    while (*link != -1 && *link != index)
+        link = &cache->frames[*link].hash_next;
 
-    // Filter for particular IOFile
-    IOFile* curr_file = hash_table[hash];
-    while (curr_file != NULL) {
-        if (curr_file->fd == fd)
-            break;
-        curr_file = curr_file->next;
-    }
+    if (*link == index)
+        __atomic_store_n(link, frame->hash_next, __ATOMIC_RELEASE);
+}
 
-    // Set the errno if the file descriptor was invalid
-    if (curr_file == NULL)
-        errno = EBADF;
+// Pin the frame so that it can't be handed to another page, fails if that's already happening
+int io_page_cache_try_pin(IOPageFrame* frame) {
+    int pins = __atomic_load_n(&frame->pins, __ATOMIC_ACQUIRE);
+    while (pins >= 0) {
+        if (__atomic_compare_exchange_n(&frame->pins, &pins, pins + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
 
-    return curr_file;
+    return 0;
 }
 
-// Deallocate the IOFile pertaining to the given fd
-int io_file_hash_table_remove_file(IOFileHashTable hash_table, int fd) {
-    // Get hash for the fd
-    int hash = io_file_hash_table_hash(fd);
+void io_page_cache_unpin(IOPageFrame* frame) {
+    __atomic_fetch_sub(&frame->pins, 1, __ATOMIC_RELEASE);
+}
 
-    // Maintain the previous file in the bucket to allow for re-linking of bucket elements
-    IOFile* curr_file = hash_table[hash];
-    IOFile* prev_file = NULL;
-    while (curr_file != NULL) {
-        // If the IOFile is found patch up the links in the bucket before deallocation
-        if (curr_file->fd == fd) {
-            if (prev_file != NULL)
-                prev_file->next = curr_file->next;
-            else
-                hash_table[hash] = curr_file->next;
-            break;
+// Find the frame holding the page and pin it without taking the cache's lock. A frame that's moved to another chain
+// while it's being looked at can make the page look missing, callers that miss look again under the lock
+IOPageFrame* io_page_cache_find(IOPageCache* cache, uint64_t object_id, uint64_t page) {
+    uint32_t bucket = (uint32_t)(io_page_cache_key(object_id, page) >> 32) & cache->bucket_mask;
+    int index = __atomic_load_n(&cache->buckets[bucket], __ATOMIC_ACQUIRE);
+    for (int steps = 0; index != -1 && steps < cache->num_frames; steps++) {
+        IOPageFrame* frame = &cache->frames[index];
+        if (__atomic_load_n(&frame->object_id, __ATOMIC_RELAXED) == object_id && __atomic_load_n(&frame->page, __ATOMIC_RELAXED) == page) {
+            if (!io_page_cache_try_pin(frame))
+                return NULL;
+
+            // The page can't change while the frame is pinned, so this check settles whether it's the right one
+            if (__atomic_load_n(&frame->object_id, __ATOMIC_RELAXED) == object_id && __atomic_load_n(&frame->page, __ATOMIC_RELAXED) == page)
+                return frame;
+
+            io_page_cache_unpin(frame);
+            return NULL;
         }
 
-        prev_file = curr_file;
-        curr_file = curr_file->next;
+        index = __atomic_load_n(&frame->hash_next, __ATOMIC_ACQUIRE);
     }
 
-    // Ensure that the IOFile associated with the fd exists
-    if (curr_file == NULL) {
-        errno = EBADF;
-        return 0;
-    }
+    return NULL;
+}
 
-    // Deallocate the memory associated with the IOFile in the hashtable
-    free(curr_file);
+// Claim a frame for a new page, evicting the page it holds. The frame comes back with its pins at -1, out of every
+// queue and chain, or -1 if every frame is pinned. The cache's lock must be held
+int io_page_cache_take_frame(IOPageCache* cache) {
+    if (cache->free_head != -1) {
+        int index = cache->free_head;
+        cache->free_head = cache->frames[index].queue_next;
+        cache->frames[index].queue_next = -1;
+        __atomic_store_n(&cache->frames[index].pins, -1, __ATOMIC_RELAXED);
+        return index;
+    }
 
-    // A successful removal
-    return 1;
-}
+    int probation_target = cache->num_frames * IO_PAGE_CACHE_PROBATION_PERCENT / 100;
+    if (probation_target == 0)
+        probation_target = 1;
 
-/////////////////////////
-/* File Descriptor API */
-/////////////////////////
+    // Every frame gets two chances, a pass to clear its referenced bit and a pass to be evicted
+    for (int tries = 0; tries < 2 * cache->num_frames + 1; tries++) {
+        int from_probation = cache->probation_count > 0 && (cache->probation_count >= probation_target || cache->main_count == 0);
+        int index = from_probation ? cache->probation_head : cache->clock_hand;
+        if (index == -1)
+            break;
 
-// Initialize the IOModule
-int io_module_init() {
-    // Allocate space for new IOModule
-    io_module = (IOModule*)malloc(sizeof(IOModule));
-    if (io_module == NULL) {
-        perror("ERROR: Could not allocate data for IOModule\n");
-        return 0;
-    }
+        IOPageFrame* frame = &cache->frames[index];
 
-    // Initialize the new IOModule
-    io_module->hash_table = io_file_hash_table_init();
-    if (io_module->hash_table == NULL) {
-        free(io_module);
-        return 0;
-    }
-    
-    io_module->free_list = free_list_init();
-    if (io_module->free_list == NULL) {
-        io_file_hash_table_destroy(&io_module->hash_table);
-        free(io_module);
-        return 0;
-    }
+        // Pages in probation are evicted in order whether or not they were hit, a hit only counts in the main queue
+        if (!from_probation && __atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&frame->referenced, 0, __ATOMIC_RELAXED);
+            cache->clock_hand = frame->queue_next;
+            continue;
+        }
 
-    io_module->next_fd = 0;
+        int unpinned = 0;
+        if (!__atomic_compare_exchange_n(&frame->pins, &unpinned, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            // Someone is using the page, skip it for now
+            if (from_probation) {
+                io_page_cache_unlink_queue(cache, index);
+                io_page_cache_push_probation(cache, index);
+            } else {
+                cache->clock_hand = frame->queue_next;
+            }
+            continue;
+        }
 
-    return 1;
-}
+        io_page_cache_unlink_queue(cache, index);
+        if (frame->object_id != 0) {
+            io_page_cache_unlink_hash(cache, index);
+            cache->evictions++;
+            if (frame->prefetched)
+                cache->prefetch_wasted++;
+
+            // Remember pages leaving probation so that a miss on one soon after shows it's part of the working set
+            if (from_probation) {
+                uint64_t key = io_page_cache_key(frame->object_id, frame->page);
+                cache->ghosts[(uint32_t)(key >> 32) & cache->ghost_mask] = key;
+            }
+        }
 
-// Deallocate the structures associated with the IOModule
-void io_module_destory() {
-    // Deallocate all the data structures used by the module
-    io_file_hash_table_destroy(&io_module->hash_table);
-    free_list_destroy(&io_module->free_list);
-    free(io_module);
+        return index;
+    }
 
-    io_module = NULL;
+    return -1;
 }
 
-int io_module_create_new_fd() {
-    int selected_fd = -1;
-    // If we have some previously used fds we want to resuse them
-    if (io_module->free_list->length != 0) {
-        selected_fd = free_list_peak(io_module->free_list);
-        free_list_pop(io_module->free_list);
-    }
-    // Otherwise use the next highest fd
-    else {
-        selected_fd = io_module->next_fd;
-        io_module->next_fd++;
-    }
+// Count a hit on the calling thread's counter
+void io_page_cache_count_hit(IOPageCache* cache) {
+    if (io_page_cache_stripe == -1)
+        io_page_cache_stripe = __atomic_fetch_add(&io_page_cache_next_stripe, 1, __ATOMIC_RELAXED) % IO_PAGE_CACHE_STRIPES;
 
-    return selected_fd;    
+    __atomic_fetch_add(&cache->hit_stripes[io_page_cache_stripe].hits, 1, __ATOMIC_RELAXED);
 }
 
-// The API call to open a new IOFile and return a new file descriptor
-int io_open(const char* filename, unsigned int mode_type) {
-    // Ensure user provides an io mode
-    if (mode_type == 0) {
-        fprintf(stderr, "ERROR: Provide at least one of the io modes: IOFILE_MODE_READ or IOFILE_MODE_WRITE\n");
-        return -1;
+// Give the frame taken for a missing page to that page and make it findable, pinned and marked as loading so that
+// other readers of the page wait for its data. The cache's lock must be held. Pages read in by readahead are counted
+// apart from misses
+IOPageFrame* io_page_cache_claim(IOPageCache* cache, FSStoreObject* object, uint64_t page, int index, int prefetch) {
+    IOPageFrame* frame = &cache->frames[index];
+    __atomic_store_n(&frame->object_id, object->id, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame->page, page, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame->referenced, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame->loading, 1, __ATOMIC_RELAXED);
+    frame->error = 0;
+    frame->length = 0;
+    __atomic_store_n(&frame->prefetched, prefetch, __ATOMIC_RELAXED);
+
+    // A page that recently fell out of probation is wanted again, so it goes straight into the main queue
+    uint64_t key = io_page_cache_key(object->id, page);
+    uint64_t* ghost = &cache->ghosts[(uint32_t)(key >> 32) & cache->ghost_mask];
+    if (*ghost == key) {
+        *ghost = 0;
+        cache->ghost_hits++;
+        io_page_cache_push_main(cache, index);
+    } else {
+        io_page_cache_push_probation(cache, index);
     }
 
-    // Get the file system object
-    FSFile* fs_file = file_system_find_file(fs_module, filename);
-    if (fs_file == NULL) {
-        // errno already set by file system call
-        return -1;
-    }
+    io_page_cache_link_hash(cache, index);
+    if (prefetch)
+        cache->prefetched++;
+    else
+        cache->misses++;
 
-    // Get a new fd that can be used for the file
-    int new_fd = io_module_create_new_fd();
-    
-    // Associate the fd with a file object with malloc setting ENOMEM
-    io_file_hash_table_new_file(io_module->hash_table, new_fd, mode_type, fs_file);
+    __atomic_store_n(&frame->pins, 1, __ATOMIC_RELEASE);
 
-    return new_fd;
+    return frame;
 }
 
-// The API call to close the given file descriptor
-int io_close(int fd) {
-    // Remove the fd - IOFile association from the hash table
-    int removed_io_file = io_file_hash_table_remove_file(io_module->hash_table, fd);
-    if (!removed_io_file) {
-        // errno set by io_file_hash_table_remove_file
-        return -1;
+// Finish loading a claimed frame with the bytes read for it, or the errno if the read failed, and wake its waiters.
+// The cache's lock must be held
+void io_page_cache_finish(IOPageCache* cache, IOPageFrame* frame, ssize_t bytes_read, int error) {
+    if (bytes_read == -1) {
+        // The frame can't be found again and is evicted like any other once its waiters are done with it
+        frame->error = error;
+        io_page_cache_unlink_hash(cache, frame - cache->frames);
+        __atomic_store_n(&frame->object_id, 0, __ATOMIC_RELAXED);
+    } else {
+        frame->length = bytes_read;
     }
-    
-    // Could potentially cause ENOMEM but we don't want to put the fd - IOFile pair back in the hashtable
-    // because over time it could potentially degrade hashtable look up times
-    free_list_push(io_module->free_list, fd);
 
-    return 0;
+    __atomic_store_n(&frame->loading, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&cache->loaded);
 }
 
-// Read count many bytes from the IOFile pointed to by the given fd
-ssize_t io_read(int fd, char* buf, size_t count) {
-    IOFile* io_file = io_file_hash_table_get_file(io_module->hash_table, fd);
-    if ((io_file->mode_type & IOFILE_MODE_READ) == 0) {
-        errno = EROFS;
-        return -1;
-    }
-
-    if (io_file == NULL)
-        // errno is set by io_file_hash_table_get_file
-        return -1;
+// Read a missing page in from the store into the frame taken for it and return the frame pinned. Called with the cache's
+// lock held, which is dropped while the store is read so that hits and other misses carry on
+IOPageFrame* io_page_cache_load(IOPageCache* cache, FSStoreObject* object, uint64_t page, int index) {
+    IOPageFrame* frame = io_page_cache_claim(cache, object, page, index, 0);
+    pthread_mutex_unlock(&cache->lock);
 
-    // Get the file in the file system
-    FSFile* fs_file = io_file->fs_file;
-    
-    // If you've already read all the bytes don't read any more
-    if (io_file->cursor_pos >= fs_file->size)
-        return 0;
+    ssize_t bytes_read = object->store->read(object->store, object->handle, frame->data, IO_PAGE_SIZE, page * IO_PAGE_SIZE);
+    int error = errno;
 
-    // Make read a bit safer
-    ssize_t available_bytes = fs_file->size - io_file->cursor_pos;
-    ssize_t bytes_read = available_bytes;
-    if (count < available_bytes)
-        bytes_read = count;
+    pthread_mutex_lock(&cache->lock);
+    io_page_cache_finish(cache, frame, bytes_read, error);
+    pthread_mutex_unlock(&cache->lock);
 
-    // Copy the bytes over        
-    strncpy(buf, (fs_file->data + io_file->cursor_pos), bytes_read);
-        
-    io_file->cursor_pos += bytes_read;
+    if (bytes_read == -1) {
+        io_page_cache_unpin(frame);
+        errno = error;
+        return NULL;
+    }
+
+    return frame;
+}
+
+// Get the page of the object pinned, reading it in from the store on a miss. Hits don't take the cache's lock.
+// Returns NULL with errno set if the store fails or every frame stays pinned
+IOPageFrame* io_page_cache_get(IOPageCache* cache, FSStoreObject* object, uint64_t page) {
+    IOPageFrame* frame = io_page_cache_find(cache, object->id, page);
+    if (frame == NULL) {
+        pthread_mutex_lock(&cache->lock);
+
+        // Another thread may have started reading the page in while this one waited for the lock
+        for (int waits = 0; (frame = io_page_cache_find(cache, object->id, page)) == NULL; waits++) {
+            int index = io_page_cache_take_frame(cache);
+            if (index != -1)
+                // errno is set by io_page_cache_load
+                return io_page_cache_load(cache, object, page, index);
+
+            if (waits == IO_PAGE_CACHE_MAX_WAITS) {
+                pthread_mutex_unlock(&cache->lock);
+                errno = ENOBUFS;
+                return NULL;
+            }
+
+            // Every page is pinned, let the threads using them finish
+            pthread_mutex_unlock(&cache->lock);
+            sched_yield();
+            pthread_mutex_lock(&cache->lock);
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    io_page_cache_count_hit(cache);
+
+    if (__atomic_load_n(&frame->loading, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&cache->lock);
+        while (frame->loading)
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        int error = frame->error;
+        pthread_mutex_unlock(&cache->lock);
+
+        if (error != 0) {
+            io_page_cache_unpin(frame);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    // Skip the store when the bit is already set so that hot pages don't bounce their cache line between threads
+    if (!__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+
+    // The first read of a page read ahead shows the readahead was worth it
+    if (__atomic_load_n(&frame->prefetched, __ATOMIC_RELAXED) && __atomic_exchange_n(&frame->prefetched, 0, __ATOMIC_RELAXED))
+        __atomic_fetch_add(&cache->prefetch_hits, 1, __ATOMIC_RELAXED);
+
+    return frame;
+}
+
+// Read the pages of the object that aren't in the cache yet into it ahead of a reader. Runs of missing pages are read
+// from the store in one go through buffer, which has room for num_pages pages. Readahead never waits for a frame,
+// so it stops early once every frame is pinned, and failures are left for the reader to run into
+void io_page_cache_prefetch(IOPageCache* cache, FSStoreObject* object, uint64_t first_page, uint64_t num_pages, char* buffer) {
+    IOPageFrame** frames = (IOPageFrame**)malloc(sizeof(IOPageFrame*) * num_pages);
+    if (frames == NULL)
+        return;
+
+    uint64_t claimed = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (; claimed < num_pages; claimed++) {
+        frames[claimed] = io_page_cache_find(cache, object->id, first_page + claimed);
+        if (frames[claimed] != NULL) {
+            // The page is already there or on its way in
+            io_page_cache_unpin(frames[claimed]);
+            frames[claimed] = NULL;
+            continue;
+        }
+
+        int index = io_page_cache_take_frame(cache);
+        if (index == -1)
+            break;
+
+        frames[claimed] = io_page_cache_claim(cache, object, first_page + claimed, index, 1);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    for (uint64_t i = 0; i < claimed; ) {
+        if (frames[i] == NULL) {
+            i++;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while (i + run < claimed && frames[i + run] != NULL)
+            run++;
+
+        ssize_t bytes_read = object->store->read(object->store, object->handle, buffer, run * IO_PAGE_SIZE, (first_page + i) * IO_PAGE_SIZE);
+        int error = errno;
+
+        // Hand every page of the run its part of what was read
+        pthread_mutex_lock(&cache->lock);
+        for (uint64_t r = 0; r < run; r++) {
+            ssize_t length = bytes_read;
+            if (bytes_read != -1) {
+                size_t page_start = r * IO_PAGE_SIZE;
+                length = (size_t)bytes_read > page_start ? bytes_read - page_start : 0;
+                if (length > IO_PAGE_SIZE)
+                    length = IO_PAGE_SIZE;
+                memcpy(frames[i + r]->data, buffer + page_start, length);
+            }
+
+            io_page_cache_finish(cache, frames[i + r], length, error);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        for (uint64_t r = 0; r < run; r++)
+            io_page_cache_unpin(frames[i + r]);
+        i += run;
+    }
+
+    free(frames);
+}
+
+// Read up to count bytes of the object at the given offset through the cache, reading straight from the store if there's
+// no cache. The caller has already cut count down to the file's size, and bytes the store doesn't have read back as zeros
+ssize_t io_page_cache_read(IOPageCache* cache, FSStoreObject* object, size_t offset, char* buf, size_t count) {
+    if (cache == NULL) {
+        ssize_t bytes_read = object->store->read(object->store, object->handle, buf, count, offset);
+        if (bytes_read == -1)
+            // errno is set by the store
+            return -1;
+
+        memset(buf + bytes_read, 0, count - bytes_read);
+        return count;
+    }
+
+    size_t copied = 0;
+    while (copied < count) {
+        size_t position = offset + copied;
+        size_t page_offset = position % IO_PAGE_SIZE;
+        size_t length = IO_PAGE_SIZE - page_offset;
+        if (length > count - copied)
+            length = count - copied;
+
+        IOPageFrame* frame = io_page_cache_get(cache, object, position / IO_PAGE_SIZE);
+        if (frame == NULL) {
+            // errno is set by io_page_cache_get, only report it if nothing was read
+            if (copied == 0)
+                return -1;
+            break;
+        }
+
+        size_t available = frame->length > page_offset ? frame->length - page_offset : 0;
+        if (available > length)
+            available = length;
+
+        memcpy(buf + copied, frame->data + page_offset, available);
+        memset(buf + copied + available, 0, length - available);
+        io_page_cache_unpin(frame);
+        copied += length;
+    }
+
+    return copied;
+}
+
+// Drop a page that's pinned by someone else from the cache so that it can't be found again, whoever has it pinned
+// keeps the old data. The cache's lock must not be held
+void io_page_cache_drop(IOPageCache* cache, IOPageFrame* frame) {
+    pthread_mutex_lock(&cache->lock);
+    io_page_cache_unlink_hash(cache, frame - cache->frames);
+    __atomic_store_n(&frame->object_id, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Write count bytes to the object at the given offset straight through to the store, then bring any cached pages
+// the write covers up to date. Nothing is ever dirty in the cache, so evicting a page never has to write it.
+// The caller must keep readers of the object out while it writes
+ssize_t io_page_cache_write(IOPageCache* cache, FSStoreObject* object, size_t offset, const char* buf, size_t count) {
+    ssize_t written = object->store->write(object->store, object->handle, buf, count, offset);
+    if (written <= 0 || cache == NULL)
+        // errno is set by the store if the write failed
+        return written;
+
+    size_t updated = 0;
+    while (updated < (size_t)written) {
+        size_t position = offset + updated;
+        size_t page_offset = position % IO_PAGE_SIZE;
+        size_t length = IO_PAGE_SIZE - page_offset;
+        if (length > (size_t)written - updated)
+            length = written - updated;
+
+        IOPageFrame* frame = io_page_cache_find(cache, object->id, position / IO_PAGE_SIZE);
+        if (frame != NULL) {
+            // Other pins can only come from views, which must keep seeing the data they were given
+            if (__atomic_load_n(&frame->pins, __ATOMIC_ACQUIRE) > 1) {
+                io_page_cache_drop(cache, frame);
+            } else {
+                if (page_offset > frame->length)
+                    memset(frame->data + frame->length, 0, page_offset - frame->length);
+                memcpy(frame->data + page_offset, buf + updated, length);
+                if (page_offset + length > frame->length)
+                    frame->length = page_offset + length;
+            }
+
+            io_page_cache_unpin(frame);
+        }
+
+        updated += length;
+    }
+
+    return written;
+}
+
+// Drop the pages of the object that the count bytes at offset cover from the cache, whoever has one of them pinned
+// keeps the old data
+void io_page_cache_invalidate(IOPageCache* cache, FSStoreObject* object, size_t offset, size_t count) {
+    uint64_t last_page = (offset + count - 1) / IO_PAGE_SIZE;
+    for (uint64_t page = offset / IO_PAGE_SIZE; page <= last_page; page++) {
+        IOPageFrame* frame = io_page_cache_find(cache, object->id, page);
+        if (frame != NULL) {
+            io_page_cache_drop(cache, frame);
+            io_page_cache_unpin(frame);
+        }
+    }
+}
+
+// Drop the pages a write through cache covered from the page cache of every other context, which would otherwise
+// keep reading back what was there before. The caller must keep readers of the object out while it writes
+void io_page_cache_invalidate_others(IOPageCache* cache, FSStoreObject* object, size_t offset, size_t count) {
+    pthread_mutex_lock(&io_modules_lock);
+    for (IOModule* io_module = io_modules; io_module != NULL; io_module = io_module->next) {
+        if (io_module->page_cache != NULL && io_module->page_cache != cache)
+            io_page_cache_invalidate(io_module->page_cache, object, offset, count);
+    }
+    pthread_mutex_unlock(&io_modules_lock);
+}
+
+// Add up the cache's counters and how its pages are split between the queues
+void io_page_cache_get_stats(IOPageCache* cache, IOPageCacheStats* stats) {
+    memset(stats, 0, sizeof(IOPageCacheStats));
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < IO_PAGE_CACHE_STRIPES; i++)
+        stats->hits += __atomic_load_n(&cache->hit_stripes[i].hits, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&cache->lock);
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->ghost_hits = cache->ghost_hits;
+    stats->prefetched = cache->prefetched;
+    stats->prefetch_hits = __atomic_load_n(&cache->prefetch_hits, __ATOMIC_RELAXED);
+    stats->prefetch_wasted = cache->prefetch_wasted;
+    stats->num_pages = cache->num_frames;
+    stats->probation_pages = cache->probation_count;
+    stats->main_pages = cache->main_count;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (stats->hits + stats->misses > 0)
+        stats->hit_rate = (double)stats->hits / (stats->hits + stats->misses);
+}
+
+///////////////////////////////////////
+/* Simple file system in a directory */
+///////////////////////////////////////
+
+// FUNCTIONS FOR FSChunk
+// Allocate a chunk with room for capacity bytes, the data is zeroed so gaps in the file read back as zeros
+FSChunk* fs_chunk_init(size_t capacity) {
+    FSChunk* new_chunk = (FSChunk*)malloc(sizeof(FSChunk) + capacity);
+    if (new_chunk == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    new_chunk->refs = 1;
+    new_chunk->capacity = capacity;
+    new_chunk->data = (char*)(new_chunk + 1);
+    new_chunk->mapping = NULL;
+    memset(new_chunk->data, 0, capacity);
+
+    return new_chunk;
+}
+
+// Map length bytes of the open host file read-only, the caller holds the only reference to the new mapping
+FSMapping* fs_mapping_init(int host_fd, size_t length) {
+    FSMapping* mapping = (FSMapping*)malloc(sizeof(FSMapping));
+    if (mapping == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    mapping->base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, host_fd, 0);
+    if (mapping->base == MAP_FAILED) {
+        // errno is set by mmap
+        free(mapping);
+        return NULL;
+    }
+
+    mapping->refs = 1;
+    mapping->length = length;
+    mapping->arena = 0;
+
+    return mapping;
+}
+
+// Allocate a block for the data arena, the caller holds the only reference to it
+FSMapping* fs_mapping_init_arena(size_t length) {
+    FSMapping* mapping = (FSMapping*)malloc(sizeof(FSMapping));
+    if (mapping == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    mapping->base = malloc(length);
+    if (mapping->base == NULL) {
+        // malloc will set ENOMEM
+        free(mapping);
+        return NULL;
+    }
+
+    mapping->refs = 1;
+    mapping->length = length;
+    mapping->arena = 1;
+
+    return mapping;
+}
+
+// Drop a chunk's reference on a mapping, the last reference unmaps it
+void fs_mapping_release(FSMapping* mapping) {
+    if (__atomic_sub_fetch(&mapping->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (mapping->arena)
+            free(mapping->base);
+        else
+            munmap(mapping->base, mapping->length);
+        free(mapping);
+    }
+}
+
+// Take another reference on the chunk so that its data stays put
+void fs_chunk_acquire(FSChunk* chunk) {
+    __atomic_fetch_add(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference on the chunk, the last reference deallocates the chunk and its data
+void fs_chunk_release(FSChunk** chunk_ptr) {
+    FSChunk* chunk = *chunk_ptr;
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        // Chunks in the data arena live inside their block and go with it
+        FSMapping* mapping = chunk->mapping;
+        if (mapping == NULL || !mapping->arena)
+            free(chunk);
+        if (mapping != NULL)
+            fs_mapping_release(mapping);
+    }
+
+    *chunk_ptr = NULL;
+}
+
+// Give the caller a private copy of a shared chunk with at least the given capacity
+FSChunk* fs_chunk_unshare(FSChunk* chunk, size_t min_capacity) {
+    size_t capacity = chunk->capacity;
+    while (capacity < min_capacity)
+        capacity *= 2;
+    if (capacity > FS_CHUNK_SIZE)
+        capacity = FS_CHUNK_SIZE;
+
+    FSChunk* new_chunk = fs_chunk_init(capacity);
+    if (new_chunk == NULL) {
+        // errno is set by fs_chunk_init
+        return NULL;
+    }
+
+    // The other holders keep the old data untouched
+    memcpy(new_chunk->data, chunk->data, chunk->capacity);
+    fs_chunk_release(&chunk);
+
+    return new_chunk;
+}
+
+// Double the chunk's capacity until it can hold at least the given number of bytes
+FSChunk* fs_chunk_grow(FSChunk* chunk, size_t min_capacity) {
+    size_t old_capacity = chunk->capacity;
+    size_t new_capacity = old_capacity;
+    while (new_capacity < min_capacity)
+        new_capacity *= 2;
+    if (new_capacity > FS_CHUNK_SIZE)
+        new_capacity = FS_CHUNK_SIZE;
+
+    // Capacity is bounded by FS_CHUNK_SIZE so growing never copies more than one chunk
+    FSChunk* new_chunk = (FSChunk*)realloc(chunk, sizeof(FSChunk) + new_capacity);
+    if (new_chunk == NULL) {
+        // realloc will set ENOMEM and leave the old chunk untouched
+        return NULL;
+    }
+
+    new_chunk->capacity = new_capacity;
+    new_chunk->data = (char*)(new_chunk + 1);
+    memset(new_chunk->data + old_capacity, 0, new_capacity - old_capacity);
+
+    return new_chunk;
+}
+
+// FUNCTIONS FOR FSFile data
+// Drop a file's reference on a chunk table, the last reference releases the chunks and frees the table
+void fs_chunk_table_release(FSChunkTable* table, size_t num_chunks) {
+    if (__atomic_sub_fetch(&table->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (table->chunks[i] != NULL)
+            fs_chunk_release(&table->chunks[i]);
+    }
+
+    free(table);
+}
+
+// Deallocate every chunk of the file along with the chunk table, chunks shared with clones stay with them
+void file_system_file_free_chunks(FSFile* file) {
+    if (file->table != NULL) {
+        fs_chunk_table_release(file->table, file->num_chunks);
+    } else if (file->num_chunks > 0 && file->first_chunk != NULL) {
+        fs_chunk_release(&file->first_chunk);
+    }
+
+    file->table = NULL;
+    file->first_chunk = NULL;
+    file->chunks = NULL;
+    file->num_chunks = 0;
+    file->chunks_capacity = 0;
+}
+
+// Make sure the chunk table has an entry for the given number of chunks and belongs to this file alone,
+// a table shared with clones is copied and the copy takes its own reference on every chunk
+int file_system_file_reserve_chunks(FSFile* file, size_t num_chunks) {
+    FSChunkTable* table = file->table;
+    int shared = table != NULL && __atomic_load_n(&table->refs, __ATOMIC_ACQUIRE) > 1;
+
+    if (num_chunks == 1 && file->chunks_capacity == 0) {
+        file->chunks = &file->first_chunk;
+        file->chunks_capacity = 1;
+    } else if (num_chunks > file->chunks_capacity || shared) {
+        size_t new_capacity = FS_CHUNK_TABLE_INITIAL_CAPACITY;
+        while (new_capacity < num_chunks || new_capacity < file->chunks_capacity)
+            new_capacity *= 2;
+
+        // Only the chunk pointers move, the file data itself is never copied
+        size_t table_size = sizeof(FSChunkTable) + sizeof(FSChunk*) * new_capacity;
+        FSChunkTable* new_table = (FSChunkTable*)(shared || table == NULL ? malloc(table_size) : realloc(table, table_size));
+        if (new_table == NULL) {
+            // malloc and realloc will set ENOMEM and leave the old table untouched
+            return 0;
+        }
+
+        if (table == NULL) {
+            new_table->refs = 1;
+            if (file->num_chunks > 0)
+                new_table->chunks[0] = file->first_chunk;
+            file->first_chunk = NULL;
+        } else if (shared) {
+            new_table->refs = 1;
+            for (size_t i = 0; i < file->num_chunks; i++) {
+                new_table->chunks[i] = table->chunks[i];
+                if (new_table->chunks[i] != NULL)
+                    fs_chunk_acquire(new_table->chunks[i]);
+            }
+
+            fs_chunk_table_release(table, file->num_chunks);
+        }
+
+        file->table = new_table;
+        file->chunks = new_table->chunks;
+        file->chunks_capacity = new_capacity;
+    }
+
+    // Chunks that haven't been written yet have no data
+    for (size_t i = file->num_chunks; i < num_chunks; i++)
+        file->chunks[i] = NULL;
+
+    if (num_chunks > file->num_chunks)
+        file->num_chunks = num_chunks;
+
+    return 1;
+}
+
+// Get a chunk of the file that can hold at least the given number of bytes
+FSChunk* file_system_file_get_writable_chunk(FSFile* file, size_t chunk_index, size_t min_capacity) {
+    FSChunk* chunk = file->chunks[chunk_index];
+    if (chunk == NULL) {
+        size_t capacity = FS_CHUNK_MIN_CAPACITY;
+        while (capacity < min_capacity)
+            capacity *= 2;
+        if (capacity > FS_CHUNK_SIZE)
+            capacity = FS_CHUNK_SIZE;
+
+        chunk = fs_chunk_init(capacity);
+    } else if (__atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) > 1 || chunk->mapping != NULL) {
+        // Someone is still looking at this chunk's data, or it's a read-only mapping, so write to a copy instead
+        chunk = fs_chunk_unshare(chunk, min_capacity);
+    } else if (chunk->capacity < min_capacity) {
+        chunk = fs_chunk_grow(chunk, min_capacity);
+    }
+
+    if (chunk != NULL)
+        file->chunks[chunk_index] = chunk;
+
+    // errno is set by fs_chunk_init or fs_chunk_grow
+    return chunk;
+}
+
+// Write count bytes into the file at the given offset, extending the file if needed. Writes to stored files go through
+// cache and drop the pages they cover from the page caches of every other context
+ssize_t file_system_file_write(FSFile* file, IOPageCache* cache, size_t offset, const char* buf, size_t count) {
+    if (count == 0)
+        return 0;
+
+    pthread_rwlock_wrlock(&file->lock);
+
+    // Stored files have no chunks, their data goes straight to the store
+    if (file->stored != NULL) {
+        // errno is set by io_page_cache_write if the write fails
+        ssize_t stored = io_page_cache_write(cache, file->stored, offset, buf, count);
+        if (stored > 0) {
+            io_page_cache_invalidate_others(cache, file->stored, offset, stored);
+            if (offset + stored > file->size)
+                file->size = offset + stored;
+        }
+        pthread_rwlock_unlock(&file->lock);
+        return stored;
+    }
+
+    int reserved = file_system_file_reserve_chunks(file, (offset + count + FS_CHUNK_SIZE - 1) / FS_CHUNK_SIZE);
+    if (!reserved) {
+        // errno is set by file_system_file_reserve_chunks
+        pthread_rwlock_unlock(&file->lock);
+        return -1;
+    }
+
+    // Only the chunks overlapping the written range are touched
+    size_t written = 0;
+    while (written < count) {
+        size_t position = offset + written;
+        size_t chunk_index = position / FS_CHUNK_SIZE;
+        size_t chunk_offset = position % FS_CHUNK_SIZE;
+        size_t length = FS_CHUNK_SIZE - chunk_offset;
+        if (length > count - written)
+            length = count - written;
+
+        FSChunk* chunk = file_system_file_get_writable_chunk(file, chunk_index, chunk_offset + length);
+        if (chunk == NULL)
+            break;
+
+        memcpy(chunk->data + chunk_offset, buf + written, length);
+        written += length;
+    }
+
+    if (offset + written > file->size)
+        file->size = offset + written;
+
+    pthread_rwlock_unlock(&file->lock);
+
+    // Report a partial write if some of the data made it in before running out of memory
+    if (written == 0)
+        return -1;
+
+    return written;
+}
+
+// Read up to count bytes from the file at the given offset, the file's lock must be held. Stored files are read through
+// cache, or straight from their store if it's NULL. Only stored files can fail, when their store does
+ssize_t file_system_file_read_locked(FSFile* file, IOPageCache* cache, size_t offset, char* buf, size_t count) {
+    if (offset >= file->size)
+        return 0;
+
+    if (count > file->size - offset)
+        count = file->size - offset;
+
+    if (file->stored != NULL)
+        // errno is set by io_page_cache_read
+        return io_page_cache_read(cache, file->stored, offset, buf, count);
+
+    size_t copied = 0;
+    while (copied < count) {
+        size_t position = offset + copied;
+        size_t chunk_index = position / FS_CHUNK_SIZE;
+        size_t chunk_offset = position % FS_CHUNK_SIZE;
+        size_t length = FS_CHUNK_SIZE - chunk_offset;
+        if (length > count - copied)
+            length = count - copied;
+
+        // Chunks that were never written and bytes past a chunk's capacity read back as zeros
+        FSChunk* chunk = file->chunks[chunk_index];
+        size_t available = 0;
+        if (chunk != NULL && chunk->capacity > chunk_offset)
+            available = chunk->capacity - chunk_offset;
+        if (available > length)
+            available = length;
+
+        if (available > 0)
+            memcpy(buf + copied, chunk->data + chunk_offset, available);
+        memset(buf + copied + available, 0, length - available);
+        copied += length;
+    }
+
+    return copied;
+}
+
+// Read up to count bytes from the file at the given offset
+ssize_t file_system_file_read(FSFile* file, IOPageCache* cache, size_t offset, char* buf, size_t count) {
+    pthread_rwlock_rdlock(&file->lock);
+    ssize_t copied = file_system_file_read_locked(file, cache, offset, buf, count);
+    pthread_rwlock_unlock(&file->lock);
+
+    return copied;
+}
+
+// Run count reads of the file, each at its own offset, under one hold of the file's lock. A read that fails
+// gets -1 and its errno in errors, the others get an error of 0
+void file_system_file_read_batch(FSFile* file, IOPageCache* cache, const size_t* offsets, const IOVec* iov, ssize_t* bytes_read, int* errors, int count) {
+    pthread_rwlock_rdlock(&file->lock);
+    for (int i = 0; i < count; i++) {
+        bytes_read[i] = file_system_file_read_locked(file, cache, offsets[i], (char*)iov[i].base, iov[i].length);
+        errors[i] = bytes_read[i] == -1 ? errno : 0;
+    }
+    pthread_rwlock_unlock(&file->lock);
+}
+
+// Point the chunks of an empty file at size bytes of the mapping starting at offset instead of copying them.
+// Every chunk takes its own reference on the mapping
+int file_system_file_set_mapped_data(FSFile* file, FSMapping* mapping, size_t offset, size_t size) {
+    size_t num_chunks = (size + FS_CHUNK_SIZE - 1) / FS_CHUNK_SIZE;
+    if (!file_system_file_reserve_chunks(file, num_chunks)) {
+        // errno is set by file_system_file_reserve_chunks
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        FSChunk* chunk = (FSChunk*)malloc(sizeof(FSChunk));
+        if (chunk == NULL) {
+            // malloc will set ENOMEM, the chunks made so far go with the chunk table
+            file_system_file_free_chunks(file);
+            errno = ENOMEM;
+            return 0;
+        }
+
+        size_t chunk_start = i * FS_CHUNK_SIZE;
+        chunk->refs = 1;
+        chunk->capacity = size - chunk_start < FS_CHUNK_SIZE ? size - chunk_start : FS_CHUNK_SIZE;
+        chunk->data = (char*)mapping->base + offset + chunk_start;
+        chunk->mapping = mapping;
+        __atomic_add_fetch(&mapping->refs, 1, __ATOMIC_RELAXED);
+        file->chunks[i] = chunk;
+    }
+
+    file->size = size;
+
+    return 1;
+}
+
+// FUNCTIONS FOR FSFile
+// Bump allocate size bytes from the arena, a request too big for a block gets a block of its own
+void* fs_arena_alloc(FSArenaBlock** blocks, size_t size) {
+    FSArenaBlock* block = *blocks;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = size > FS_ARENA_BLOCK_SIZE ? size : FS_ARENA_BLOCK_SIZE;
+        block = (FSArenaBlock*)malloc(sizeof(FSArenaBlock) + capacity);
+        if (block == NULL) {
+            // malloc will set ENOMEM
+            return NULL;
+        }
+
+        block->used = 0;
+        block->capacity = capacity;
+        block->next = *blocks;
+        *blocks = block;
+    }
+
+    void* ptr = (char*)(block + 1) + block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+// Free every block of the arena
+void fs_arena_destroy(FSArenaBlock** blocks) {
+    while (*blocks != NULL) {
+        FSArenaBlock* block = *blocks;
+        *blocks = block->next;
+        free(block);
+    }
+}
+
+// Initialize the FSFile, the file system's lock must be held exclusively
+FSFile* file_system_file_init(FileSystem* file_system, const char* filename) {
+    FSFile* new_file = (FSFile*)slab_cache_alloc(file_system->file_cache);
+    if (new_file == NULL) {
+        perror("ERROR: Could not allocate data for FSFile\n");
+        return NULL;
+    }
+    
+    // Initialize file name, names can't be given back to the arena so one is only lost if the file fails to be added
+    size_t filename_length = strlen(filename);
+    new_file->filename = (char*)fs_arena_alloc(&file_system->name_blocks, filename_length + 1);
+    if (new_file->filename == NULL) {
+        perror("ERROR: Could not allocate data for FSFile filename\n");
+        slab_cache_free(new_file);
+        return NULL;
+    }
+
+    memcpy(new_file->filename, filename, filename_length + 1);
+
+    pthread_rwlock_init(&new_file->lock, NULL);
+    
+    // Initialize the data chunks, the chunk table is only allocated once the file has more than one chunk
+    new_file->chunks = NULL;
+    new_file->num_chunks = 0;
+    new_file->chunks_capacity = 0;
+    new_file->size = 0;
+    new_file->mount = NULL;
+    new_file->first_chunk = NULL;
+    new_file->table = NULL;
+    new_file->stored = NULL;
+
+    return new_file;
+}
+
+// Deallocate an FSFile that never made it into the file system
+void file_system_file_destroy(FileSystem* file_system, FSFile** file_ptr) {
+    FSFile* file = *file_ptr;
+
+    file_system_file_free_chunks(file);
+    if (file->stored != NULL)
+        fs_store_object_close(&file->stored);
+    pthread_rwlock_destroy(&file->lock);
+    slab_cache_free(file);
+
+    *file_ptr = NULL;
+}
+
+// Copy the data of a small file into the data arena, the file system's lock must be held exclusively
+int file_system_file_set_arena_data(FileSystem* file_system, FSFile* file, const char* data, size_t size) {
+    // The chunk sits in the block right in front of its data
+    size_t needed = (sizeof(FSChunk) + size + 7) & ~(size_t)7;
+    if (file_system->data_block == NULL || FS_ARENA_BLOCK_SIZE - file_system->data_block_used < needed) {
+        FSMapping* block = fs_mapping_init_arena(FS_ARENA_BLOCK_SIZE);
+        if (block == NULL) {
+            // errno is set by fs_mapping_init_arena
+            return 0;
+        }
+
+        // The file system's reference keeps a block around while it's being filled
+        if (file_system->data_block != NULL)
+            fs_mapping_release(file_system->data_block);
+        file_system->data_block = block;
+        file_system->data_block_used = 0;
+        file_system->data_blocks++;
+    }
+
+    if (!file_system_file_reserve_chunks(file, 1)) {
+        // errno is set by file_system_file_reserve_chunks
+        return 0;
+    }
+
+    FSMapping* block = file_system->data_block;
+    FSChunk* chunk = (FSChunk*)((char*)block->base + file_system->data_block_used);
+    chunk->refs = 1;
+    chunk->capacity = size;
+    chunk->data = (char*)(chunk + 1);
+    chunk->mapping = block;
+    memcpy(chunk->data, data, size);
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    file_system->data_block_used += needed;
+
+    file->chunks[0] = chunk;
+    file->size = size;
+
+    return 1;
+}
+
+// Scatter the file's data starting at the given offset across the buffers in a single pass over the chunks
+ssize_t file_system_file_readv(FSFile* file, IOPageCache* cache, size_t offset, const IOVec* iov, int iovcnt) {
+    pthread_rwlock_rdlock(&file->lock);
+
+    if (offset >= file->size) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    // Stored files are read a buffer at a time through the page cache
+    if (file->stored != NULL) {
+        size_t copied = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t bytes_read = file_system_file_read_locked(file, cache, offset + copied, (char*)iov[i].base, iov[i].length);
+            if (bytes_read == -1) {
+                // errno is set by file_system_file_read_locked, only report it if nothing was read
+                pthread_rwlock_unlock(&file->lock);
+                return copied == 0 ? -1 : (ssize_t)copied;
+            }
+
+            copied += bytes_read;
+            if ((size_t)bytes_read < iov[i].length)
+                break;
+        }
+
+        pthread_rwlock_unlock(&file->lock);
+        return copied;
+    }
+
+    size_t remaining = file->size - offset;
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && remaining > 0; i++) {
+        char* buf = (char*)iov[i].base;
+        size_t count = iov[i].length;
+        if (count > remaining)
+            count = remaining;
+
+        // Fill this buffer chunk by chunk
+        size_t filled = 0;
+        while (filled < count) {
+            size_t position = offset + copied + filled;
+            size_t chunk_offset = position % FS_CHUNK_SIZE;
+            FSChunk* chunk = file->chunks[position / FS_CHUNK_SIZE];
+            size_t length = FS_CHUNK_SIZE - chunk_offset;
+            if (length > count - filled)
+                length = count - filled;
+
+            // Chunks that were never written and bytes past a chunk's capacity read back as zeros
+            size_t available = 0;
+            if (chunk != NULL && chunk->capacity > chunk_offset)
+                available = chunk->capacity - chunk_offset;
+            if (available > length)
+                available = length;
+
+            if (available > 0)
+                memcpy(buf + filled, chunk->data + chunk_offset, available);
+            if (available < length)
+                memset(buf + filled + available, 0, length - available);
+            filled += length;
+        }
+
+        copied += count;
+        remaining -= count;
+    }
+
+    pthread_rwlock_unlock(&file->lock);
+
+    return copied;
+}
+
+// Point the view at up to count bytes of the file at the given offset without copying them.
+// The view never crosses a chunk boundary and holds a reference on its chunk until it is released. A view of a stored
+// file pins its page in cache instead, and fails with EOPNOTSUPP if cache is NULL
+ssize_t file_system_file_view(FSFile* file, IOPageCache* cache, size_t offset, size_t count, IOView* view) {
+    view->data = NULL;
+    view->length = 0;
+    view->chunk = NULL;
+    view->frame = NULL;
+
+    if (count == 0)
+        return 0;
+
+    // The chunk can't be reallocated by a writer until the view holds its reference
+    pthread_rwlock_rdlock(&file->lock);
+
+    if (offset >= file->size) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    if (count > file->size - offset)
+        count = file->size - offset;
+
+    // Views of stored files pin their page in the page cache, which stops writes from changing it in place
+    if (file->stored != NULL) {
+        if (cache == NULL) {
+            pthread_rwlock_unlock(&file->lock);
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        IOPageFrame* frame = io_page_cache_get(cache, file->stored, offset / IO_PAGE_SIZE);
+        if (frame == NULL) {
+            // errno is set by io_page_cache_get
+            pthread_rwlock_unlock(&file->lock);
+            return -1;
+        }
+
+        size_t page_offset = offset % IO_PAGE_SIZE;
+        size_t length = IO_PAGE_SIZE - page_offset;
+        if (length > count)
+            length = count;
+
+        if (page_offset < frame->length) {
+            if (length > frame->length - page_offset)
+                length = frame->length - page_offset;
+            view->data = frame->data + page_offset;
+            view->frame = frame;
+        } else {
+            io_page_cache_unpin(frame);
+            view->data = fs_zero_data;
+        }
+
+        view->length = length;
+        pthread_rwlock_unlock(&file->lock);
+        return length;
+    }
+
+    size_t chunk_index = offset / FS_CHUNK_SIZE;
+    size_t chunk_offset = offset % FS_CHUNK_SIZE;
+    size_t length = FS_CHUNK_SIZE - chunk_offset;
+    if (length > count)
+        length = count;
+
+    FSChunk* chunk = file->chunks[chunk_index];
+    if (chunk != NULL && chunk_offset < chunk->capacity) {
+        if (length > chunk->capacity - chunk_offset)
+            length = chunk->capacity - chunk_offset;
+
+        fs_chunk_acquire(chunk);
+        view->chunk = chunk;
+        view->data = chunk->data + chunk_offset;
+    } else {
+        // Parts of the file that were never written are served from shared zeros
+        view->data = fs_zero_data;
+    }
+
+    view->length = length;
+
+    pthread_rwlock_unlock(&file->lock);
+
+    return length;
+}
+
+// Grow the malloc'd buffer at *lineptr whose size is *n to at least size bytes, at least doubling it when it grows
+int fs_line_reserve(char** lineptr, size_t* n, size_t size) {
+    if (*lineptr != NULL && *n >= size)
+        return 1;
+
+    size_t new_size = *lineptr == NULL || *n < 128 ? 128 : *n * 2;
+    while (new_size < size)
+        new_size *= 2;
+
+    char* new_line = (char*)realloc(*lineptr, new_size);
+    if (new_line == NULL) {
+        // realloc will set ENOMEM
+        return 0;
+    }
+
+    *lineptr = new_line;
+    *n = new_size;
+
+    return 1;
+}
+
+// Copy the record of the file at offset into the malloc'd buffer at *lineptr of *n bytes, growing it to fit the record
+// and a terminating '\0'. The record runs up to and including the next delim or up to the end of the file, and is found
+// by scanning the file's data in place so that every byte is only copied once. Returns the record's length
+ssize_t file_system_file_getdelim(FSFile* file, IOPageCache* cache, size_t offset, char delim, char** lineptr, size_t* n) {
+    size_t length = 0;
+    const char* found = NULL;
+
+    // Stored files are scanned a page at a time through views, which pin each page instead of holding the lock
+    if (file->stored != NULL && cache != NULL) {
+        while (found == NULL) {
+            IOView view;
+            ssize_t viewed = file_system_file_view(file, cache, offset + length, SIZE_MAX, &view);
+            if (viewed <= 0) {
+                // errno is set by file_system_file_view if it fails
+                if (viewed == -1)
+                    return -1;
+                break;
+            }
+
+            found = io_scan_delim(view.data, viewed, delim);
+            size_t part = found != NULL ? (size_t)(found - view.data) + 1 : (size_t)viewed;
+            int reserved = fs_line_reserve(lineptr, n, length + part + 1);
+            if (reserved)
+                memcpy(*lineptr + length, view.data, part);
+            if (view.frame != NULL)
+                io_page_cache_unpin(view.frame);
+            if (!reserved) {
+                // errno is set by fs_line_reserve
+                return -1;
+            }
+
+            length += part;
+        }
+    } else if (file->stored != NULL) {
+        // Without a page cache there's nothing to view, so the store is read a page at a time straight into the line
+        // and scanned there
+        pthread_rwlock_rdlock(&file->lock);
+
+        while (found == NULL) {
+            if (!fs_line_reserve(lineptr, n, length + IO_PAGE_SIZE + 1)) {
+                // errno is set by fs_line_reserve
+                pthread_rwlock_unlock(&file->lock);
+                return -1;
+            }
+
+            size_t position = offset + length;
+            char* data = *lineptr + length;
+            ssize_t bytes_read = file_system_file_read_locked(file, NULL, position, data, IO_PAGE_SIZE - position % IO_PAGE_SIZE);
+            if (bytes_read <= 0) {
+                // errno is set by file_system_file_read_locked if it fails
+                if (bytes_read == -1) {
+                    pthread_rwlock_unlock(&file->lock);
+                    return -1;
+                }
+                break;
+            }
+
+            found = io_scan_delim(data, bytes_read, delim);
+            length += found != NULL ? (size_t)(found - data) + 1 : (size_t)bytes_read;
+        }
+
+        pthread_rwlock_unlock(&file->lock);
+    } else {
+        pthread_rwlock_rdlock(&file->lock);
+
+        while (found == NULL && offset + length < file->size) {
+            size_t position = offset + length;
+            size_t chunk_offset = position % FS_CHUNK_SIZE;
+            size_t span = FS_CHUNK_SIZE - chunk_offset;
+            if (span > file->size - position)
+                span = file->size - position;
+
+            // Chunks that were never written and bytes past a chunk's capacity are scanned as zeros
+            FSChunk* chunk = file->chunks[position / FS_CHUNK_SIZE];
+            const char* data = fs_zero_data + chunk_offset;
+            if (chunk != NULL && chunk->capacity > chunk_offset) {
+                data = chunk->data + chunk_offset;
+                if (span > chunk->capacity - chunk_offset)
+                    span = chunk->capacity - chunk_offset;
+            }
+
+            found = io_scan_delim(data, span, delim);
+            size_t part = found != NULL ? (size_t)(found - data) + 1 : span;
+            if (!fs_line_reserve(lineptr, n, length + part + 1)) {
+                // errno is set by fs_line_reserve
+                pthread_rwlock_unlock(&file->lock);
+                return -1;
+            }
+
+            memcpy(*lineptr + length, data, part);
+            length += part;
+        }
+
+        pthread_rwlock_unlock(&file->lock);
+    }
+
+    if (*lineptr != NULL)
+        (*lineptr)[length] = '\0';
+
+    return length;
+}
+
+// Find the first byte at or after offset that is data, or that is in a hole when hole is set. Holes are the chunks that
+// were never written and the implicit hole at the end of the file, stored files are all data. Fails with ENXIO if offset
+// is at or past the end of the file or there's no data after it
+int file_system_file_seek_data(FSFile* file, size_t offset, int hole, size_t* result) {
+    pthread_rwlock_rdlock(&file->lock);
+
+    if (offset >= file->size) {
+        pthread_rwlock_unlock(&file->lock);
+        errno = ENXIO;
+        return 0;
+    }
+
+    size_t position = file->size;
+    if (file->stored != NULL) {
+        if (!hole)
+            position = offset;
+    } else {
+        // Only the chunk pointers are looked at, the holes themselves have nothing to look at
+        for (size_t i = offset / FS_CHUNK_SIZE; i < file->num_chunks; i++) {
+            if ((file->chunks[i] == NULL) == hole) {
+                position = i * FS_CHUNK_SIZE > offset ? i * FS_CHUNK_SIZE : offset;
+                break;
+            }
+        }
+    }
+
+    // Past the last chunk is the hole at the end of the file
+    if (position > file->size)
+        position = file->size;
+
+    pthread_rwlock_unlock(&file->lock);
+
+    if (!hole && position == file->size) {
+        errno = ENXIO;
+        return 0;
+    }
+
+    *result = position;
+
+    return 1;
+}
+
+// Check whether the file's data starts out in a mapping of a host file or image rather than in memory
+int file_system_file_is_mapped(FSFile* file) {
+    pthread_rwlock_rdlock(&file->lock);
+    FSChunk* chunk = file->num_chunks > 0 ? file->chunks[0] : NULL;
+    int mapped = chunk != NULL && chunk->mapping != NULL && !chunk->mapping->arena;
+    pthread_rwlock_unlock(&file->lock);
+
+    return mapped;
+}
+
+// Ask the kernel to start reading in the parts of the file mapped from host files or images that cover the range,
+// so that later reads don't fault on them one page at a time
+void file_system_file_advise(FSFile* file, size_t offset, size_t length) {
+    pthread_rwlock_rdlock(&file->lock);
+
+    if (offset < file->size && length > file->size - offset)
+        length = file->size - offset;
+
+    long host_page_size = sysconf(_SC_PAGESIZE);
+    for (size_t position = offset; position < offset + length && position < file->size; ) {
+        size_t chunk_index = position / FS_CHUNK_SIZE;
+        size_t chunk_offset = position % FS_CHUNK_SIZE;
+        size_t end = (chunk_index + 1) * FS_CHUNK_SIZE;
+        if (end > offset + length)
+            end = offset + length;
+
+        // Data in memory and the data arena is already there
+        FSChunk* chunk = file->chunks[chunk_index];
+        if (chunk != NULL && chunk->mapping != NULL && !chunk->mapping->arena && chunk_offset < chunk->capacity) {
+            size_t chunk_end = end - chunk_index * FS_CHUNK_SIZE;
+            if (chunk_end > chunk->capacity)
+                chunk_end = chunk->capacity;
+
+            uintptr_t start = (uintptr_t)(chunk->data + chunk_offset) & ~(uintptr_t)(host_page_size - 1);
+            madvise((void*)start, (uintptr_t)(chunk->data + chunk_end) - start, MADV_WILLNEED);
+        }
+
+        position = end;
+    }
+
+    pthread_rwlock_unlock(&file->lock);
+}
+
+// Set the data for the given FSFile
+void file_system_file_set_data(FSFile* file, const char* data, size_t size) {
+    if (file->size != 0) {
+        fprintf(stderr, "ERROR: You cannot set the file data twice\n");
+        return;
+    }
+
+    ssize_t written = file_system_file_write(file, NULL, 0, data, size);
+    if (written != (ssize_t)size)
+        perror("ERROR: Could not allocate space for FSFile data\n");
+}
+
+// FUNCTIONS FOR FSIndex
+// FNV-1a hash of the filename which also measures its length
+uint32_t fs_index_hash(const char* filename, uint32_t* length) {
+    uint32_t hash = 2166136261u;
+    const char* c = filename;
+    while (*c != '\0') {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+        c++;
+    }
+
+    *length = c - filename;
+    return hash;
+}
+
+// FNV-1a hash of a name within the directory with the given id, the id is mixed into the starting state so that the
+// same name in different directories lands in different buckets
+uint32_t fs_index_hash_name(uint32_t parent, const char* name, uint32_t length) {
+    uint32_t hash = 2166136261u ^ (parent * 2654435761u);
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Allocate a table of empty buckets
+FSIndexEntry* fs_index_alloc_entries(int capacity) {
+    // calloc leaves every bucket with a NULL name which marks it as empty
+    return (FSIndexEntry*)calloc(capacity, sizeof(FSIndexEntry));
+}
+
+// Initialize an empty FSIndex
+FSIndex* fs_index_init() {
+    FSIndex* new_index = (FSIndex*)malloc(sizeof(FSIndex));
+    if (new_index == NULL) {
+        perror("ERROR: Could not allocate data for FSIndex\n");
+        return NULL;
+    }
+
+    new_index->entries = fs_index_alloc_entries(FS_INDEX_INITIAL_CAPACITY);
+    if (new_index->entries == NULL) {
+        perror("ERROR: Could not allocate data for FSIndex buckets\n");
+        free(new_index);
+        return NULL;
+    }
+
+    new_index->capacity = FS_INDEX_INITIAL_CAPACITY;
+    new_index->count = 0;
+    new_index->negative = 0;
+    new_index->old_entries = NULL;
+    new_index->old_capacity = 0;
+    new_index->migrate_pos = 0;
+
+    return new_index;
+}
+
+// Deallocate the FSIndex, the FSFiles and FSDirectories belong to the FileSystem
+void fs_index_destroy(FSIndex** index_ptr) {
+    FSIndex* index = *index_ptr;
+
+    free(index->entries);
+    free(index->old_entries);
+    free(index);
+
+    *index_ptr = NULL;
+}
+
+// Place an entry into the first empty bucket of its probe sequence
+void fs_index_place(FSIndexEntry* entries, int capacity, FSIndexEntry* entry) {
+    int mask = capacity - 1;
+    int bucket = entry->hash & mask;
+    while (entries[bucket].name != NULL)
+        bucket = (bucket + 1) & mask;
+
+    entries[bucket] = *entry;
+}
+
+// Find the entry for the name in the directory with the given id in a single table
+FSIndexEntry* fs_index_probe(FSIndexEntry* entries, int capacity, uint32_t parent, const char* name, uint32_t hash, uint32_t length) {
+    int mask = capacity - 1;
+    int bucket = hash & mask;
+    while (entries[bucket].name != NULL) {
+        FSIndexEntry* entry = &entries[bucket];
+        if (entry->hash == hash && entry->length == length && entry->parent == parent && memcmp(name, entry->name, length) == 0)
+            return entry;
+
+        bucket = (bucket + 1) & mask;
+    }
+
+    return NULL;
+}
+
+// Move up to steps buckets from the old table into the new one
+void fs_index_migrate(FSIndex* index, int steps) {
+    if (index->old_entries == NULL)
+        return;
+
+    // The old table is left untouched so that its probe sequences stay valid for lookups
+    while (steps > 0 && index->migrate_pos < index->old_capacity) {
+        FSIndexEntry* entry = &index->old_entries[index->migrate_pos];
+        if (entry->name != NULL)
+            fs_index_place(index->entries, index->capacity, entry);
+
+        index->migrate_pos++;
+        steps--;
+    }
+
+    if (index->migrate_pos == index->old_capacity) {
+        free(index->old_entries);
+        index->old_entries = NULL;
+        index->old_capacity = 0;
+        index->migrate_pos = 0;
+    }
+}
+
+// Start moving the entries into a table twice the size
+int fs_index_start_resize(FSIndex* index) {
+    // Only one resize can be in flight at a time
+    fs_index_migrate(index, index->old_capacity);
+
+    FSIndexEntry* new_entries = fs_index_alloc_entries(index->capacity * 2);
+    if (new_entries == NULL) {
+        // calloc will set ENOMEM
+        return 0;
+    }
+
+    index->old_entries = index->entries;
+    index->old_capacity = index->capacity;
+    index->migrate_pos = 0;
+    index->entries = new_entries;
+    index->capacity *= 2;
+
+    return 1;
+}
+
+// Find the entry for the name in the directory with the given id and precomputed hash, negative entries included
+FSIndexEntry* fs_index_find_hashed(FSIndex* index, uint32_t parent, const char* name, uint32_t hash, uint32_t length) {
+    FSIndexEntry* entry = fs_index_probe(index->entries, index->capacity, parent, name, hash, length);
+
+    // Entries that haven't been migrated yet are still in the old table
+    if (entry == NULL && index->old_entries != NULL)
+        entry = fs_index_probe(index->old_entries, index->old_capacity, parent, name, hash, length);
+
+    return entry;
+}
+
+// Find the entry for the first length bytes of name in the directory with the given id
+FSIndexEntry* fs_index_find(FSIndex* index, uint32_t parent, const char* name, uint32_t length) {
+    return fs_index_find_hashed(index, parent, name, fs_index_hash_name(parent, name, length), length);
+}
+
+// Add an entry for the file or directory under the first length bytes of name in the directory with the given id, or a
+// negative entry if both are NULL. The name has to stay valid as long as the entry does, and a negative entry already
+// there for the name is taken over
+int fs_index_insert(FSIndex* index, uint32_t parent, const char* name, uint32_t length, FSFile* file, FSDirectory* directory) {
+    FSIndexEntry entry;
+    entry.hash = fs_index_hash_name(parent, name, length);
+    entry.length = length;
+    entry.parent = parent;
+    entry.name = name;
+    entry.file = file;
+    entry.directory = directory;
+    int negative = file == NULL && directory == NULL;
+
+    // Names have to be unique within their directory
+    FSIndexEntry* existing = fs_index_find_hashed(index, parent, name, entry.hash, length);
+    if (existing != NULL) {
+        if (negative || existing->file != NULL || existing->directory != NULL) {
+            errno = EEXIST;
+            return 0;
+        }
+
+        // An entry still in the old table carries the change along when it's migrated
+        *existing = entry;
+        index->negative--;
+        return 1;
+    }
+
+    fs_index_migrate(index, FS_INDEX_MIGRATE_STEP);
+
+    // Keep the load factor under 3/4, only fail if the table is actually full
+    if ((index->count + 1) * 4 > index->capacity * 3) {
+        int resized = fs_index_start_resize(index);
+        if (!resized && index->count + 1 >= index->capacity) {
+            // errno is set by fs_index_start_resize
+            return 0;
+        }
+    }
+
+    fs_index_place(index->entries, index->capacity, &entry);
+    index->count++;
+    index->negative += negative;
+
+    return 1;
+}
+
+// Remove every negative entry by moving the rest into a new table of the same size, which also finishes any resize
+int fs_index_drop_negatives(FSIndex* index) {
+    if (index->negative == 0)
+        return 1;
+
+    FSIndexEntry* new_entries = fs_index_alloc_entries(index->capacity);
+    if (new_entries == NULL) {
+        // calloc will set ENOMEM
+        return 0;
+    }
+
+    for (int bucket = 0; bucket < index->capacity; bucket++) {
+        FSIndexEntry* entry = &index->entries[bucket];
+        if (entry->file != NULL || entry->directory != NULL)
+            fs_index_place(new_entries, index->capacity, entry);
+    }
+
+    // Only the buckets of the old table that haven't been moved yet hold entries of their own
+    for (int bucket = index->migrate_pos; index->old_entries != NULL && bucket < index->old_capacity; bucket++) {
+        FSIndexEntry* entry = &index->old_entries[bucket];
+        if (entry->file != NULL || entry->directory != NULL)
+            fs_index_place(new_entries, index->capacity, entry);
+    }
+
+    free(index->entries);
+    free(index->old_entries);
+    index->entries = new_entries;
+    index->old_entries = NULL;
+    index->old_capacity = 0;
+    index->migrate_pos = 0;
+    index->count -= index->negative;
+    index->negative = 0;
+
+    return 1;
+}
+
+// FUNCTIONS FOR FileSystem
+// Initialize the FileSystem
+FileSystem* file_system_init() {
+    FileSystem* file_system = (FileSystem*)malloc(sizeof(FileSystem));
+    if (file_system == NULL) {
+        perror("ERROR: Could not allocate data for FileSystem\n");
+        return NULL;
+    }
+
+    file_system->files = NULL;
+    file_system->names = NULL;
+    file_system->name_lengths = NULL;
+    file_system->hashes = NULL;
+    file_system->num_files = 0;
+    file_system->files_capacity = 0;
+    file_system->mounts = NULL;
+    file_system->images = NULL;
+    file_system->name_blocks = NULL;
+    file_system->data_block = NULL;
+    file_system->data_block_used = 0;
+    file_system->data_blocks = 0;
+    pthread_rwlock_init(&file_system->lock, NULL);
+
+    file_system->index = fs_index_init();
+    if (file_system->index == NULL) {
+        free(file_system);
+        return NULL;
+    }
+
+    // Set up the cache for FSFiles
+    file_system->file_cache = slab_cache_init(sizeof(FSFile));
+    if (file_system->file_cache == NULL) {
+        fs_index_destroy(&file_system->index);
+        free(file_system);
+        return NULL;
+    }
+
+    // Set up the cache for FSDirectories along with the root, which isn't in the index since nothing contains it
+    file_system->directory_cache = slab_cache_init(sizeof(FSDirectory));
+    if (file_system->directory_cache != NULL)
+        file_system->root = (FSDirectory*)slab_cache_alloc(file_system->directory_cache);
+    if (file_system->directory_cache == NULL || file_system->root == NULL) {
+        perror("ERROR: Could not allocate data for the root FSDirectory\n");
+        if (file_system->directory_cache != NULL)
+            slab_cache_destroy(&file_system->directory_cache);
+        slab_cache_destroy(&file_system->file_cache);
+        fs_index_destroy(&file_system->index);
+        free(file_system);
+        return NULL;
+    }
+
+    file_system->root->path = "";
+    file_system->root->path_length = 0;
+    file_system->root->id = 0;
+    file_system->root->parent = NULL;
+    file_system->num_directories = 1;
+    file_system->id = __atomic_fetch_add(&fs_next_id, 1, __ATOMIC_RELAXED);
+
+    return file_system;
+}
+
+// Destroy the FileSystem
+void file_system_destroy(FileSystem** file_system_ptr) {
+    FileSystem* file_system = *file_system_ptr;
+    
+    // Small files only hold references on the data arena, so only large files free anything here
+    for (size_t i = 0; i < file_system->num_files; i++) {
+        file_system_file_free_chunks(file_system->files[i]);
+        if (file_system->files[i]->stored != NULL)
+            fs_store_object_close(&file_system->files[i]->stored);
+        pthread_rwlock_destroy(&file_system->files[i]->lock);
+    }
+
+    free(file_system->files);
+    free(file_system->names);
+    free(file_system->name_lengths);
+    free(file_system->hashes);
+    fs_index_destroy(&file_system->index);
+    pthread_rwlock_destroy(&file_system->lock);
+
+    while (file_system->mounts != NULL) {
+        FSMount* mount = file_system->mounts;
+        file_system->mounts = mount->next;
+        free(mount->root);
+        free(mount);
+    }
+
+    // Files taken from an image hold their own references on its mapping
+    while (file_system->images != NULL) {
+        FSImage* image = file_system->images;
+        file_system->images = image->next;
+        fs_mapping_release(image->mapping);
+        free(image);
+    }
+
+    // Release the FSFiles, filenames and small file data in bulk
+    if (file_system->data_block != NULL)
+        fs_mapping_release(file_system->data_block);
+    slab_cache_destroy(&file_system->file_cache);
+    slab_cache_destroy(&file_system->directory_cache);
+    fs_arena_destroy(&file_system->name_blocks);
+
+    free(file_system);
+    *file_system_ptr = NULL;
+}
+
+// Make sure the parallel file arrays have room for one more file
+int file_system_reserve_files(FileSystem* file_system) {
+    if (file_system->num_files < file_system->files_capacity)
+        return 1;
+
+    size_t new_capacity = file_system->files_capacity == 0 ? FS_FILES_INITIAL_CAPACITY : file_system->files_capacity * 2;
+
+    // Each array keeps its old contents if a later one fails, the capacity is only raised once they all succeed
+    FSFile** files = (FSFile**)realloc(file_system->files, sizeof(FSFile*) * new_capacity);
+    if (files == NULL)
+        return 0;
+    file_system->files = files;
+
+    const char** names = (const char**)realloc(file_system->names, sizeof(char*) * new_capacity);
+    if (names == NULL)
+        return 0;
+    file_system->names = names;
+
+    uint32_t* name_lengths = (uint32_t*)realloc(file_system->name_lengths, sizeof(uint32_t) * new_capacity);
+    if (name_lengths == NULL)
+        return 0;
+    file_system->name_lengths = name_lengths;
+
+    uint32_t* hashes = (uint32_t*)realloc(file_system->hashes, sizeof(uint32_t) * new_capacity);
+    if (hashes == NULL)
+        return 0;
+    file_system->hashes = hashes;
+
+    file_system->files_capacity = new_capacity;
+
+    return 1;
+}
+
+// Make a directory for the first path_length bytes of path in parent, its name is the last component of that.
+// The file system's lock must be held exclusively
+FSDirectory* file_system_directory_init(FileSystem* file_system, FSDirectory* parent, const char* path, uint32_t path_length) {
+    FSDirectory* directory = (FSDirectory*)slab_cache_alloc(file_system->directory_cache);
+    if (directory == NULL) {
+        // errno is set by slab_cache_alloc
+        return NULL;
+    }
+
+    // The path is left in the arena if the directory can't be indexed, like the names of files that can't be added
+    char* stored_path = (char*)fs_arena_alloc(&file_system->name_blocks, path_length + 1);
+    if (stored_path == NULL) {
+        slab_cache_free(directory);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(stored_path, path, path_length);
+    stored_path[path_length] = '\0';
+
+    directory->path = stored_path;
+    directory->path_length = path_length;
+    directory->id = file_system->num_directories;
+    directory->parent = parent;
+
+    uint32_t name_offset = parent->path_length == 0 ? 0 : parent->path_length + 1;
+    if (!fs_index_insert(file_system->index, parent->id, stored_path + name_offset, path_length - name_offset, NULL, directory)) {
+        // errno is set by fs_index_insert
+        slab_cache_free(directory);
+        return NULL;
+    }
+
+    file_system->num_directories++;
+
+    return directory;
+}
+
+// Find the directory the last component of path is in by walking the directories along it from the root, and point
+// name at that component. Missing directories are made on the way when create is set, which needs the file system's
+// lock held exclusively rather than shared. Returns NULL with errno set to ENOTDIR if a file is in the way, or to
+// ENOENT if a directory is missing or a component is empty, EINVAL for an empty component when creating
+FSDirectory* file_system_walk_path(FileSystem* file_system, const char* path, const char** name, int create) {
+    FSDirectory* directory = file_system->root;
+    const char* component = path;
+    const char* slash;
+    while ((slash = strchr(component, '/')) != NULL) {
+        uint32_t length = slash - component;
+        if (length == 0) {
+            errno = create ? EINVAL : ENOENT;
+            return NULL;
+        }
+
+        FSIndexEntry* entry = fs_index_find(file_system->index, directory->id, component, length);
+        if (entry != NULL && entry->file != NULL) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+
+        if (entry != NULL && entry->directory != NULL) {
+            directory = entry->directory;
+        } else if (create) {
+            directory = file_system_directory_init(file_system, directory, path, slash - path);
+            if (directory == NULL) {
+                // errno is set by file_system_directory_init
+                return NULL;
+            }
+        } else {
+            errno = ENOENT;
+            return NULL;
+        }
+
+        component = slash + 1;
+    }
+
+    *name = component;
+    return directory;
+}
+
+// Find the directory the file at path would be in without making anything, going straight to the directory the
+// calling thread last found one in when the path is in it. The file system's lock must be held
+FSDirectory* file_system_find_parent(FileSystem* file_system, const char* path, const char** name) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        *name = path;
+        return file_system->root;
+    }
+
+    FSDirectory* directory = fs_path_cache;
+    uint32_t prefix_length = slash - path;
+    if (fs_path_cache_id == file_system->id && directory->path_length == prefix_length
+        && memcmp(directory->path, path, prefix_length) == 0) {
+        *name = slash + 1;
+        return directory;
+    }
+
+    directory = file_system_walk_path(file_system, path, name, 0);
+    if (directory != NULL) {
+        fs_path_cache = directory;
+        fs_path_cache_id = file_system->id;
+    }
+
+    // errno is set by file_system_walk_path if it fails
+    return directory;
+}
+
+// Add the directory at path along with any of the directories above it that are missing, succeeding if it's already
+// there. Fails with ENOTDIR if a file is in the way along the path or EEXIST if a file has the directory's name
+int file_system_make_directory(FileSystem* file_system, const char* path) {
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    const char* name;
+    FSDirectory* parent = file_system_walk_path(file_system, path, &name, 1);
+    if (parent == NULL) {
+        // errno is set by file_system_walk_path
+        pthread_rwlock_unlock(&file_system->lock);
+        return 0;
+    }
+
+    // A path ending in '/' names the directory its last component is in
+    uint32_t length = strlen(name);
+    FSIndexEntry* entry = length > 0 ? fs_index_find(file_system->index, parent->id, name, length) : NULL;
+    int made = 1;
+    if (entry != NULL && entry->file != NULL) {
+        errno = EEXIST;
+        made = 0;
+    } else if (length > 0 && (entry == NULL || entry->directory == NULL)) {
+        // errno is set by file_system_directory_init if it fails
+        made = file_system_directory_init(file_system, parent, path, name + length - path) != NULL;
+    }
+
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return made;
+}
+
+// Make the file findable under its name in its directory, making the directories along its path that are missing.
+// The file system's lock must be held exclusively
+int file_system_index_file(FileSystem* file_system, FSFile* file) {
+    const char* name;
+    FSDirectory* directory = file_system_walk_path(file_system, file->filename, &name, 1);
+    if (directory == NULL) {
+        // errno is set by file_system_walk_path
+        return 0;
+    }
+
+    uint32_t length = strlen(name);
+    if (length == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    // errno is set by fs_index_insert if it fails
+    return fs_index_insert(file_system->index, directory->id, name, length, file, NULL);
+}
+
+// Make a newly created file findable and add it to the file system, destroying it if it can't be added.
+// The file system's lock must be held exclusively
+int file_system_attach_file(FileSystem* file_system, FSFile* file) {
+    if (!file_system_reserve_files(file_system)) {
+        // realloc will set ENOMEM
+        fprintf(stderr, "ERROR: Failed to add a file to the file system\n");
+        file_system_file_destroy(file_system, &file);
+        return 0;
+    }
+
+    // Make the file findable by its name
+    int indexed = file_system_index_file(file_system, file);
+    if (!indexed) {
+        // errno is set by file_system_index_file, a taken name or a bad path is left to the caller
+        int error = errno;
+        if (error == ENOMEM)
+            fprintf(stderr, "ERROR: Failed to index a file in the file system\n");
+        file_system_file_destroy(file_system, &file);
+        errno = error;
+        return 0;
+    }
+
+    // Attach the file to the file system
+    size_t i = file_system->num_files++;
+    file_system->files[i] = file;
+    file_system->names[i] = file->filename;
+    file_system->hashes[i] = fs_index_hash(file->filename, &file_system->name_lengths[i]);
+
+    return 1;
+}
+
+// Look the filename up in the index of a loaded image, returning NULL if it isn't there
+const FSImageEntry* fs_image_probe(FSImage* image, const char* filename, uint32_t hash, uint32_t length) {
+    const char* base = (const char*)image->mapping->base;
+    uint64_t image_size = image->header->image_size;
+    uint32_t mask = image->header->index_capacity - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+        const FSImageEntry* entry = &image->entries[i];
+        if (entry->name_length == 0)
+            return NULL;
+
+        // Names that run past the end of a damaged image never match
+        if (entry->hash != hash || entry->name_length != length || length > image_size || entry->name_offset > image_size - length)
+            continue;
+
+        if (memcmp(base + entry->name_offset, filename, length) == 0)
+            return entry;
+    }
+
+    // A damaged image can have an index with no empty bucket to stop at
+    return NULL;
+}
+
+// Find a file in the loaded images, giving it an FSFile that points into the image the first time it's found
+FSFile* file_system_find_image_file(FileSystem* file_system, FSImage* images, const char* filename, uint32_t hash, uint32_t length) {
+    // Images are never unloaded and always added at the front, so the list can be walked without the lock
+    FSImage* image = images;
+    const FSImageEntry* entry = NULL;
+    while (image != NULL && entry == NULL) {
+        entry = fs_image_probe(image, filename, hash, length);
+        if (entry == NULL)
+            image = image->next;
+    }
+
+    if (entry == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if (entry->data_offset > image->header->image_size || entry->size > image->header->image_size - entry->data_offset) {
+        errno = EIO;
+        return NULL;
+    }
+
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    // Another thread may have found the file first
+    const char* name;
+    FSDirectory* directory = file_system_walk_path(file_system, filename, &name, 0);
+    FSIndexEntry* found = directory != NULL ? fs_index_find(file_system->index, directory->id, name, strlen(name)) : NULL;
+    if (found != NULL && found->file != NULL) {
+        pthread_rwlock_unlock(&file_system->lock);
+        return found->file;
+    }
+
+    FSFile* file = file_system_file_init(file_system, filename);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&file_system->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (entry->size > 0 && !file_system_file_set_mapped_data(file, image->mapping, entry->data_offset, entry->size)) {
+        // errno is set by file_system_file_set_mapped_data
+        int error = errno;
+        file_system_file_destroy(file_system, &file);
+        pthread_rwlock_unlock(&file_system->lock);
+        errno = error;
+        return NULL;
+    }
+
+    int attached = file_system_attach_file(file_system, file);
+    pthread_rwlock_unlock(&file_system->lock);
+
+    // errno is set by file_system_attach_file if it fails
+    return attached ? file : NULL;
+}
+
+// Add the probe lengths of the entries of a single table from first_bucket on to the stats
+void fs_index_add_stats(FSIndexEntry* entries, int capacity, int first_bucket, FSIndexStats* stats, size_t* total_probes) {
+    int mask = capacity - 1;
+    for (int bucket = first_bucket; bucket < capacity; bucket++) {
+        if (entries[bucket].name == NULL)
+            continue;
+
+        size_t probe_length = ((bucket - (int)(entries[bucket].hash & mask)) & mask) + 1;
+        if (probe_length > stats->max_probe_length)
+            stats->max_probe_length = probe_length;
+        *total_probes += probe_length;
+    }
+}
+
+// Get how crowded the filename index is, this walks every bucket
+void file_system_get_index_stats(FileSystem* file_system, FSIndexStats* stats) {
+    memset(stats, 0, sizeof(FSIndexStats));
+
+    pthread_rwlock_rdlock(&file_system->lock);
+
+    FSIndex* index = file_system->index;
+    size_t total_probes = 0;
+    fs_index_add_stats(index->entries, index->capacity, 0, stats, &total_probes);
+    // The buckets of the old table that have been moved are left in place, only the rest are looked up there
+    if (index->old_entries != NULL) {
+        fs_index_add_stats(index->old_entries, index->old_capacity, index->migrate_pos, stats, &total_probes);
+        stats->resizing = 1;
+    }
+
+    stats->entries = index->count;
+    stats->capacity = index->capacity;
+    stats->directories = file_system->num_directories - 1;
+    stats->negative_entries = index->negative;
+    stats->load_factor = (double)index->count / index->capacity;
+    if (index->count > 0)
+        stats->mean_probe_length = (double)total_probes / index->count;
+
+    pthread_rwlock_unlock(&file_system->lock);
+}
+
+// Get the occupancy of the cache backing the FSFiles
+void file_system_get_pool_stats(FileSystem* file_system, SlabStats* file_stats) {
+    memset(file_stats, 0, sizeof(SlabStats));
+    slab_cache_add_stats(file_system->file_cache, file_stats);
+}
+
+// Add up where the memory of the file system goes
+void file_system_get_memory_stats(FileSystem* file_system, FSMemoryStats* stats) {
+    memset(stats, 0, sizeof(FSMemoryStats));
+
+    pthread_rwlock_rdlock(&file_system->lock);
+
+    SlabStats file_stats;
+    file_system_get_pool_stats(file_system, &file_stats);
+    stats->num_files = file_system->num_files;
+    stats->file_bytes = (size_t)file_stats.slabs * SLAB_SIZE;
+
+    for (FSArenaBlock* block = file_system->name_blocks; block != NULL; block = block->next)
+        stats->name_bytes += sizeof(FSArenaBlock) + block->capacity;
+
+    FSIndex* index = file_system->index;
+    stats->table_bytes = sizeof(FSIndexEntry) * (index->capacity + (index->old_entries != NULL ? index->old_capacity : 0));
+    stats->table_bytes += (sizeof(FSFile*) + sizeof(char*) + 2 * sizeof(uint32_t)) * file_system->files_capacity;
+    SlabStats directory_stats;
+    memset(&directory_stats, 0, sizeof(SlabStats));
+    slab_cache_add_stats(file_system->directory_cache, &directory_stats);
+    stats->table_bytes += (size_t)directory_stats.slabs * SLAB_SIZE;
+    stats->chunk_bytes = file_system->data_blocks * FS_ARENA_BLOCK_SIZE;
+
+    for (size_t i = 0; i < file_system->num_files; i++) {
+        FSFile* file = file_system->files[i];
+        pthread_rwlock_rdlock(&file->lock);
+
+        // Tables and chunks shared with clones are split between the files sharing them so they're counted once
+        stats->data_bytes += file->size;
+        int table_refs = 1;
+        if (file->table != NULL) {
+            table_refs = __atomic_load_n(&file->table->refs, __ATOMIC_RELAXED);
+            stats->table_bytes += (sizeof(FSChunkTable) + sizeof(FSChunk*) * file->chunks_capacity) / table_refs;
+        }
+
+        // Chunks of the data arena are counted with their blocks, and mapped data belongs to the host
+        double chunk_bytes = 0;
+        for (size_t c = 0; c < file->num_chunks; c++) {
+            FSChunk* chunk = file->chunks[c];
+            if (chunk == NULL || (chunk->mapping != NULL && chunk->mapping->arena))
+                continue;
+
+            int chunk_refs = __atomic_load_n(&chunk->refs, __ATOMIC_RELAXED);
+            chunk_bytes += (double)(sizeof(FSChunk) + (chunk->mapping == NULL ? chunk->capacity : 0)) / chunk_refs;
+        }
+        stats->chunk_bytes += (size_t)(chunk_bytes / table_refs);
+
+        pthread_rwlock_unlock(&file->lock);
+    }
+
+    pthread_rwlock_unlock(&file_system->lock);
+
+    size_t total_bytes = stats->file_bytes + stats->name_bytes + stats->table_bytes + stats->chunk_bytes;
+    if (stats->num_files > 0 && total_bytes > stats->data_bytes)
+        stats->overhead_per_file = (double)(total_bytes - stats->data_bytes) / stats->num_files;
+}
+
+// Visit every file whose name starts with prefix in the order they were added, stopping early if visit returns 0.
+// Only the parallel name arrays are read to find the matches, and files can't be added from inside visit.
+// Returns the number of files visited
+size_t file_system_scan(FileSystem* file_system, const char* prefix, int (*visit)(FSFile* file, void* arg), void* arg) {
+    size_t prefix_length = strlen(prefix);
+    size_t visited = 0;
+
+    pthread_rwlock_rdlock(&file_system->lock);
+    for (size_t i = 0; i < file_system->num_files; i++) {
+        if (file_system->name_lengths[i] < prefix_length || memcmp(file_system->names[i], prefix, prefix_length) != 0)
+            continue;
+
+        visited++;
+        if (!visit(file_system->files[i], arg))
+            break;
+    }
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return visited;
+}
+int file_system_add_file(FileSystem* file_system, const char* filename, const char* data, size_t size) {
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    FSFile* file = file_system_file_init(file_system, filename);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&file_system->lock);
+        fprintf(stderr, "ERROR: Failed to add a file to file system\n");
+        return 0;
+    }
+
+    // Assign the data to the FSFile before anyone can find it, small files are packed into the data arena
+    if (size > 0 && size <= FS_ARENA_MAX_FILE_SIZE) {
+        if (!file_system_file_set_arena_data(file_system, file, data, size))
+            perror("ERROR: Could not allocate space for FSFile data\n");
+    } else {
+        file_system_file_set_data(file, data, size);
+    }
+
+    // errno is set by file_system_attach_file if it fails
+    int attached = file_system_attach_file(file_system, file);
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return attached;
+}
+
+// Add a file whose data lives in the object of the same name on the store instead of in memory, creating the object
+// if the store doesn't have it yet. Reads go through the page cache and writes go straight through to the store,
+// which has to outlive the file system
+int file_system_add_stored_file(FileSystem* file_system, const char* filename, FSStore* store) {
+    size_t size;
+    FSStoreObject* object = fs_store_object_open(store, filename, &size);
+    if (object == NULL) {
+        // errno is set by fs_store_object_open
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    FSFile* file = file_system_file_init(file_system, filename);
+    if (file == NULL) {
+        pthread_rwlock_unlock(&file_system->lock);
+        fs_store_object_close(&object);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    file->stored = object;
+    file->size = size;
+
+    // errno is set by file_system_attach_file if it fails, which closes the object along with the file
+    int attached = file_system_attach_file(file_system, file);
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return attached;
+}
+
+// Remember that the file at path is neither in the file system nor in the images it had when it was looked up, so that
+// looking it up again doesn't probe every image. Nothing is recorded if an image was loaded since or the table of
+// negative entries is full
+void file_system_add_negative(FileSystem* file_system, const char* filename, FSImage* images) {
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    const char* name;
+    FSDirectory* directory = file_system_walk_path(file_system, filename, &name, 0);
+    FSIndex* index = file_system->index;
+    if (directory != NULL && file_system->images == images && index->negative < FS_INDEX_MAX_NEGATIVE) {
+        uint32_t length = strlen(name);
+        char* stored_name = length > 0 ? (char*)fs_arena_alloc(&file_system->name_blocks, length) : NULL;
+        if (stored_name != NULL) {
+            memcpy(stored_name, name, length);
+            // Another thread may have added the file or recorded the miss first, which fails with EEXIST
+            fs_index_insert(index, directory->id, stored_name, length, NULL, NULL);
+        }
+    }
+
+    pthread_rwlock_unlock(&file_system->lock);
+}
+
+FSFile* file_system_find_file(FileSystem* file_system, const char* filename) {
+    // Files and directories are never removed so they stay valid after the lock is dropped
+    pthread_rwlock_rdlock(&file_system->lock);
+    const char* name;
+    FSDirectory* directory = file_system_find_parent(file_system, filename, &name);
+    int error = errno;
+    FSIndexEntry* entry = directory != NULL ? fs_index_find(file_system->index, directory->id, name, strlen(name)) : NULL;
+    FSFile* file = entry != NULL ? entry->file : NULL;
+    int is_directory = entry != NULL && entry->directory != NULL;
+    int negative = entry != NULL && file == NULL && !is_directory;
+    FSImage* images = file_system->images;
+    pthread_rwlock_unlock(&file_system->lock);
+
+    if (file != NULL)
+        return file;
+
+    if (is_directory) {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    // Negative entries are dropped whenever an image is loaded so the name isn't in any of the images either, and images
+    // can have files in directories that haven't been made yet. A file in the way of the path hides the images
+    if (!negative && images != NULL && (directory != NULL || error == ENOENT)) {
+        uint32_t length;
+        uint32_t hash = fs_index_hash(filename, &length);
+
+        // Files in loaded images are added to the file system the first time they're found
+        file = file_system_find_image_file(file_system, images, filename, hash, length);
+        if (file != NULL || errno != ENOENT) {
+            // errno is set by file_system_find_image_file if it fails
+            return file;
+        }
+
+        if (directory != NULL)
+            file_system_add_negative(file_system, filename, images);
+    }
+
+    errno = directory != NULL ? ENOENT : error;
+    return NULL;
+}
+
+// Map a mounted file's data in from its host file the first time it's needed, the chunks point straight into the mapping
+int file_system_file_map(FSFile* file) {
+    if (__atomic_load_n(&file->mount, __ATOMIC_ACQUIRE) == NULL)
+        return 1;
+
+    pthread_rwlock_wrlock(&file->lock);
+
+    // Another thread mapped the file while this one waited for the lock
+    FSMount* mount = file->mount;
+    if (mount == NULL) {
+        pthread_rwlock_unlock(&file->lock);
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", mount->root, file->filename) >= (int)sizeof(path)) {
+        pthread_rwlock_unlock(&file->lock);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    // errno is set by open, fstat and mmap if they fail
+    int host_fd = open(path, O_RDONLY);
+    if (host_fd == -1) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    struct stat host_stat;
+    if (fstat(host_fd, &host_stat) == -1) {
+        close(host_fd);
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    size_t size = host_stat.st_size;
+    FSMapping* mapping = NULL;
+    if (size > 0) {
+        mapping = fs_mapping_init(host_fd, size);
+        if (mapping == NULL) {
+            // errno is set by fs_mapping_init
+            close(host_fd);
+            pthread_rwlock_unlock(&file->lock);
+            return 0;
+        }
+    }
+
+    close(host_fd);
+
+    int set = mapping == NULL || file_system_file_set_mapped_data(file, mapping, 0, size);
+    if (mapping != NULL)
+        fs_mapping_release(mapping);
+
+    if (!set) {
+        // errno is set by file_system_file_set_mapped_data
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    __atomic_store_n(&file->mount, NULL, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&file->lock);
+
+    return 1;
+}
+
+// Add every regular file below the directory at path to the file system, path holds the mount's root followed by
+// the directory's own path and has room for PATH_MAX bytes. Returns the number of files added or -1
+int file_system_mount_directory(FileSystem* file_system, FSMount* mount, char* path, size_t root_length) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        // errno is set by opendir
+        return -1;
+    }
+
+    int mounted = 0;
+    size_t path_length = strlen(path);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t name_length = strlen(entry->d_name);
+        if (path_length + 1 + name_length >= PATH_MAX)
+            continue;
+
+        path[path_length] = '/';
+        memcpy(path + path_length + 1, entry->d_name, name_length + 1);
+
+        // Only look the entry up when the directory listing doesn't say what it is, symlinked directories aren't followed
+        int is_file = entry->d_type == DT_REG;
+        int is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat entry_stat;
+            if (stat(path, &entry_stat) == 0) {
+                is_file = S_ISREG(entry_stat.st_mode);
+                is_directory = entry->d_type == DT_UNKNOWN && S_ISDIR(entry_stat.st_mode);
+            }
+        }
+
+        if (is_directory) {
+            int mounted_below = file_system_mount_directory(file_system, mount, path, root_length);
+            if (mounted_below > 0)
+                mounted += mounted_below;
+        } else if (is_file) {
+            // Files are named by their path below the mount's root, and their data is only mapped in when they're opened
+            pthread_rwlock_wrlock(&file_system->lock);
+            FSFile* file = file_system_file_init(file_system, path + root_length + 1);
+            if (file != NULL) {
+                file->mount = mount;
+                mounted += file_system_attach_file(file_system, file);
+            }
+            pthread_rwlock_unlock(&file_system->lock);
+        }
+
+        path[path_length] = '\0';
+    }
+
+    closedir(dir);
+
+    return mounted;
+}
+
+// Mount the host directory at host_dir, adding every regular file below it without reading any of them.
+// Returns the number of files added, files whose names are already taken are skipped.
+// Host files must not shrink while they're mapped, reading mapped pages past their new end faults
+int file_system_mount(FileSystem* file_system, const char* host_dir) {
+    char path[PATH_MAX];
+    size_t root_length = strlen(host_dir);
+    while (root_length > 1 && host_dir[root_length - 1] == '/')
+        root_length--;
+
+    if (root_length >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    FSMount* mount = (FSMount*)malloc(sizeof(FSMount));
+    if (mount == NULL) {
+        // malloc will set ENOMEM
+        return -1;
+    }
+
+    mount->root = (char*)malloc(root_length + 1);
+    if (mount->root == NULL) {
+        // malloc will set ENOMEM
+        free(mount);
+        return -1;
+    }
+
+    memcpy(mount->root, host_dir, root_length);
+    mount->root[root_length] = '\0';
+    strcpy(path, mount->root);
+
+    // Files can't be removed, so the mount has to live as long as the file system even if nothing was added
+    pthread_rwlock_wrlock(&file_system->lock);
+    mount->next = file_system->mounts;
+    file_system->mounts = mount;
+    pthread_rwlock_unlock(&file_system->lock);
+
+    // errno is set by file_system_mount_directory if the root can't be read
+    return file_system_mount_directory(file_system, mount, path, root_length);
+}
+
+// Load the image at image_path into the file system by mapping it, none of its files are read until they're found.
+// Files in the image are hidden by files of the same name that are already in the file system
+int file_system_load_image(FileSystem* file_system, const char* image_path) {
+    // errno is set by open, fstat and fs_mapping_init if they fail
+    int image_fd = open(image_path, O_RDONLY);
+    if (image_fd == -1)
+        return 0;
+
+    struct stat image_stat;
+    if (fstat(image_fd, &image_stat) == -1) {
+        close(image_fd);
+        return 0;
+    }
+
+    if ((size_t)image_stat.st_size < sizeof(FSImageHeader)) {
+        close(image_fd);
+        errno = EINVAL;
+        return 0;
+    }
+
+    FSMapping* mapping = fs_mapping_init(image_fd, image_stat.st_size);
+    close(image_fd);
+    if (mapping == NULL)
+        return 0;
+
+    // Check that the header and the index fit in the image, entries are checked as they're found
+    const FSImageHeader* header = (const FSImageHeader*)mapping->base;
+    uint32_t capacity = header->index_capacity;
+    if (memcmp(header->magic, FS_IMAGE_MAGIC, 8) != 0 || header->version != FS_IMAGE_VERSION
+        || header->image_size != (uint64_t)image_stat.st_size || capacity == 0 || (capacity & (capacity - 1)) != 0
+        || header->num_files >= capacity || header->index_offset % 8 != 0 || header->index_offset > header->image_size
+        || (header->image_size - header->index_offset) / sizeof(FSImageEntry) < capacity) {
+        fs_mapping_release(mapping);
+        errno = EINVAL;
+        return 0;
+    }
+
+    // Probes stop at the first empty bucket, so an index with none of them is damaged
+    const FSImageEntry* entries = (const FSImageEntry*)((const char*)mapping->base + header->index_offset);
+    uint32_t empty = 0;
+    while (empty < capacity && entries[empty].name_length != 0)
+        empty++;
+    if (empty == capacity) {
+        fs_mapping_release(mapping);
+        errno = EINVAL;
+        return 0;
+    }
+
+    FSImage* image = (FSImage*)malloc(sizeof(FSImage));
+    if (image == NULL) {
+        // malloc will set ENOMEM
+        fs_mapping_release(mapping);
+        return 0;
+    }
+
+    image->mapping = mapping;
+    image->header = header;
+    image->entries = entries;
+
+    // The image can have files that were recorded as missing
+    pthread_rwlock_wrlock(&file_system->lock);
+    if (!fs_index_drop_negatives(file_system->index)) {
+        // calloc will set ENOMEM
+        pthread_rwlock_unlock(&file_system->lock);
+        fs_mapping_release(mapping);
+        free(image);
+        return 0;
+    }
+
+    image->next = file_system->images;
+    file_system->images = image;
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return 1;
+}
+
+// Round an image offset up to the next multiple of 8
+uint64_t fs_image_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Write every file of the file system into a packed image at image_path. Files from a mounted directory are mapped in
+// to be copied, files of loaded images that were never looked up are not included
+int file_system_write_image(FileSystem* file_system, const char* image_path) {
+    pthread_rwlock_rdlock(&file_system->lock);
+
+    uint32_t num_files = file_system->num_files;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < num_files; i++)
+        names_size += file_system->name_lengths[i];
+
+    // Keep the index at most half full so that probes stay short
+    uint32_t capacity = 1;
+    while (capacity < 2 * (uint64_t)num_files + 1)
+        capacity <<= 1;
+
+    FSImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FS_IMAGE_MAGIC, 8);
+    header.version = FS_IMAGE_VERSION;
+    header.num_files = num_files;
+    header.index_capacity = capacity;
+    header.index_offset = fs_image_align(sizeof(FSImageHeader));
+    header.names_offset = header.index_offset + (uint64_t)capacity * sizeof(FSImageEntry);
+    header.data_offset = fs_image_align(header.names_offset + names_size);
+
+    FSImageEntry* entries = (FSImageEntry*)calloc(capacity, sizeof(FSImageEntry));
+    FILE* image_file = fopen(image_path, "wb");
+    if (entries == NULL || image_file == NULL) {
+        // errno is set by calloc or fopen
+        int error = errno;
+        pthread_rwlock_unlock(&file_system->lock);
+        free(entries);
+        if (image_file != NULL)
+            fclose(image_file);
+        errno = error;
+        return 0;
+    }
+
+    // Lay out the names and data in list order
+    int written = 1;
+    uint64_t name_offset = header.names_offset;
+    uint64_t data_offset = header.data_offset;
+    for (uint32_t f = 0; f < num_files; f++) {
+        FSFile* file = file_system->files[f];
+        if (!file_system_file_map(file)) {
+            written = 0;
+            break;
+        }
+
+        uint32_t length = file_system->name_lengths[f];
+        uint32_t hash = file_system->hashes[f];
+        uint32_t i = hash & (capacity - 1);
+        while (entries[i].name_length != 0)
+            i = (i + 1) & (capacity - 1);
+
+        entries[i].hash = hash;
+        entries[i].name_length = length;
+        entries[i].name_offset = name_offset;
+        entries[i].data_offset = data_offset;
+        entries[i].size = file->size;
+
+        name_offset += length;
+        data_offset = fs_image_align(data_offset + file->size);
+    }
+    header.image_size = data_offset;
+
+    char padding[8] = { 0 };
+    if (written) {
+        written = fwrite(&header, sizeof(header), 1, image_file) == 1
+            && fwrite(padding, 1, header.index_offset - sizeof(header), image_file) == header.index_offset - sizeof(header)
+            && fwrite(entries, sizeof(FSImageEntry), capacity, image_file) == capacity;
+    }
+
+    for (uint32_t f = 0; f < num_files && written; f++)
+        written = fwrite(file_system->names[f], 1, file_system->name_lengths[f], image_file) == file_system->name_lengths[f];
+
+    uint64_t position = header.names_offset + names_size;
+    char* buffer = (char*)malloc(FS_CHUNK_SIZE);
+    written = written && buffer != NULL;
+    for (uint32_t f = 0; f < num_files && written; f++) {
+        FSFile* file = file_system->files[f];
+        size_t padding_size = fs_image_align(position) - position;
+        written = fwrite(padding, 1, padding_size, image_file) == padding_size;
+        position += padding_size;
+
+        for (size_t offset = 0; offset < file->size && written; offset += FS_CHUNK_SIZE) {
+            ssize_t bytes_read = file_system_file_read(file, NULL, offset, buffer, FS_CHUNK_SIZE);
+            written = bytes_read != -1 && fwrite(buffer, 1, bytes_read, image_file) == (size_t)bytes_read;
+            position += bytes_read;
+        }
+    }
+
+    // The image ends on an aligned offset after the last file's data, which is the size loading checks against
+    size_t end_padding = written ? header.image_size - position : 0;
+    written = written && fwrite(padding, 1, end_padding, image_file) == end_padding;
+
+    pthread_rwlock_unlock(&file_system->lock);
+
+    int error = errno;
+    free(buffer);
+    free(entries);
+    written = fclose(image_file) == 0 && written;
+    if (!written) {
+        unlink(image_path);
+        errno = error == 0 ? EIO : error;
+    }
+
+    return written;
+}
+
+// Add a file named dst_filename that shares all of the data of the file named src_filename. The two files share their
+// chunk table and chunks until one of them is written, which only copies the table and the chunks being written.
+// Stored files have no chunks to share, so cloning one fails with EOPNOTSUPP
+int file_system_clone_file(FileSystem* file_system, const char* src_filename, const char* dst_filename) {
+    FSFile* src_file = file_system_find_file(file_system, src_filename);
+    if (src_file == NULL) {
+        // errno is set by file_system_find_file
+        return 0;
+    }
+
+    // A mounted file needs its data mapped in before there's anything to share
+    if (!file_system_file_map(src_file)) {
+        // errno is set by file_system_file_map
+        return 0;
+    }
+
+    // Stored files have no chunks to share
+    if (src_file->stored != NULL) {
+        errno = EOPNOTSUPP;
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&file_system->lock);
+
+    FSFile* dst_file = file_system_file_init(file_system, dst_filename);
+    if (dst_file == NULL) {
+        pthread_rwlock_unlock(&file_system->lock);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // A single chunk is shared directly, anything larger shares the whole table
+    pthread_rwlock_rdlock(&src_file->lock);
+    dst_file->size = src_file->size;
+    dst_file->num_chunks = src_file->num_chunks;
+    dst_file->chunks_capacity = src_file->chunks_capacity;
+    if (src_file->table != NULL) {
+        __atomic_add_fetch(&src_file->table->refs, 1, __ATOMIC_RELAXED);
+        dst_file->table = src_file->table;
+        dst_file->chunks = dst_file->table->chunks;
+    } else if (src_file->num_chunks > 0) {
+        dst_file->first_chunk = src_file->first_chunk;
+        if (dst_file->first_chunk != NULL)
+            fs_chunk_acquire(dst_file->first_chunk);
+        dst_file->chunks = &dst_file->first_chunk;
+    }
+    pthread_rwlock_unlock(&src_file->lock);
+
+    // errno is set by file_system_attach_file if it fails, which gives back the references taken above
+    int attached = file_system_attach_file(file_system, dst_file);
+    pthread_rwlock_unlock(&file_system->lock);
+
+    return attached;
+}
+
+// FUNCTIONS TO SET UP A BASIC ENVIRONMENT
+// Set up a basic environment
+int fs_environment_init() {
+    fs_module = file_system_init();
+    if (fs_module == NULL) {
+        return 0;
+    }
+
+    const char* filename1 = "file1.txt";
+    const char* data1 = "Test Data1";
+    int created = file_system_add_file(fs_module, filename1, data1, 10);
+    if (!created) {
+        file_system_destroy(&fs_module);
+        return 0;
+    }
+
+    const char* filename2 = "file2.txt";
+    const char* data2 = "hellogoodbye";
+    created = file_system_add_file(fs_module, filename2, data2, 12);
+    if (!created) {
+        file_system_destroy(&fs_module);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Tear down the file system environment
+void fs_environment_destroy() {
+    file_system_destroy(&fs_module);
+}
+
+//////////////////////////////////////////////////
+/* Bitmap allocator for handing out the lowest fd */
+//////////////////////////////////////////////////
+// Level 0 has a set bit for every fd in use, every level above it has a set bit for every full word below it
+
+#define FD_BITMAP_FULL_WORD (~(uint64_t)0)
+
+// Work out how many words each level needs so that the top level is a single word
+int fd_bitmap_layout(int capacity, int* level_words) {
+    int num_levels = 1;
+    level_words[0] = capacity / 64;
+    while (level_words[num_levels - 1] > 1) {
+        level_words[num_levels] = (level_words[num_levels - 1] + 63) / 64;
+        num_levels++;
+    }
+
+    return num_levels;
+}
+
+// Recompute every summary level from level 0
+void fd_bitmap_rebuild_summaries(FdBitmap* fd_bitmap) {
+    for (int level = 1; level < fd_bitmap->num_levels; level++) {
+        uint64_t* below = fd_bitmap->levels[level - 1];
+        uint64_t* summary = fd_bitmap->levels[level];
+        int below_words = fd_bitmap->level_words[level - 1];
+
+        for (int i = 0; i < fd_bitmap->level_words[level]; i++)
+            summary[i] = 0;
+
+        for (int i = 0; i < below_words; i++) {
+            if (below[i] == FD_BITMAP_FULL_WORD)
+                summary[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+
+        // Words past the end of the level below don't exist so mark them as full to never descend into them
+        for (int i = below_words; i < fd_bitmap->level_words[level] * 64; i++)
+            summary[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+// Allocate the summary levels for the given layout, level 0 is managed by the caller
+int fd_bitmap_alloc_summaries(uint64_t** levels, int* level_words, int num_levels) {
+    for (int level = 1; level < num_levels; level++) {
+        levels[level] = (uint64_t*)malloc(sizeof(uint64_t) * level_words[level]);
+        if (levels[level] == NULL) {
+            // malloc will set ENOMEM
+            for (int i = 1; i < level; i++)
+                free(levels[i]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Free the summary levels, level 0 is managed by the caller
+void fd_bitmap_free_summaries(FdBitmap* fd_bitmap) {
+    for (int level = 1; level < FD_BITMAP_MAX_LEVELS; level++) {
+        free(fd_bitmap->levels[level]);
+        fd_bitmap->levels[level] = NULL;
+    }
+}
+
+// Allocate an FdBitmap with every fd marked as free
+FdBitmap* fd_bitmap_init() {
+    FdBitmap* new_fd_bitmap = (FdBitmap*)malloc(sizeof(FdBitmap));
+    if (new_fd_bitmap == NULL) {
+        perror("ERROR: Could not allocate data for FdBitmap\n");
+        return NULL;
+    }
+
+    for (int level = 0; level < FD_BITMAP_MAX_LEVELS; level++)
+        new_fd_bitmap->levels[level] = NULL;
+
+    new_fd_bitmap->capacity = FD_BITMAP_INITIAL_CAPACITY;
+    new_fd_bitmap->num_levels = fd_bitmap_layout(new_fd_bitmap->capacity, new_fd_bitmap->level_words);
+
+    new_fd_bitmap->levels[0] = (uint64_t*)calloc(new_fd_bitmap->level_words[0], sizeof(uint64_t));
+    if (new_fd_bitmap->levels[0] == NULL) {
+        perror("ERROR: Could not allocate data for FdBitmap levels\n");
+        free(new_fd_bitmap);
+        return NULL;
+    }
+
+    int allocated = fd_bitmap_alloc_summaries(new_fd_bitmap->levels, new_fd_bitmap->level_words, new_fd_bitmap->num_levels);
+    if (!allocated) {
+        perror("ERROR: Could not allocate data for FdBitmap levels\n");
+        free(new_fd_bitmap->levels[0]);
+        free(new_fd_bitmap);
+        return NULL;
+    }
+
+    fd_bitmap_rebuild_summaries(new_fd_bitmap);
+
+    return new_fd_bitmap;
+}
+
+// Deallocate all of the FdBitmap's memory
+void fd_bitmap_destroy(FdBitmap** fd_bitmap_ptr) {
+    FdBitmap* fd_bitmap = *fd_bitmap_ptr;
+
+    free(fd_bitmap->levels[0]);
+    fd_bitmap_free_summaries(fd_bitmap);
+    free(fd_bitmap);
+
+    *fd_bitmap_ptr = NULL;
+}
+
+// Double the number of fds tracked, this is the only time the allocator touches the heap
+int fd_bitmap_grow(FdBitmap* fd_bitmap) {
+    if (fd_bitmap->capacity >= FD_BITMAP_MAX_CAPACITY) {
+        errno = EMFILE;
+        return 0;
+    }
+
+    int new_capacity = fd_bitmap->capacity * 2;
+    int new_level_words[FD_BITMAP_MAX_LEVELS];
+    int new_num_levels = fd_bitmap_layout(new_capacity, new_level_words);
+
+    // Allocate everything up front so that a failure leaves the old bitmap untouched
+    uint64_t* new_levels[FD_BITMAP_MAX_LEVELS] = { NULL };
+    int allocated = fd_bitmap_alloc_summaries(new_levels, new_level_words, new_num_levels);
+    if (!allocated) {
+        // errno is set by fd_bitmap_alloc_summaries
+        return 0;
+    }
+
+    new_levels[0] = (uint64_t*)realloc(fd_bitmap->levels[0], sizeof(uint64_t) * new_level_words[0]);
+    if (new_levels[0] == NULL) {
+        // realloc will set ENOMEM
+        for (int level = 1; level < new_num_levels; level++)
+            free(new_levels[level]);
+        return 0;
+    }
+
+    // All of the new fds start off free
+    for (int i = fd_bitmap->level_words[0]; i < new_level_words[0]; i++)
+        new_levels[0][i] = 0;
+
+    fd_bitmap_free_summaries(fd_bitmap);
+    for (int level = 0; level < new_num_levels; level++) {
+        fd_bitmap->levels[level] = new_levels[level];
+        fd_bitmap->level_words[level] = new_level_words[level];
+    }
+    fd_bitmap->capacity = new_capacity;
+    fd_bitmap->num_levels = new_num_levels;
+
+    fd_bitmap_rebuild_summaries(fd_bitmap);
+
+    return 1;
+}
+
+// Find the lowest free fd and mark it as used
+int fd_bitmap_alloc(FdBitmap* fd_bitmap) {
+    // When the single top level word is full every fd is in use
+    if (fd_bitmap->levels[fd_bitmap->num_levels - 1][0] == FD_BITMAP_FULL_WORD) {
+        int grown = fd_bitmap_grow(fd_bitmap);
+        if (!grown) {
+            // errno is set by fd_bitmap_grow
+            return -1;
+        }
+    }
+
+    // Descend through the levels following the first word that isn't full
+    int index = 0;
+    for (int level = fd_bitmap->num_levels - 1; level >= 0; level--) {
+        uint64_t word = fd_bitmap->levels[level][index];
+        index = index * 64 + __builtin_ctzll(~word);
+    }
+
+    // Mark the fd as used and propagate any words that became full up the levels
+    int fd = index;
+    for (int level = 0; level < fd_bitmap->num_levels; level++) {
+        uint64_t* word = &fd_bitmap->levels[level][index / 64];
+        *word |= (uint64_t)1 << (index % 64);
+        if (*word != FD_BITMAP_FULL_WORD)
+            break;
+
+        index /= 64;
+    }
+
+    return fd;
+}
+
+// Mark the given fd as free so that it can be handed out again
+void fd_bitmap_free(FdBitmap* fd_bitmap, int fd) {
+    int index = fd;
+    for (int level = 0; level < fd_bitmap->num_levels; level++) {
+        uint64_t* word = &fd_bitmap->levels[level][index / 64];
+        int was_full = *word == FD_BITMAP_FULL_WORD;
+        *word &= ~((uint64_t)1 << (index % 64));
+
+        // The levels above only need updating if this word stopped being full
+        if (!was_full)
+            break;
+
+        index /= 64;
+    }
+}
+
+////////////////////////////////////////////////////////
+/* fd table for rapid access of file objects (IOFile) */
+////////////////////////////////////////////////////////
+// IOFiles are stored inline in fixed size pages of slots indexed by their fd, lookups take no locks
+
+// Allocate a page of free slots for the fds starting at first_fd
+IOFile* io_file_table_page_init(int first_fd) {
+    IOFile* new_page = (IOFile*)malloc(sizeof(IOFile) * IOFILE_TABLE_PAGE_SIZE);
+    if (new_page == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    for (int i = 0; i < IOFILE_TABLE_PAGE_SIZE; i++) {
+        new_page[i].fd = first_fd + i;
+        new_page[i].state = IOFILE_STATE_FREE;
+        new_page[i].fs_file = NULL;
+        pthread_mutex_init(&new_page[i].cursor_lock, NULL);
+    }
+
+    return new_page;
+}
+
+// Deallocate a page of slots
+void io_file_table_page_destroy(IOFile* page) {
+    for (int i = 0; i < IOFILE_TABLE_PAGE_SIZE; i++)
+        pthread_mutex_destroy(&page[i].cursor_lock);
+
+    free(page);
+}
+
+// Allocate a directory with room for the given number of pages
+IOFileDirectory* io_file_directory_init(int num_pages) {
+    IOFileDirectory* new_directory = (IOFileDirectory*)malloc(sizeof(IOFileDirectory) + sizeof(IOFile*) * num_pages);
+    if (new_directory == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    new_directory->num_pages = num_pages;
+    new_directory->next_retired = NULL;
+    new_directory->retire_epoch = 0;
+
+    return new_directory;
+}
+
+// Allocate the fd table with a single page of free slots
+IOFileTable* io_file_table_init() {
+    IOFileTable* new_file_table = (IOFileTable*)malloc(sizeof(IOFileTable));
+    if (new_file_table == NULL) {
+        perror("ERROR: Could not allocate data for new IOFileTable\n");
+        return NULL;
+    }
+
+    new_file_table->directory = io_file_directory_init(1);
+    if (new_file_table->directory == NULL) {
+        perror("ERROR: Could not allocate data for IOFileTable directory\n");
+        free(new_file_table);
+        return NULL;
+    }
+
+    new_file_table->directory->pages[0] = io_file_table_page_init(0);
+    if (new_file_table->directory->pages[0] == NULL) {
+        perror("ERROR: Could not allocate data for IOFileTable slots\n");
+        free(new_file_table->directory);
+        free(new_file_table);
+        return NULL;
+    }
+
+    pthread_mutex_init(&new_file_table->grow_lock, NULL);
+
+    return new_file_table;
+}
+
+// Deallocate any memory used for the IOFileTable structure, replaced directories belong to the IOModule
+void io_file_table_destroy(IOFileTable** file_table_ptr) {
+    IOFileTable* file_table = *file_table_ptr;
+
+    IOFileDirectory* directory = file_table->directory;
+    for (int i = 0; i < directory->num_pages; i++)
+        io_file_table_page_destroy(directory->pages[i]);
+
+    free(directory);
+    pthread_mutex_destroy(&file_table->grow_lock);
+    free(file_table);
+    *file_table_ptr = NULL;
+}
+
+// Grow the table by doubling its pages until the given fd has a slot.
+// The replaced directory is handed back since lookups on other threads might still be using it
+int io_file_table_grow(IOFileTable* file_table, int fd, IOFileDirectory** old_directory_ptr) {
+    *old_directory_ptr = NULL;
+
+    pthread_mutex_lock(&file_table->grow_lock);
+
+    // Another thread might have grown the table while this one waited for the lock
+    IOFileDirectory* old_directory = file_table->directory;
+    int needed_pages = fd / IOFILE_TABLE_PAGE_SIZE + 1;
+    if (needed_pages <= old_directory->num_pages) {
+        pthread_mutex_unlock(&file_table->grow_lock);
+        return 1;
+    }
+
+    int new_num_pages = old_directory->num_pages;
+    while (new_num_pages < needed_pages)
+        new_num_pages *= 2;
+
+    IOFileDirectory* new_directory = io_file_directory_init(new_num_pages);
+    if (new_directory == NULL) {
+        // errno is set by io_file_directory_init
+        pthread_mutex_unlock(&file_table->grow_lock);
+        return 0;
+    }
+
+    // The existing pages are shared with the old directory, only the new ones are allocated
+    for (int i = 0; i < old_directory->num_pages; i++)
+        new_directory->pages[i] = old_directory->pages[i];
+
+    for (int i = old_directory->num_pages; i < new_num_pages; i++) {
+        new_directory->pages[i] = io_file_table_page_init(i * IOFILE_TABLE_PAGE_SIZE);
+        if (new_directory->pages[i] == NULL) {
+            // errno is set by io_file_table_page_init
+            for (int j = old_directory->num_pages; j < i; j++)
+                io_file_table_page_destroy(new_directory->pages[j]);
+            free(new_directory);
+            pthread_mutex_unlock(&file_table->grow_lock);
+            return 0;
+        }
+    }
+
+    // Publish the new directory only once all of its pages are ready
+    __atomic_store_n(&file_table->directory, new_directory, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&file_table->grow_lock);
+
+    *old_directory_ptr = old_directory;
+
+    return 1;
+}
+
+// Get the slot for the given fd whatever its state, or NULL if the table doesn't reach that far
+IOFile* io_file_table_get_slot(IOFileTable* file_table, int fd) {
+    IOFileDirectory* directory = __atomic_load_n(&file_table->directory, __ATOMIC_ACQUIRE);
+    if (fd < 0 || fd / IOFILE_TABLE_PAGE_SIZE >= directory->num_pages)
+        return NULL;
+
+    return &directory->pages[fd / IOFILE_TABLE_PAGE_SIZE][fd % IOFILE_TABLE_PAGE_SIZE];
+}
+
+// Fill in the slot of a newly allocated fd and make it visible to lookups, the slot has to exist already
+void io_file_table_new_file(IOFileTable* file_table, int fd, unsigned int mode_type, FSFile* fs_file) {
+    IOFile* new_io_file = io_file_table_get_slot(file_table, fd);
+    new_io_file->cursor_pos = 0;
+    new_io_file->mode_type = mode_type;
+    new_io_file->fs_file = fs_file;
+    new_io_file->readahead = fs_file->stored != NULL || file_system_file_is_mapped(fs_file);
+    new_io_file->readahead_next = SIZE_MAX;
+    new_io_file->readahead_window = 0;
+    new_io_file->readahead_end = 0;
+
+    __atomic_store_n(&new_io_file->state, IOFILE_STATE_OPEN, __ATOMIC_RELEASE);
+}
+
+// Get the IOFile pertaining to the given fd
+IOFile* io_file_table_get_file(IOFileTable* file_table, int fd) {
+    IOFile* io_file = io_file_table_get_slot(file_table, fd);
+
+    // Set the errno if the file descriptor was invalid
+    if (io_file == NULL || __atomic_load_n(&io_file->state, __ATOMIC_ACQUIRE) != IOFILE_STATE_OPEN) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return io_file;
+}
+
+// Mark the IOFile pertaining to the given fd as closed, only one of several racing closes of an fd succeeds
+int io_file_table_remove_file(IOFileTable* file_table, int fd) {
+    IOFile* io_file = io_file_table_get_slot(file_table, fd);
+
+    int expected_state = IOFILE_STATE_OPEN;
+    if (io_file == NULL || !__atomic_compare_exchange_n(&io_file->state, &expected_state, IOFILE_STATE_CLOSED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        errno = EBADF;
+        return 0;
+    }
+
+    // A successful removal
+    return 1;
+}
+
+// The FileSystem a context opens its files in
+FileSystem* io_module_file_system(IOModule* io_module) {
+    return io_module->file_system != NULL ? io_module->file_system : fs_module;
+}
+
+/////////////////////////////////////////
+/* Epochs for reclaiming fds and slots */
+/////////////////////////////////////////
+// A closed fd or replaced directory is only reused or freed once every thread inside an API call has moved 2 epochs past it
+
+// Move to the next epoch if every thread inside an API call has already seen the current one
+uint64_t io_module_try_advance_epoch(IOModule* io_module) {
+    uint64_t epoch = __atomic_load_n(&io_module->epoch, __ATOMIC_SEQ_CST);
+
+    IOThreadRecord* record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+    while (record != NULL) {
+        uint64_t state = __atomic_load_n(&record->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch)
+            return epoch;
+
+        record = record->next;
+    }
+
+    // If another thread advanced the epoch first the failed exchange loads the new epoch
+    if (__atomic_compare_exchange_n(&io_module->epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        epoch++;
+
+    return epoch;
+}
+
+// Queue a fd closed in the given epoch to be reused once no thread can still see its slot, the fd lock must be held
+void io_module_retire_fd_at(IOModule* io_module, int fd, uint64_t epoch) {
+    IOFile* io_file = io_file_table_get_slot(io_module->file_table, fd);
+    io_file->retire_epoch = epoch;
+    io_file->next_retired = -1;
+
+    if (io_module->retired_fds_back == -1)
+        io_module->retired_fds_front = fd;
+    else
+        io_file_table_get_slot(io_module->file_table, io_module->retired_fds_back)->next_retired = fd;
+
+    io_module->retired_fds_back = fd;
+}
+
+// Queue a fd that was just closed to be reused once no thread can still see its slot, the fd lock must be held
+void io_module_retire_fd(IOModule* io_module, int fd) {
+    io_module_retire_fd_at(io_module, fd, __atomic_load_n(&io_module->epoch, __ATOMIC_SEQ_CST));
+}
+
+// Queue a replaced directory to be freed once no thread can still see it, the fd lock must be held
+void io_module_retire_directory(IOModule* io_module, IOFileDirectory* directory) {
+    directory->retire_epoch = __atomic_load_n(&io_module->epoch, __ATOMIC_SEQ_CST);
+    directory->next_retired = NULL;
+
+    if (io_module->retired_directories_back == NULL)
+        io_module->retired_directories_front = directory;
+    else
+        io_module->retired_directories_back->next_retired = directory;
+
+    io_module->retired_directories_back = directory;
+}
+
+// Reuse the fds and free the directories that no thread can still see, the fd lock must be held
+void io_module_reclaim(IOModule* io_module) {
+    if (io_module->retired_fds_front == -1 && io_module->retired_directories_front == NULL)
+        return;
+
+    // Anything retired 2 epochs ago is safe, and with no other threads inside API calls both advances succeed
+    io_module_try_advance_epoch(io_module);
+    uint64_t epoch = io_module_try_advance_epoch(io_module);
+
+    // Both queues are in retirement order so they can stop at the first entry that's too recent
+    while (io_module->retired_fds_front != -1) {
+        IOFile* io_file = io_file_table_get_slot(io_module->file_table, io_module->retired_fds_front);
+        if (io_file->retire_epoch + 2 > epoch)
+            break;
+
+        io_module->retired_fds_front = io_file->next_retired;
+        if (io_module->retired_fds_front == -1)
+            io_module->retired_fds_back = -1;
+
+        io_file->fs_file = NULL;
+        __atomic_store_n(&io_file->state, IOFILE_STATE_FREE, __ATOMIC_RELAXED);
+        fd_bitmap_free(io_module->fd_bitmap, io_file->fd);
+    }
+
+    while (io_module->retired_directories_front != NULL) {
+        IOFileDirectory* directory = io_module->retired_directories_front;
+        if (directory->retire_epoch + 2 > epoch)
+            break;
+
+        io_module->retired_directories_front = directory->next_retired;
+        if (io_module->retired_directories_front == NULL)
+            io_module->retired_directories_back = NULL;
+
+        free(directory);
+    }
+}
+
+/////////////////////////
+/* Per thread fd caches */
+/////////////////////////
+// Threads open and close fds against their own cache and only take the fd lock to move IO_FD_CACHE_BATCH fds at a time
+
+// Bump one of the calling thread's counters, other threads only ever read them
+void io_fd_cache_count(uint64_t* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// Give half of the free fds back to the FdBitmap, the fd lock must be held
+void io_fd_cache_spill_free(IOModule* io_module, IOThreadRecord* record) {
+    int keep = record->num_free_fds / 2;
+    for (int i = keep; i < record->num_free_fds; i++)
+        fd_bitmap_free(io_module->fd_bitmap, record->free_fds[i]);
+
+    record->num_free_fds = keep;
+}
+
+// Give every fd in a thread's cache back to the IOModule, the fd lock must be held
+void io_fd_cache_flush(IOModule* io_module, IOThreadRecord* record) {
+    for (int i = 0; i < record->num_free_fds; i++)
+        fd_bitmap_free(io_module->fd_bitmap, record->free_fds[i]);
+
+    for (int i = 0; i < record->num_closed_fds; i++)
+        io_module_retire_fd_at(io_module, record->closed_fds[i], record->closed_epochs[i]);
+
+    record->num_free_fds = 0;
+    record->num_closed_fds = 0;
+}
+
+// Runs as a thread exits so that its cached fds aren't lost and its record can be taken over
+void io_thread_exit(void* arg) {
+    (void)arg;
+
+    // Records in destroyed contexts are gone along with them, so only the live contexts are looked through
+    pthread_mutex_lock(&io_modules_lock);
+    for (IOModule* io_module = io_modules; io_module != NULL; io_module = io_module->next) {
+        IOThreadRecord* record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+        while (record != NULL) {
+            if (__atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&record->owner, __ATOMIC_RELAXED) == io_thread_id) {
+                pthread_mutex_lock(&io_module->fd_lock);
+                io_fd_cache_flush(io_module, record);
+                pthread_mutex_unlock(&io_module->fd_lock);
+
+                __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+            }
+
+            record = record->next;
+        }
+    }
+    pthread_mutex_unlock(&io_modules_lock);
+}
+
+void io_thread_exit_key_init() {
+    pthread_key_create(&io_thread_exit_key, io_thread_exit);
+}
+
+// Give the calling thread a record to announce its epochs in. That's the record it already has if it was pushed out of
+// the thread's slots by other contexts, then the record of an exited thread if there is one
+IOThreadRecord* io_module_register_thread(IOModule* io_module) {
+    pthread_once(&io_thread_exit_key_once, io_thread_exit_key_init);
+    if (io_thread_id == 0)
+        io_thread_id = __atomic_fetch_add(&io_next_thread_id, 1, __ATOMIC_RELAXED);
+
+    // A record only gets a new owner once its thread has exited, so one in use with this thread's id is this thread's
+    IOThreadRecord* record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+    while (record != NULL) {
+        if (__atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&record->owner, __ATOMIC_RELAXED) == io_thread_id)
+            break;
+
+        record = record->next;
+    }
+
+    if (record == NULL) {
+        record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+        while (record != NULL) {
+            int expected_in_use = 0;
+            if (__atomic_compare_exchange_n(&record->in_use, &expected_in_use, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+
+            record = record->next;
+        }
+    }
+
+    if (record == NULL) {
+        record = (IOThreadRecord*)malloc(sizeof(IOThreadRecord));
+        if (record == NULL) {
+            // malloc will set ENOMEM
+            return NULL;
+        }
+
+        record->state = 0;
+        record->in_use = 1;
+        record->owner = io_thread_id;
+        record->num_free_fds = 0;
+        record->num_closed_fds = 0;
+        record->fd_cache_hits = 0;
+        record->fd_cache_misses = 0;
+        record->fd_cache_spills = 0;
+        memset(&record->stats, 0, sizeof(IOStatsShard));
+        record->trace_ring = NULL;
+
+        // Push the record without a lock, records are only freed along with the IOModule
+        record->next = __atomic_load_n(&io_module->thread_records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&io_module->thread_records, &record->next, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    __atomic_store_n(&record->owner, io_thread_id, __ATOMIC_RELAXED);
+
+    IOThreadSlot* slot = &io_thread_slots[io_module->id & (IO_THREAD_SLOTS - 1)];
+    slot->module_id = io_module->id;
+    slot->record = record;
+    // Any value other than NULL has the exit handler run
+    pthread_setspecific(io_thread_exit_key, io_thread_slots);
+
+    return record;
+}
+
+// Get the calling thread's record, registering the thread if this is its first call in the context
+IOThreadRecord* io_module_get_thread_record(IOModule* io_module) {
+    IOThreadSlot* slot = &io_thread_slots[io_module->id & (IO_THREAD_SLOTS - 1)];
+    if (slot->module_id != io_module->id)
+        // errno is set by io_module_register_thread if it fails
+        return io_module_register_thread(io_module);
+
+    return slot->record;
+}
+
+// Announce that the calling thread is inside an API call so that no slot or directory it can see is reused or freed
+IOThreadRecord* io_module_enter(IOModule* io_module) {
+    IOThreadRecord* record = io_module_get_thread_record(io_module);
+    if (record == NULL) {
+        // errno is set by io_module_get_thread_record
+        return NULL;
+    }
+
+    // The announcement has to be visible before anything in the table is looked at. The exchange is as much of a barrier
+    // as a fence, which gcc makes a locked op on the top of the stack that stalls behind the register saves just made
+    uint64_t epoch = __atomic_load_n(&io_module->epoch, __ATOMIC_RELAXED);
+    __atomic_exchange_n(&record->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+
+    return record;
+}
+
+// Announce that the calling thread has left its API call
+void io_module_exit(IOThreadRecord* record) {
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+}
+
+// Move the closed fds no other thread can see anymore into the free fds, spilling free fds if there is no room for them
+void io_fd_cache_collect_closed(IOModule* io_module, IOThreadRecord* record) {
+    if (record->num_closed_fds == 0)
+        return;
+
+    io_module_try_advance_epoch(io_module);
+    uint64_t epoch = io_module_try_advance_epoch(io_module);
+
+    // The slots are only touched inside an API call so that a growing fd table can't free them underneath
+    io_module_enter(io_module);
+
+    int still_closed = 0;
+    for (int i = 0; i < record->num_closed_fds; i++) {
+        int fd = record->closed_fds[i];
+        if (record->closed_epochs[i] + 2 > epoch) {
+            record->closed_epochs[still_closed] = record->closed_epochs[i];
+            record->closed_fds[still_closed++] = fd;
+            continue;
+        }
+
+        if (record->num_free_fds == IO_FD_CACHE_SIZE) {
+            pthread_mutex_lock(&io_module->fd_lock);
+            io_fd_cache_spill_free(io_module, record);
+            pthread_mutex_unlock(&io_module->fd_lock);
+            io_fd_cache_count(&record->fd_cache_spills);
+        }
+
+        IOFile* io_file = io_file_table_get_slot(io_module->file_table, fd);
+        io_file->fs_file = NULL;
+        __atomic_store_n(&io_file->state, IOFILE_STATE_FREE, __ATOMIC_RELAXED);
+        record->free_fds[record->num_free_fds++] = fd;
+    }
+
+    io_module_exit(record);
+
+    record->num_closed_fds = still_closed;
+}
+
+// Get an fd from the calling thread's cache, refilling it from the FdBitmap when it runs dry
+int io_fd_cache_alloc(IOModule* io_module, IOThreadRecord* record) {
+    if (record->num_free_fds == 0)
+        io_fd_cache_collect_closed(io_module, record);
+
+    if (record->num_free_fds > 0) {
+        io_fd_cache_count(&record->fd_cache_hits);
+        return record->free_fds[--record->num_free_fds];
+    }
+
+    io_fd_cache_count(&record->fd_cache_misses);
+
+    pthread_mutex_lock(&io_module->fd_lock);
+    io_module_reclaim(io_module);
+
+    int refill[IO_FD_CACHE_BATCH];
+    int num_refilled = 0;
+    while (num_refilled < IO_FD_CACHE_BATCH) {
+        int fd = fd_bitmap_alloc(io_module->fd_bitmap);
+        if (fd == -1)
+            break;
+
+        refill[num_refilled++] = fd;
+    }
+
+    pthread_mutex_unlock(&io_module->fd_lock);
+
+    if (num_refilled == 0) {
+        // errno is set by fd_bitmap_alloc
+        return -1;
+    }
+
+    // Push the fds in reverse so that the lowest is handed out first
+    for (int i = num_refilled - 1; i >= 0; i--)
+        record->free_fds[record->num_free_fds++] = refill[i];
+
+    return record->free_fds[--record->num_free_fds];
+}
+
+// Queue a closed fd in the calling thread's cache until no other thread can see its slot
+void io_fd_cache_retire(IOModule* io_module, IOThreadRecord* record, int fd) {
+    uint64_t epoch = __atomic_load_n(&io_module->epoch, __ATOMIC_SEQ_CST);
+
+    if (record->num_closed_fds == IO_FD_CACHE_SIZE)
+        io_fd_cache_collect_closed(io_module, record);
+
+    // Other threads are holding the epoch back, so hand the closed fds over to the IOModule's queue
+    if (record->num_closed_fds == IO_FD_CACHE_SIZE) {
+        pthread_mutex_lock(&io_module->fd_lock);
+        for (int i = 0; i < record->num_closed_fds; i++)
+            io_module_retire_fd_at(io_module, record->closed_fds[i], record->closed_epochs[i]);
+        pthread_mutex_unlock(&io_module->fd_lock);
+
+        record->num_closed_fds = 0;
+        io_fd_cache_count(&record->fd_cache_spills);
+    }
+
+    record->closed_epochs[record->num_closed_fds] = epoch;
+    record->closed_fds[record->num_closed_fds++] = fd;
+}
+
+// Get the calling thread's fd cache stats and the totals across all threads, either can be NULL
+void io_ctx_get_fd_cache_stats(IOModule* io_module, IOFdCacheStats* thread_stats, IOFdCacheStats* total_stats) {
+    IOFdCacheStats stats[2];
+    memset(stats, 0, sizeof(stats));
+
+    IOThreadRecord* record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+    while (record != NULL) {
+        uint64_t hits = __atomic_load_n(&record->fd_cache_hits, __ATOMIC_RELAXED);
+        uint64_t misses = __atomic_load_n(&record->fd_cache_misses, __ATOMIC_RELAXED);
+        uint64_t spills = __atomic_load_n(&record->fd_cache_spills, __ATOMIC_RELAXED);
+
+        // The first entry is the calling thread's and the second is the total
+        for (int i = 0; i < 2; i++) {
+            if (i == 0 && __atomic_load_n(&record->owner, __ATOMIC_RELAXED) != io_thread_id)
+                continue;
+
+            stats[i].hits += hits;
+            stats[i].misses += misses;
+            stats[i].spills += spills;
+        }
+
+        record = record->next;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (stats[i].hits + stats[i].misses > 0)
+            stats[i].hit_rate = (double)stats[i].hits / (stats[i].hits + stats[i].misses);
+    }
+
+    if (thread_stats != NULL)
+        *thread_stats = stats[0];
+    if (total_stats != NULL)
+        *total_stats = stats[1];
+}
+
+// Get the hit rate of the context's page cache and how its pages are split between probation and the main queue
+void io_ctx_get_page_cache_stats(IOModule* io_module, IOPageCacheStats* stats) {
+    io_page_cache_get_stats(io_module->page_cache, stats);
+}
+
+///////////////////////////////////////
+/* Statistics                        */
+///////////////////////////////////////
+// Every API call bumps counters in its thread's IOStatsShard and one in IO_STATS_SAMPLE_PERIOD calls is timed into a
+// histogram, so that a call costs an increment or two rather than two clock reads. io_stats_snapshot adds up the shards
+
+#if IO_STATS
+#define IO_STATS_BEGIN() io_stats_begin()
+#define IO_STATS_PHASE(module, stat, start) io_stats_phase(module, stat, start)
+#define IO_STATS_END(module, record, stat, start, result) io_stats_end(module, record, stat, start, result)
+#else
+#define IO_STATS_BEGIN() 0
+#define IO_STATS_PHASE(module, stat, start) ((void)(start), 0)
+#define IO_STATS_END(module, record, stat, start, result) ((void)(start))
+#endif
+
+uint64_t io_stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Add to one of the calling thread's counters, other threads only ever read them
+void io_stats_add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+// Get the start time of the calling thread's call if it's one of the timed ones and 0 otherwise
+uint64_t io_stats_begin() {
+    if ((++io_stats_tick & (IO_STATS_SAMPLE_PERIOD - 1)) != 0)
+        return 0;
+
+    return io_stats_now_ns();
+}
+
+// Get the calling thread's record for a call that failed or finished before it got it
+IOThreadRecord* io_stats_get_thread_record(IOModule* io_module) {
+    // The call's errno is what its caller sees, and the first call of a thread can fail to get it a record
+    int saved_errno = errno;
+    IOThreadRecord* record = io_module_get_thread_record(io_module);
+    errno = saved_errno;
+
+    return record;
+}
+
+// Put the time since start into the stat's histogram and return the time it ended at
+uint64_t io_stats_record_latency(IOStatsShard* shard, int stat, uint64_t start) {
+    uint64_t end = io_stats_now_ns();
+    uint64_t ns = end > start ? end - start : 0;
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= IO_STATS_BUCKETS)
+        bucket = IO_STATS_BUCKETS - 1;
+
+    io_stats_add(&shard->latency[stat][bucket], 1);
+
+    return end;
+}
+
+// Time a part of a timed call that started at start and return when it ended, the end is the start of the next part
+uint64_t io_stats_phase(IOModule* io_module, int stat, uint64_t start) {
+    if (start == 0)
+        return 0;
+
+    IOThreadRecord* record = io_stats_get_thread_record(io_module);
+    if (record == NULL)
+        return io_stats_now_ns();
+
+    io_stats_add(&record->stats.calls[stat], 1);
+
+    return io_stats_record_latency(&record->stats, stat, start);
+}
+
+// Count a finished call along with the bytes it moved or its failure, and its latency if it was timed. record is the
+// calling thread's record, or NULL for calls that failed or finished before they got it
+void io_stats_end(IOModule* io_module, IOThreadRecord* record, int stat, uint64_t start, ssize_t result) {
+    if (record == NULL && (record = io_stats_get_thread_record(io_module)) == NULL)
+        return;
+
+    IOStatsShard* shard = &record->stats;
+    io_stats_add(&shard->calls[stat], 1);
+    if (result < 0)
+        io_stats_add(&shard->errors[stat], 1);
+    else
+        io_stats_add(&shard->bytes[stat], result);
+
+    if (start != 0)
+        io_stats_record_latency(shard, stat, start);
+}
+
+// Add up the stats of every thread that has used the IOModule and take the state of the fd table and the FileSystem.
+// The counters are all zero when built with IO_STATS set to 0
+void io_ctx_stats_snapshot(IOModule* io_module, IOStatsSnapshot* snapshot) {
+    memset(snapshot, 0, sizeof(IOStatsSnapshot));
+
+    IOThreadRecord* record = __atomic_load_n(&io_module->thread_records, __ATOMIC_ACQUIRE);
+    while (record != NULL) {
+        IOStatsShard* shard = &record->stats;
+        for (int stat = 0; stat < IO_STAT_COUNT; stat++) {
+            snapshot->calls[stat] += __atomic_load_n(&shard->calls[stat], __ATOMIC_RELAXED);
+            snapshot->errors[stat] += __atomic_load_n(&shard->errors[stat], __ATOMIC_RELAXED);
+            for (int bucket = 0; bucket < IO_STATS_BUCKETS; bucket++)
+                snapshot->latency[stat][bucket] += __atomic_load_n(&shard->latency[stat][bucket], __ATOMIC_RELAXED);
+        }
+        snapshot->bytes_read += __atomic_load_n(&shard->bytes[IO_STAT_READ], __ATOMIC_RELAXED);
+        snapshot->bytes_written += __atomic_load_n(&shard->bytes[IO_STAT_WRITE], __ATOMIC_RELAXED);
+
+        record = record->next;
+    }
+
+    uint64_t opened = snapshot->calls[IO_STAT_OPEN] - snapshot->errors[IO_STAT_OPEN];
+    uint64_t closed = snapshot->calls[IO_STAT_CLOSE] - snapshot->errors[IO_STAT_CLOSE];
+    snapshot->open_fds = opened > closed ? opened - closed : 0;
+
+    pthread_mutex_lock(&io_module->fd_lock);
+    FdBitmap* fd_bitmap = io_module->fd_bitmap;
+    for (int word = 0; word < fd_bitmap->level_words[0]; word++)
+        snapshot->allocated_fds += __builtin_popcountll(fd_bitmap->levels[0][word]);
+    snapshot->fd_capacity = fd_bitmap->capacity;
+    pthread_mutex_unlock(&io_module->fd_lock);
+
+    FileSystem* file_system = io_module_file_system(io_module);
+    if (file_system != NULL) {
+        file_system_get_index_stats(file_system, &snapshot->index);
+        pthread_rwlock_rdlock(&file_system->lock);
+        file_system_get_pool_stats(file_system, &snapshot->file_pool);
+        pthread_rwlock_unlock(&file_system->lock);
+    }
+}
+
+// Get the upper bound in ns of the bucket that percentile p of the timed calls of a kind falls in, 0 if none were timed
+uint64_t io_stats_percentile(const IOStatsSnapshot* snapshot, int stat, double p) {
+    uint64_t timed = 0;
+    for (int bucket = 0; bucket < IO_STATS_BUCKETS; bucket++)
+        timed += snapshot->latency[stat][bucket];
+    if (timed == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p * timed + 0.999999);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < IO_STATS_BUCKETS; bucket++) {
+        seen += snapshot->latency[stat][bucket];
+        if (seen >= rank)
+            return bucket == 0 ? 0 : 1ULL << bucket;
+    }
+
+    return 1ULL << (IO_STATS_BUCKETS - 1);
+}
+
+// Write the snapshot out as one key=value line per kind of call and one for the fd table and the FileSystem, with the
+// non-empty histogram buckets listed by their upper bound in ns
+void io_stats_write(const IOStatsSnapshot* snapshot, FILE* out) {
+    const char* names[IO_STAT_COUNT] = { "open", "close", "read", "write", "open_lookup", "open_fd" };
+    for (int stat = 0; stat < IO_STAT_COUNT; stat++) {
+        fprintf(out, "io_stats call=%s calls=%llu errors=%llu p50_ns=%llu p99_ns=%llu histogram=", names[stat],
+                (unsigned long long)snapshot->calls[stat], (unsigned long long)snapshot->errors[stat],
+                (unsigned long long)io_stats_percentile(snapshot, stat, 0.50),
+                (unsigned long long)io_stats_percentile(snapshot, stat, 0.99));
+
+        int first = 1;
+        for (int bucket = 0; bucket < IO_STATS_BUCKETS; bucket++) {
+            if (snapshot->latency[stat][bucket] == 0)
+                continue;
+
+            fprintf(out, "%s%llu:%llu", first ? "" : ",", bucket == 0 ? 0ULL : 1ULL << bucket,
+                    (unsigned long long)snapshot->latency[stat][bucket]);
+            first = 0;
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "io_stats bytes_read=%llu bytes_written=%llu open_fds=%zu allocated_fds=%zu fd_capacity=%zu\n",
+            (unsigned long long)snapshot->bytes_read, (unsigned long long)snapshot->bytes_written, snapshot->open_fds,
+            snapshot->allocated_fds, snapshot->fd_capacity);
+    fprintf(out, "fs_stats files=%zu directories=%zu negative=%zu index_capacity=%zu load_factor=%.3f mean_probe=%.3f "
+                 "max_probe=%zu resizing=%d pool_objects=%d pool_free=%d\n",
+            snapshot->index.entries - snapshot->index.directories - snapshot->index.negative_entries,
+            snapshot->index.directories, snapshot->index.negative_entries, snapshot->index.capacity, snapshot->index.load_factor,
+            snapshot->index.mean_probe_length, snapshot->index.max_probe_length, snapshot->index.resizing,
+            snapshot->file_pool.objects_in_use, snapshot->file_pool.objects_capacity - snapshot->file_pool.objects_in_use);
+}
+
+///////////////////////////////////////
+/* Tracing                           */
+///////////////////////////////////////
+// Each traced call is put into its thread's ring without a lock and a flusher thread writes the rings out every
+// IO_TRACE_FLUSH_INTERVAL_NS. The events of different threads end up interleaved in the file, so readers of the trace
+// order them by timestamp
+
+// Tracing costs a load and a branch per call while it's off
+#define IO_TRACE(module, record, op, fd, file, offset, count, result) \
+    do { \
+        if (__atomic_load_n(&(module)->trace_active, __ATOMIC_RELAXED)) \
+            io_trace_record(module, record, op, fd, file, offset, count, result); \
+    } while (0)
+
+// Give the thread of record a ring to trace into
+IOTraceRing* io_trace_ring_init(IOModule* io_module, IOThreadRecord* record) {
+    IOTraceRing* ring = (IOTraceRing*)calloc(1, sizeof(IOTraceRing));
+    if (ring == NULL)
+        return NULL;
+
+    // Rings are only freed along with the IOModule, so the flusher walks the list without the lock
+    pthread_mutex_lock(&io_module->trace_lock);
+    ring->thread = io_module->trace_num_rings++;
+    ring->next = io_module->trace_rings;
+    __atomic_store_n(&io_module->trace_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&io_module->trace_lock);
+
+    record->trace_ring = ring;
+
+    return ring;
+}
+
+void io_trace_write(IOModule* io_module, const void* data, size_t size) {
+    if (fwrite(data, 1, size, io_module->trace_file) == size)
+        io_module->trace_stats.bytes += size;
+}
+
+// Get the id of a file in the trace, naming it in the trace the first time it's seen along with its size, which is the
+// size at the open when event is one. Only called while writing the rings out
+uint32_t io_trace_file_id(IOModule* io_module, FSFile* file, IOTraceEvent* event) {
+    if (file == NULL)
+        return 0;
+
+    // Keep the map at most half full, ids start at 1 so that 0 can mean no file
+    if (2 * (io_module->trace_stats.files + 1) > io_module->trace_file_ids_capacity) {
+        size_t capacity = io_module->trace_file_ids_capacity == 0 ? 64 : 2 * io_module->trace_file_ids_capacity;
+        IOTraceFileId* file_ids = (IOTraceFileId*)calloc(capacity, sizeof(IOTraceFileId));
+        if (file_ids == NULL)
+            return 0;
+
+        for (size_t i = 0; i < io_module->trace_file_ids_capacity; i++) {
+            IOTraceFileId* entry = &io_module->trace_file_ids[i];
+            if (entry->file == NULL)
+                continue;
+
+            size_t bucket = ((uintptr_t)entry->file >> 4) & (capacity - 1);
+            while (file_ids[bucket].file != NULL)
+                bucket = (bucket + 1) & (capacity - 1);
+            file_ids[bucket] = *entry;
+        }
+
+        free(io_module->trace_file_ids);
+        io_module->trace_file_ids = file_ids;
+        io_module->trace_file_ids_capacity = capacity;
+    }
+
+    size_t mask = io_module->trace_file_ids_capacity - 1;
+    size_t bucket = ((uintptr_t)file >> 4) & mask;
+    while (io_module->trace_file_ids[bucket].file != NULL) {
+        if (io_module->trace_file_ids[bucket].file == file)
+            return io_module->trace_file_ids[bucket].id;
+
+        bucket = (bucket + 1) & mask;
+    }
+
+    uint32_t id = ++io_module->trace_stats.files;
+    io_module->trace_file_ids[bucket].file = file;
+    io_module->trace_file_ids[bucket].id = id;
+
+    // Files are never removed, so their names stay valid for as long as the FileSystem does
+    IOTraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.op = IO_TRACE_RECORD_FILE;
+    record.file_id = id;
+    record.count = strlen(file->filename);
+    if (event->op == IO_TRACE_OP_OPEN) {
+        record.offset = event->offset;
+    } else {
+        pthread_rwlock_rdlock(&file->lock);
+        record.offset = file->size;
+        pthread_rwlock_unlock(&file->lock);
+    }
+    io_trace_write(io_module, &record, sizeof(record));
+    io_trace_write(io_module, file->filename, record.count);
+
+    return id;
+}
+
+// Write out every event the threads have put in their rings so far, the drain lock must be held. Once the trace file
+// is closed the events of calls that raced with the stop are dropped instead, so that full rings still make room
+void io_trace_drain(IOModule* io_module) {
+    if (io_module->trace_file == NULL) {
+        for (IOTraceRing* ring = __atomic_load_n(&io_module->trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+            __atomic_store_n(&ring->head, __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        return;
+    }
+
+    IOTraceRing* ring = __atomic_load_n(&io_module->trace_rings, __ATOMIC_ACQUIRE);
+    while (ring != NULL) {
+        unsigned int head = ring->head;
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            IOTraceEvent* event = &ring->events[head & (IO_TRACE_RING_SIZE - 1)];
+            // A call that raced with the end of an earlier trace
+            if (event->timestamp < io_module->trace_start)
+                continue;
+
+            IOTraceRecord record;
+            memset(&record, 0, sizeof(record));
+            record.op = event->op;
+            record.thread = ring->thread;
+            record.file_id = io_trace_file_id(io_module, event->file, event);
+            record.fd = event->fd;
+            record.count = event->count;
+            record.offset = event->offset;
+            record.timestamp = event->timestamp - io_module->trace_start;
+            record.result = event->result;
+            io_trace_write(io_module, &record, sizeof(record));
+            io_module->trace_stats.events++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        ring = ring->next;
+    }
+}
+
+// Put a call into the calling thread's ring, writing the rings out first if the flusher is a whole ring behind
+void io_trace_record(IOModule* io_module, IOThreadRecord* record, int op, int fd, FSFile* file, size_t offset, size_t count, ssize_t result) {
+    IOTraceRing* ring = record->trace_ring;
+    if (ring == NULL && (ring = io_trace_ring_init(io_module, record)) == NULL)
+        return;
+
+    uint64_t timestamp = io_stats_now_ns();
+    unsigned int tail = ring->tail;
+    unsigned int pending = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (pending == IO_TRACE_RING_SIZE) {
+        io_stats_add(&ring->stalls, 1);
+        pthread_mutex_lock(&io_module->trace_drain_lock);
+        io_trace_drain(io_module);
+        pthread_mutex_unlock(&io_module->trace_drain_lock);
+        pending = 0;
+    }
+
+    // The file's size at the open lets a replay make the file as it was
+    if (op == IO_TRACE_OP_OPEN) {
+        pthread_rwlock_rdlock(&file->lock);
+        offset = file->size;
+        pthread_rwlock_unlock(&file->lock);
+    }
+
+    IOTraceEvent* event = &ring->events[tail & (IO_TRACE_RING_SIZE - 1)];
+    event->timestamp = timestamp;
+    event->offset = offset;
+    event->file = file;
+    event->result = result;
+    event->count = count > UINT32_MAX ? UINT32_MAX : count;
+    event->fd = fd;
+    event->op = op;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (pending + 1 == IO_TRACE_RING_SIZE / 2)
+        pthread_cond_signal(&io_module->trace_wake);
+}
+
+// Drain the rings every IO_TRACE_FLUSH_INTERVAL_NS, or sooner when one fills up, until the trace is stopped
+void* io_trace_thread(void* arg) {
+    IOModule* io_module = (IOModule*)arg;
+
+    pthread_mutex_lock(&io_module->trace_lock);
+    while (!io_module->trace_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += IO_TRACE_FLUSH_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&io_module->trace_wake, &io_module->trace_lock, &deadline);
+
+        pthread_mutex_unlock(&io_module->trace_lock);
+        pthread_mutex_lock(&io_module->trace_drain_lock);
+        io_trace_drain(io_module);
+        pthread_mutex_unlock(&io_module->trace_drain_lock);
+        pthread_mutex_lock(&io_module->trace_lock);
+    }
+    pthread_mutex_unlock(&io_module->trace_lock);
+
+    // Whatever was traced before the stop
+    pthread_mutex_lock(&io_module->trace_drain_lock);
+    io_trace_drain(io_module);
+    pthread_mutex_unlock(&io_module->trace_drain_lock);
+
+    return NULL;
+}
+
+// Start tracing every io_open, io_close, io_read, io_pread, io_write and io_pwrite call into a new trace file at path.
+// Returns 1 on success or 0 with errno set, EBUSY if a trace is already running
+int io_ctx_trace_start(IOModule* io_module, const char* path) {
+    pthread_mutex_lock(&io_module->trace_lock);
+
+    if (io_module->trace_file != NULL) {
+        pthread_mutex_unlock(&io_module->trace_lock);
+        errno = EBUSY;
+        return 0;
+    }
+
+    io_module->trace_file = fopen(path, "wb");
+    if (io_module->trace_file == NULL) {
+        // errno is set by fopen
+        pthread_mutex_unlock(&io_module->trace_lock);
+        return 0;
+    }
+
+    memset(&io_module->trace_stats, 0, sizeof(IOTraceStats));
+    free(io_module->trace_file_ids);
+    io_module->trace_file_ids = NULL;
+    io_module->trace_file_ids_capacity = 0;
+
+    IOTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IO_TRACE_MAGIC, 8);
+    header.version = IO_TRACE_VERSION;
+    header.record_size = sizeof(IOTraceRecord);
+    io_trace_write(io_module, &header, sizeof(header));
+
+    // Events left in the rings by the end of an earlier trace are skipped by their timestamps
+    io_module->trace_start = io_stats_now_ns();
+    for (IOTraceRing* ring = io_module->trace_rings; ring != NULL; ring = ring->next) {
+        __atomic_store_n(&ring->head, __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->stalls, 0, __ATOMIC_RELAXED);
+    }
+
+    io_module->trace_stop = 0;
+    if (pthread_create(&io_module->trace_thread, NULL, io_trace_thread, io_module) != 0) {
+        fclose(io_module->trace_file);
+        io_module->trace_file = NULL;
+        pthread_mutex_unlock(&io_module->trace_lock);
+        errno = EAGAIN;
+        return 0;
+    }
+
+    __atomic_store_n(&io_module->trace_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&io_module->trace_lock);
+
+    return 1;
+}
+
+// Stop the running trace once what was traced so far is written out and close its file. stats can be NULL.
+// Returns 1 on success or 0 with errno set, EINVAL if no trace is running
+int io_ctx_trace_stop(IOModule* io_module, IOTraceStats* stats) {
+    pthread_mutex_lock(&io_module->trace_lock);
+
+    if (io_module->trace_file == NULL) {
+        pthread_mutex_unlock(&io_module->trace_lock);
+        errno = EINVAL;
+        return 0;
+    }
+
+    __atomic_store_n(&io_module->trace_active, 0, __ATOMIC_RELAXED);
+    io_module->trace_stop = 1;
+    pthread_cond_signal(&io_module->trace_wake);
+    pthread_mutex_unlock(&io_module->trace_lock);
+
+    pthread_join(io_module->trace_thread, NULL);
+
+    // A thread whose ring filled up can still be draining, or start to after the flusher's last drain
+    pthread_mutex_lock(&io_module->trace_lock);
+    pthread_mutex_lock(&io_module->trace_drain_lock);
+    for (IOTraceRing* ring = io_module->trace_rings; ring != NULL; ring = ring->next)
+        io_module->trace_stats.stalls += __atomic_load_n(&ring->stalls, __ATOMIC_RELAXED);
+
+    // errno is set by fclose if the last of the trace couldn't be written
+    int closed = fclose(io_module->trace_file) == 0;
+    int error = errno;
+    io_module->trace_file = NULL;
+
+    if (stats != NULL)
+        *stats = io_module->trace_stats;
+    pthread_mutex_unlock(&io_module->trace_drain_lock);
+    pthread_mutex_unlock(&io_module->trace_lock);
+
+    errno = error;
+    return closed;
+}
+
+///////////////////////////////////////
+/* Readahead                         */
+///////////////////////////////////////
+// Reads through the cursor that pick up where the last one ended are a sequential stream. A stream gets a window of the
+// file read ahead of it which doubles each time the reader gets within half a window of its end, and a read anywhere
+// else drops the window. Stored files are read ahead into the page cache by the readahead thread, mapped files are
+// left to the kernel with madvise
+
+// Read the queued ranges into the page cache until the IOModule is destroyed
+void* io_readahead_thread(void* arg) {
+    IOModule* io_module = (IOModule*)arg;
+
+    // A range covers at most a window, which can start part way into a page
+    char* buffer = (char*)malloc(io_module->config.readahead_max_window + 2 * IO_PAGE_SIZE);
+
+    pthread_mutex_lock(&io_module->readahead_lock);
+    while (1) {
+        while (io_module->readahead_head == io_module->readahead_tail && !io_module->readahead_stop)
+            pthread_cond_wait(&io_module->readahead_ready, &io_module->readahead_lock);
+        if (io_module->readahead_head == io_module->readahead_tail)
+            break;
+
+        IOReadaheadRequest request = io_module->readahead_queue[io_module->readahead_head % IO_READAHEAD_QUEUE_SIZE];
+        io_module->readahead_head++;
+        io_module->readahead_busy = 1;
+        pthread_mutex_unlock(&io_module->readahead_lock);
+
+        // Without a buffer the requests are dropped as they come in
+        if (buffer != NULL)
+            io_page_cache_prefetch(io_module->page_cache, request.object, request.first_page, request.num_pages, buffer);
+        else
+            __atomic_fetch_add(&io_module->readahead_dropped, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&io_module->readahead_lock);
+        io_module->readahead_busy = 0;
+        if (io_module->readahead_head == io_module->readahead_tail)
+            pthread_cond_broadcast(&io_module->readahead_idle);
+    }
+    pthread_mutex_unlock(&io_module->readahead_lock);
+
+    free(buffer);
+
+    return NULL;
+}
+
+// Queue a range of a stored file for the readahead thread, starting the thread the first time.
+// The request is dropped if the queue is full or the thread can't be started
+void io_readahead_queue(IOModule* io_module, FSStoreObject* object, uint64_t first_page, uint64_t num_pages) {
+    pthread_mutex_lock(&io_module->readahead_lock);
+
+    if (!io_module->readahead_running) {
+        if (pthread_create(&io_module->readahead_thread, NULL, io_readahead_thread, io_module) != 0) {
+            pthread_mutex_unlock(&io_module->readahead_lock);
+            __atomic_fetch_add(&io_module->readahead_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        io_module->readahead_running = 1;
+    }
+
+    if (io_module->readahead_tail - io_module->readahead_head == IO_READAHEAD_QUEUE_SIZE) {
+        pthread_mutex_unlock(&io_module->readahead_lock);
+        __atomic_fetch_add(&io_module->readahead_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    IOReadaheadRequest* request = &io_module->readahead_queue[io_module->readahead_tail % IO_READAHEAD_QUEUE_SIZE];
+    request->object = object;
+    request->first_page = first_page;
+    request->num_pages = num_pages;
+    io_module->readahead_tail++;
+    pthread_cond_signal(&io_module->readahead_ready);
+
+    pthread_mutex_unlock(&io_module->readahead_lock);
+}
+
+// Wait until the readahead thread has read in everything queued so far
+void io_ctx_readahead_wait_idle(IOModule* io_module) {
+    pthread_mutex_lock(&io_module->readahead_lock);
+    while (io_module->readahead_head != io_module->readahead_tail || io_module->readahead_busy)
+        pthread_cond_wait(&io_module->readahead_idle, &io_module->readahead_lock);
+    pthread_mutex_unlock(&io_module->readahead_lock);
+}
+
+// Track a read of count bytes at offset through the IOFile's cursor and read ahead if it continues a stream.
+// The IOFile's cursor lock must be held
+void io_file_readahead(IOModule* io_module, IOFile* io_file, size_t offset, size_t count) {
+    FSFile* file = io_file->fs_file;
+    size_t max_window = io_module->config.readahead_max_window;
+    if (!io_file->readahead || max_window == 0 || count == 0 || (file->stored != NULL && io_module->page_cache == NULL))
+        return;
+
+    // Random access costs nothing more than remembering where the read ended
+    int sequential = offset == io_file->readahead_next;
+    io_file->readahead_next = offset + count;
+    if (!sequential) {
+        if (io_file->readahead_window != 0)
+            __atomic_fetch_add(&io_module->readahead_windows_collapsed, 1, __ATOMIC_RELAXED);
+        io_file->readahead_window = 0;
+        return;
+    }
+
+    size_t end = offset + count;
+    if (io_file->readahead_window == 0) {
+        io_file->readahead_window = IO_READAHEAD_MIN_WINDOW < max_window ? IO_READAHEAD_MIN_WINDOW : max_window;
+        io_file->readahead_end = end;
+        __atomic_fetch_add(&io_module->readahead_windows_started, 1, __ATOMIC_RELAXED);
+    }
+
+    // Only read the next window once the reader is within half a window of the end of the last one
+    if (io_file->readahead_end >= end + io_file->readahead_window / 2)
+        return;
+
+    size_t start = io_file->readahead_end > end ? io_file->readahead_end : end;
+    pthread_rwlock_rdlock(&file->lock);
+    size_t size = file->size;
+    pthread_rwlock_unlock(&file->lock);
+
+    size_t stop = start + io_file->readahead_window;
+    if (stop > size)
+        stop = size;
+
+    // Past the end of the file there's nothing to read until the reader gets another window further
+    if (start >= stop) {
+        io_file->readahead_end = start + io_file->readahead_window;
+        return;
+    }
+
+    if (file->stored != NULL) {
+        uint64_t first_page = start / IO_PAGE_SIZE;
+        io_readahead_queue(io_module, file->stored, first_page, (stop + IO_PAGE_SIZE - 1) / IO_PAGE_SIZE - first_page);
+    } else {
+        file_system_file_advise(file, start, stop - start);
+    }
+
+    __atomic_fetch_add(&io_module->readahead_requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io_module->readahead_bytes, stop - start, __ATOMIC_RELAXED);
+
+    io_file->readahead_end = stop;
+    io_file->readahead_window *= 2;
+    if (io_file->readahead_window > max_window)
+        io_file->readahead_window = max_window;
+}
+
+// Get how many streams were found and how many of the pages read ahead for them got read
+void io_ctx_get_readahead_stats(IOModule* io_module, IOReadaheadStats* stats) {
+    memset(stats, 0, sizeof(IOReadaheadStats));
+    stats->windows_started = __atomic_load_n(&io_module->readahead_windows_started, __ATOMIC_RELAXED);
+    stats->windows_collapsed = __atomic_load_n(&io_module->readahead_windows_collapsed, __ATOMIC_RELAXED);
+    stats->requests = __atomic_load_n(&io_module->readahead_requests, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&io_module->readahead_bytes, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&io_module->readahead_dropped, __ATOMIC_RELAXED);
+
+    IOPageCacheStats cache_stats;
+    io_page_cache_get_stats(io_module->page_cache, &cache_stats);
+    stats->pages_prefetched = cache_stats.prefetched;
+    stats->pages_used = cache_stats.prefetch_hits;
+    stats->pages_wasted = cache_stats.prefetch_wasted;
+    if (stats->pages_used + stats->pages_wasted > 0)
+        stats->usefulness = (double)stats->pages_used / (stats->pages_used + stats->pages_wasted);
+}
+
+/////////////////////////////////////////
+/* Async workers                       */
+/////////////////////////////////////////
+// Each worker has a queue of its own that submissions are spread over round robin, and a worker whose queue runs dry
+// steals from the others before going to sleep. Workers only sleep while every queue is empty
+
+// Add a request to the back of the queue, doubling the ring if it's full
+int io_async_queue_push(IOAsyncQueue* queue, const IOAsyncRequest* request) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->tail - queue->head == queue->capacity) {
+        IOAsyncRequest* requests = (IOAsyncRequest*)malloc(sizeof(IOAsyncRequest) * queue->capacity * 2);
+        if (requests == NULL) {
+            // malloc will set ENOMEM
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+
+        for (size_t i = queue->head; i != queue->tail; i++)
+            requests[i & (queue->capacity * 2 - 1)] = queue->requests[i & (queue->capacity - 1)];
+        free(queue->requests);
+        queue->requests = requests;
+        queue->capacity *= 2;
+    }
+
+    queue->requests[queue->tail & (queue->capacity - 1)] = *request;
+    queue->tail++;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return 1;
+}
+
+// Take the request at the front of the queue, returning 0 if it's empty
+int io_async_queue_pop(IOAsyncQueue* queue, IOAsyncRequest* request) {
+    pthread_mutex_lock(&queue->lock);
+
+    int popped = queue->head != queue->tail;
+    if (popped) {
+        *request = queue->requests[queue->head & (queue->capacity - 1)];
+        queue->head++;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return popped;
+}
+
+// Take the next request for the worker, from its own queue or else from the first other queue that has one
+int io_async_pool_take(IOAsyncPool* pool, IOAsyncQueue* queue, IOAsyncRequest* request) {
+    if (io_async_queue_pop(queue, request))
+        return 1;
+
+    for (int i = 1; i < pool->num_workers; i++) {
+        IOAsyncQueue* victim = &pool->queues[(queue->index + i) % pool->num_workers];
+        if (io_async_queue_pop(victim, request)) {
+            __atomic_fetch_add(&pool->stolen, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Hand the result of a request to its callback or the completion queue, then let io_async_wait_idle go once nothing
+// is left
+void io_async_pool_complete(IOAsyncPool* pool, const IOAsyncRequest* request, ssize_t result, int error) {
+    __atomic_fetch_add(&pool->completed, 1, __ATOMIC_RELAXED);
+    if (request->callback != NULL) {
+        request->callback(result, error, request->userdata);
+    } else {
+        pthread_mutex_lock(&pool->completion_lock);
+        IOAsyncCompletion* completion = &pool->completions[pool->completions_tail & (pool->completions_capacity - 1)];
+        completion->result = result;
+        completion->error = error;
+        completion->userdata = request->userdata;
+        pool->completions_tail++;
+        pool->completions_reserved--;
+        pthread_cond_broadcast(&pool->completion_ready);
+        pthread_mutex_unlock(&pool->completion_lock);
+    }
+
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Run requests until the pool is stopped and every queue is empty
+void* io_async_worker(void* arg) {
+    IOAsyncQueue* queue = (IOAsyncQueue*)arg;
+    IOAsyncPool* pool = queue->pool;
+    io_async_worker_queue = queue;
+
+    while (1) {
+        IOAsyncRequest request;
+        if (io_async_pool_take(pool, queue, &request)) {
+            __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+            errno = 0;
+            ssize_t result = pool->run(pool->io_module, &request);
+            io_async_pool_complete(pool, &request, result, result == -1 ? errno : 0);
+            continue;
+        }
+
+        // A submitter checks for sleepers after counting its request, so one of the two always sees the other
+        pthread_mutex_lock(&pool->lock);
+        __atomic_fetch_add(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        __atomic_fetch_sub(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        int done = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+// Queue a request on the calling worker's own queue, or on the next queue round robin from other threads.
+// A request without a callback reserves its slot in the completion queue first
+int io_async_pool_submit(IOAsyncPool* pool, const IOAsyncRequest* request) {
+    if (request->callback == NULL) {
+        pthread_mutex_lock(&pool->completion_lock);
+        size_t needed = pool->completions_tail - pool->completions_head + pool->completions_reserved + 1;
+        if (needed > pool->completions_capacity) {
+            size_t capacity = pool->completions_capacity * 2;
+            IOAsyncCompletion* completions = (IOAsyncCompletion*)malloc(sizeof(IOAsyncCompletion) * capacity);
+            if (completions == NULL) {
+                // malloc will set ENOMEM
+                pthread_mutex_unlock(&pool->completion_lock);
+                return 0;
+            }
+
+            for (size_t i = pool->completions_head; i != pool->completions_tail; i++)
+                completions[i & (capacity - 1)] = pool->completions[i & (pool->completions_capacity - 1)];
+            free(pool->completions);
+            pool->completions = completions;
+            pool->completions_capacity = capacity;
+        }
+        pool->completions_reserved++;
+        pthread_mutex_unlock(&pool->completion_lock);
+    }
+
+    IOAsyncQueue* queue = io_async_worker_queue;
+    if (queue == NULL || queue->pool != pool)
+        queue = &pool->queues[__atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->num_workers];
+
+    // The request is counted before a worker can see it, so it can't complete before pending goes up
+    __atomic_fetch_add(&pool->submitted, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    if (!io_async_queue_push(queue, request)) {
+        // errno is set by io_async_queue_push
+        int error = errno;
+        __atomic_fetch_sub(&pool->submitted, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->idle);
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        if (request->callback == NULL) {
+            pthread_mutex_lock(&pool->completion_lock);
+            pool->completions_reserved--;
+            pthread_mutex_unlock(&pool->completion_lock);
+        }
+        errno = error;
+        return 0;
+    }
+
+    if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 1;
+}
+
+// Free the pool and the first num_workers queues, its workers must have been joined
+void io_async_pool_free(IOAsyncPool* pool) {
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].requests);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->completion_lock);
+    pthread_cond_destroy(&pool->completion_ready);
+    free(pool->completions);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+// Stop the first num_started workers once they have run every request that was queued
+void io_async_pool_stop(IOAsyncPool* pool, int num_started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < num_started; i++)
+        pthread_join(pool->threads[i], NULL);
+}
+
+// Destroy the pool once its workers have run every request that was queued, including ones their callbacks queue
+void io_async_pool_destroy(IOAsyncPool** pool_ptr) {
+    IOAsyncPool* pool = *pool_ptr;
+
+    io_async_pool_stop(pool, pool->num_workers);
+    io_async_pool_free(pool);
+
+    *pool_ptr = NULL;
+}
+
+// Start a pool of num_workers workers making calls in the context with run
+IOAsyncPool* io_async_pool_init(IOModule* io_module, int num_workers, ssize_t (*run)(IOModule*, const IOAsyncRequest*)) {
+    IOAsyncPool* pool = (IOAsyncPool*)calloc(1, sizeof(IOAsyncPool));
+    if (pool == NULL) {
+        // calloc will set ENOMEM
+        return NULL;
+    }
+
+    pool->io_module = io_module;
+    pool->run = run;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_workers);
+    pool->queues = (IOAsyncQueue*)calloc(num_workers, sizeof(IOAsyncQueue));
+    pool->completions = (IOAsyncCompletion*)malloc(sizeof(IOAsyncCompletion) * IO_ASYNC_INITIAL_QUEUE_SIZE);
+    pool->completions_capacity = IO_ASYNC_INITIAL_QUEUE_SIZE;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pthread_mutex_init(&pool->completion_lock, NULL);
+    pthread_cond_init(&pool->completion_ready, NULL);
+    if (pool->threads == NULL || pool->queues == NULL || pool->completions == NULL) {
+        io_async_pool_free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Every queue is ready before any worker starts stealing from it
+    for (int i = 0; i < num_workers; i++) {
+        IOAsyncQueue* queue = &pool->queues[i];
+        queue->requests = (IOAsyncRequest*)malloc(sizeof(IOAsyncRequest) * IO_ASYNC_INITIAL_QUEUE_SIZE);
+        if (queue->requests == NULL) {
+            io_async_pool_free(pool);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->capacity = IO_ASYNC_INITIAL_QUEUE_SIZE;
+        queue->pool = pool;
+        queue->index = i;
+        pool->num_workers++;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        int error = pthread_create(&pool->threads[i], NULL, io_async_worker, &pool->queues[i]);
+        if (error != 0) {
+            // Nothing has been submitted yet, so the workers that did start stop right away
+            io_async_pool_stop(pool, i);
+            io_async_pool_free(pool);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/////////////////////////////////////////
+/* Delimiter scanning                  */
+/////////////////////////////////////////
+
+// Find the first byte equal to delim in the length bytes at data, returning NULL if there is none. Whole words are
+// compared at a time, a byte of the word xor the pattern is zero where it matches
+const char* io_scan_delim_scalar(const char* data, size_t length, char delim) {
+    const char* end = data + length;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    uint64_t pattern = ones * (unsigned char)delim;
+
+    // The borrows of the subtraction only run towards later bytes, so the lowest bit set is always the first match
+    while (end - data >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= pattern;
+        uint64_t matches = (word - ones) & ~word & highs;
+        if (matches != 0)
+            return data + (__builtin_ctzll(matches) >> 3);
+
+        data += 8;
+    }
+#endif
+
+    while (data < end) {
+        if (*data == delim)
+            return data;
+        data++;
+    }
+
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Scan 16 bytes at a time, the bit set for each matching byte of a block tells where the first match is
+__attribute__((target("sse2")))
+const char* io_scan_delim_sse2(const char* data, size_t length, char delim) {
+    const char* end = data + length;
+    __m128i pattern = _mm_set1_epi8(delim);
+
+    while (end - data >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)data);
+        int matches = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern));
+        if (matches != 0)
+            return data + __builtin_ctz(matches);
+
+        data += 16;
+    }
+
+    return io_scan_delim_scalar(data, end - data, delim);
+}
+
+// Scan 64 bytes at a time as two 32 byte blocks, only looking for where the match is once either of them has one
+__attribute__((target("avx2")))
+const char* io_scan_delim_avx2(const char* data, size_t length, char delim) {
+    const char* end = data + length;
+    __m256i pattern = _mm256_set1_epi8(delim);
+
+    while (end - data >= 64) {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)data), pattern);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + 32)), pattern);
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+            uint32_t low_matches = (uint32_t)_mm256_movemask_epi8(low);
+            if (low_matches != 0)
+                return data + __builtin_ctz(low_matches);
+            return data + 32 + __builtin_ctz((uint32_t)_mm256_movemask_epi8(high));
+        }
+
+        data += 64;
+    }
+
+    while (end - data >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)data);
+        uint32_t matches = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, pattern));
+        if (matches != 0)
+            return data + __builtin_ctz(matches);
+
+        data += 32;
+    }
+
+    return io_scan_delim_sse2(data, end - data, delim);
+}
+#endif
+
+// Point io_scan_delim at the fastest scanner the CPU supports
+void io_scan_delim_select() {
+    io_scan_delim = io_scan_delim_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        io_scan_delim = io_scan_delim_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        io_scan_delim = io_scan_delim_sse2;
+#endif
+}
+
+/////////////////////////
+/* File Descriptor API */
+/////////////////////////
+
+// Make a context that opens files in file_system, NULL for whatever fs_module is at the time of each call
+IOModule* io_ctx_init(FileSystem* file_system, const IOModuleConfig* config) {
+    pthread_once(&io_scan_delim_once, io_scan_delim_select);
+
+    // Allocate space for new IOModule
+    IOModule* io_module = (IOModule*)malloc(sizeof(IOModule));
+    if (io_module == NULL) {
+        perror("ERROR: Could not allocate data for IOModule\n");
+        return NULL;
+    }
+
+    // Initialize the new IOModule
+    io_module->file_table = io_file_table_init();
+    if (io_module->file_table == NULL) {
+        free(io_module);
+        return NULL;
+    }
+    
+    io_module->fd_bitmap = fd_bitmap_init();
+    if (io_module->fd_bitmap == NULL) {
+        io_file_table_destroy(&io_module->file_table);
+        free(io_module);
+        return NULL;
+    }
+
+    io_module->page_cache = NULL;
+    if (config->page_cache_size > 0) {
+        io_module->page_cache = io_page_cache_init(config->page_cache_size);
+        if (io_module->page_cache == NULL) {
+            perror("ERROR: Could not allocate the page cache\n");
+            fd_bitmap_destroy(&io_module->fd_bitmap);
+            io_file_table_destroy(&io_module->file_table);
+            free(io_module);
+            return NULL;
+        }
+    }
+
+    io_module->id = __atomic_fetch_add(&io_module_next_id, 1, __ATOMIC_RELAXED);
+    io_module->config = *config;
+    io_module->file_system = file_system;
+    pthread_mutex_init(&io_module->fd_lock, NULL);
+    io_module->epoch = 1;
+    io_module->thread_records = NULL;
+    io_module->retired_fds_front = -1;
+    io_module->retired_fds_back = -1;
+    io_module->retired_directories_front = NULL;
+    io_module->retired_directories_back = NULL;
+    io_module->readahead_running = 0;
+    pthread_mutex_init(&io_module->readahead_lock, NULL);
+    pthread_cond_init(&io_module->readahead_ready, NULL);
+    pthread_cond_init(&io_module->readahead_idle, NULL);
+    io_module->readahead_head = 0;
+    io_module->readahead_tail = 0;
+    io_module->readahead_busy = 0;
+    io_module->readahead_stop = 0;
+    io_module->readahead_windows_started = 0;
+    io_module->readahead_windows_collapsed = 0;
+    io_module->readahead_requests = 0;
+    io_module->readahead_bytes = 0;
+    io_module->readahead_dropped = 0;
+    io_module->trace_active = 0;
+    io_module->trace_file = NULL;
+    pthread_mutex_init(&io_module->trace_lock, NULL);
+    pthread_cond_init(&io_module->trace_wake, NULL);
+    pthread_mutex_init(&io_module->trace_drain_lock, NULL);
+    io_module->trace_stop = 0;
+    io_module->trace_start = 0;
+    io_module->trace_rings = NULL;
+    io_module->trace_num_rings = 0;
+    io_module->trace_file_ids = NULL;
+    io_module->trace_file_ids_capacity = 0;
+    memset(&io_module->trace_stats, 0, sizeof(IOTraceStats));
+    io_module->async_pool = NULL;
+    pthread_mutex_init(&io_module->async_lock, NULL);
+
+    if (config->trace_path != NULL && !io_ctx_trace_start(io_module, config->trace_path)) {
+        perror("ERROR: Could not start the trace\n");
+        pthread_mutex_destroy(&io_module->async_lock);
+        pthread_mutex_destroy(&io_module->trace_lock);
+        pthread_cond_destroy(&io_module->trace_wake);
+        pthread_mutex_destroy(&io_module->trace_drain_lock);
+        pthread_mutex_destroy(&io_module->readahead_lock);
+        pthread_cond_destroy(&io_module->readahead_ready);
+        pthread_cond_destroy(&io_module->readahead_idle);
+        pthread_mutex_destroy(&io_module->fd_lock);
+        if (io_module->page_cache != NULL)
+            io_page_cache_destroy(&io_module->page_cache);
+        fd_bitmap_destroy(&io_module->fd_bitmap);
+        io_file_table_destroy(&io_module->file_table);
+        free(io_module);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&io_modules_lock);
+    io_module->next = io_modules;
+    io_modules = io_module;
+    pthread_mutex_unlock(&io_modules_lock);
+
+    return io_module;
+}
+
+// Initialize the default context with the given options
+int io_module_init_with_config(const IOModuleConfig* config) {
+    io_default_module = io_ctx_init(NULL, config);
+    if (io_default_module == NULL)
+        return 0;
+
+    return 1;
+}
+
+// Fill in the default options, callers change the ones they care about before passing them to io_module_init_with_config
+void io_module_default_config(IOModuleConfig* config) {
+    config->fd_cache_enabled = 0;
+    config->page_cache_size = IO_PAGE_CACHE_DEFAULT_SIZE;
+    config->readahead_max_window = IO_READAHEAD_DEFAULT_MAX_WINDOW;
+    config->trace_path = NULL;
+    config->async_workers = IO_ASYNC_DEFAULT_WORKERS;
+}
+
+// Initialize the default context with the default options
+int io_module_init() {
+    IOModuleConfig config;
+    io_module_default_config(&config);
+
+    return io_module_init_with_config(&config);
+}
+
+// Deallocate the structures associated with a context, no other thread may be inside one of its API calls and every
+// view read through it must have been released
+void io_ctx_destroy(IOModule** io_module_ptr) {
+    IOModule* io_module = *io_module_ptr;
+
+    // Let the workers finish what's queued, they make their calls in the context and give their records back as they exit
+    if (io_module->async_pool != NULL)
+        io_async_pool_destroy(&io_module->async_pool);
+    pthread_mutex_destroy(&io_module->async_lock);
+
+    // Threads exiting from now on no longer look through the context's records
+    pthread_mutex_lock(&io_modules_lock);
+    IOModule** link = &io_modules;
+    while (*link != io_module)
+        link = &(*link)->next;
+    *link = io_module->next;
+    pthread_mutex_unlock(&io_modules_lock);
+
+    // Write out what has been traced, the files it names must still be around
+    if (io_module->trace_file != NULL)
+        io_ctx_trace_stop(io_module, NULL);
+
+    IOTraceRing* curr_ring = io_module->trace_rings;
+    IOTraceRing* next_ring;
+    while (curr_ring != NULL) {
+        next_ring = curr_ring->next;
+        free(curr_ring);
+
+        curr_ring = next_ring;
+    }
+    free(io_module->trace_file_ids);
+    pthread_mutex_destroy(&io_module->trace_lock);
+    pthread_cond_destroy(&io_module->trace_wake);
+    pthread_mutex_destroy(&io_module->trace_drain_lock);
+
+    // Let the readahead thread finish what's queued, the files it reads ahead must still be around
+    pthread_mutex_lock(&io_module->readahead_lock);
+    io_module->readahead_stop = 1;
+    pthread_cond_signal(&io_module->readahead_ready);
+    pthread_mutex_unlock(&io_module->readahead_lock);
+    if (io_module->readahead_running)
+        pthread_join(io_module->readahead_thread, NULL);
+    pthread_mutex_destroy(&io_module->readahead_lock);
+    pthread_cond_destroy(&io_module->readahead_ready);
+    pthread_cond_destroy(&io_module->readahead_idle);
+
+    // Nothing reads through the page cache anymore, writers in other contexts stopped looking at it once it was unlinked
+    if (io_module->page_cache != NULL)
+        io_page_cache_destroy(&io_module->page_cache);
+
+    // Deallocate all the data structures used by the module
+    IOThreadRecord* curr_record = io_module->thread_records;
+    IOThreadRecord* next_record;
+    while (curr_record != NULL) {
+        next_record = curr_record->next;
+        free(curr_record);
+
+        curr_record = next_record;
+    }
+
+    IOFileDirectory* curr_directory = io_module->retired_directories_front;
+    IOFileDirectory* next_directory;
+    while (curr_directory != NULL) {
+        next_directory = curr_directory->next_retired;
+        free(curr_directory);
+
+        curr_directory = next_directory;
+    }
+
+    io_file_table_destroy(&io_module->file_table);
+    fd_bitmap_destroy(&io_module->fd_bitmap);
+    pthread_mutex_destroy(&io_module->fd_lock);
+    free(io_module);
+
+    *io_module_ptr = NULL;
+}
+
+// Deallocate the default context, no other thread may be inside an API call
+void io_module_destory() {
+    io_ctx_destroy(&io_default_module);
+}
+
+// Get the lowest fd that isn't currently in use, or an fd from the calling thread's cache
+int io_module_create_new_fd(IOModule* io_module) {
+    if (io_module->config.fd_cache_enabled) {
+        IOThreadRecord* record = io_module_get_thread_record(io_module);
+        if (record == NULL) {
+            // errno is set by io_module_get_thread_record
+            return -1;
+        }
+
+        // errno is set by io_fd_cache_alloc if every fd is in use
+        return io_fd_cache_alloc(io_module, record);
+    }
+
+    pthread_mutex_lock(&io_module->fd_lock);
+
+    // Closed fds become available once no thread can still see their slot
+    io_module_reclaim(io_module);
+
+    // errno is set by fd_bitmap_alloc if every fd is in use
+    int new_fd = fd_bitmap_alloc(io_module->fd_bitmap);
+
+    pthread_mutex_unlock(&io_module->fd_lock);
+
+    return new_fd;
+}
+
+// Hand back an fd that was never opened
+void io_module_discard_fd(IOModule* io_module, int fd) {
+    pthread_mutex_lock(&io_module->fd_lock);
+    fd_bitmap_free(io_module->fd_bitmap, fd);
+    pthread_mutex_unlock(&io_module->fd_lock);
+}
+
+// Check that the IOFile was opened with the given mode, setting errno if it wasn't
+int io_file_has_mode(IOFile* io_file, unsigned int mode_type) {
+    if ((io_file->mode_type & mode_type) == 0) {
+        // Like POSIX, writing to an fd that wasn't opened for writing is a bad fd
+        errno = mode_type == IOFILE_MODE_WRITE ? EBADF : EROFS;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Enter an API call and get the open IOFile for the fd if it was opened with the given mode.
+// On success the caller must leave the API call with io_module_exit
+IOFile* io_module_enter_file(IOModule* io_module, int fd, unsigned int mode_type, IOThreadRecord** record_ptr) {
+    IOThreadRecord* record = io_module_enter(io_module);
+    if (record == NULL) {
+        // errno is set by io_module_enter
+        return NULL;
+    }
+
+    IOFile* io_file = io_file_table_get_file(io_module->file_table, fd);
+    if (io_file == NULL) {
+        // errno is set by io_file_table_get_file
+        io_module_exit(record);
+        return NULL;
+    }
+
+    if (!io_file_has_mode(io_file, mode_type)) {
+        // errno is set by io_file_has_mode
+        io_module_exit(record);
+        return NULL;
+    }
+
+    *record_ptr = record;
+
+    return io_file;
+}
+
+// The API call to open a new IOFile and return a new file descriptor
+int io_ctx_open(IOModule* io_module, const char* filename, unsigned int mode_type) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    // Ensure user provides an io mode
+    if (mode_type == 0) {
+        fprintf(stderr, "ERROR: Provide at least one of the io modes: IOFILE_MODE_READ or IOFILE_MODE_WRITE\n");
+        IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+        return -1;
+    }
+
+    // Get the file system object
+    FSFile* fs_file = file_system_find_file(io_module_file_system(io_module), filename);
+    if (fs_file == NULL) {
+        // errno already set by file system call
+        IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+        return -1;
+    }
+
+    // Files from a mounted directory are mapped in on their first open
+    if (!file_system_file_map(fs_file)) {
+        // errno is set by file_system_file_map
+        IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+        return -1;
+    }
+    uint64_t stats_lookup_end = IO_STATS_PHASE(io_module, IO_STAT_OPEN_LOOKUP, stats_start);
+
+    // Get a new fd that can be used for the file
+    int new_fd = io_module_create_new_fd(io_module);
+    if (new_fd == -1) {
+        // errno is set by io_module_create_new_fd
+        IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+        return -1;
+    }
+
+    // Make sure the fd has a slot in the table
+    IOThreadRecord* record = io_module_enter(io_module);
+    if (record == NULL) {
+        // errno is set by io_module_enter
+        io_module_discard_fd(io_module, new_fd);
+        IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+        return -1;
+    }
+
+    if (io_file_table_get_slot(io_module->file_table, new_fd) == NULL) {
+        IOFileDirectory* old_directory;
+        int grown = io_file_table_grow(io_module->file_table, new_fd, &old_directory);
+        if (!grown) {
+            // errno is set by io_file_table_grow
+            io_module_exit(record);
+            io_module_discard_fd(io_module, new_fd);
+            IO_STATS_END(io_module, NULL, IO_STAT_OPEN, stats_start, -1);
+            return -1;
+        }
+
+        if (old_directory != NULL) {
+            pthread_mutex_lock(&io_module->fd_lock);
+            io_module_retire_directory(io_module, old_directory);
+            pthread_mutex_unlock(&io_module->fd_lock);
+        }
+    }
+
+    // Associate the fd with a file object
+    io_file_table_new_file(io_module->file_table, new_fd, mode_type, fs_file);
+
+    io_module_exit(record);
+    (void)IO_STATS_PHASE(io_module, IO_STAT_OPEN_FD, stats_lookup_end);
+    IO_STATS_END(io_module, record, IO_STAT_OPEN, stats_start, 0);
+    IO_TRACE(io_module, record, IO_TRACE_OP_OPEN, new_fd, fs_file, 0, mode_type, new_fd);
+
+    return new_fd;
+}
+
+// The API call to close the given file descriptor
+int io_ctx_close(IOModule* io_module, int fd) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    IOThreadRecord* record = io_module_enter(io_module);
+    if (record == NULL) {
+        // errno is set by io_module_enter
+        IO_STATS_END(io_module, NULL, IO_STAT_CLOSE, stats_start, -1);
+        return -1;
+    }
+
+    // Remove the fd - IOFile association from the fd table
+    int removed_io_file = io_file_table_remove_file(io_module->file_table, fd);
+
+    io_module_exit(record);
+
+    if (!removed_io_file) {
+        // errno set by io_file_table_remove_file
+        IO_STATS_END(io_module, NULL, IO_STAT_CLOSE, stats_start, -1);
+        return -1;
+    }
+
+    // Let the fd be handed out again by a later io_open once no other thread can be using its slot
+    IO_TRACE(io_module, record, IO_TRACE_OP_CLOSE, fd, NULL, 0, 0, 0);
+    if (io_module->config.fd_cache_enabled) {
+        io_fd_cache_retire(io_module, record, fd);
+        IO_STATS_END(io_module, record, IO_STAT_CLOSE, stats_start, 0);
+        return 0;
+    }
+
+    pthread_mutex_lock(&io_module->fd_lock);
+    io_module_retire_fd(io_module, fd);
+    io_module_reclaim(io_module);
+    pthread_mutex_unlock(&io_module->fd_lock);
+
+    IO_STATS_END(io_module, record, IO_STAT_CLOSE, stats_start, 0);
+
+    return 0;
+}
+
+// Read count many bytes from the IOFile pointed to by the given fd
+ssize_t io_ctx_read(IOModule* io_module, int fd, char* buf, size_t count) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    // Copy the bytes over, reading past the end of the file reads nothing. What follows is read ahead first so that
+    // it comes in while this read is served
+    pthread_mutex_lock(&io_file->cursor_lock);
+    size_t offset = io_file->cursor_pos;
+    io_file_readahead(io_module, io_file, offset, count);
+    ssize_t bytes_read = file_system_file_read(io_file->fs_file, io_module->page_cache, offset, buf, count);
+    if (bytes_read > 0)
+        io_file->cursor_pos += bytes_read;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    IO_TRACE(io_module, record, IO_TRACE_OP_READ, fd, io_file->fs_file, offset, count, bytes_read);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, bytes_read);
+
+    return bytes_read;
+}
+
+// Read count many bytes from the IOFile pointed to by the given fd starting at offset, leaving its cursor untouched.
+// Many threads can call this at once on the same fd
+ssize_t io_ctx_pread(IOModule* io_module, int fd, char* buf, size_t count, off_t offset) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    if (offset < 0) {
+        errno = EINVAL;
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    ssize_t bytes_read = file_system_file_read(io_file->fs_file, io_module->page_cache, offset, buf, count);
+
+    IO_TRACE(io_module, record, IO_TRACE_OP_PREAD, fd, io_file->fs_file, offset, count, bytes_read);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, bytes_read);
+
+    return bytes_read;
+}
+
+// Write count many bytes to the IOFile pointed to by the given fd starting at offset, leaving its cursor untouched.
+// Writing past the end of the file fills the gap with zeros
+ssize_t io_ctx_pwrite(IOModule* io_module, int fd, const char* buf, size_t count, off_t offset) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    if (offset < 0) {
+        errno = EINVAL;
+        IO_STATS_END(io_module, NULL, IO_STAT_WRITE, stats_start, -1);
+        return -1;
+    }
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_WRITE, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_WRITE, stats_start, -1);
+        return -1;
+    }
+
+    // errno is set by file_system_file_write if the write fails
+    ssize_t bytes_written = file_system_file_write(io_file->fs_file, io_module->page_cache, offset, buf, count);
+
+    IO_TRACE(io_module, record, IO_TRACE_OP_PWRITE, fd, io_file->fs_file, offset, count, bytes_written);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_WRITE, stats_start, bytes_written);
+
+    return bytes_written;
+}
+
+// Get a zero-copy view of up to count bytes from the IOFile pointed to by the given fd and advance its cursor.
+// A view stops at the end of a chunk so it can return fewer bytes than io_read, and it must be released with io_release_view.
+// Views of stored files stop at the end of a page and fail with EOPNOTSUPP if the context has no page cache
+ssize_t io_ctx_read_view(IOModule* io_module, int fd, size_t count, IOView* view) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&io_file->cursor_lock);
+    ssize_t bytes_viewed = file_system_file_view(io_file->fs_file, io_module->page_cache, io_file->cursor_pos, count, view);
+    if (bytes_viewed > 0)
+        io_file->cursor_pos += bytes_viewed;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, bytes_viewed);
+
+    return bytes_viewed;
+}
+
+// Release a view returned by io_read_view, its data must not be used afterwards
+void io_release_view(IOView* view) {
+    if (view->chunk != NULL)
+        fs_chunk_release(&view->chunk);
+    if (view->frame != NULL)
+        io_page_cache_unpin(view->frame);
+    view->frame = NULL;
+
+    view->data = NULL;
+    view->length = 0;
+}
+
+// Read the record at the cursor of the IOFile pointed to by the given fd into *lineptr and advance the cursor past it.
+// A record runs up to and including the next delim, or up to the end of the file. Like POSIX getdelim, *lineptr is a
+// malloc'd buffer of *n bytes or NULL, which is grown to fit the record and a terminating '\0'. Returns the record's
+// length, 0 at the end of the file
+ssize_t io_ctx_getdelim(IOModule* io_module, int fd, char** lineptr, size_t* n, int delim) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    if (lineptr == NULL || n == NULL) {
+        errno = EINVAL;
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    // A failed read leaves the cursor where it was, what follows the record is read ahead for the next call
+    pthread_mutex_lock(&io_file->cursor_lock);
+    size_t offset = io_file->cursor_pos;
+    ssize_t bytes_read = file_system_file_getdelim(io_file->fs_file, io_module->page_cache, offset, (char)delim, lineptr, n);
+    if (bytes_read > 0) {
+        io_file->cursor_pos += bytes_read;
+        io_file_readahead(io_module, io_file, offset, bytes_read);
+    }
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    // errno is set by file_system_file_getdelim if it fails
+    size_t count = bytes_read > 0 ? bytes_read : 0;
+    IO_TRACE(io_module, record, IO_TRACE_OP_READ, fd, io_file->fs_file, offset, count, bytes_read);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, bytes_read);
+
+    return bytes_read;
+}
+
+// Read the line at the cursor of the IOFile pointed to by the given fd, see io_ctx_getdelim
+ssize_t io_ctx_getline(IOModule* io_module, int fd, char** lineptr, size_t* n) {
+    return io_ctx_getdelim(io_module, fd, lineptr, n, '\n');
+}
+
+// Get a zero-copy view of the record at the cursor of the IOFile pointed to by the given fd and advance the cursor past
+// it. Like io_read_view the view stops at the end of a chunk, so a record running past it comes back in parts and only
+// the last part ends with delim. The view must be released with io_release_view. Like io_read_view it fails with
+// EOPNOTSUPP on stored files if the context has no page cache
+ssize_t io_ctx_getdelim_view(IOModule* io_module, int fd, int delim, IOView* view) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&io_file->cursor_lock);
+    size_t offset = io_file->cursor_pos;
+    ssize_t bytes_viewed = file_system_file_view(io_file->fs_file, io_module->page_cache, offset, SIZE_MAX, view);
+    if (bytes_viewed > 0) {
+        const char* found = io_scan_delim(view->data, bytes_viewed, (char)delim);
+        if (found != NULL)
+            view->length = bytes_viewed = found - view->data + 1;
+
+        io_file_readahead(io_module, io_file, offset, bytes_viewed);
+        io_file->cursor_pos += bytes_viewed;
+    }
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    size_t count = bytes_viewed > 0 ? bytes_viewed : 0;
+    IO_TRACE(io_module, record, IO_TRACE_OP_READ, fd, io_file->fs_file, offset, count, bytes_viewed);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, bytes_viewed);
+
+    return bytes_viewed;
+}
+
+// Write count many bytes to the IOFile pointed to by the given fd at its cursor
+ssize_t io_ctx_write(IOModule* io_module, int fd, const char* buf, size_t count) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_WRITE, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_WRITE, stats_start, -1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&io_file->cursor_lock);
+    size_t offset = io_file->cursor_pos;
+    ssize_t bytes_written = file_system_file_write(io_file->fs_file, io_module->page_cache, offset, buf, count);
+    // errno is set by file_system_file_write if the write fails
+    if (bytes_written != -1)
+        io_file->cursor_pos += bytes_written;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    IO_TRACE(io_module, record, IO_TRACE_OP_WRITE, fd, io_file->fs_file, offset, count, bytes_written);
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_WRITE, stats_start, bytes_written);
+
+    return bytes_written;
+}
+
+// Move the cursor of the IOFile pointed to by the given fd to offset measured from whence, one of the IO_SEEK_* constants.
+// The cursor can go past the end of the file, and writing there leaves a hole that takes no memory and reads back as
+// zeros. Returns the new cursor position or -1 with errno set
+off_t io_ctx_lseek(IOModule* io_module, int fd, off_t offset, int whence) {
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ | IOFILE_MODE_WRITE, &record);
+    if (io_file == NULL)
+        // errno is set by io_module_enter_file
+        return -1;
+
+    FSFile* file = io_file->fs_file;
+    pthread_mutex_lock(&io_file->cursor_lock);
+
+    off_t base = 0;
+    if (whence == IO_SEEK_CUR) {
+        base = io_file->cursor_pos;
+    } else if (whence == IO_SEEK_END) {
+        pthread_rwlock_rdlock(&file->lock);
+        base = file->size;
+        pthread_rwlock_unlock(&file->lock);
+    } else if (whence != IO_SEEK_SET && whence != IO_SEEK_DATA && whence != IO_SEEK_HOLE) {
+        pthread_mutex_unlock(&io_file->cursor_lock);
+        io_module_exit(record);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((offset > 0 && base > LLONG_MAX - offset) || base + offset < 0) {
+        pthread_mutex_unlock(&io_file->cursor_lock);
+        io_module_exit(record);
+        errno = offset > 0 ? EOVERFLOW : EINVAL;
+        return -1;
+    }
+
+    size_t position = base + offset;
+    if (whence == IO_SEEK_DATA || whence == IO_SEEK_HOLE) {
+        if (!file_system_file_seek_data(file, position, whence == IO_SEEK_HOLE, &position)) {
+            // errno is set by file_system_file_seek_data
+            pthread_mutex_unlock(&io_file->cursor_lock);
+            io_module_exit(record);
+            return -1;
+        }
+    }
+
+    io_file->cursor_pos = position;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    io_module_exit(record);
+
+    return position;
+}
+
+// Read from the IOFile pointed to by the given fd into each of the iovcnt buffers in turn, resolving the fd only once
+ssize_t io_ctx_readv(IOModule* io_module, int fd, const IOVec* iov, int iovcnt) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_READ, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, stats_start, -1);
+        return -1;
+    }
+
+    // Fill the buffers in order, stopping early at the end of the file
+    size_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].length;
+
+    pthread_mutex_lock(&io_file->cursor_lock);
+    io_file_readahead(io_module, io_file, io_file->cursor_pos, count);
+    ssize_t total_read = file_system_file_readv(io_file->fs_file, io_module->page_cache, io_file->cursor_pos, iov, iovcnt);
+    if (total_read > 0)
+        io_file->cursor_pos += total_read;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    io_module_exit(record);
+    IO_STATS_END(io_module, record, IO_STAT_READ, stats_start, total_read);
+
+    return total_read;
+}
+
+// Write each of the iovcnt buffers in turn to the IOFile pointed to by the given fd at its cursor, resolving the fd only once
+ssize_t io_ctx_writev(IOModule* io_module, int fd, const IOVec* iov, int iovcnt) {
+    uint64_t stats_start = IO_STATS_BEGIN();
+
+    if (iovcnt < 0) {
+        errno = EINVAL;
+        IO_STATS_END(io_module, NULL, IO_STAT_WRITE, stats_start, -1);
+        return -1;
+    }
+
+    IOThreadRecord* record;
+    IOFile* io_file = io_module_enter_file(io_module, fd, IOFILE_MODE_WRITE, &record);
+    if (io_file == NULL) {
+        // errno is set by io_module_enter_file
+        IO_STATS_END(io_module, NULL, IO_STAT_WRITE, stats_start, -1);
+        return -1;
+    }
+
+    // Drain the buffers in order, stopping early if the file system runs out of memory
+    pthread_mutex_lock(&io_file->cursor_lock);
+    FSFile* fs_file = io_file->fs_file;
+    size_t total_written = 0;
+    int failed = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].length == 0)
+            continue;
+
+        ssize_t bytes_written = file_system_file_write(fs_file, io_module->page_cache, io_file->cursor_pos + total_written, (const char*)iov[i].base, iov[i].length);
+        if (bytes_written == -1) {
+            // errno is set by file_system_file_write, only report it if nothing was written
+            failed = total_written == 0;
+            break;
+        }
+
+        total_written += bytes_written;
+        if ((size_t)bytes_written < iov[i].length)
+            break;
+    }
+
+    io_file->cursor_pos += total_written;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    io_module_exit(record);
+
+    ssize_t result = failed ? -1 : (ssize_t)total_written;
+    IO_STATS_END(io_module, record, IO_STAT_WRITE, stats_start, result);
+
+    return result;
+}
+
+// Create the file dst_filename as a copy-on-write clone of src_filename, which costs the same no matter the file's size.
+// Fails with ENOENT if the source doesn't exist, EEXIST if the destination does and EOPNOTSUPP if the source is a
+// stored file, whose data lives in its store rather than in chunks that can be shared
+int io_ctx_clone(IOModule* io_module, const char* src_filename, const char* dst_filename) {
+    if (!file_system_clone_file(io_module_file_system(io_module), src_filename, dst_filename)) {
+        // errno is set by file_system_clone_file
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////
+/* Submission and completion rings    */
+////////////////////////////////////////
+// Queue up opens, reads, writes and closes, run them all with one io_ring_submit and reap their results afterwards
+
+// Make a ring with room for at least the given number of submissions and completions, run in the given context
+IORing* io_ctx_ring_init(IOModule* io_module, unsigned int entries) {
+    if (entries == 0 || entries > (1u << 16)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    unsigned int capacity = 1;
+    while (capacity < entries)
+        capacity <<= 1;
+
+    IORing* ring = (IORing*)malloc(sizeof(IORing));
+    if (ring == NULL) {
+        // malloc will set ENOMEM
+        return NULL;
+    }
+
+    ring->submissions = (IOSubmission*)malloc(sizeof(IOSubmission) * capacity);
+    ring->completions = (IOCompletion*)malloc(sizeof(IOCompletion) * capacity);
+    if (ring->submissions == NULL || ring->completions == NULL) {
+        // malloc will set ENOMEM
+        free(ring->submissions);
+        free(ring->completions);
+        free(ring);
+        return NULL;
+    }
+
+    ring->mask = capacity - 1;
+    ring->sq_head = 0;
+    ring->sq_tail = 0;
+    ring->cq_head = 0;
+    ring->cq_tail = 0;
+    ring->coalesced_reads = 0;
+    ring->io_module = io_module;
+
+    return ring;
+}
+
+// Free the ring, any submissions that were never submitted are dropped
+void io_ring_destroy(IORing** ring_ptr) {
+    IORing* ring = *ring_ptr;
+    free(ring->submissions);
+    free(ring->completions);
+    free(ring);
+
+    *ring_ptr = NULL;
+}
+
+// Get the next free submission in the ring, or NULL with EBUSY if the submission queue is full
+IOSubmission* io_ring_get_submission(IORing* ring) {
+    if (ring->sq_tail - ring->sq_head > ring->mask) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    IOSubmission* submission = &ring->submissions[ring->sq_tail & ring->mask];
+    memset(submission, 0, sizeof(IOSubmission));
+    submission->fd = -1;
+    submission->offset = IO_OFFSET_CURSOR;
+    ring->sq_tail++;
+
+    return submission;
+}
+
+void io_ring_prep_open(IOSubmission* submission, const char* filename, unsigned int mode_type) {
+    submission->opcode = IO_OP_OPEN;
+    submission->filename = filename;
+    submission->mode_type = mode_type;
+}
+
+void io_ring_prep_close(IOSubmission* submission, int fd) {
+    submission->opcode = IO_OP_CLOSE;
+    submission->fd = fd;
+}
+
+void io_ring_prep_read(IOSubmission* submission, int fd, void* buf, size_t count, off_t offset) {
+    submission->opcode = IO_OP_READ;
+    submission->fd = fd;
+    submission->buf = buf;
+    submission->count = count;
+    submission->offset = offset;
+}
+
+void io_ring_prep_write(IOSubmission* submission, int fd, const void* buf, size_t count, off_t offset) {
+    submission->opcode = IO_OP_WRITE;
+    submission->fd = fd;
+    submission->buf = (void*)buf;
+    submission->count = count;
+    submission->offset = offset;
+}
+
+// The fd a submission runs on, prev_fd is the fd from the last open of the submit or -1
+int io_ring_submission_fd(IOSubmission* submission, int prev_fd) {
+    if (submission->flags & IO_SUBMIT_PREV_FD)
+        return prev_fd;
+
+    return submission->fd;
+}
+
+// Pop the submission at the head of the submission queue and push its result onto the completion queue
+void io_ring_complete(IORing* ring, ssize_t result, int error) {
+    IOSubmission* submission = &ring->submissions[ring->sq_head & ring->mask];
+    IOCompletion* completion = &ring->completions[ring->cq_tail & ring->mask];
+    completion->user_data = submission->user_data;
+    completion->result = result;
+    completion->error = result == -1 ? error : 0;
+
+    ring->sq_head++;
+    ring->cq_tail++;
+}
+
+// Run the read at the head of the submission queue along with the reads of the same fd right after it, holding the
+// file's lock once for all of them. Cursor reads continue each other so they fill their buffers in one pass over the file.
+// Returns how many reads it ran
+int io_ring_read_run(IOModule* io_module, IORing* ring, IOFile* io_file, int fd, int prev_fd) {
+    unsigned int cq_space = ring->mask + 1 - (ring->cq_tail - ring->cq_head);
+    IOSubmission* first = &ring->submissions[ring->sq_head & ring->mask];
+    int use_cursor = first->offset == IO_OFFSET_CURSOR;
+
+    IOVec iov[IO_RING_MAX_COALESCE];
+    size_t offsets[IO_RING_MAX_COALESCE];
+    int run = 0;
+    while (run < IO_RING_MAX_COALESCE && (unsigned int)run < cq_space && ring->sq_head + run != ring->sq_tail) {
+        IOSubmission* submission = &ring->submissions[(ring->sq_head + run) & ring->mask];
+        if (submission->opcode != IO_OP_READ || io_ring_submission_fd(submission, prev_fd) != fd)
+            break;
+
+        // Cursor reads and reads at an offset aren't mixed, and a bad offset is left for io_ring_submit to fail
+        if (use_cursor != (submission->offset == IO_OFFSET_CURSOR) || (!use_cursor && submission->offset < 0))
+            break;
+
+        iov[run].base = submission->buf;
+        iov[run].length = submission->count;
+        offsets[run] = submission->offset;
+        run++;
+    }
+
+    ssize_t bytes_read[IO_RING_MAX_COALESCE];
+    int errors[IO_RING_MAX_COALESCE];
+    if (use_cursor) {
+        pthread_mutex_lock(&io_file->cursor_lock);
+        ssize_t total_read = file_system_file_readv(io_file->fs_file, io_module->page_cache, io_file->cursor_pos, iov, run);
+        if (total_read > 0)
+            io_file->cursor_pos += total_read;
+        pthread_mutex_unlock(&io_file->cursor_lock);
+
+        // The pass stops at the end of the file, so later reads in the run come back short or empty.
+        // If a stored file's store failed up front every read in the run fails with it
+        int error = total_read == -1 ? errno : 0;
+        for (int i = 0; i < run; i++) {
+            errors[i] = error;
+            if (error != 0) {
+                bytes_read[i] = -1;
+                continue;
+            }
+
+            bytes_read[i] = iov[i].length < (size_t)total_read ? (ssize_t)iov[i].length : total_read;
+            total_read -= bytes_read[i];
+        }
+    } else {
+        file_system_file_read_batch(io_file->fs_file, io_module->page_cache, offsets, iov, bytes_read, errors, run);
+    }
+
+    // The reads of a ring are counted but not timed since they share their time with the rest of the run
+    for (int i = 0; i < run; i++) {
+        io_ring_complete(ring, bytes_read[i], errors[i]);
+        IO_STATS_END(io_module, NULL, IO_STAT_READ, 0, bytes_read[i]);
+    }
+
+    ring->coalesced_reads += run - 1;
+
+    return run;
+}
+
+// Run the write at the head of the submission queue
+ssize_t io_ring_write(IOModule* io_module, IOFile* io_file, IOSubmission* submission) {
+    if (submission->offset != IO_OFFSET_CURSOR)
+        // errno is set by file_system_file_write if the write fails
+        return file_system_file_write(io_file->fs_file, io_module->page_cache, submission->offset, (const char*)submission->buf, submission->count);
+
+    pthread_mutex_lock(&io_file->cursor_lock);
+    ssize_t bytes_written = file_system_file_write(io_file->fs_file, io_module->page_cache, io_file->cursor_pos, (const char*)submission->buf, submission->count);
+    // errno is set by file_system_file_write if the write fails
+    if (bytes_written != -1)
+        io_file->cursor_pos += bytes_written;
+    pthread_mutex_unlock(&io_file->cursor_lock);
+
+    return bytes_written;
+}
+
+// Run the queued submissions in order until the submission queue is empty or the completion queue is full.
+// Reads and writes share one API call and one fd lookup per fd, and back to back reads of a fd are merged.
+// Returns the number of submissions that were run
+int io_ring_submit(IORing* ring) {
+    IOModule* io_module = ring->io_module != NULL ? ring->io_module : io_default_module;
+    int submitted = 0;
+    int prev_fd = -1;
+
+    // Reads and writes stay inside one API call until an open or close has to run
+    IOThreadRecord* record = NULL;
+    int looked_up_fd = -1;
+    IOFile* looked_up_file = NULL;
+
+    while (ring->sq_head != ring->sq_tail && ring->cq_tail - ring->cq_head <= ring->mask) {
+        IOSubmission* submission = &ring->submissions[ring->sq_head & ring->mask];
+        int fd = io_ring_submission_fd(submission, prev_fd);
+
+        if (submission->opcode == IO_OP_OPEN || submission->opcode == IO_OP_CLOSE) {
+            if (record != NULL) {
+                io_module_exit(record);
+                record = NULL;
+                looked_up_fd = -1;
+            }
+
+            // errno is set by io_open and io_close if they fail
+            if (submission->opcode == IO_OP_OPEN) {
+                prev_fd = io_ctx_open(io_module, submission->filename, submission->mode_type);
+                io_ring_complete(ring, prev_fd, errno);
+            } else {
+                io_ring_complete(ring, io_ctx_close(io_module, fd), errno);
+            }
+
+            submitted++;
+            continue;
+        }
+
+        if (submission->opcode != IO_OP_READ && submission->opcode != IO_OP_WRITE) {
+            io_ring_complete(ring, -1, EINVAL);
+            submitted++;
+            continue;
+        }
+
+        if (submission->offset < 0 && submission->offset != IO_OFFSET_CURSOR) {
+            io_ring_complete(ring, -1, EINVAL);
+            submitted++;
+            continue;
+        }
+
+        if (record == NULL) {
+            record = io_module_enter(io_module);
+            if (record == NULL) {
+                // errno is set by io_module_enter
+                io_ring_complete(ring, -1, errno);
+                submitted++;
+                continue;
+            }
+        }
+
+        // Runs of submissions on the same fd only look it up once
+        if (fd != looked_up_fd) {
+            looked_up_file = io_file_table_get_file(io_module->file_table, fd);
+            looked_up_fd = fd;
+        }
+
+        if (looked_up_file == NULL) {
+            io_ring_complete(ring, -1, EBADF);
+            submitted++;
+            continue;
+        }
+
+        IOFile* io_file = looked_up_file;
+        if (!io_file_has_mode(io_file, submission->opcode == IO_OP_READ ? IOFILE_MODE_READ : IOFILE_MODE_WRITE)) {
+            // errno is set by io_file_has_mode
+            io_ring_complete(ring, -1, errno);
+            submitted++;
+            continue;
+        }
+
+        if (submission->opcode == IO_OP_READ) {
+            submitted += io_ring_read_run(io_module, ring, io_file, fd, prev_fd);
+        } else {
+            ssize_t bytes_written = io_ring_write(io_module, io_file, submission);
+            io_ring_complete(ring, bytes_written, errno);
+            IO_STATS_END(io_module, record, IO_STAT_WRITE, 0, bytes_written);
+            submitted++;
+        }
+    }
+
+    if (record != NULL)
+        io_module_exit(record);
+
+    return submitted;
+}
+
+// Move up to max completions out of the ring in the order their submissions were queued
+int io_ring_reap(IORing* ring, IOCompletion* completions, int max) {
+    int reaped = 0;
+    while (reaped < max && ring->cq_head != ring->cq_tail) {
+        completions[reaped++] = ring->completions[ring->cq_head & ring->mask];
+        ring->cq_head++;
+    }
+
+    return reaped;
+}
+
+////////////////////////////////////
+/* Async calls                    */
+////////////////////////////////////
+// An async call is queued for the context's workers and returns once it's queued. Its result goes to the callback on
+// the worker that made the call, or to the completion queue for io_async_poll when there is no callback. The buffer
+// must stay valid until the call completes, and calls through the cursor of the same fd complete in no set order
+
+// Make the call that a request stands for, on the worker that took it
+ssize_t io_async_run(IOModule* io_module, const IOAsyncRequest* request) {
+    switch (request->op) {
+        case IO_ASYNC_OP_READ:
+            return io_ctx_read(io_module, request->fd, request->buf, request->count);
+        case IO_ASYNC_OP_PREAD:
+            return io_ctx_pread(io_module, request->fd, request->buf, request->count, request->offset);
+        case IO_ASYNC_OP_WRITE:
+            return io_ctx_write(io_module, request->fd, request->buf, request->count);
+        case IO_ASYNC_OP_PWRITE:
+            return io_ctx_pwrite(io_module, request->fd, request->buf, request->count, request->offset);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+// Get the context's pool, starting its workers the first time
+IOAsyncPool* io_async_get_pool(IOModule* io_module) {
+    IOAsyncPool* pool = __atomic_load_n(&io_module->async_pool, __ATOMIC_ACQUIRE);
+    if (pool != NULL)
+        return pool;
+
+    pthread_mutex_lock(&io_module->async_lock);
+    pool = io_module->async_pool;
+    if (pool == NULL) {
+        int num_workers = io_module->config.async_workers > 0 ? io_module->config.async_workers : IO_ASYNC_DEFAULT_WORKERS;
+        pool = io_async_pool_init(io_module, num_workers, io_async_run);
+        if (pool != NULL)
+            __atomic_store_n(&io_module->async_pool, pool, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&io_module->async_lock);
+
+    // errno is set by io_async_pool_init
+    return pool;
+}
+
+// Queue a call of the given op for the context's workers
+int io_async_submit(IOModule* io_module, int op, int fd, char* buf, size_t count, off_t offset, IOAsyncCallback callback, void* userdata) {
+    IOAsyncPool* pool = io_async_get_pool(io_module);
+    if (pool == NULL) {
+        // errno is set by io_async_get_pool
+        return -1;
+    }
+
+    IOAsyncRequest request;
+    request.op = op;
+    request.fd = fd;
+    request.buf = buf;
+    request.count = count;
+    request.offset = offset;
+    request.callback = callback;
+    request.userdata = userdata;
+    if (!io_async_pool_submit(pool, &request)) {
+        // errno is set by io_async_pool_submit
+        return -1;
+    }
+
+    return 0;
+}
+
+// Queue a read of count bytes through the fd's cursor
+int io_ctx_read_async(IOModule* io_module, int fd, char* buf, size_t count, IOAsyncCallback callback, void* userdata) {
+    return io_async_submit(io_module, IO_ASYNC_OP_READ, fd, buf, count, 0, callback, userdata);
+}
+
+// Queue a read of count bytes starting at offset
+int io_ctx_pread_async(IOModule* io_module, int fd, char* buf, size_t count, off_t offset, IOAsyncCallback callback, void* userdata) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return io_async_submit(io_module, IO_ASYNC_OP_PREAD, fd, buf, count, offset, callback, userdata);
+}
+
+// Queue a write of count bytes through the fd's cursor
+int io_ctx_write_async(IOModule* io_module, int fd, const char* buf, size_t count, IOAsyncCallback callback, void* userdata) {
+    return io_async_submit(io_module, IO_ASYNC_OP_WRITE, fd, (char*)buf, count, 0, callback, userdata);
+}
+
+// Queue a write of count bytes starting at offset
+int io_ctx_pwrite_async(IOModule* io_module, int fd, const char* buf, size_t count, off_t offset, IOAsyncCallback callback, void* userdata) {
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return io_async_submit(io_module, IO_ASYNC_OP_PWRITE, fd, (char*)buf, count, offset, callback, userdata);
+}
+
+// Move up to max completions of calls queued without a callback into completions, waiting until there are at least
+// min of them or no such call is left in flight
+int io_ctx_async_poll(IOModule* io_module, IOAsyncCompletion* completions, int max, int min) {
+    IOAsyncPool* pool = __atomic_load_n(&io_module->async_pool, __ATOMIC_ACQUIRE);
+    if (pool == NULL)
+        return 0;
+
+    int taken = 0;
+    pthread_mutex_lock(&pool->completion_lock);
+    while (taken < max) {
+        if (pool->completions_head != pool->completions_tail) {
+            completions[taken++] = pool->completions[pool->completions_head & (pool->completions_capacity - 1)];
+            pool->completions_head++;
+        } else if (taken < min && pool->completions_reserved > 0) {
+            pthread_cond_wait(&pool->completion_ready, &pool->completion_lock);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->completion_lock);
+
+    return taken;
+}
+
+// Wait until every call queued so far has completed, including ones their callbacks queue
+void io_ctx_async_wait_idle(IOModule* io_module) {
+    IOAsyncPool* pool = __atomic_load_n(&io_module->async_pool, __ATOMIC_ACQUIRE);
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Get how many calls the context's workers have run and how many of them were stolen from another worker
+void io_ctx_get_async_stats(IOModule* io_module, IOAsyncStats* stats) {
+    memset(stats, 0, sizeof(IOAsyncStats));
+
+    IOAsyncPool* pool = __atomic_load_n(&io_module->async_pool, __ATOMIC_ACQUIRE);
+    if (pool == NULL)
+        return;
+
+    stats->workers = pool->num_workers;
+    stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+    stats->stolen = __atomic_load_n(&pool->stolen, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->completion_lock);
+    stats->completions = pool->completions_tail - pool->completions_head;
+    pthread_mutex_unlock(&pool->completion_lock);
+}
+
+////////////////////////////////////
+/* Trace replay                   */
+////////////////////////////////////
+// A trace is replayed one call at a time in timestamp order against whatever FileSystem and IOModule are set up, so that
+// the same traffic can be run against different configurations and builds. The traced fds are mapped to the fds the
+// replay gets back from io_open
+
+// A call of the trace in the order it's replayed
+typedef struct IOReplayEvent {
+    IOTraceRecord record;
+    uint64_t sequence;
+    double latency_ns;
+} IOReplayEvent;
+
+int io_replay_compare_events(const void* a, const void* b) {
+    const IOReplayEvent* x = (const IOReplayEvent*)a;
+    const IOReplayEvent* y = (const IOReplayEvent*)b;
+    if (x->record.timestamp != y->record.timestamp)
+        return x->record.timestamp < y->record.timestamp ? -1 : 1;
+
+    return x->sequence < y->sequence ? -1 : (x->sequence > y->sequence);
+}
+
+int io_replay_compare_latencies(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Add the files a trace names that the FileSystem doesn't have, at the size they had when the trace first saw them
+int io_replay_create_files(IOModule* io_module, char** names, uint64_t* sizes, uint32_t num_files, IOReplayStats* stats) {
+    char* block = (char*)malloc(FS_CHUNK_SIZE);
+    if (block == NULL) {
+        // malloc will set ENOMEM
+        return 0;
+    }
+    memset(block, 'r', FS_CHUNK_SIZE);
+
+    FileSystem* file_system = io_module_file_system(io_module);
+    for (uint32_t id = 1; id <= num_files; id++) {
+        if (names[id] == NULL || file_system_find_file(file_system, names[id]) != NULL)
+            continue;
+
+        if (!file_system_add_file(file_system, names[id], NULL, 0)) {
+            // errno is set by file_system_add_file
+            free(block);
+            return 0;
+        }
+
+        FSFile* file = file_system_find_file(file_system, names[id]);
+        for (uint64_t offset = 0; offset < sizes[id]; offset += FS_CHUNK_SIZE) {
+            size_t count = sizes[id] - offset < FS_CHUNK_SIZE ? sizes[id] - offset : FS_CHUNK_SIZE;
+            if (file_system_file_write(file, io_module->page_cache, offset, block, count) == -1) {
+                // errno is set by file_system_file_write
+                free(block);
+                return 0;
+            }
+        }
+        stats->files_created++;
+    }
+
+    free(block);
+
+    return 1;
+}
+
+// Run a single call of the trace and return its result, fds maps the traced fds to the replay's
+ssize_t io_replay_call(IOModule* io_module, IOTraceRecord* record, char** names, int* fds, size_t* cursors, char* buffer, IOReplayStats* stats) {
+    int fd = record->op == IO_TRACE_OP_OPEN ? -1 : fds[record->fd];
+    if (record->op != IO_TRACE_OP_OPEN && fd == -1) {
+        stats->skipped++;
+        return record->result;
+    }
+
+    // Reads and writes through the cursor only line up with the trace if the cursor is where it was traced
+    if ((record->op == IO_TRACE_OP_READ || record->op == IO_TRACE_OP_WRITE) && cursors[record->fd] != record->offset) {
+        io_ctx_lseek(io_module, fd, record->offset, IO_SEEK_SET);
+        cursors[record->fd] = record->offset;
+    }
+
+    ssize_t result = -1;
+    switch (record->op) {
+        case IO_TRACE_OP_OPEN:
+            result = io_ctx_open(io_module, names[record->file_id], record->count);
+            if (result != -1 && record->fd >= 0) {
+                fds[record->fd] = result;
+                cursors[record->fd] = 0;
+            }
+            break;
+        case IO_TRACE_OP_CLOSE:
+            result = io_ctx_close(io_module, fd);
+            fds[record->fd] = -1;
+            break;
+        case IO_TRACE_OP_READ:
+            result = io_ctx_read(io_module, fd, buffer, record->count);
+            break;
+        case IO_TRACE_OP_PREAD:
+            result = io_ctx_pread(io_module, fd, buffer, record->count, record->offset);
+            break;
+        case IO_TRACE_OP_WRITE:
+            result = io_ctx_write(io_module, fd, buffer, record->count);
+            break;
+        case IO_TRACE_OP_PWRITE:
+            result = io_ctx_pwrite(io_module, fd, buffer, record->count, record->offset);
+            break;
+    }
+
+    if ((record->op == IO_TRACE_OP_READ || record->op == IO_TRACE_OP_WRITE) && result > 0)
+        cursors[record->fd] += result;
+
+    return result;
+}
+
+// Replay the trace at path in the context, adding the files it names that the context's FileSystem doesn't have.
+// With timed set each call waits for the time it was made at in the trace, otherwise the calls run back to back.
+// Returns 1 on success or 0 with errno set, EINVAL if the file isn't a trace
+int io_ctx_trace_replay(IOModule* io_module, const char* path, int timed, IOReplayStats* stats) {
+    memset(stats, 0, sizeof(IOReplayStats));
+
+    FILE* trace_file = fopen(path, "rb");
+    if (trace_file == NULL) {
+        // errno is set by fopen
+        return 0;
+    }
+
+    IOTraceHeader header;
+    if (fread(&header, sizeof(header), 1, trace_file) != 1 || memcmp(header.magic, IO_TRACE_MAGIC, 8) != 0
+        || header.version != IO_TRACE_VERSION || header.record_size != sizeof(IOTraceRecord)) {
+        fclose(trace_file);
+        errno = EINVAL;
+        return 0;
+    }
+
+    // Read the whole trace in, the names are indexed by file id
+    IOReplayEvent* events = NULL;
+    size_t num_events = 0;
+    size_t events_capacity = 0;
+    char** names = NULL;
+    uint64_t* sizes = NULL;
+    uint32_t num_files = 0;
+    int max_fd = -1;
+    size_t max_count = 0;
+    // The errno to fail with, set once something has gone wrong
+    int error = 0;
+
+    IOTraceRecord record;
+    while (fread(&record, sizeof(record), 1, trace_file) == 1) {
+        if (record.op == IO_TRACE_RECORD_FILE) {
+            if (record.file_id > num_files) {
+                char** new_names = (char**)realloc(names, sizeof(char*) * (record.file_id + 1));
+                if (new_names != NULL)
+                    names = new_names;
+                uint64_t* new_sizes = (uint64_t*)realloc(sizes, sizeof(uint64_t) * (record.file_id + 1));
+                if (new_sizes != NULL)
+                    sizes = new_sizes;
+                if (new_names == NULL || new_sizes == NULL) {
+                    error = ENOMEM;
+                    break;
+                }
+
+                for (uint32_t id = num_files + 1; id <= record.file_id; id++)
+                    names[id] = NULL;
+                num_files = record.file_id;
+            }
+
+            if (record.file_id == 0 || names[record.file_id] != NULL) {
+                error = EINVAL;
+                break;
+            }
+
+            names[record.file_id] = (char*)malloc(record.count + 1);
+            if (names[record.file_id] == NULL) {
+                error = ENOMEM;
+                break;
+            }
+            if (fread(names[record.file_id], 1, record.count, trace_file) != record.count) {
+                error = EINVAL;
+                break;
+            }
+            names[record.file_id][record.count] = '\0';
+            sizes[record.file_id] = record.offset;
+            continue;
+        }
+
+        // Every call names an fd and opens name a file the trace has already named
+        if (record.op >= IO_TRACE_OPS || record.fd < 0 || record.file_id > num_files
+            || (record.op == IO_TRACE_OP_OPEN && (record.file_id == 0 || names[record.file_id] == NULL))) {
+            error = EINVAL;
+            break;
+        }
+
+        if (num_events == events_capacity) {
+            events_capacity = events_capacity == 0 ? 1024 : 2 * events_capacity;
+            IOReplayEvent* new_events = (IOReplayEvent*)realloc(events, sizeof(IOReplayEvent) * events_capacity);
+            if (new_events == NULL) {
+                error = ENOMEM;
+                break;
+            }
+            events = new_events;
+        }
+
+        events[num_events].record = record;
+        events[num_events].sequence = num_events;
+        events[num_events].latency_ns = 0;
+        num_events++;
+
+        if (record.fd > max_fd)
+            max_fd = record.fd;
+        if (record.count > max_count)
+            max_count = record.count;
+    }
+    fclose(trace_file);
+
+    int* fds = error ? NULL : (int*)malloc(sizeof(int) * (max_fd + 1));
+    size_t* cursors = error ? NULL : (size_t*)calloc(max_fd + 1, sizeof(size_t));
+    char* buffer = error ? NULL : (char*)malloc(max_count + 1);
+    double* latencies = error ? NULL : (double*)malloc(sizeof(double) * (num_events + 1));
+    if (!error && (fds == NULL || cursors == NULL || buffer == NULL || latencies == NULL))
+        error = ENOMEM;
+
+    // errno is set by io_replay_create_files
+    if (!error && !io_replay_create_files(io_module, names, sizes, num_files, stats))
+        error = errno;
+
+    if (!error) {
+        for (int fd = 0; fd <= max_fd; fd++)
+            fds[fd] = -1;
+        memset(buffer, 'r', max_count + 1);
+        qsort(events, num_events, sizeof(IOReplayEvent), io_replay_compare_events);
+
+        uint64_t replay_start = io_stats_now_ns();
+        for (size_t i = 0; i < num_events; i++) {
+            IOTraceRecord* event = &events[i].record;
+
+            // Sleep through most of the wait for the call's time and spin the rest of the way
+            if (timed) {
+                uint64_t target = replay_start + event->timestamp;
+                uint64_t now = io_stats_now_ns();
+                if (target > now + 100000) {
+                    struct timespec pause = { 0, (long)(target - now - 50000) };
+                    while (pause.tv_nsec >= 1000000000) {
+                        pause.tv_sec++;
+                        pause.tv_nsec -= 1000000000;
+                    }
+                    nanosleep(&pause, NULL);
+                }
+                while (io_stats_now_ns() < target)
+                    ;
+            }
+
+            uint64_t start = io_stats_now_ns();
+            ssize_t result = io_replay_call(io_module, event, names, fds, cursors, buffer, stats);
+            events[i].latency_ns = (double)(io_stats_now_ns() - start);
+
+            // Opens are only compared on whether they worked since the fds handed out can differ
+            IOReplayOpStats* op_stats = &stats->ops[event->op];
+            op_stats->calls++;
+            op_stats->errors += result < 0;
+            if (event->op == IO_TRACE_OP_OPEN ? (result < 0) != (event->result < 0) : result != event->result)
+                stats->mismatches++;
+        }
+        stats->seconds = (double)(io_stats_now_ns() - replay_start) / 1e9;
+        stats->events = num_events;
+
+        // Close what the trace left open so that the IOModule is left the way it was found
+        for (int fd = 0; fd <= max_fd; fd++) {
+            if (fds[fd] != -1)
+                io_ctx_close(io_module, fds[fd]);
+        }
+
+        for (int op = 1; op < IO_TRACE_OPS; op++) {
+            size_t count = 0;
+            double total = 0;
+            for (size_t i = 0; i < num_events; i++) {
+                if (events[i].record.op != op)
+                    continue;
+                latencies[count++] = events[i].latency_ns;
+                total += events[i].latency_ns;
+            }
+            if (count == 0)
+                continue;
+
+            qsort(latencies, count, sizeof(double), io_replay_compare_latencies);
+            IOReplayOpStats* op_stats = &stats->ops[op];
+            op_stats->mean_ns = total / count;
+            op_stats->p50_ns = latencies[(size_t)(0.50 * (count - 1))];
+            op_stats->p90_ns = latencies[(size_t)(0.90 * (count - 1))];
+            op_stats->p99_ns = latencies[(size_t)(0.99 * (count - 1))];
+            op_stats->max_ns = latencies[count - 1];
+        }
+    }
+
+    for (uint32_t id = 1; id <= num_files; id++)
+        free(names[id]);
+    free(names);
+    free(sizes);
+    free(events);
+    free(fds);
+    free(cursors);
+    free(buffer);
+    free(latencies);
+
+    if (error) {
+        errno = error;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Write the latencies of a replay out as CSV, one line per kind of call
+void io_replay_write_stats(const IOReplayStats* stats, FILE* out) {
+    const char* names[IO_TRACE_OPS] = { "", "open", "close", "read", "pread", "write", "pwrite" };
+    fprintf(out, "op,calls,errors,ns_mean,ns_p50,ns_p90,ns_p99,ns_max\n");
+    for (int op = 1; op < IO_TRACE_OPS; op++) {
+        const IOReplayOpStats* op_stats = &stats->ops[op];
+        if (op_stats->calls == 0)
+            continue;
+
+        fprintf(out, "%s,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f\n", names[op], (unsigned long long)op_stats->calls,
+                (unsigned long long)op_stats->errors, op_stats->mean_ns, op_stats->p50_ns, op_stats->p90_ns,
+                op_stats->p99_ns, op_stats->max_ns);
+    }
+}
+
+/////////////////////////
+/* Default Context API */
+/////////////////////////
+// The calls without a context run in the default context that io_module_init makes
+
+int io_open(const char* filename, unsigned int mode_type) {
+    return io_ctx_open(io_default_module, filename, mode_type);
+}
+
+int io_close(int fd) {
+    return io_ctx_close(io_default_module, fd);
+}
+
+ssize_t io_read(int fd, char* buf, size_t count) {
+    return io_ctx_read(io_default_module, fd, buf, count);
+}
+
+ssize_t io_pread(int fd, char* buf, size_t count, off_t offset) {
+    return io_ctx_pread(io_default_module, fd, buf, count, offset);
+}
+
+ssize_t io_pwrite(int fd, const char* buf, size_t count, off_t offset) {
+    return io_ctx_pwrite(io_default_module, fd, buf, count, offset);
+}
+
+ssize_t io_read_view(int fd, size_t count, IOView* view) {
+    return io_ctx_read_view(io_default_module, fd, count, view);
+}
+
+ssize_t io_getdelim(int fd, char** lineptr, size_t* n, int delim) {
+    return io_ctx_getdelim(io_default_module, fd, lineptr, n, delim);
+}
+
+ssize_t io_getline(int fd, char** lineptr, size_t* n) {
+    return io_ctx_getline(io_default_module, fd, lineptr, n);
+}
+
+ssize_t io_getdelim_view(int fd, int delim, IOView* view) {
+    return io_ctx_getdelim_view(io_default_module, fd, delim, view);
+}
+
+ssize_t io_write(int fd, const char* buf, size_t count) {
+    return io_ctx_write(io_default_module, fd, buf, count);
+}
+
+off_t io_lseek(int fd, off_t offset, int whence) {
+    return io_ctx_lseek(io_default_module, fd, offset, whence);
+}
+
+ssize_t io_readv(int fd, const IOVec* iov, int iovcnt) {
+    return io_ctx_readv(io_default_module, fd, iov, iovcnt);
+}
+
+ssize_t io_writev(int fd, const IOVec* iov, int iovcnt) {
+    return io_ctx_writev(io_default_module, fd, iov, iovcnt);
+}
+
+int io_clone(const char* src_filename, const char* dst_filename) {
+    return io_ctx_clone(io_default_module, src_filename, dst_filename);
+}
+
+// The ring follows the default context, so it can outlive an io_module_destory and io_module_init
+IORing* io_ring_init(unsigned int entries) {
+    return io_ctx_ring_init(NULL, entries);
+}
+
+int io_trace_start(const char* path) {
+    return io_ctx_trace_start(io_default_module, path);
+}
+
+int io_trace_stop(IOTraceStats* stats) {
+    return io_ctx_trace_stop(io_default_module, stats);
+}
+
+int io_trace_replay(const char* path, int timed, IOReplayStats* stats) {
+    return io_ctx_trace_replay(io_default_module, path, timed, stats);
+}
+
+void io_stats_snapshot(IOStatsSnapshot* snapshot) {
+    io_ctx_stats_snapshot(io_default_module, snapshot);
+}
+
+void io_module_get_fd_cache_stats(IOFdCacheStats* thread_stats, IOFdCacheStats* total_stats) {
+    io_ctx_get_fd_cache_stats(io_default_module, thread_stats, total_stats);
+}
+
+void io_module_get_page_cache_stats(IOPageCacheStats* stats) {
+    io_ctx_get_page_cache_stats(io_default_module, stats);
+}
+
+void io_module_get_readahead_stats(IOReadaheadStats* stats) {
+    io_ctx_get_readahead_stats(io_default_module, stats);
+}
+
+void io_readahead_wait_idle() {
+    io_ctx_readahead_wait_idle(io_default_module);
+}
+
+int io_read_async(int fd, char* buf, size_t count, IOAsyncCallback callback, void* userdata) {
+    return io_ctx_read_async(io_default_module, fd, buf, count, callback, userdata);
+}
+
+int io_pread_async(int fd, char* buf, size_t count, off_t offset, IOAsyncCallback callback, void* userdata) {
+    return io_ctx_pread_async(io_default_module, fd, buf, count, offset, callback, userdata);
+}
+
+int io_write_async(int fd, const char* buf, size_t count, IOAsyncCallback callback, void* userdata) {
+    return io_ctx_write_async(io_default_module, fd, buf, count, callback, userdata);
+}
+
+int io_pwrite_async(int fd, const char* buf, size_t count, off_t offset, IOAsyncCallback callback, void* userdata) {
+    return io_ctx_pwrite_async(io_default_module, fd, buf, count, offset, callback, userdata);
+}
+
+int io_async_poll(IOAsyncCompletion* completions, int max, int min) {
+    return io_ctx_async_poll(io_default_module, completions, max, min);
+}
+
+void io_async_wait_idle() {
+    io_ctx_async_wait_idle(io_default_module);
+}
+
+void io_module_get_async_stats(IOAsyncStats* stats) {
+    io_ctx_get_async_stats(io_default_module, stats);
+}
+
+////////////////////////////////////
+/* Some IO Tests                  */
+////////////////////////////////////
+/*
+    Description: 4 file descriptors are requested from the system, 2 are freed and another 2 are requested
+    Expected Result: The file descriptors of the 2 files which were closed should be reused for the new files
+*/
+int test_reuse() {
+    printf("\n==========\ntest_reuse\n==========\n");
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd1 = io_open("file1.txt", IOFILE_MODE_READ);
+    int fd2 = io_open("file1.txt", IOFILE_MODE_READ);
+    int fd3 = io_open("file1.txt", IOFILE_MODE_READ);
+    int fd4 = io_open("file1.txt", IOFILE_MODE_READ);
+
+    int r = io_close(fd2);
+    r = io_close(fd3);
+
+    int fd5 = io_open("file2.txt", IOFILE_MODE_READ);
+    printf("The fd of the first new file is: %d\n", fd5);
+
+    int fd6 = io_open("file2.txt", IOFILE_MODE_READ);
+    printf("The fd of the second new file is: %d\n", fd6);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+}
+
+/*
+    Description: Program attempts to close fd that never existed
+    Expected Result: Call to io_close should return -1 and when calling perror(), 
+                     should mention bad file descriptor error 
+*/
+int test_ebadf() {
+    printf("\n==========\ntest_ebadf\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int r = io_close(0);
+    printf("The return code is: %d\n", r);
+    perror("The error is");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+}
+
+/*
+    Description: Program calls io_open to get a handle on file2.txt and reads 5 bytes from the file and then another 7
+    Expected Result: The first read should read the word hello and then second read, the word good bye
+*/
+int test_read() {
+    printf("\n=========\ntest_read\n=========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    if (fd == -1) {
+        printf("Failed to open file\n");
+        return 1;
+    }
+
+    char hello_buffer[6];
+    hello_buffer[5] = '\0';
+    
+    io_read(fd, hello_buffer, 5);
+    printf("Greeting 1: %s\n", hello_buffer);
+
+    char goodbye_buffer[8];
+    goodbye_buffer[7] = '\0';
+
+    io_read(fd, goodbye_buffer, 7);
+    printf("Greeting 2: %s\n", goodbye_buffer);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+}
+
+/*
+    Description: 6 file descriptors are requested from the system, fds 4, 1 and 3 are closed in that order and 3 more are requested
+    Expected Result: The closed fds should be handed out lowest first, so the new files get fds 1, 3 and 4
+*/
+int test_lowest_fd() {
+    printf("\n==============\ntest_lowest_fd\n==============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    for (int i = 0; i < 6; i++)
+        io_open("file1.txt", IOFILE_MODE_READ);
+
+    io_close(4);
+    io_close(1);
+    io_close(3);
+
+    int expected_fds[] = { 1, 3, 4 };
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        int fd = io_open("file2.txt", IOFILE_MODE_READ);
+        printf("The fd of new file %d is: %d\n", i + 1, fd);
+        failed |= fd != expected_fds[i];
+    }
+    if (failed)
+        fprintf(stderr, "ERROR: The closed fds weren't handed out lowest first\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: 200 files are added to a fresh file system, the occupancy of its FSFile pool and its memory use are
+                 queried and the files whose names start with extra1 are scanned
+    Expected Result: The FSFile pool should hold all 202 files, all of the names and data should fit in one block of
+                     each arena, and the scan should visit extra1.txt and extra10.txt to extra199.txt, 111 files
+*/
+int test_pool_stats_count(FSFile* file, void* arg) {
+    (*(int*)arg)++;
+    return 1;
+}
+
+int test_pool_stats() {
+    printf("\n===============\ntest_pool_stats\n===============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char filename[32];
+    for (int i = 0; i < 200; i++) {
+        sprintf(filename, "extra%d.txt", i);
+        file_system_add_file(fs_module, filename, "data", 4);
+    }
+
+    SlabStats file_stats;
+    file_system_get_pool_stats(fs_module, &file_stats);
+    printf("FSFile pool: %d in use, %d capacity, %d slabs, %.2f fragmentation\n",
+        file_stats.objects_in_use, file_stats.objects_capacity, file_stats.slabs, file_stats.fragmentation);
+
+    FSMemoryStats memory_stats;
+    file_system_get_memory_stats(fs_module, &memory_stats);
+    printf("Name arena: %zu bytes, data arena: %zu bytes, %zu bytes of file data\n",
+        memory_stats.name_bytes, memory_stats.chunk_bytes, memory_stats.data_bytes);
+
+    int files_seen = 0;
+    size_t visited = file_system_scan(fs_module, "extra1", test_pool_stats_count, &files_seen);
+    printf("Scanned %zu files starting with extra1, %d seen\n", visited, files_seen);
+
+    int failed = file_stats.objects_in_use != 202 || visited != 111 || files_seen != 111;
+    if (failed)
+        fprintf(stderr, "ERROR: The FSFile pool or the scan missed some of the files\n");
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: file1.txt is opened for reading and writing, "Best" is written over its start and 200000 bytes are appended
+                 in 100 byte writes, then the file is read back through a second fd
+    Expected Result: The second fd should read "Best Data1", the file should be 200010 bytes long and the appended bytes intact
+*/
+int test_write() {
+    printf("\n==========\ntest_write\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int write_fd = io_open("file1.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_write(write_fd, "Best", 4);
+
+    // Skip to the end of the file before appending
+    char skip_buffer[6];
+    io_read(write_fd, skip_buffer, 6);
+
+    char append_buffer[100];
+    for (int i = 0; i < 100; i++)
+        append_buffer[i] = 'a' + i % 26;
+    for (int i = 0; i < 2000; i++)
+        io_write(write_fd, append_buffer, 100);
+
+    int read_fd = io_open("file1.txt", IOFILE_MODE_READ);
+    char start_buffer[11];
+    start_buffer[10] = '\0';
+    io_read(read_fd, start_buffer, 10);
+    printf("The start of the file is: %s\n", start_buffer);
+
+    // Check every appended byte, including the ones straddling chunk boundaries
+    int intact = 1;
+    size_t total_read = 10;
+    ssize_t bytes_read;
+    while ((bytes_read = io_read(read_fd, append_buffer, 100)) > 0) {
+        for (int i = 0; i < bytes_read; i++) {
+            if (append_buffer[i] != 'a' + i % 26)
+                intact = 0;
+        }
+        total_read += bytes_read;
+    }
+    printf("The file is %zu bytes long and the appended bytes are %s\n", total_read, intact ? "intact" : "corrupt");
+
+    // Writing to an fd opened only for reading should fail
+    ssize_t r = io_write(read_fd, "x", 1);
+    int write_errno = errno;
+    printf("Writing to a read only fd returns: %zd\n", r);
+    perror("The error is");
+
+    int failed = strcmp(start_buffer, "Best Data1") != 0 || total_read != 200010 || !intact || r != -1 || write_errno != EBADF;
+    if (failed)
+        fprintf(stderr, "ERROR: The written file does not read back as expected\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: A view of the first 5 bytes of file2.txt is taken, then the same bytes are overwritten through another fd
+                 and the file is destroyed while the view is still held
+    Expected Result: The view should keep showing hello after the overwrite and the file's destruction, while a fresh read shows HELLO
+*/
+int test_read_view() {
+    printf("\n==============\ntest_read_view\n==============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    IOView view;
+    ssize_t length = io_read_view(fd, 5, &view);
+    printf("The view is: %.*s\n", (int)length, view.data);
+    int failed = length != 5 || memcmp(view.data, "hello", 5) != 0;
+
+    // Overwriting the viewed bytes writes to a copy of the chunk
+    int write_fd = io_open("file2.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_write(write_fd, "HELLO", 5);
+
+    int read_fd = io_open("file2.txt", IOFILE_MODE_READ);
+    char buffer[6];
+    buffer[5] = '\0';
+    io_read(read_fd, buffer, 5);
+    printf("After the overwrite the view is: %.*s and a fresh read is: %s\n", (int)length, view.data, buffer);
+    failed |= memcmp(view.data, "hello", 5) != 0 || strcmp(buffer, "HELLO") != 0;
+
+    // Destroying the file system leaves the viewed chunk alive until the view is released
+    io_module_destory();
+    fs_environment_destroy();
+    printf("After destroying the file the view is: %.*s\n", (int)length, view.data);
+    failed |= memcmp(view.data, "hello", 5) != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The view did not keep the bytes it was taken over\n");
+
+    io_release_view(&view);
+
+    return failed;
+}
+
+/*
+    Description: file2.txt is read into a 5 byte and a 7 byte buffer with a single io_readv, then a new file is written
+                 with a single io_writev of 3 buffers
+    Expected Result: The buffers should hold hello and goodbye, and the new file should read back as header|payload|trailer
+*/
+int test_readv_writev() {
+    printf("\n=================\ntest_readv_writev\n=================\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    char hello_buffer[6];
+    char goodbye_buffer[8];
+    hello_buffer[5] = '\0';
+    goodbye_buffer[7] = '\0';
+
+    IOVec read_iov[2] = { { hello_buffer, 5 }, { goodbye_buffer, 7 } };
+    ssize_t bytes_read = io_readv(fd, read_iov, 2);
+    printf("Read %zd bytes: %s %s\n", bytes_read, hello_buffer, goodbye_buffer);
+
+    file_system_add_file(fs_module, "record.bin", "", 0);
+    int write_fd = io_open("record.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    IOVec write_iov[3] = { { "header|", 7 }, { "payload|", 8 }, { "trailer", 7 } };
+    ssize_t bytes_written = io_writev(write_fd, write_iov, 3);
+
+    int read_fd = io_open("record.bin", IOFILE_MODE_READ);
+    char record_buffer[23];
+    record_buffer[22] = '\0';
+    io_read(read_fd, record_buffer, 22);
+    printf("Wrote %zd bytes: %s\n", bytes_written, record_buffer);
+
+    int failed = bytes_read != 12 || strcmp(hello_buffer, "hello") != 0 || strcmp(goodbye_buffer, "goodbye") != 0 ||
+        bytes_written != 22 || strcmp(record_buffer, "header|payload|trailer") != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The vectored read or write moved the wrong bytes\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: Read a small file of lines with io_getline, then a 200000 byte file of 100 byte records ending in ';'
+                 with io_getdelim and io_getdelim_view, where a record runs across the first chunk boundary. Then compare
+                 every scanner against memchr over every offset and length of a buffer, and pass bad arguments. Last,
+                 read the lines of a stored file from a context without a page cache
+    Expected Result: The lines come back with their newlines and the last one without, then 0 at the end. Every record
+                     matches, the views come back in an extra part for each of the 3 chunk boundaries, the scanners
+                     agree with memchr, and the bad calls fail with EINVAL and EBADF. The stored file's lines come back
+                     whole, including the one across a page boundary
+*/
+int test_getdelim() {
+    printf("\n=============\ntest_getdelim\n=============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    file_system_add_file(fs_module, "lines.txt", "alpha\nbeta\n\ngamma", 17);
+
+    // Records are 99 bytes followed by a ';', record 655 runs from 65500 to 65599 across the end of the first chunk
+    const int num_records = 2000;
+    char* records = (char*)malloc(num_records * 100);
+    for (int i = 0; i < num_records * 100; i++)
+        records[i] = i % 100 == 99 ? ';' : 'a' + i % 26;
+    file_system_add_file(fs_module, "records.bin", records, num_records * 100);
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("lines.txt", IOFILE_MODE_READ);
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    ssize_t expected_lengths[] = { 6, 5, 1, 5 };
+    int lines = 0;
+    int failed = 0;
+    while ((length = io_getline(fd, &line, &line_size)) > 0) {
+        printf("Line of %zd bytes: \"%.*s\"\n", length, (int)(length - (line[length - 1] == '\n')), line);
+        failed |= lines >= 4 || length != expected_lengths[lines];
+        lines++;
+    }
+    printf("At the end: %zd\n", length);
+    failed |= lines != 4 || length != 0;
+
+    fd = io_open("records.bin", IOFILE_MODE_READ);
+    int matched = 0;
+    while ((length = io_getdelim(fd, &line, &line_size, ';')) > 0)
+        matched += length == 100 && memcmp(line, records + matched * 100, 100) == 0;
+    printf("Records matched: %d of %d\n", matched, num_records);
+    failed |= matched != num_records;
+
+    fd = io_open("records.bin", IOFILE_MODE_READ);
+    int parts = 0;
+    int complete = 0;
+    IOView view;
+    while ((length = io_getdelim_view(fd, ';', &view)) > 0) {
+        parts++;
+        complete += view.data[length - 1] == ';';
+        io_release_view(&view);
+    }
+    printf("View parts: %d, complete records: %d\n", parts, complete);
+    failed |= parts != num_records + 3 || complete != num_records;
+
+    // Every scanner the CPU has is checked against memchr, matches are planted every 37 bytes
+    const char* (*scanners[3])(const char*, size_t, char) = { io_scan_delim_scalar, NULL, NULL };
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+        scanners[1] = io_scan_delim_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        scanners[2] = io_scan_delim_avx2;
+#endif
+    char data[300];
+    for (int i = 0; i < 300; i++)
+        data[i] = i % 37 == 36 ? '\n' : (char)(i * 7);
+    int agree = 1;
+    for (int s = 0; s < 3; s++) {
+        for (int start = 0; start < 64 && scanners[s] != NULL; start++) {
+            for (size_t count = 0; count + start <= 300; count++)
+                agree &= scanners[s](data + start, count, '\n') == memchr(data + start, '\n', count);
+        }
+    }
+    printf("Scanners agree with memchr: %d\n", agree);
+    failed |= !agree;
+
+    length = io_getline(fd, NULL, &line_size);
+    failed |= length != -1 || errno != EINVAL;
+    printf("NULL lineptr: %zd (%s)\n", length, strerror(errno));
+    length = io_getline(99, &line, &line_size);
+    failed |= length != -1 || errno != EBADF;
+    printf("Bad fd: %zd (%s)\n", length, strerror(errno));
+
+    // A stored file read from a context without a page cache, its last line runs across a page boundary
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_disk(root);
+    file_system_add_stored_file(fs_module, "stored.txt", store);
+    char* long_line = (char*)malloc(IO_PAGE_SIZE);
+    memset(long_line, 'c', IO_PAGE_SIZE - 1);
+    long_line[IO_PAGE_SIZE - 1] = '\n';
+
+    IOModuleConfig config;
+    io_module_default_config(&config);
+    config.page_cache_size = 0;
+    IOModule* uncached = io_ctx_init(NULL, &config);
+    fd = io_ctx_open(uncached, "stored.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_ctx_write(uncached, fd, "a\nbb\n", 5);
+    io_ctx_write(uncached, fd, long_line, IO_PAGE_SIZE);
+    io_ctx_lseek(uncached, fd, 0, SEEK_SET);
+    printf("Stored lines without a page cache:");
+    ssize_t expected_stored_lengths[] = { 2, 3, IO_PAGE_SIZE };
+    int stored_lines = 0;
+    int long_matches = 0;
+    while ((length = io_ctx_getline(uncached, fd, &line, &line_size)) > 0) {
+        printf(" %zd", length);
+        failed |= stored_lines >= 3 || length != expected_stored_lengths[stored_lines];
+        stored_lines++;
+        long_matches += length == IO_PAGE_SIZE && memcmp(line, long_line, IO_PAGE_SIZE) == 0;
+    }
+    printf(", at the end: %zd, long line matches: %d\n", length, long_matches);
+    failed |= stored_lines != 3 || length != 0 || long_matches != 1;
+    if (failed)
+        fprintf(stderr, "ERROR: A line or record did not come back whole\n");
+    io_ctx_close(uncached, fd);
+    io_ctx_destroy(&uncached);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(long_line);
+    free(records);
+    free(line);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stored.txt", root);
+    unlink(path);
+    rmdir(root);
+
+    return failed;
+}
+
+/*
+    Description: io_pwrite writes GOOD over the start of goodbye in file2.txt, io_pread reads it back from offset 5 and then
+                 4 threads io_pread a patterned 1MB file at scattered offsets through one shared fd
+    Expected Result: io_pread should return GOODbye, the fd's cursor should still read hello and every threaded read should match
+*/
+typedef struct PreadThreadArgs {
+    int fd;
+    int seed;
+    int mismatches;
+} PreadThreadArgs;
+
+void* test_pread_thread(void* arg) {
+    PreadThreadArgs* args = (PreadThreadArgs*)arg;
+    char buffer[100];
+    unsigned int offset = args->seed;
+    for (int i = 0; i < 20000; i++) {
+        offset = (offset * 1103515245u + 12345u) % ((1 << 20) - 100);
+        io_pread(args->fd, buffer, 100, offset);
+        for (int j = 0; j < 100; j++) {
+            if (buffer[j] != (char)((offset + j) % 251))
+                args->mismatches++;
+        }
+    }
+
+    return NULL;
+}
+
+int test_pread_pwrite() {
+    printf("\n=================\ntest_pread_pwrite\n=================\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_pwrite(fd, "GOOD", 4, 5);
+
+    char goodbye_buffer[8];
+    goodbye_buffer[7] = '\0';
+    io_pread(fd, goodbye_buffer, 7, 5);
+
+    char hello_buffer[6];
+    hello_buffer[5] = '\0';
+    io_read(fd, hello_buffer, 5);
+    printf("io_pread read: %s and the cursor read: %s\n", goodbye_buffer, hello_buffer);
+
+    // Many threads reading through the same fd at their own offsets
+    char* pattern = (char*)malloc(1 << 20);
+    for (int i = 0; i < (1 << 20); i++)
+        pattern[i] = (char)(i % 251);
+    file_system_add_file(fs_module, "pattern.bin", pattern, 1 << 20);
+    free(pattern);
+
+    int shared_fd = io_open("pattern.bin", IOFILE_MODE_READ);
+    pthread_t threads[4];
+    PreadThreadArgs args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i].fd = shared_fd;
+        args[i].seed = i + 1;
+        args[i].mismatches = 0;
+        pthread_create(&threads[i], NULL, test_pread_thread, &args[i]);
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        mismatches += args[i].mismatches;
+    }
+    printf("The threaded reads had %d mismatched bytes\n", mismatches);
+
+    int failed = strcmp(goodbye_buffer, "GOODbye") != 0 || strcmp(hello_buffer, "hello") != 0 || mismatches != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: A positional read or write used the wrong offset\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: One submit opens file2.txt, reads it 3 bytes at a time through the cursor in 4 back to back reads, writes
+                 to the read only fd, closes it, then reads the closed fd at offset 0
+    Expected Result: The open returns fd 0, the reads return 3, 3, 3 and 3 bytes as one merged pass spelling hellogoodbye,
+                     the write fails with EBADF, the close returns 0 and the final read fails with EBADF
+*/
+int test_ring() {
+    printf("\n=========\ntest_ring\n=========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    IORing* ring = io_ring_init(8);
+    char buffer[13] = { 0 };
+
+    IOSubmission* submission = io_ring_get_submission(ring);
+    io_ring_prep_open(submission, "file2.txt", IOFILE_MODE_READ);
+    for (int i = 0; i < 4; i++) {
+        submission = io_ring_get_submission(ring);
+        io_ring_prep_read(submission, -1, buffer + i * 3, 3, IO_OFFSET_CURSOR);
+        submission->flags = IO_SUBMIT_PREV_FD;
+    }
+
+    submission = io_ring_get_submission(ring);
+    io_ring_prep_write(submission, -1, "hi", 2, 0);
+    submission->flags = IO_SUBMIT_PREV_FD;
+
+    submission = io_ring_get_submission(ring);
+    io_ring_prep_close(submission, -1);
+    submission->flags = IO_SUBMIT_PREV_FD;
+
+    submission = io_ring_get_submission(ring);
+    io_ring_prep_read(submission, 0, buffer, 3, 0);
+
+    int submitted = io_ring_submit(ring);
+    printf("Submitted %d operations, %llu reads were merged\n", submitted, (unsigned long long)ring->coalesced_reads);
+
+    IOCompletion completions[8];
+    int reaped = io_ring_reap(ring, completions, 8);
+    for (int i = 0; i < reaped; i++) {
+        printf("Completion %d: %zd", i, completions[i].result);
+        if (completions[i].result == -1)
+            printf(" (%s)", strerror(completions[i].error));
+        printf("\n");
+    }
+    printf("Read: %s\n", buffer);
+
+    ssize_t expected_results[8] = { 0, 3, 3, 3, 3, -1, 0, -1 };
+    int failed = submitted != 8 || ring->coalesced_reads != 3 || reaped != 8 || strcmp(buffer, "hellogoodbye") != 0;
+    for (int i = 0; i < reaped && i < 8; i++) {
+        if (completions[i].result != expected_results[i])
+            failed = 1;
+    }
+    if (failed)
+        fprintf(stderr, "ERROR: The ring did not complete the chain as expected\n");
+
+    io_ring_destroy(&ring);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+typedef struct TestAsyncState {
+    char* buffer;
+    int completed;
+    int failures;
+    int chained;
+    int fd;
+} TestAsyncState;
+
+void test_async_count(ssize_t result, int error, void* userdata) {
+    TestAsyncState* state = (TestAsyncState*)userdata;
+    if (result != 1 || error != 0)
+        __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->completed, 1, __ATOMIC_RELAXED);
+}
+
+// Each read queues the read of the next byte from the worker it completes on
+void test_async_chain(ssize_t result, int error, void* userdata) {
+    TestAsyncState* state = (TestAsyncState*)userdata;
+    if (result != 1)
+        __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+
+    int chained = __atomic_add_fetch(&state->chained, 1, __ATOMIC_RELAXED);
+    if (chained < 12 && io_pread_async(state->fd, state->buffer + chained, 1, chained, test_async_chain, state) != 0)
+        __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Description: Read file2.txt a byte at a time with 12 async preads that have a callback, then with 3 that are polled
+                 for, then 500 times with a chain of reads that each queue the next from their callback, and make an
+                 async write to the read only fd. Finally write 8 pages of a stored file whose store takes 200us per
+                 call and read them back with async preads
+    Expected Result: Every read returns its byte so the buffers spell hellogoodbye, the poll returns the 3 reads and the
+                     write fails with EBADF, every chain finishes before io_async_wait_idle returns, the stored file reads
+                     back what was written, and every call that was submitted has completed
+*/
+int test_async() {
+    printf("\n==========\ntest_async\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    char buffer[13] = { 0 };
+    TestAsyncState state = { buffer, 0, 0, 0, fd };
+    for (int i = 0; i < 12; i++)
+        io_pread_async(fd, buffer + i, 1, i, test_async_count, &state);
+    io_async_wait_idle();
+    printf("Callbacks: %d, failures: %d, read: %s\n", state.completed, state.failures, buffer);
+    int failed = state.completed != 12 || state.failures != 0 || strcmp(buffer, "hellogoodbye") != 0;
+
+    // Calls without a callback are polled for, the userdata tells them apart
+    char polled[4] = { 0 };
+    for (int i = 0; i < 3; i++)
+        io_pread_async(fd, polled + i, 1, 5 + i, NULL, (void*)(intptr_t)i);
+    io_write_async(fd, "hi", 2, NULL, (void*)(intptr_t)3);
+
+    IOAsyncCompletion completions[8];
+    int taken = 0;
+    while (taken < 4)
+        taken += io_async_poll(completions + taken, 8 - taken, 4 - taken);
+    ssize_t results[4];
+    int errors[4];
+    for (int i = 0; i < taken; i++) {
+        results[(intptr_t)completions[i].userdata] = completions[i].result;
+        errors[(intptr_t)completions[i].userdata] = completions[i].error;
+    }
+    printf("Polled reads: %zd %zd %zd, read: %s\n", results[0], results[1], results[2], polled);
+    int left = io_async_poll(completions, 8, 0);
+    printf("Polled write: %zd (%s), left to poll: %d\n", results[3], strerror(errors[3]), left);
+    failed |= taken != 4 || results[0] != 1 || results[1] != 1 || results[2] != 1 || strcmp(polled, "goo") != 0 ||
+        results[3] != -1 || errors[3] != EBADF || left != 0;
+
+    // Every link of a chain is queued before the call before it completes, so the wait never returns partway
+    int cut_short = 0;
+    for (int round = 0; round < 500; round++) {
+        memset(buffer, 0, sizeof(buffer));
+        state.chained = 0;
+        io_pread_async(fd, buffer, 1, 0, test_async_chain, &state);
+        io_async_wait_idle();
+        cut_short += __atomic_load_n(&state.chained, __ATOMIC_RELAXED) != 12;
+    }
+    printf("Chained reads: %d, chains cut short: %d, failures: %d, read: %s\n", state.chained, cut_short, state.failures, buffer);
+    failed |= cut_short != 0 || state.failures != 0 || strcmp(buffer, "hellogoodbye") != 0;
+
+    int bad_offset = io_pread_async(fd, buffer, 1, -1, NULL, NULL);
+    failed |= bad_offset != -1 || errno != EINVAL;
+    printf("Negative offset: %d (%s)\n", bad_offset, strerror(errno));
+    io_close(fd);
+
+    // A store slow enough that the workers overlap their waits
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_slow(fs_store_init_disk(root), 200000, 200000);
+    file_system_add_stored_file(fs_module, "slow.bin", store);
+
+    char* data = (char*)malloc(8 * IO_PAGE_SIZE);
+    char* read_back = (char*)calloc(8, IO_PAGE_SIZE);
+    for (int i = 0; i < 8 * IO_PAGE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    int stored_fd = io_open("slow.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    for (int i = 0; i < 8; i++)
+        io_pwrite_async(stored_fd, data + i * IO_PAGE_SIZE, IO_PAGE_SIZE, i * IO_PAGE_SIZE, NULL, NULL);
+    for (taken = 0; taken < 8;)
+        taken += io_async_poll(completions, 8, 8 - taken);
+    for (int i = 0; i < 8; i++)
+        io_pread_async(stored_fd, read_back + i * IO_PAGE_SIZE, IO_PAGE_SIZE, i * IO_PAGE_SIZE, NULL, NULL);
+    ssize_t total_read = 0;
+    for (taken = 0; taken < 8;) {
+        int polled_now = io_async_poll(completions, 8, 1);
+        for (int i = 0; i < polled_now; i++)
+            total_read += completions[i].result;
+        taken += polled_now;
+    }
+    printf("Stored file read: %zd bytes, data matches: %d\n", total_read, memcmp(data, read_back, 8 * IO_PAGE_SIZE) == 0);
+    failed |= total_read != 8 * IO_PAGE_SIZE || memcmp(data, read_back, 8 * IO_PAGE_SIZE) != 0;
+    io_close(stored_fd);
+
+    IOAsyncStats stats;
+    io_module_get_async_stats(&stats);
+    printf("Workers: %d, submitted: %llu, completed: %llu\n", stats.workers, (unsigned long long)stats.submitted,
+        (unsigned long long)stats.completed);
+    failed |= stats.submitted != stats.completed;
+    if (failed)
+        fprintf(stderr, "ERROR: An async call did not complete as expected\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(data);
+    free(read_back);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/slow.bin", root);
+    unlink(path);
+    rmdir(root);
+
+    return failed;
+}
+
+/*
+    Description: Mount a host directory holding a.txt, sub/b.txt which spans 2 chunks and an empty file, then read each
+                 of them, overwrite the start of a.txt through the IOModule and read the host's a.txt again
+    Expected Result: 3 files are mounted with none of them mapped, every read matches the host files, and the overwrite
+                     is seen through the fd while the host file keeps its original data
+*/
+int test_mount() {
+    printf("\n==========\ntest_mount\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Build the host directory
+    char root[] = "/tmp/oshandle_mount_XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    char* big_data = (char*)malloc(70000);
+    for (int i = 0; i < 70000; i++)
+        big_data[i] = 'a' + i % 26;
+
+    snprintf(path, sizeof(path), "%s/a.txt", root);
+    FILE* host_file = fopen(path, "w");
+    fputs("mounted data", host_file);
+    fclose(host_file);
+    snprintf(path, sizeof(path), "%s/sub", root);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/sub/b.txt", root);
+    host_file = fopen(path, "w");
+    fwrite(big_data, 1, 70000, host_file);
+    fclose(host_file);
+    snprintf(path, sizeof(path), "%s/empty.txt", root);
+    host_file = fopen(path, "w");
+    fclose(host_file);
+
+    // Module API Calls:
+    int mounted = file_system_mount(fs_module, root);
+    FSFile* fs_file = file_system_find_file(fs_module, "sub/b.txt");
+    printf("Mounted %d files, sub/b.txt is mapped: %d\n", mounted, fs_file->mount == NULL);
+    int failed = mounted != 3 || fs_file->mount == NULL;
+
+    char buffer[13] = { 0 };
+    int fd_a = io_open("a.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_read(fd_a, buffer, 12);
+    printf("a.txt: %s\n", buffer);
+    failed |= strcmp(buffer, "mounted data") != 0;
+
+    int fd_b = io_open("sub/b.txt", IOFILE_MODE_READ);
+    io_pread(fd_b, buffer, 12, 65530);
+    printf("sub/b.txt across chunks matches: %d, sub/b.txt is mapped: %d\n", memcmp(buffer, big_data + 65530, 12) == 0, fs_file->mount == NULL);
+    failed |= memcmp(buffer, big_data + 65530, 12) != 0;
+
+    int fd_empty = io_open("empty.txt", IOFILE_MODE_READ);
+    ssize_t empty_read = io_read(fd_empty, buffer, 12);
+    printf("empty.txt read: %zd\n", empty_read);
+    failed |= empty_read != 0;
+
+    io_pwrite(fd_a, "MOUNTED", 7, 0);
+    memset(buffer, 0, sizeof(buffer));
+    io_pread(fd_a, buffer, 12, 0);
+    printf("a.txt after write: %s\n", buffer);
+    failed |= strcmp(buffer, "MOUNTED data") != 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    snprintf(path, sizeof(path), "%s/a.txt", root);
+    host_file = fopen(path, "r");
+    fread(buffer, 1, 12, host_file);
+    fclose(host_file);
+    printf("Host a.txt after write: %s\n", buffer);
+    failed |= strcmp(buffer, "mounted data") != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The mounted files do not match the host directory\n");
+
+    // Clean up the host directory
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub/b.txt", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/sub", root);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/empty.txt", root);
+    unlink(path);
+    rmdir(root);
+    free(big_data);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: Pack the basic environment plus a 70000 byte file into an image, load the image into an empty file system,
+                 then read file2.txt and the big file through the IOModule and look for a file that isn't in the image
+                 Then load copies of the image damaged with a name longer than the image and with an index that has no
+                 empty bucket
+    Expected Result: Loading adds no files until they're looked up, the reads match the original data, and the missing
+                     file fails with ENOENT. The long name is never compared past the image, and the full index is
+                     rejected with EINVAL
+*/
+int test_image() {
+    printf("\n==========\ntest_image\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char* big_data = (char*)malloc(70000);
+    for (int i = 0; i < 70000; i++)
+        big_data[i] = 'a' + i % 26;
+    file_system_add_file(fs_module, "big.bin", big_data, 70000);
+
+    char image_path[] = "/tmp/oshandle_image_XXXXXX";
+    int image_fd = mkstemp(image_path);
+    close(image_fd);
+    int written = file_system_write_image(fs_module, image_path);
+    printf("Wrote the image: %d\n", written);
+
+    // Swap in a file system built only from the image
+    fs_environment_destroy();
+    fs_module = file_system_init();
+    int loaded = file_system_load_image(fs_module, image_path);
+    printf("Loaded the image: %d, files added: %zu\n", loaded, fs_module->num_files);
+    int failed = !written || !loaded || fs_module->num_files != 0;
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    char buffer[13] = { 0 };
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    io_read(fd, buffer, 12);
+    printf("file2.txt: %s\n", buffer);
+    failed |= strcmp(buffer, "hellogoodbye") != 0;
+
+    fd = io_open("big.bin", IOFILE_MODE_READ);
+    io_pread(fd, buffer, 12, 65530);
+    printf("big.bin across chunks matches: %d\n", memcmp(buffer, big_data + 65530, 12) == 0);
+    failed |= memcmp(buffer, big_data + 65530, 12) != 0;
+
+    fd = io_open("missing.txt", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != ENOENT;
+    printf("missing.txt: %d (%s)\n", fd, strerror(errno));
+
+    // Damage a copy of the image, first with a name longer than the whole image
+    FILE* image_file = fopen(image_path, "rb");
+    fseek(image_file, 0, SEEK_END);
+    size_t image_size = ftell(image_file);
+    fseek(image_file, 0, SEEK_SET);
+    char* image_data = (char*)malloc(image_size);
+    fread(image_data, 1, image_size, image_file);
+    fclose(image_file);
+
+    FSImageHeader* header = (FSImageHeader*)image_data;
+    FSImageEntry* entries = (FSImageEntry*)(image_data + header->index_offset);
+    char* long_name = (char*)malloc(image_size + 2);
+    memset(long_name, 'x', image_size + 1);
+    long_name[image_size + 1] = '\0';
+    uint32_t long_length;
+    uint32_t long_hash = fs_index_hash(long_name, &long_length);
+    FSImageEntry* long_entry = &entries[long_hash & (header->index_capacity - 1)];
+    long_entry->hash = long_hash;
+    long_entry->name_length = long_length;
+    long_entry->name_offset = 0;
+
+    char damaged_path[] = "/tmp/oshandle_image_XXXXXX";
+    int damaged_fd = mkstemp(damaged_path);
+    write(damaged_fd, image_data, image_size);
+    FileSystem* damaged = file_system_init();
+    loaded = file_system_load_image(damaged, damaged_path);
+    const FSImageEntry* found = fs_image_probe(damaged->images, long_name, long_hash, long_length);
+    printf("Loaded the damaged image: %d, name longer than the image found: %d\n", loaded, found != NULL);
+    failed |= !loaded || found != NULL;
+    file_system_destroy(&damaged);
+
+    // Then with an index that has no empty bucket
+    for (uint32_t i = 0; i < header->index_capacity; i++) {
+        if (entries[i].name_length == 0)
+            entries[i].name_length = 1;
+    }
+    pwrite(damaged_fd, image_data, image_size, 0);
+    close(damaged_fd);
+    damaged = file_system_init();
+    loaded = file_system_load_image(damaged, damaged_path);
+    failed |= loaded || errno != EINVAL;
+    printf("Loaded the image with a full index: %d (%s)\n", loaded, strerror(errno));
+    if (failed)
+        fprintf(stderr, "ERROR: The image did not load or reject as expected\n");
+    file_system_destroy(&damaged);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    unlink(damaged_path);
+    unlink(image_path);
+    free(long_name);
+    free(image_data);
+    free(big_data);
+
+    return failed;
+}
+
+/*
+    Description: Add files a few directories deep and an empty directory, open files and directories through the IOModule,
+                 add files whose names are taken or run through a file, then load an image and look up a file it doesn't
+                 have twice before adding it and loading the image again
+    Expected Result: The files read back, a directory fails to open with EISDIR, a path through a file with ENOTDIR and a
+                     missing directory with ENOENT. The bad adds fail with EEXIST, ENOTDIR and EINVAL, the miss leaves one
+                     negative entry that the add takes over, and loading the image drops the new miss
+*/
+int test_directories() {
+    printf("\n================\ntest_directories\n================\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    file_system_add_file(fs_module, "docs/a/b/readme.txt", "hello world!", 12);
+    file_system_add_file(fs_module, "docs/a/notes.txt", "some notes..", 12);
+    int made = file_system_make_directory(fs_module, "empty/dir");
+    int made_again = file_system_make_directory(fs_module, "empty/dir/");
+    printf("Made empty/dir: %d %d\n", made, made_again);
+    int failed = !made || !made_again;
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    char buffer[13] = { 0 };
+    int fd = io_open("docs/a/b/readme.txt", IOFILE_MODE_READ);
+    io_read(fd, buffer, 12);
+    printf("docs/a/b/readme.txt: %s\n", buffer);
+    failed |= strcmp(buffer, "hello world!") != 0;
+    fd = io_open("docs/a/notes.txt", IOFILE_MODE_READ);
+    io_read(fd, buffer, 12);
+    printf("docs/a/notes.txt: %s\n", buffer);
+    failed |= strcmp(buffer, "some notes..") != 0;
+
+    fd = io_open("docs/a", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != EISDIR;
+    printf("docs/a: %d (%s)\n", fd, strerror(errno));
+    fd = io_open("docs/a/notes.txt/more", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != ENOTDIR;
+    printf("docs/a/notes.txt/more: %d (%s)\n", fd, strerror(errno));
+    fd = io_open("docs/missing/file.txt", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != ENOENT;
+    printf("docs/missing/file.txt: %d (%s)\n", fd, strerror(errno));
+
+    int added = file_system_add_file(fs_module, "docs", "x", 1);
+    failed |= added || errno != EEXIST;
+    printf("Add docs: %d (%s)\n", added, strerror(errno));
+    added = file_system_add_file(fs_module, "file2.txt/x", "x", 1);
+    failed |= added || errno != ENOTDIR;
+    printf("Add file2.txt/x: %d (%s)\n", added, strerror(errno));
+    added = file_system_add_file(fs_module, "docs//x", "x", 1);
+    failed |= added || errno != EINVAL;
+    printf("Add docs//x: %d (%s)\n", added, strerror(errno));
+
+    FSIndexStats stats;
+    file_system_get_index_stats(fs_module, &stats);
+    printf("Directories: %zu\n", stats.directories);
+    failed |= stats.directories != 5;
+
+    char image_path[] = "/tmp/oshandle_image_XXXXXX";
+    int image_fd = mkstemp(image_path);
+    close(image_fd);
+    file_system_write_image(fs_module, image_path);
+
+    // Swap in a file system built only from the image, only misses in directories that have been made are remembered
+    io_module_destory();
+    fs_environment_destroy();
+    fs_module = file_system_init();
+    file_system_load_image(fs_module, image_path);
+    io_module_init();
+
+    fd = io_open("docs/a/b/readme.txt", IOFILE_MODE_READ);
+    io_read(fd, buffer, 12);
+    printf("docs/a/b/readme.txt from the image: %s\n", buffer);
+    failed |= strcmp(buffer, "hello world!") != 0;
+
+    fd = io_open("docs/a/new.txt", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != ENOENT;
+    printf("docs/a/new.txt: %d (%s)\n", fd, strerror(errno));
+    fd = io_open("docs/a/new.txt", IOFILE_MODE_READ);
+    failed |= fd != -1 || errno != ENOENT;
+    printf("docs/a/new.txt again: %d (%s)\n", fd, strerror(errno));
+    file_system_get_index_stats(fs_module, &stats);
+    printf("Negative entries: %zu\n", stats.negative_entries);
+    failed |= stats.negative_entries != 1;
+
+    file_system_add_file(fs_module, "docs/a/new.txt", "brand new...", 12);
+    fd = io_open("docs/a/new.txt", IOFILE_MODE_READ);
+    io_read(fd, buffer, 12);
+    file_system_get_index_stats(fs_module, &stats);
+    printf("docs/a/new.txt after the add: %s, negative entries: %zu\n", buffer, stats.negative_entries);
+    failed |= strcmp(buffer, "brand new...") != 0 || stats.negative_entries != 0;
+
+    fd = io_open("docs/a/b/other.txt", IOFILE_MODE_READ);
+    file_system_get_index_stats(fs_module, &stats);
+    printf("Negative entries after another miss: %zu\n", stats.negative_entries);
+    failed |= stats.negative_entries != 1;
+    file_system_load_image(fs_module, image_path);
+    file_system_get_index_stats(fs_module, &stats);
+    printf("Negative entries after loading the image again: %zu\n", stats.negative_entries);
+    failed |= stats.negative_entries != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: A path did not resolve or fail as expected\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    unlink(image_path);
+
+    return failed;
+}
+
+/*
+    Description: Clone file2.txt and a 200000 byte file spanning 4 chunks, write to both clones, then clone onto a name
+                 that's taken and clone a file that doesn't exist
+    Expected Result: Each clone reads back its own write while the sources keep their data, the big clone only copies the
+                     chunk it wrote to and keeps sharing the other 3, and the bad clones fail with EEXIST and ENOENT
+*/
+int test_clone() {
+    printf("\n==========\ntest_clone\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char* big_data = (char*)malloc(200000);
+    for (int i = 0; i < 200000; i++)
+        big_data[i] = 'a' + i % 26;
+    file_system_add_file(fs_module, "big.bin", big_data, 200000);
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int cloned = io_clone("file2.txt", "copy.txt");
+    int big_cloned = io_clone("big.bin", "big_copy.bin");
+    printf("Clones: %d %d\n", cloned, big_cloned);
+
+    int fd = io_open("copy.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_pwrite(fd, "J", 1, 0);
+    char buffer[13] = { 0 };
+    io_pread(fd, buffer, 12, 0);
+    printf("copy.txt: %s\n", buffer);
+    int failed = cloned != 0 || big_cloned != 0 || strcmp(buffer, "Jellogoodbye") != 0;
+
+    fd = io_open("file2.txt", IOFILE_MODE_READ);
+    io_pread(fd, buffer, 12, 0);
+    printf("file2.txt: %s\n", buffer);
+    failed |= strcmp(buffer, "hellogoodbye") != 0;
+
+    fd = io_open("big_copy.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_pwrite(fd, "XYZ", 3, 140000);
+    io_pread(fd, buffer, 3, 140000);
+    buffer[3] = '\0';
+    printf("big_copy.bin at 140000: %s\n", buffer);
+    failed |= strcmp(buffer, "XYZ") != 0;
+
+    fd = io_open("big.bin", IOFILE_MODE_READ);
+    io_pread(fd, buffer, 3, 140000);
+    printf("big.bin unchanged: %d\n", memcmp(buffer, big_data + 140000, 3) == 0);
+    failed |= memcmp(buffer, big_data + 140000, 3) != 0;
+
+    FSFile* src_file = file_system_find_file(fs_module, "big.bin");
+    FSFile* dst_file = file_system_find_file(fs_module, "big_copy.bin");
+    int shared_chunks = 0;
+    for (size_t i = 0; i < src_file->num_chunks; i++)
+        shared_chunks += src_file->chunks[i] == dst_file->chunks[i];
+    printf("Chunks still shared: %d of %zu\n", shared_chunks, src_file->num_chunks);
+    failed |= shared_chunks != 3;
+
+    int result = io_clone("file1.txt", "copy.txt");
+    failed |= result != -1 || errno != EEXIST;
+    printf("Clone onto copy.txt: %d (%s)\n", result, strerror(errno));
+    result = io_clone("missing.txt", "other.txt");
+    failed |= result != -1 || errno != ENOENT;
+    printf("Clone of missing.txt: %d (%s)\n", result, strerror(errno));
+    if (failed)
+        fprintf(stderr, "ERROR: A clone did not keep its data separate from its source\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    free(big_data);
+
+    return failed;
+}
+
+/*
+    Description: Seek around file2.txt from the start, the cursor and the end, then write 4 bytes 1GB into an empty file
+                 and another 4 at 3GB. Read from the holes, walk the file with IO_SEEK_DATA and IO_SEEK_HOLE and make some
+                 bad seeks
+    Expected Result: The seeks land where asked, the sparse file is 3GB long but only its 2 written chunks take memory,
+                     the holes read back as zeros and are viewed without a chunk, the walk finds the data at 1GB and 3GB and
+                     the holes right after them, and the bad seeks fail with EINVAL and ENXIO
+*/
+int test_lseek() {
+    printf("\n==========\ntest_lseek\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    char buffer[16] = { 0 };
+    off_t position = io_lseek(fd, 5, IO_SEEK_SET);
+    io_read(fd, buffer, 4);
+    printf("SET 5: %lld %s\n", (long long)position, buffer);
+    int failed = position != 5 || strcmp(buffer, "good") != 0;
+    position = io_lseek(fd, -4, IO_SEEK_CUR);
+    io_read(fd, buffer, 4);
+    printf("CUR -4: %lld %s\n", (long long)position, buffer);
+    failed |= position != 5 || strcmp(buffer, "good") != 0;
+    position = io_lseek(fd, -3, IO_SEEK_END);
+    memset(buffer, 0, sizeof(buffer));
+    io_read(fd, buffer, 8);
+    printf("END -3: %lld %s\n", (long long)position, buffer);
+    failed |= position != 9 || strcmp(buffer, "bye") != 0;
+    position = io_lseek(fd, 0, IO_SEEK_HOLE);
+    printf("HOLE 0: %lld\n", (long long)position);
+    failed |= position != 12;
+
+    FSMemoryStats before;
+    file_system_get_memory_stats(fs_module, &before);
+
+    file_system_add_file(fs_module, "sparse.bin", NULL, 0);
+    int sparse_fd = io_open("sparse.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_lseek(sparse_fd, 1LL << 30, IO_SEEK_SET);
+    io_write(sparse_fd, "DATA", 4);
+    io_pwrite(sparse_fd, "MORE", 4, 3LL << 30);
+
+    FSMemoryStats after;
+    file_system_get_memory_stats(fs_module, &after);
+    off_t sparse_size = io_lseek(sparse_fd, 0, IO_SEEK_END);
+    printf("Size: %lld, chunk memory added: %zu, table memory added: %zu\n", (long long)sparse_size,
+           after.chunk_bytes - before.chunk_bytes, after.table_bytes - before.table_bytes);
+    failed |= sparse_size != (3LL << 30) + 4 || after.chunk_bytes - before.chunk_bytes > 2 * (sizeof(FSChunk) + FS_CHUNK_SIZE);
+
+    memset(buffer, 'x', 8);
+    io_pread(sparse_fd, buffer, 8, (1LL << 30) - 4);
+    printf("Across the edge of the hole: %d %d %d %d %.4s\n", buffer[0], buffer[1], buffer[2], buffer[3], buffer + 4);
+    failed |= memcmp(buffer, "\0\0\0\0DATA", 8) != 0;
+
+    IOView view;
+    io_lseek(sparse_fd, 12345, IO_SEEK_SET);
+    ssize_t viewed = io_read_view(sparse_fd, 100, &view);
+    printf("View of the hole: %zd bytes, chunk %s, zeros %d\n", viewed, view.chunk == NULL ? "NULL" : "set",
+           view.data[0] == 0 && view.data[99] == 0);
+    failed |= viewed != 100 || view.chunk != NULL || view.data[0] != 0 || view.data[99] != 0;
+    io_release_view(&view);
+
+    off_t expected_data[] = { 1LL << 30, 3LL << 30 };
+    off_t expected_holes[] = { (1LL << 30) + FS_CHUNK_SIZE, (3LL << 30) + 4 };
+    int regions = 0;
+    position = 0;
+    while ((position = io_lseek(sparse_fd, position, IO_SEEK_DATA)) != -1) {
+        off_t hole = io_lseek(sparse_fd, position, IO_SEEK_HOLE);
+        printf("Data from %lld to %lld\n", (long long)position, (long long)hole);
+        failed |= regions >= 2 || position != expected_data[regions] || hole != expected_holes[regions];
+        regions++;
+        position = hole;
+    }
+    failed |= regions != 2 || errno != ENXIO;
+    printf("Walk ended: %s\n", strerror(errno));
+
+    position = io_lseek(sparse_fd, 3LL << 30, IO_SEEK_HOLE);
+    printf("HOLE in the last chunk: %lld\n", (long long)position);
+    failed |= position != (3LL << 30) + 4;
+
+    position = io_lseek(sparse_fd, -1, IO_SEEK_SET);
+    failed |= position != -1 || errno != EINVAL;
+    printf("SET -1: %lld (%s)\n", (long long)position, strerror(errno));
+    position = io_lseek(sparse_fd, 0, 7);
+    failed |= position != -1 || errno != EINVAL;
+    printf("Bad whence: %lld (%s)\n", (long long)position, strerror(errno));
+    position = io_lseek(sparse_fd, 4LL << 30, IO_SEEK_DATA);
+    failed |= position != -1 || errno != ENXIO;
+    printf("DATA past the end: %lld (%s)\n", (long long)position, strerror(errno));
+    position = io_lseek(sparse_fd, 4LL << 30, IO_SEEK_SET);
+    printf("SET past the end: %lld\n", (long long)position);
+    failed |= position != 4LL << 30;
+    if (failed)
+        fprintf(stderr, "ERROR: A seek landed in the wrong place or the sparse file took too much memory\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: Put a 40 page file on a disk store and read it through an 8 page cache. Read pages 0 and 1, scan pages
+                 2 to 9, read pages 0 and 1 again, scan the rest of the file and then read pages 0 and 1 once more.
+                 Then write to page 0 through the cache and while a view has it pinned, clone the file and view it
+                 from a context without a page cache
+    Expected Result: The second reads of 0 and 1 are ghost hits that move them into the main queue, so the long scan
+                     doesn't evict them and the last reads are hits. Writes reach the host file and cached pages, and a
+                     view keeps the data it was given. The clone and the uncached view fail with EOPNOTSUPP
+*/
+int test_page_cache() {
+    printf("\n===============\ntest_page_cache\n===============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule with a cache of 8 pages
+    IOModuleConfig config;
+    io_module_default_config(&config);
+    config.page_cache_size = 8 * IO_PAGE_SIZE;
+    int module_init = io_module_init_with_config(&config);
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_disk(root);
+    file_system_add_stored_file(fs_module, "stored.bin", store);
+
+    // Fill page i with the letter 'A' + i
+    char* data = (char*)malloc(40 * IO_PAGE_SIZE);
+    for (int i = 0; i < 40 * IO_PAGE_SIZE; i++)
+        data[i] = 'A' + (i / IO_PAGE_SIZE) % 26;
+
+    // Module API Calls:
+    int fd = io_open("stored.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    ssize_t written = io_pwrite(fd, data, 40 * IO_PAGE_SIZE, 0);
+    printf("Written: %zd\n", written);
+    int failed = written != 40 * IO_PAGE_SIZE;
+
+    char buffer[8] = { 0 };
+    int hot_pages[] = { 0, 1 };
+    unsigned long long expected_misses[] = { 2, 2, 0 };
+    unsigned long long expected_ghost_hits[] = { 0, 2, 0 };
+    IOPageCacheStats before, after;
+    for (int pass = 0; pass < 3; pass++) {
+        io_module_get_page_cache_stats(&before);
+        for (int i = 0; i < 2; i++)
+            io_pread(fd, buffer, 1, hot_pages[i] * IO_PAGE_SIZE + 100);
+        io_module_get_page_cache_stats(&after);
+        printf("Hot pages read %c: %llu misses, %llu ghost hits\n", buffer[0], (unsigned long long)(after.misses - before.misses),
+            (unsigned long long)(after.ghost_hits - before.ghost_hits));
+        failed |= buffer[0] != 'A' + 1 || after.misses - before.misses != expected_misses[pass] ||
+            after.ghost_hits - before.ghost_hits != expected_ghost_hits[pass];
+
+        // Scan pages that haven't been read yet, the first time just far enough to push the hot pages out of probation
+        int scan_start = pass == 0 ? 2 : 10;
+        int scan_end = pass == 0 ? 10 : 40;
+        for (int page = scan_start; page < scan_end && pass < 2; page++)
+            io_pread(fd, buffer, 1, page * IO_PAGE_SIZE);
+    }
+
+    io_pread(fd, buffer, 1, 25 * IO_PAGE_SIZE + 7);
+    printf("Page 25 after evictions: %c\n", buffer[0]);
+    failed |= buffer[0] != 'Z';
+
+    // Write through to a cached page
+    io_module_get_page_cache_stats(&before);
+    io_pwrite(fd, "XYZ", 3, 100);
+    io_pread(fd, buffer, 3, 100);
+    buffer[3] = '\0';
+    io_module_get_page_cache_stats(&after);
+    printf("Read after write: %s, %llu misses\n", buffer, (unsigned long long)(after.misses - before.misses));
+    failed |= strcmp(buffer, "XYZ") != 0 || after.misses != before.misses;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stored.bin", root);
+    int host_fd = open(path, O_RDONLY);
+    pread(host_fd, buffer, 3, 100);
+    off_t host_size = lseek(host_fd, 0, SEEK_END);
+    printf("Host file: %s, %lld bytes\n", buffer, (long long)host_size);
+    failed |= strcmp(buffer, "XYZ") != 0 || host_size != 40 * IO_PAGE_SIZE;
+    close(host_fd);
+
+    // A write to a page a view has pinned doesn't change the view's data
+    IOView view;
+    io_read_view(fd, 3, &view);
+    io_pwrite(fd, "abc", 3, 0);
+    io_pread(fd, buffer, 3, 0);
+    printf("View: %.3s, read: %s\n", view.data, buffer);
+    failed |= memcmp(view.data, "AAA", 3) != 0 || strcmp(buffer, "abc") != 0;
+    io_release_view(&view);
+
+    // Stored files have no chunks to share with a clone, and nothing to view without a page cache
+    int cloned = io_clone("stored.bin", "stored_copy.bin");
+    failed |= cloned != -1 || errno != EOPNOTSUPP;
+    printf("Clone of the stored file: %d (%s)\n", cloned, strerror(errno));
+
+    IOModuleConfig uncached_config = config;
+    uncached_config.page_cache_size = 0;
+    IOModule* uncached = io_ctx_init(NULL, &uncached_config);
+    int uncached_fd = io_ctx_open(uncached, "stored.bin", IOFILE_MODE_READ);
+    ssize_t viewed = io_ctx_read_view(uncached, uncached_fd, 3, &view);
+    failed |= viewed != -1 || errno != EOPNOTSUPP;
+    printf("View without a page cache: %zd (%s)\n", viewed, strerror(errno));
+    io_ctx_close(uncached, uncached_fd);
+    io_ctx_destroy(&uncached);
+
+    io_module_get_page_cache_stats(&after);
+    printf("Stats: %llu hits, %llu misses, %llu evictions, %d probation pages, %d main pages\n", (unsigned long long)after.hits,
+        (unsigned long long)after.misses, (unsigned long long)after.evictions, after.probation_pages, after.main_pages);
+    if (failed)
+        fprintf(stderr, "ERROR: The page cache did not keep the hot pages or the written data\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(data);
+
+    unlink(path);
+    rmdir(root);
+
+    return failed;
+}
+
+/*
+    Description: Stream through a 64 page stored file with 4K io_reads from a store that takes 200us a read, then start
+                 a second stream on another fd and move its cursor with a write
+    Expected Result: The first stream is found, pages are read ahead for it and every one of them gets read, and the
+                     second stream's window collapses once its reads stop picking up where the last one ended. The test
+                     fails if nothing was read ahead or a page read ahead went unused
+*/
+int test_readahead() {
+    printf("\n==============\ntest_readahead\n==============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    // A store slow enough that the readahead thread gets ahead of the reads
+    FSStore* store = fs_store_init_slow(fs_store_init_disk(root), 200000, 0);
+    file_system_add_stored_file(fs_module, "stream.bin", store);
+
+    char* data = (char*)malloc(64 * IO_PAGE_SIZE);
+    for (int i = 0; i < 64 * IO_PAGE_SIZE; i++)
+        data[i] = 'a' + i % 26;
+
+    // Module API Calls:
+    int fd = io_open("stream.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_pwrite(fd, data, 64 * IO_PAGE_SIZE, 0);
+
+    char buffer[4096];
+    size_t total_read = 0;
+    int matches = 1;
+    ssize_t bytes_read;
+    while ((bytes_read = io_read(fd, buffer, sizeof(buffer))) > 0) {
+        matches = matches && memcmp(buffer, data + total_read, bytes_read) == 0;
+        total_read += bytes_read;
+    }
+    io_readahead_wait_idle();
+    printf("Read %zu bytes, data matches: %d\n", total_read, matches);
+
+    IOReadaheadStats stats;
+    io_module_get_readahead_stats(&stats);
+    printf("Streams: %llu, pages read ahead: %d, all of them used: %d\n", (unsigned long long)stats.windows_started,
+        stats.pages_prefetched > 0, stats.pages_used == stats.pages_prefetched);
+    int failed = stats.pages_prefetched == 0 || stats.pages_used != stats.pages_prefetched;
+    if (failed)
+        fprintf(stderr, "ERROR: The stream wasn't read ahead, or pages read ahead for it went unused\n");
+
+    // A write moves the cursor past where the next read would have to start
+    int fd2 = io_open("stream.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_read(fd2, buffer, sizeof(buffer));
+    io_read(fd2, buffer, sizeof(buffer));
+    io_write(fd2, "x", 1);
+    io_read(fd2, buffer, sizeof(buffer));
+    io_readahead_wait_idle();
+
+    io_module_get_readahead_stats(&stats);
+    printf("Streams: %llu, collapsed: %llu\n", (unsigned long long)stats.windows_started, (unsigned long long)stats.windows_collapsed);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(data);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stream.bin", root);
+    unlink(path);
+    rmdir(root);
+
+    return failed;
+}
+
+void* test_stats_thread(void* arg) {
+    int fd = *(int*)arg;
+    char buffer[4];
+    for (int i = 0; i < 1000; i++)
+        io_pread(fd, buffer, 4, 0);
+
+    return NULL;
+}
+
+/*
+    Description: Open file1.txt 200 times and close 150 of the fds, read 4 bytes 1000 times from each of 4 threads,
+                 write 5 bytes, then make a failed open, read and close and take a snapshot of the stats
+    Expected Result: The snapshot adds the 4 threads' reads to the main thread's calls, counts the failures as errors,
+                     has 50 fds open, the bytes moved, some timed opens with their lookup and fd parts, and the 2 files
+                     in the FileSystem's index
+*/
+int test_stats() {
+    printf("\n==========\ntest_stats\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    int fds[200];
+    for (int i = 0; i < 200; i++)
+        fds[i] = io_open("file1.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    for (int i = 0; i < 150; i++)
+        io_close(fds[i]);
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, test_stats_thread, &fds[199]);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    io_write(fds[199], "Hello", 5);
+    io_open("missing.txt", IOFILE_MODE_READ);
+    char buffer[4];
+    io_read(12345, buffer, 4);
+    io_close(12345);
+
+    IOStatsSnapshot snapshot;
+    io_stats_snapshot(&snapshot);
+    printf("Opens: %llu (%llu errors), closes: %llu (%llu errors)\n", (unsigned long long)snapshot.calls[IO_STAT_OPEN],
+           (unsigned long long)snapshot.errors[IO_STAT_OPEN], (unsigned long long)snapshot.calls[IO_STAT_CLOSE],
+           (unsigned long long)snapshot.errors[IO_STAT_CLOSE]);
+    printf("Reads: %llu (%llu errors), writes: %llu\n", (unsigned long long)snapshot.calls[IO_STAT_READ],
+           (unsigned long long)snapshot.errors[IO_STAT_READ], (unsigned long long)snapshot.calls[IO_STAT_WRITE]);
+    printf("Bytes read: %llu, bytes written: %llu\n", (unsigned long long)snapshot.bytes_read,
+           (unsigned long long)snapshot.bytes_written);
+    printf("Open fds: %zu\n", snapshot.open_fds);
+
+    uint64_t timed_opens = 0;
+    for (int bucket = 0; bucket < IO_STATS_BUCKETS; bucket++)
+        timed_opens += snapshot.latency[IO_STAT_OPEN][bucket];
+    printf("Timed opens: %d, lookups: %d, fd allocations: %d\n", timed_opens > 0,
+           snapshot.calls[IO_STAT_OPEN_LOOKUP] > 0, snapshot.calls[IO_STAT_OPEN_FD] > 0);
+    printf("Open p50 under 1ms: %d\n", io_stats_percentile(&snapshot, IO_STAT_OPEN, 0.5) < 1000000);
+    printf("Files in the index: %zu, probe length: %.1f\n", snapshot.index.entries, snapshot.index.mean_probe_length);
+
+    // The call counters stay at zero when the stats are compiled out
+    int failed = snapshot.index.entries != 2;
+    failed |= IO_STATS && (snapshot.open_fds != 50 || snapshot.calls[IO_STAT_OPEN] != 201 || snapshot.errors[IO_STAT_OPEN] != 1 ||
+        snapshot.calls[IO_STAT_CLOSE] != 151 || snapshot.errors[IO_STAT_CLOSE] != 1 || snapshot.calls[IO_STAT_READ] != 4001 ||
+        snapshot.errors[IO_STAT_READ] != 1 || snapshot.calls[IO_STAT_WRITE] != 1 || snapshot.bytes_read != 16000 ||
+        snapshot.bytes_written != 5 || timed_opens == 0 || snapshot.calls[IO_STAT_OPEN_LOOKUP] == 0 ||
+        snapshot.calls[IO_STAT_OPEN_FD] == 0);
+    if (failed)
+        fprintf(stderr, "ERROR: The stats snapshot does not add up to the calls made\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: Trace opening file2.txt and data.bin, reads through the cursor and at offsets, a write, a read of a bad
+                 fd and the closes, then replay the trace against a new FileSystem with no files and again timed
+    Expected Result: The trace has the 8 successful calls on the 2 files, the replay creates both files at their sizes
+                     when they were opened and gets the same results for every call, and the timed replay takes as long
+                     as the traced calls
+*/
+int test_trace() {
+    printf("\n==========\ntest_trace\n==========\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char* data = (char*)calloc(100000, 1);
+    file_system_add_file(fs_module, "data.bin", data, 100000);
+    free(data);
+
+    char trace_path[] = "/tmp/oshandle_trace_XXXXXX";
+    int trace_fd = mkstemp(trace_path);
+    close(trace_fd);
+
+    // Initialize the IOModule with the trace running from the start
+    IOModuleConfig config;
+    io_module_default_config(&config);
+    config.trace_path = trace_path;
+    int module_init = io_module_init_with_config(&config);
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    char buffer[16] = { 0 };
+    int fd = io_open("file2.txt", IOFILE_MODE_READ);
+    int data_fd = io_open("data.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_read(fd, buffer, 5);
+    io_pread(data_fd, buffer, 16, 50000);
+    io_pwrite(data_fd, "xyz", 3, 99999);
+    usleep(20000);
+    io_read(fd, buffer, 16);
+    io_read(12345, buffer, 1);
+    io_close(fd);
+    io_close(data_fd);
+
+    IOTraceStats trace_stats;
+    int stopped = io_trace_stop(&trace_stats);
+    printf("Trace stopped: %d, events: %llu, files: %llu\n", stopped, (unsigned long long)trace_stats.events,
+           (unsigned long long)trace_stats.files);
+    int failed = !stopped || trace_stats.events != 8 || trace_stats.files != 2;
+    stopped = io_trace_stop(NULL);
+    failed |= stopped || errno != EINVAL;
+    printf("Stop again: %d (%s)\n", stopped, strerror(errno));
+
+    // Replay against a FileSystem that has none of the files
+    io_module_destory();
+    fs_environment_destroy();
+    fs_module = file_system_init();
+    io_module_init();
+
+    IOReplayStats replay_stats;
+    int replayed = io_trace_replay(trace_path, 0, &replay_stats);
+    FSFile* data_file = file_system_find_file(fs_module, "data.bin");
+    printf("Replayed: %d, events: %llu, files created: %llu, mismatches: %llu, skipped: %llu\n", replayed,
+           (unsigned long long)replay_stats.events, (unsigned long long)replay_stats.files_created,
+           (unsigned long long)replay_stats.mismatches, (unsigned long long)replay_stats.skipped);
+    printf("data.bin size: %zu, reads: %llu, preads: %llu\n", data_file != NULL ? data_file->size : 0,
+           (unsigned long long)replay_stats.ops[IO_TRACE_OP_READ].calls,
+           (unsigned long long)replay_stats.ops[IO_TRACE_OP_PREAD].calls);
+    failed |= !replayed || replay_stats.events != 8 || replay_stats.files_created != 2 || replay_stats.mismatches != 0 ||
+        replay_stats.skipped != 0 || data_file == NULL || data_file->size != 100002 ||
+        replay_stats.ops[IO_TRACE_OP_READ].calls != 2 || replay_stats.ops[IO_TRACE_OP_PREAD].calls != 1;
+
+    replayed = io_trace_replay(trace_path, 1, &replay_stats);
+    printf("Timed replay: %d, took the traced 20ms: %d, mismatches: %llu\n", replayed, replay_stats.seconds >= 0.02,
+           (unsigned long long)replay_stats.mismatches);
+    failed |= !replayed || replay_stats.seconds < 0.02 || replay_stats.mismatches != 0;
+
+    int bad = io_trace_replay("/tmp/oshandle_no_such_trace", 0, &replay_stats);
+    failed |= bad || errno != ENOENT;
+    printf("Replay of a missing trace: %d (%s)\n", bad, strerror(errno));
+    if (failed)
+        fprintf(stderr, "ERROR: The trace or its replay did not match the traced calls\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+    unlink(trace_path);
+
+    return failed;
+}
+
+/*
+    Description: Two contexts each open tenant.txt in a FileSystem of their own next to the default context, one thread
+                 calls into 6 contexts in turn, and two threads one after the other use a context with fd caches.
+                 Then two contexts read a stored file, one overwrites it, and the default context is destroyed while
+                 the other holds a view of the file
+    Expected Result: Every context hands out fd 0 first and reads its own tenant.txt, closing a fd in one context
+                     leaves the others alone, the thread has one record in each of the 6 contexts, and the second
+                     thread takes over the record the first left behind. Each context reads the stored file through
+                     a page cache of its own, the other context reads the overwrite back, and the view outlives the
+                     default context
+*/
+void* test_contexts_thread(void* arg) {
+    IOModule* ctx = (IOModule*)arg;
+    for (int i = 0; i < 100; i++)
+        io_ctx_close(ctx, io_ctx_open(ctx, "tenant.txt", IOFILE_MODE_READ));
+
+    return NULL;
+}
+
+int test_contexts_count_records(IOModule* ctx) {
+    int records = 0;
+    for (IOThreadRecord* record = ctx->thread_records; record != NULL; record = record->next)
+        records++;
+
+    return records;
+}
+
+int test_contexts() {
+    printf("\n=============\ntest_contexts\n=============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // A FileSystem and a context for each tenant
+    FileSystem* fs_a = file_system_init();
+    FileSystem* fs_b = file_system_init();
+    file_system_add_file(fs_a, "tenant.txt", "alpha", 5);
+    file_system_add_file(fs_b, "tenant.txt", "bravo", 5);
+
+    IOModuleConfig config;
+    io_module_default_config(&config);
+    IOModule* ctx_a = io_ctx_init(fs_a, &config);
+    IOModule* ctx_b = io_ctx_init(fs_b, &config);
+
+    // Module API Calls:
+    int fd_a = io_ctx_open(ctx_a, "tenant.txt", IOFILE_MODE_READ);
+    int fd_b = io_ctx_open(ctx_b, "tenant.txt", IOFILE_MODE_READ);
+    int fd = io_open("file1.txt", IOFILE_MODE_READ);
+    printf("fds: %d %d %d\n", fd_a, fd_b, fd);
+    int failed = fd_a != 0 || fd_b != 0 || fd != 0;
+
+    char buffer_a[8] = { 0 };
+    char buffer_b[8] = { 0 };
+    io_ctx_read(ctx_a, fd_a, buffer_a, 5);
+    io_ctx_read(ctx_b, fd_b, buffer_b, 5);
+    printf("Tenant a: %s, tenant b: %s\n", buffer_a, buffer_b);
+    failed |= strcmp(buffer_a, "alpha") != 0 || strcmp(buffer_b, "bravo") != 0;
+
+    int missing = io_ctx_open(ctx_a, "file1.txt", IOFILE_MODE_READ);
+    failed |= missing != -1 || errno != ENOENT;
+    printf("Default file in tenant a: %d (%s)\n", missing, strerror(errno));
+
+    io_ctx_close(ctx_a, fd_a);
+    ssize_t closed_read = io_ctx_read(ctx_a, fd_a, buffer_a, 1);
+    failed |= closed_read != -1 || errno != EBADF;
+    printf("Read of the closed fd: %zd (%s)\n", closed_read, strerror(errno));
+    ssize_t other_read = io_ctx_pread(ctx_b, fd_b, buffer_b, 5, 0);
+    ssize_t default_read = io_pread(fd, buffer_a, 5, 0);
+    printf("Reads in the other contexts: %zd %zd\n", other_read, default_read);
+    failed |= other_read != 5 || default_read != 5;
+
+    // More contexts than the thread has slots for
+    IOModule* ctxs[6];
+    for (int i = 0; i < 6; i++)
+        ctxs[i] = io_ctx_init(fs_a, &config);
+    int failures = 0;
+    for (int i = 0; i < 600; i++) {
+        IOModule* ctx = ctxs[i % 6];
+        int ctx_fd = io_ctx_open(ctx, "tenant.txt", IOFILE_MODE_READ);
+        failures += ctx_fd != 0 || io_ctx_close(ctx, ctx_fd) != 0;
+    }
+    int records = 0;
+    for (int i = 0; i < 6; i++)
+        records += test_contexts_count_records(ctxs[i]);
+    printf("Failed calls: %d, records in 6 contexts: %d\n", failures, records);
+    failed |= failures != 0 || records != 6;
+
+    // Threads that exit give their record back
+    config.fd_cache_enabled = 1;
+    IOModule* ctx_c = io_ctx_init(fs_a, &config);
+    for (int i = 0; i < 2; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, test_contexts_thread, ctx_c);
+        pthread_join(thread, NULL);
+    }
+    int thread_records = test_contexts_count_records(ctx_c);
+    printf("Records after 2 threads: %d\n", thread_records);
+    failed |= thread_records != 1;
+
+    // Each context has a page cache of its own
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_disk(root);
+    file_system_add_stored_file(fs_a, "stored.txt", store);
+    int stored_a = io_ctx_open(ctx_a, "stored.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    int stored_c = io_ctx_open(ctx_c, "stored.txt", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    io_ctx_pwrite(ctx_a, stored_a, "alpha", 5, 0);
+    io_ctx_pread(ctx_a, stored_a, buffer_a, 5, 0);
+    io_ctx_pread(ctx_c, stored_c, buffer_b, 5, 0);
+    io_ctx_pwrite(ctx_c, stored_c, "bravo", 5, 0);
+    io_ctx_pread(ctx_a, stored_a, buffer_a, 5, 0);
+
+    IOPageCacheStats cache_a;
+    IOPageCacheStats cache_c;
+    IOPageCacheStats cache_default;
+    io_ctx_get_page_cache_stats(ctx_a, &cache_a);
+    io_ctx_get_page_cache_stats(ctx_c, &cache_c);
+    io_module_get_page_cache_stats(&cache_default);
+    printf("Stored file before: %s, after the other context's write: %s\n", buffer_b, buffer_a);
+    printf("Page cache misses in a: %llu, c: %llu, default: %llu\n", (unsigned long long)cache_a.misses,
+        (unsigned long long)cache_c.misses, (unsigned long long)cache_default.misses);
+    failed |= strcmp(buffer_b, "alpha") != 0 || strcmp(buffer_a, "bravo") != 0 || cache_a.misses == 0 || cache_c.misses == 0 ||
+        cache_default.misses != 0;
+
+    IOView view;
+    io_ctx_lseek(ctx_a, stored_a, 0, SEEK_SET);
+    io_ctx_read_view(ctx_a, stored_a, 5, &view);
+    io_module_destory();
+    io_module_init();
+    printf("View after the default context is destroyed: %.*s\n", (int)view.length, view.data);
+    failed |= view.length != 5 || memcmp(view.data, "bravo", 5) != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The contexts did not keep their fds, records and page caches apart\n");
+    io_release_view(&view);
+    io_ctx_close(ctx_a, stored_a);
+    io_ctx_close(ctx_c, stored_c);
+
+    // Destroy the contexts
+    for (int i = 0; i < 6; i++)
+        io_ctx_destroy(&ctxs[i]);
+    io_ctx_destroy(&ctx_c);
+    io_ctx_destroy(&ctx_a);
+    io_ctx_destroy(&ctx_b);
+    file_system_destroy(&fs_a);
+    file_system_destroy(&fs_b);
+    fs_store_destroy(&store);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stored.txt", root);
+    unlink(path);
+    rmdir(root);
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: 8 threads each open file2.txt, read hello from it and close it 20000 times while holding 500 other fds open,
+                 which makes the fd table grow under them
+    Expected Result: Every read should return hello, no call should fail, and once all threads are done the next fd should be 0
+*/
+typedef struct ChurnThreadArgs {
+    int failures;
+} ChurnThreadArgs;
+
+void* test_threads_churn(void* arg) {
+    ChurnThreadArgs* args = (ChurnThreadArgs*)arg;
+    int held_fds[500];
+    for (int i = 0; i < 500; i++)
+        held_fds[i] = io_open("file1.txt", IOFILE_MODE_READ);
+
+    char buffer[5];
+    for (int i = 0; i < 20000; i++) {
+        int fd = io_open("file2.txt", IOFILE_MODE_READ);
+        if (fd == -1 || io_read(fd, buffer, 5) != 5 || memcmp(buffer, "hello", 5) != 0 || io_close(fd) != 0)
+            args->failures++;
+    }
+
+    for (int i = 0; i < 500; i++) {
+        if (io_close(held_fds[i]) != 0)
+            args->failures++;
+    }
+
+    return NULL;
+}
+
+int test_threads() {
+    printf("\n============\ntest_threads\n============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    pthread_t threads[8];
+    ChurnThreadArgs args[8];
+    for (int i = 0; i < 8; i++) {
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, test_threads_churn, &args[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    printf("The threads had %d failed calls\n", failures);
+
+    int fd = io_open("file1.txt", IOFILE_MODE_READ);
+    printf("The next fd is: %d\n", fd);
+
+    int failed = failures != 0 || fd != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The threads failed calls or leaked fds\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+/*
+    Description: With the fd cache on, 4 threads each hold 100 fds open and open, read hello from and close file2.txt
+                 20000 times, then print the hit rate of their fd cache
+    Expected Result: No call should fail, every thread should hit its cache almost every time, and once the threads exit
+                     their cached fds go back to the IOModule so the next fd should be 0
+*/
+typedef struct FdCacheThreadArgs {
+    int failures;
+    IOFdCacheStats stats;
+} FdCacheThreadArgs;
+
+void* test_fd_cache_thread(void* arg) {
+    FdCacheThreadArgs* args = (FdCacheThreadArgs*)arg;
+    int held_fds[100];
+    for (int i = 0; i < 100; i++)
+        held_fds[i] = io_open("file1.txt", IOFILE_MODE_READ);
+
+    char buffer[5];
+    for (int i = 0; i < 20000; i++) {
+        int fd = io_open("file2.txt", IOFILE_MODE_READ);
+        if (fd == -1 || io_read(fd, buffer, 5) != 5 || memcmp(buffer, "hello", 5) != 0 || io_close(fd) != 0)
+            args->failures++;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        if (io_close(held_fds[i]) != 0)
+            args->failures++;
+    }
+
+    io_module_get_fd_cache_stats(&args->stats, NULL);
+
+    return NULL;
+}
+
+int test_fd_cache() {
+    printf("\n=============\ntest_fd_cache\n=============\n");
+
+    // Set up a simple file system environment holding file1.txt and file2.txt
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    // Initialize the IOModule with the fd cache turned on
+    IOModuleConfig config;
+    io_module_default_config(&config);
+    config.fd_cache_enabled = 1;
+    int module_init = io_module_init_with_config(&config);
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    // Module API Calls:
+    pthread_t threads[4];
+    FdCacheThreadArgs args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, test_fd_cache_thread, &args[i]);
+    }
+
+    int failures = 0;
+    int cold_threads = 0;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+        if (args[i].stats.hit_rate < 0.9)
+            cold_threads++;
+        printf("Thread %d hit rate: %.4f (%llu misses)\n", i, args[i].stats.hit_rate, (unsigned long long)args[i].stats.misses);
+    }
+    printf("The threads had %d failed calls\n", failures);
+
+    IOFdCacheStats total_stats;
+    io_module_get_fd_cache_stats(NULL, &total_stats);
+    printf("Total hit rate: %.4f (%llu hits, %llu misses, %llu spills)\n", total_stats.hit_rate,
+           (unsigned long long)total_stats.hits, (unsigned long long)total_stats.misses, (unsigned long long)total_stats.spills);
+
+    int fd = io_open("file1.txt", IOFILE_MODE_READ);
+    printf("The next fd is: %d\n", fd);
+
+    int failed = failures != 0 || cold_threads != 0 || fd != 0;
+    if (failed)
+        fprintf(stderr, "ERROR: The fd cache missed too often or kept fds after its thread exited\n");
+
+    // Destroy the IOModule
+    io_module_destory();
+
+    // Destroy the file system environment
+    fs_environment_destroy();
+
+    return failed;
+}
+
+////////////////////////////////////
+/* Some IO Benchmarks             */
+////////////////////////////////////
+// Get a monotonic timestamp in nanoseconds for timing benchmarks
+long long bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+    Description: Hold n fds open then time open/close churn on top of them and reads spread across all of them
+    Expected Result: The ns per operation should stay flat as the number of open fds grows from 10 to 1M
+*/
+int bench_fd_table() {
+    printf("\n==============\nbench_fd_table\n==============\n");
+    printf("%10s %18s %12s\n", "open fds", "open+close (ns)", "read (ns)");
+
+    const int iterations = 1000000;
+    char buf[1];
+    for (int open_fds = 10; open_fds <= 1000000; open_fds *= 10) {
+        int fs_init = fs_environment_init();
+        if (!fs_init) {
+            fprintf(stderr, "ERROR: Unable to initialize file system\n");
+            return 1;
+        }
+
+        int module_init = io_module_init();
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        for (int i = 0; i < open_fds; i++)
+            io_open("file2.txt", IOFILE_MODE_READ);
+
+        // Churn a single fd on top of the ones being held open
+        long long start = bench_now_ns();
+        for (int i = 0; i < iterations; i++) {
+            int fd = io_open("file1.txt", IOFILE_MODE_READ);
+            io_close(fd);
+        }
+        double open_close_ns = (double)(bench_now_ns() - start) / iterations;
+
+        // Read from fds spread across the whole table, using a large odd stride to defeat locality
+        int fd = 0;
+        start = bench_now_ns();
+        for (int i = 0; i < iterations; i++) {
+            io_read(fd, buf, 1);
+            fd = (fd + 7919) % open_fds;
+        }
+        double read_ns = (double)(bench_now_ns() - start) / iterations;
+
+        printf("%10d %18.1f %12.1f\n", open_fds, open_close_ns, read_ns);
+
+        io_module_destory();
+        fs_environment_destroy();
+    }
+
+    return 0;
+}
+
+/*
+    Description: Build namespaces of 10 to 1M files then time io_open+io_close of files picked across the whole namespace
+    Expected Result: Open latency should only grow with cache misses as the namespace grows, not with a walk over every file
+*/
+int bench_fs_open() {
+    printf("\n=============\nbench_fs_open\n=============\n");
+    printf("%10s %18s %12s\n", "files", "open+close (ns)", "add (ns)");
+
+    const int iterations = 1000000;
+    const int max_files = 1000000;
+    char (*filenames)[32] = malloc(sizeof(*filenames) * max_files);
+    if (filenames == NULL) {
+        perror("ERROR: Could not allocate benchmark filenames\n");
+        return 1;
+    }
+
+    for (int i = 0; i < max_files; i++)
+        sprintf(filenames[i], "logs/shard%d/file%d.txt", i % 97, i);
+
+    for (int num_files = 10; num_files <= max_files; num_files *= 10) {
+        fs_module = file_system_init();
+        if (fs_module == NULL) {
+            fprintf(stderr, "ERROR: Unable to initialize file system\n");
+            free(filenames);
+            return 1;
+        }
+
+        long long start = bench_now_ns();
+        for (int i = 0; i < num_files; i++)
+            file_system_add_file(fs_module, filenames[i], "data", 4);
+        double add_ns = (double)(bench_now_ns() - start) / num_files;
+
+        int module_init = io_module_init();
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            free(filenames);
+            return 1;
+        }
+
+        // Walk the namespace with a large odd stride to defeat locality
+        int file_index = 0;
+        start = bench_now_ns();
+        for (int i = 0; i < iterations; i++) {
+            int fd = io_open(filenames[file_index], IOFILE_MODE_READ);
+            io_close(fd);
+            file_index = (file_index + 7919) % num_files;
+        }
+        double open_close_ns = (double)(bench_now_ns() - start) / iterations;
+
+        printf("%10d %18.1f %12.1f\n", num_files, open_close_ns, add_ns);
+
+        io_module_destory();
+        file_system_destroy(&fs_module);
+    }
+
+    free(filenames);
+
+    return 0;
+}
+
+/*
+    Description: Build files of 1MB up to 512MB out of 100 byte io_write calls, then overwrite 100 byte ranges spread across them
+    Expected Result: The ns per append should only grow with page faults as the file grows since data is never copied wholesale
+*/
+int bench_write() {
+    printf("\n===========\nbench_write\n===========\n");
+    printf("%12s %14s %17s\n", "file size", "append (ns)", "overwrite (ns)");
+
+    char buf[100];
+    memset(buf, 'x', sizeof(buf));
+    for (size_t file_size = 1 << 20; file_size <= (size_t)1 << 30; file_size *= 8) {
+        int fs_init = fs_environment_init();
+        if (!fs_init) {
+            fprintf(stderr, "ERROR: Unable to initialize file system\n");
+            return 1;
+        }
+
+        int module_init = io_module_init();
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        file_system_add_file(fs_module, "big.bin", "", 0);
+        int fd = io_open("big.bin", IOFILE_MODE_WRITE);
+
+        size_t appends = file_size / sizeof(buf);
+        long long start = bench_now_ns();
+        for (size_t i = 0; i < appends; i++)
+            io_write(fd, buf, sizeof(buf));
+        double append_ns = (double)(bench_now_ns() - start) / appends;
+
+        // Overwrite ranges spread across the file without moving the fd's cursor
+        FSFile* fs_file = file_system_find_file(fs_module, "big.bin");
+        const int overwrites = 1000000;
+        size_t offset = 0;
+        start = bench_now_ns();
+        for (int i = 0; i < overwrites; i++) {
+            file_system_file_write(fs_file, NULL, offset, buf, sizeof(buf));
+            offset = (offset + 7919 * sizeof(buf) + 13) % (file_size - sizeof(buf));
+        }
+        double overwrite_ns = (double)(bench_now_ns() - start) / overwrites;
+
+        printf("%12zu %14.1f %17.1f\n", file_size, append_ns, overwrite_ns);
+
+        io_module_destory();
+        fs_environment_destroy();
+    }
+
+    return 0;
+}
+
+/*
+    Description: Scatter a 64MB file into a 64 byte header and a payload buffer per record, and into 16 byte fields,
+                 once with io_readv and once with the equivalent loop of io_read calls
+    Expected Result: io_readv should beat the io_read loop by the per call fd lookup and cursor update, most of all for small fields
+*/
+int bench_readv() {
+    printf("\n===========\nbench_readv\n===========\n");
+    printf("%22s %16s %16s\n", "layout", "io_read (ns)", "io_readv (ns)");
+
+    const size_t file_size = 64 << 20;
+    char* data = (char*)calloc(file_size, 1);
+    char* scatter_buffer = (char*)malloc(4096);
+    if (data == NULL || scatter_buffer == NULL) {
+        perror("ERROR: Could not allocate benchmark buffers\n");
+        free(data);
+        free(scatter_buffer);
+        return 1;
+    }
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    file_system_add_file(fs_module, "records.bin", data, file_size);
+
+    // Records of 4096 bytes split into a header and a payload, and records of 256 bytes split into 16 fields
+    int layouts[2][2] = { { 4096, 2 }, { 256, 16 } };
+    const char* layout_names[2] = { "64B header + payload", "16 x 16B fields" };
+    for (int layout = 0; layout < 2; layout++) {
+        int record_size = layouts[layout][0];
+        int iovcnt = layouts[layout][1];
+        IOVec iov[16];
+        if (iovcnt == 2) {
+            iov[0].base = scatter_buffer;
+            iov[0].length = 64;
+            iov[1].base = scatter_buffer + 64;
+            iov[1].length = record_size - 64;
+        } else {
+            for (int i = 0; i < iovcnt; i++) {
+                iov[i].base = scatter_buffer + i * 16;
+                iov[i].length = 16;
+            }
+        }
+
+        size_t records = file_size / record_size;
+
+        int fd = io_open("records.bin", IOFILE_MODE_READ);
+        long long start = bench_now_ns();
+        for (size_t r = 0; r < records; r++) {
+            for (int i = 0; i < iovcnt; i++)
+                io_read(fd, (char*)iov[i].base, iov[i].length);
+        }
+        double read_ns = (double)(bench_now_ns() - start) / records;
+        io_close(fd);
+
+        fd = io_open("records.bin", IOFILE_MODE_READ);
+        start = bench_now_ns();
+        for (size_t r = 0; r < records; r++)
+            io_readv(fd, iov, iovcnt);
+        double readv_ns = (double)(bench_now_ns() - start) / records;
+        io_close(fd);
+
+        printf("%22s %16.1f %16.1f\n", layout_names[layout], read_ns, readv_ns);
+    }
+
+    io_module_destory();
+    fs_environment_destroy();
+    free(data);
+    free(scatter_buffer);
+
+    return 0;
+}
+
+/*
+    Description: Fill a 64MB file with log lines of 40 to 160 bytes and another with records of 2000 to 6000 bytes, then
+                 read each record by record with io_read into a 64KB buffer and a byte at a time loop, with io_getline
+                 using each scanner the CPU has, and with io_getdelim_view. The scanners are also timed over the data in
+                 memory for the bandwidth they can reach
+    Expected Result: io_getline should beat the byte at a time loop on either file. Short lines are bound by the cost of
+                     each call, while long records should get the vector scanners most of the way to their in memory speed
+*/
+int bench_getline() {
+    printf("\n=============\nbench_getline\n=============\n");
+
+    const size_t file_size = 64 << 20;
+    char* data = (char*)malloc(file_size);
+    char* block = (char*)malloc(65536);
+    char* line = (char*)malloc(8192);
+    size_t line_size = 8192;
+    if (data == NULL || block == NULL || line == NULL) {
+        perror("ERROR: Could not allocate benchmark buffers\n");
+        free(data);
+        free(block);
+        free(line);
+        return 1;
+    }
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    const char* scanner_names[3] = { "scalar", "sse2", "avx2" };
+    const char* (*scanners[3])(const char*, size_t, char) = { io_scan_delim_scalar, NULL, NULL };
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+        scanners[1] = io_scan_delim_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        scanners[2] = io_scan_delim_avx2;
+#endif
+    const char* (*selected)(const char*, size_t, char) = io_scan_delim;
+
+    const char* filenames[2] = { "app.log", "records.log" };
+    size_t min_lengths[2] = { 40, 2000 };
+    size_t max_lengths[2] = { 160, 6000 };
+    uint64_t random_state = 88172645463325252ull;
+    for (int f = 0; f < 2; f++) {
+        size_t num_lines = 0;
+        for (size_t i = 0; i < file_size; num_lines++) {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            size_t length = min_lengths[f] + random_state % (max_lengths[f] - min_lengths[f] + 1);
+            for (size_t c = 0; c + 1 < length && i < file_size; c++, i++)
+                data[i] = ' ' + (i * 31 + c) % 90;
+            if (i < file_size)
+                data[i++] = '\n';
+        }
+
+        file_system_add_file(fs_module, filenames[f], data, file_size);
+        printf("\n%s: %zu lines of %zu to %zu bytes\n", filenames[f], num_lines, min_lengths[f], max_lengths[f]);
+        printf("%24s %12s %14s\n", "reader", "MB/s", "ns per line");
+
+        // What callers do today, lines are copied out of each block a byte at a time
+        int fd = io_open(filenames[f], IOFILE_MODE_READ);
+        size_t lines = 0;
+        size_t line_length = 0;
+        long long start = bench_now_ns();
+        ssize_t bytes_read;
+        while ((bytes_read = io_read(fd, block, 65536)) > 0) {
+            for (ssize_t i = 0; i < bytes_read; i++) {
+                line[line_length++] = block[i];
+                if (block[i] == '\n') {
+                    lines++;
+                    line_length = 0;
+                }
+            }
+        }
+        double elapsed_ns = (double)(bench_now_ns() - start);
+        printf("%24s %12.0f %14.1f\n", "io_read + byte loop", file_size / (elapsed_ns / 1e3), elapsed_ns / lines);
+        io_close(fd);
+
+        char name[32];
+        for (int s = 0; s < 3; s++) {
+            if (scanners[s] == NULL)
+                continue;
+
+            io_scan_delim = scanners[s];
+            fd = io_open(filenames[f], IOFILE_MODE_READ);
+            lines = 0;
+            start = bench_now_ns();
+            while (io_getline(fd, &line, &line_size) > 0)
+                lines++;
+            elapsed_ns = (double)(bench_now_ns() - start);
+            snprintf(name, sizeof(name), "io_getline (%s)", scanner_names[s]);
+            printf("%24s %12.0f %14.1f\n", name, file_size / (elapsed_ns / 1e3), elapsed_ns / lines);
+            io_close(fd);
+
+            // The scanner alone over the data in memory
+            lines = 0;
+            start = bench_now_ns();
+            for (const char* c = data; (c = scanners[s](c, data + file_size - c, '\n')) != NULL; c++)
+                lines++;
+            elapsed_ns = (double)(bench_now_ns() - start);
+            snprintf(name, sizeof(name), "in memory (%s)", scanner_names[s]);
+            printf("%24s %12.0f %14.1f\n", name, file_size / (elapsed_ns / 1e3), elapsed_ns / lines);
+        }
+        io_scan_delim = selected;
+
+        fd = io_open(filenames[f], IOFILE_MODE_READ);
+        IOView view;
+        lines = 0;
+        start = bench_now_ns();
+        while ((bytes_read = io_getdelim_view(fd, '\n', &view)) > 0) {
+            lines += view.data[bytes_read - 1] == '\n';
+            io_release_view(&view);
+        }
+        elapsed_ns = (double)(bench_now_ns() - start);
+        printf("%24s %12.0f %14.1f\n", "io_getdelim_view", file_size / (elapsed_ns / 1e3), elapsed_ns / lines);
+        io_close(fd);
+    }
+
+    io_module_destory();
+    fs_environment_destroy();
+    free(data);
+    free(block);
+    free(line);
+
+    return 0;
+}
+
+/*
+    Description: Mount a host directory of 100k small files spread over 100 subdirectories, then open and read the first
+                 byte of each of them
+    Expected Result: Mounting should take milliseconds since no file is opened or read, with the cost of the mmaps only
+                     paid by the files that get opened
+*/
+int bench_mount() {
+    printf("\n===========\nbench_mount\n===========\n");
+
+    char root[] = "/tmp/oshandle_bench_XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    for (int d = 0; d < 100; d++) {
+        snprintf(path, sizeof(path), "%s/dir%d", root, d);
+        mkdir(path, 0700);
+        for (int f = 0; f < 1000; f++) {
+            snprintf(path, sizeof(path), "%s/dir%d/file%d.txt", root, d, f);
+            int host_fd = open(path, O_WRONLY | O_CREAT, 0600);
+            write(host_fd, path, strlen(path));
+            close(host_fd);
+        }
+    }
+
+    FileSystem* file_system = file_system_init();
+    long long start = bench_now_ns();
+    int mounted = file_system_mount(file_system, root);
+    double mount_ms = (double)(bench_now_ns() - start) / 1e6;
+    printf("Mounted %d files in %.2f ms\n", mounted, mount_ms);
+
+    // Open the files through the IOModule
+    FileSystem* saved_module = fs_module;
+    fs_module = file_system;
+    io_module_init();
+
+    char filename[64];
+    char byte;
+    start = bench_now_ns();
+    for (int d = 0; d < 100; d++) {
+        for (int f = 0; f < 1000; f++) {
+            snprintf(filename, sizeof(filename), "dir%d/file%d.txt", d, f);
+            int fd = io_open(filename, IOFILE_MODE_READ);
+            io_read(fd, &byte, 1);
+            io_close(fd);
+        }
+    }
+    printf("First open+read+close of each file: %.0f ns\n", (double)(bench_now_ns() - start) / mounted);
+
+    io_module_destory();
+    fs_module = saved_module;
+    file_system_destroy(&file_system);
+
+    for (int d = 0; d < 100; d++) {
+        for (int f = 0; f < 1000; f++) {
+            snprintf(path, sizeof(path), "%s/dir%d/file%d.txt", root, d, f);
+            unlink(path);
+        }
+        snprintf(path, sizeof(path), "%s/dir%d", root, d);
+        rmdir(path);
+    }
+    rmdir(root);
+
+    return 0;
+}
+
+/*
+    Description: Build a file system of 1M small files with file_system_add_file, pack it into an image, then time loading
+                 the image and looking up files from it
+    Expected Result: Loading the image should take microseconds no matter how many files it holds, against seconds for
+                     building the file system file by file, with each first lookup paying only for its own file
+*/
+int bench_image() {
+    printf("\n===========\nbench_image\n===========\n");
+
+    const int num_files = 1000000;
+    char filename[64];
+    char data[64];
+
+    FileSystem* file_system = file_system_init();
+    long long start = bench_now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", i % 1000, i);
+        int length = snprintf(data, sizeof(data), "data of file %d", i);
+        file_system_add_file(file_system, filename, data, length);
+    }
+    double build_ms = (double)(bench_now_ns() - start) / 1e6;
+
+    char image_path[] = "/tmp/oshandle_image_XXXXXX";
+    int image_fd = mkstemp(image_path);
+    close(image_fd);
+    file_system_write_image(file_system, image_path);
+    file_system_destroy(&file_system);
+
+    file_system = file_system_init();
+    start = bench_now_ns();
+    file_system_load_image(file_system, image_path);
+    double load_us = (double)(bench_now_ns() - start) / 1e3;
+
+    start = bench_now_ns();
+    for (int i = 0; i < 100000; i++) {
+        int file_index = (int)(((uint64_t)i * 2654435761u) % num_files);
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", file_index % 1000, file_index);
+        file_system_find_file(file_system, filename);
+    }
+    double lookup_ns = (double)(bench_now_ns() - start) / 100000;
+
+    printf("%d files\n", num_files);
+    printf("file_system_add_file build: %10.2f ms\n", build_ms);
+    printf("Image load:                 %10.2f us\n", load_us);
+    printf("First lookup from image:    %10.0f ns\n", lookup_ns);
+
+    file_system_destroy(&file_system);
+    unlink(image_path);
+
+    return 0;
+}
+
+/*
+    Description: Add 1000 to 100000 files at the bottom of two directory trees 1 to 16 levels deep, then time finding files
+                 in the same directory over and over and alternating between the trees. Then load an image and time
+                 looking up names it doesn't have, the first time and again once the misses have been remembered
+    Expected Result: Finds in the same directory should take the same time at any depth since the walk is skipped, finds
+                     that alternate should grow with the depth but not with the number of files, and remembered misses
+                     should be as cheap as hits instead of probing the image
+*/
+int bench_paths() {
+    printf("\n===========\nbench_paths\n===========\n");
+    printf("%8s %8s %20s %20s\n", "files", "depth", "same directory (ns)", "alternating (ns)");
+
+    const int iterations = 1000000;
+    const int depths[] = { 1, 4, 16 };
+    char prefixes[2][128];
+    char filename[192];
+
+    for (int num_files = 1000; num_files <= 100000; num_files *= 100) {
+        for (int d = 0; d < 3; d++) {
+            // Both trees have depth directories, the files are split between their bottom directories
+            for (int tree = 0; tree < 2; tree++) {
+                int length = 0;
+                for (int level = 0; level < depths[d]; level++)
+                    length += sprintf(prefixes[tree] + length, "%c%d/", 'a' + tree, level);
+            }
+
+            FileSystem* file_system = file_system_init();
+            for (int i = 0; i < num_files; i++) {
+                snprintf(filename, sizeof(filename), "%sfile%d.txt", prefixes[i % 2], i / 2);
+                file_system_add_file(file_system, filename, "data", 4);
+            }
+
+            long long start = bench_now_ns();
+            for (int i = 0; i < iterations; i++) {
+                int file_index = (int)(((uint64_t)i * 7919) % (num_files / 2));
+                snprintf(filename, sizeof(filename), "%sfile%d.txt", prefixes[0], file_index);
+                file_system_find_file(file_system, filename);
+            }
+            double same_ns = (double)(bench_now_ns() - start) / iterations;
+
+            start = bench_now_ns();
+            for (int i = 0; i < iterations; i++) {
+                int file_index = (int)(((uint64_t)i * 7919) % (num_files / 2));
+                snprintf(filename, sizeof(filename), "%sfile%d.txt", prefixes[i % 2], file_index);
+                file_system_find_file(file_system, filename);
+            }
+            double alternating_ns = (double)(bench_now_ns() - start) / iterations;
+
+            printf("%8d %8d %20.1f %20.1f\n", num_files, depths[d], same_ns, alternating_ns);
+            file_system_destroy(&file_system);
+        }
+    }
+
+    // Misses in a file system with an image loaded, every directory is made by finding one of its files first
+    const int image_files = 100000;
+    const int misses = 4000;
+    FileSystem* file_system = file_system_init();
+    for (int i = 0; i < image_files; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", i % 100, i);
+        file_system_add_file(file_system, filename, "data", 4);
+    }
+
+    char image_path[] = "/tmp/oshandle_image_XXXXXX";
+    int image_fd = mkstemp(image_path);
+    close(image_fd);
+    file_system_write_image(file_system, image_path);
+    file_system_destroy(&file_system);
+
+    file_system = file_system_init();
+    file_system_load_image(file_system, image_path);
+    for (int i = 0; i < 100; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", i, i);
+        file_system_find_file(file_system, filename);
+    }
+
+    long long start = bench_now_ns();
+    for (int i = 0; i < misses; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/missing%d.txt", i % 100, i);
+        file_system_find_file(file_system, filename);
+    }
+    double first_miss_ns = (double)(bench_now_ns() - start) / misses;
+
+    start = bench_now_ns();
+    for (int i = 0; i < iterations; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/missing%d.txt", i % 100, i % misses);
+        file_system_find_file(file_system, filename);
+    }
+    double remembered_miss_ns = (double)(bench_now_ns() - start) / iterations;
+
+    start = bench_now_ns();
+    for (int i = 0; i < iterations; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", i % 100, i % 100);
+        file_system_find_file(file_system, filename);
+    }
+    double hit_ns = (double)(bench_now_ns() - start) / iterations;
+
+    printf("Image misses: first %.1f ns, remembered %.1f ns, hits %.1f ns\n", first_miss_ns, remembered_miss_ns, hit_ns);
+
+    file_system_destroy(&file_system);
+    unlink(image_path);
+
+    return 0;
+}
+
+/*
+    Description: Add 1M small files, report where the file system's memory goes, time scanning every name for a prefix
+                 that matches 1 in 1000 files, and time tearing the file system down
+    Expected Result: The overhead per file should be a couple of hundred bytes, the scan should take a few ns per file
+                     since it only reads the name arrays, and teardown should be a few tens of ms
+*/
+int bench_fs_layout_visit(FSFile* file, void* arg) {
+    (*(size_t*)arg) += file->size;
+    return 1;
+}
+
+int bench_fs_layout() {
+    printf("\n===============\nbench_fs_layout\n===============\n");
+
+    const int num_files = 1000000;
+    char filename[64];
+    char data[64];
+
+    FileSystem* file_system = file_system_init();
+    long long start = bench_now_ns();
+    for (int i = 0; i < num_files; i++) {
+        snprintf(filename, sizeof(filename), "dir%d/file%d.txt", i % 1000, i);
+        int length = snprintf(data, sizeof(data), "data of file %d", i);
+        file_system_add_file(file_system, filename, data, length);
+    }
+    double build_ms = (double)(bench_now_ns() - start) / 1e6;
+
+    FSMemoryStats stats;
+    file_system_get_memory_stats(file_system, &stats);
+
+    size_t matched_bytes = 0;
+    start = bench_now_ns();
+    size_t matched = file_system_scan(file_system, "dir7/", bench_fs_layout_visit, &matched_bytes);
+    double scan_ns = (double)(bench_now_ns() - start) / num_files;
+
+    start = bench_now_ns();
+    file_system_destroy(&file_system);
+    double destroy_ms = (double)(bench_now_ns() - start) / 1e6;
+
+    printf("%zu files built in %.2f ms\n", stats.num_files, build_ms);
+    printf("FSFiles %zu, names %zu, tables %zu, chunks %zu, data %zu bytes\n",
+        stats.file_bytes, stats.name_bytes, stats.table_bytes, stats.chunk_bytes, stats.data_bytes);
+    printf("Overhead per file: %.1f bytes\n", stats.overhead_per_file);
+    printf("Prefix scan: %.2f ns per file, %zu matched\n", scan_ns, matched);
+    printf("Destroy: %.2f ms\n", destroy_ms);
+
+    return 0;
+}
+
+/*
+    Description: Write a 1GB file, clone it 1000 times, then write one byte to one of the clones
+    Expected Result: A clone should take the same time as cloning a tiny file and add next to no memory, and the write
+                     should only copy the clone's chunk table and one chunk
+*/
+int bench_clone() {
+    printf("\n===========\nbench_clone\n===========\n");
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    file_system_add_file(fs_module, "big.bin", NULL, 0);
+    int fd = io_open("big.bin", IOFILE_MODE_WRITE);
+    char* block = (char*)malloc(FS_CHUNK_SIZE);
+    memset(block, 'x', FS_CHUNK_SIZE);
+    for (off_t offset = 0; offset < (1LL << 30); offset += FS_CHUNK_SIZE)
+        io_pwrite(fd, block, FS_CHUNK_SIZE, offset);
+    io_close(fd);
+    free(block);
+
+    FSMemoryStats before;
+    file_system_get_memory_stats(fs_module, &before);
+
+    char filename[32];
+    long long start = bench_now_ns();
+    for (int i = 0; i < 1000; i++) {
+        snprintf(filename, sizeof(filename), "clone%d.bin", i);
+        io_clone("big.bin", filename);
+    }
+    double clone_ns = (double)(bench_now_ns() - start) / 1000;
+
+    start = bench_now_ns();
+    for (int i = 0; i < 1000; i++) {
+        snprintf(filename, sizeof(filename), "small_clone%d.txt", i);
+        io_clone("file1.txt", filename);
+    }
+    double small_clone_ns = (double)(bench_now_ns() - start) / 1000;
+
+    FSMemoryStats after_clone;
+    file_system_get_memory_stats(fs_module, &after_clone);
+
+    fd = io_open("clone0.bin", IOFILE_MODE_WRITE);
+    start = bench_now_ns();
+    io_pwrite(fd, "y", 1, 12345678);
+    double write_us = (double)(bench_now_ns() - start) / 1e3;
+    io_close(fd);
+
+    FSMemoryStats after_write;
+    file_system_get_memory_stats(fs_module, &after_write);
+
+    size_t before_bytes = before.file_bytes + before.name_bytes + before.table_bytes + before.chunk_bytes;
+    size_t clone_bytes = after_clone.file_bytes + after_clone.name_bytes + after_clone.table_bytes + after_clone.chunk_bytes;
+    size_t write_bytes = after_write.file_bytes + after_write.name_bytes + after_write.table_bytes + after_write.chunk_bytes;
+    printf("Clone of a 1GB file: %10.0f ns\n", clone_ns);
+    printf("Clone of a 10B file: %10.0f ns\n", small_clone_ns);
+    printf("Memory added by 2000 clones: %zu bytes\n", clone_bytes - before_bytes);
+    printf("First write to a clone: %.1f us, %zu bytes added\n", write_us, write_bytes - clone_bytes);
+
+    io_module_destory();
+    fs_environment_destroy();
+
+    return 0;
+}
+
+/*
+    Description: Write 10000 records of 4KB at random record slots of a 64GB index file, then walk its data with
+                 IO_SEEK_DATA and IO_SEEK_HOLE and read the extents it finds back 4KB at a time
+    Expected Result: The file should take memory for the chunks it was written to rather than its 64GB size, and the
+                     walk should cost time in the number of chunks rather than the number of bytes
+*/
+int bench_sparse() {
+    printf("\n============\nbench_sparse\n============\n");
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    const off_t index_size = 64LL << 30;
+    const int num_records = 10000;
+    char record[4096];
+    memset(record, 'r', sizeof(record));
+
+    FSMemoryStats before;
+    file_system_get_memory_stats(fs_module, &before);
+
+    file_system_add_file(fs_module, "index.bin", NULL, 0);
+    int fd = io_open("index.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+    srand(1);
+    long long start = bench_now_ns();
+    for (int i = 0; i < num_records; i++) {
+        off_t slot = (((off_t)rand() << 16) ^ rand()) % (index_size / (off_t)sizeof(record));
+        io_pwrite(fd, record, sizeof(record), slot * sizeof(record));
+    }
+    double write_ns = (double)(bench_now_ns() - start) / num_records;
+
+    FSMemoryStats after;
+    file_system_get_memory_stats(fs_module, &after);
+
+    start = bench_now_ns();
+    int extents = 0;
+    off_t position = 0;
+    size_t data_bytes = 0;
+    while ((position = io_lseek(fd, position, IO_SEEK_DATA)) != -1) {
+        off_t hole = io_lseek(fd, position, IO_SEEK_HOLE);
+        data_bytes += hole - position;
+        position = hole;
+        extents++;
+    }
+    double walk_ms = (double)(bench_now_ns() - start) / 1e6;
+
+    start = bench_now_ns();
+    int blocks_read = 0;
+    position = 0;
+    while ((position = io_lseek(fd, position, IO_SEEK_DATA)) != -1) {
+        io_read(fd, record, sizeof(record));
+        position += sizeof(record);
+        blocks_read++;
+    }
+    double read_ms = (double)(bench_now_ns() - start) / 1e6;
+
+    size_t memory = after.table_bytes + after.chunk_bytes - before.table_bytes - before.chunk_bytes;
+    printf("Logical size: %lld bytes, memory: %zu bytes (%.4f%%)\n", (long long)io_lseek(fd, 0, IO_SEEK_END), memory,
+           100.0 * memory / index_size);
+    printf("Random 4KB record write: %10.0f ns\n", write_ns);
+    printf("DATA/HOLE walk of %d extents (%zu bytes): %.2f ms\n", extents, data_bytes, walk_ms);
+    printf("Read of the %d 4KB blocks found by DATA: %.2f ms\n", blocks_read, read_ms);
+
+    io_module_destory();
+    fs_environment_destroy();
+
+    return 0;
+}
+
+/*
+    Description: Serve requests that each make 48 reads of 64 bytes from one fd, once with a call per read and once
+                 with all of the reads in one ring submit, for reads scattered across the file and for back to back reads
+    Expected Result: The ring should cut the per read cost by around half either way, since the reads of a request share
+                     one API call, one fd lookup and one hold of the file's lock
+*/
+int bench_ring() {
+    printf("\n==========\nbench_ring\n==========\n");
+    printf("%12s %16s %16s\n", "reads", "io_pread (ns)", "io_ring (ns)");
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    int module_init = io_module_init();
+    if (!module_init) {
+        fprintf(stderr, "Unable to initialize IOModule\n");
+        return 1;
+    }
+
+    char* data = (char*)calloc(1 << 20, 1);
+    file_system_add_file(fs_module, "hot.bin", data, 1 << 20);
+    free(data);
+    int fd = io_open("hot.bin", IOFILE_MODE_READ);
+
+    IORing* ring = io_ring_init(64);
+    IOCompletion completions[64];
+    char buffer[48 * 64];
+    const int requests = 100000;
+
+    for (int scattered = 1; scattered >= 0; scattered--) {
+        off_t stride = scattered ? 4160 : 64;
+
+        long long start = bench_now_ns();
+        for (int r = 0; r < requests; r++) {
+            for (int i = 0; i < 48; i++)
+                io_pread(fd, buffer + i * 64, 64, (i * stride) % ((1 << 20) - 64));
+        }
+        double pread_ns = (double)(bench_now_ns() - start) / (requests * 48);
+
+        start = bench_now_ns();
+        for (int r = 0; r < requests; r++) {
+            for (int i = 0; i < 48; i++)
+                io_ring_prep_read(io_ring_get_submission(ring), fd, buffer + i * 64, 64, (i * stride) % ((1 << 20) - 64));
+            io_ring_submit(ring);
+            io_ring_reap(ring, completions, 64);
+        }
+        double ring_ns = (double)(bench_now_ns() - start) / (requests * 48);
+
+        printf("%12s %16.1f %16.1f\n", scattered ? "scattered" : "sequential", pread_ns, ring_ns);
+    }
+
+    io_ring_destroy(&ring);
+    io_module_destory();
+    fs_environment_destroy();
+
+    return 0;
+}
+
+/*
+    Description: 1 to 32 threads io_pread 64 bytes at a time from one hot shared fd, with every 8th operation being an
+                 io_open+io_close of a private fd, first with the fd lock taken on every open and close then with the fd cache on
+    Expected Result: Throughput should scale with the number of cores since fd lookups take no locks, and with the fd cache
+                     opens and closes should stop contending on the fd lock
+*/
+typedef struct BenchPageCacheArgs {
+    int fd;
+    int reads;
+    unsigned int seed;
+} BenchPageCacheArgs;
+
+// Random 4K reads of the first 8MB of the file
+void* bench_page_cache_worker(void* arg) {
+    BenchPageCacheArgs* args = (BenchPageCacheArgs*)arg;
+    char buffer[4096];
+    for (int i = 0; i < args->reads; i++) {
+        args->seed = args->seed * 1103515245 + 12345;
+        io_pread(args->fd, buffer, sizeof(buffer), (off_t)(args->seed % 2048) * 4096);
+    }
+
+    return NULL;
+}
+
+/*
+    Description: Put a 64MB file on a disk store behind a 16MB page cache, read it sequentially, make random 4K reads of
+                 its first 8MB with and without the cache, then mix those reads with a scan of the whole file, and finally
+                 make the random reads from 1 to 8 threads
+    Expected Result: The 8MB working set fits in the cache so random reads hit almost every time and are much cheaper than
+                     going to the store, and the scan going past barely lowers their hit rate
+*/
+int bench_page_cache() {
+    printf("\n================\nbench_page_cache\n================\n");
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_disk(root);
+    file_system_add_stored_file(fs_module, "big.bin", store);
+
+    const size_t file_size = 64 << 20;
+    char* block = (char*)malloc(1 << 20);
+    memset(block, 'x', 1 << 20);
+
+    for (int cached = 1; cached >= 0; cached--) {
+        IOModuleConfig config;
+        io_module_default_config(&config);
+        config.page_cache_size = cached ? 16 << 20 : 0;
+        int module_init = io_module_init_with_config(&config);
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        int fd = io_open("big.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+        if (cached) {
+            for (size_t offset = 0; offset < file_size; offset += 1 << 20)
+                io_pwrite(fd, block, 1 << 20, offset);
+
+            long long start = bench_now_ns();
+            for (size_t offset = 0; offset < file_size; offset += 1 << 20)
+                io_pread(fd, block, 1 << 20, offset);
+            double seconds = (double)(bench_now_ns() - start) / 1e9;
+            printf("Sequential read: %.0f MB/s\n", file_size / seconds / 1e6);
+        }
+
+        // Warm the working set up, twice so that it makes it out of probation
+        BenchPageCacheArgs args;
+        args.fd = fd;
+        args.reads = 20000;
+        args.seed = 1;
+        bench_page_cache_worker(&args);
+        bench_page_cache_worker(&args);
+
+        IOPageCacheStats before, after;
+        io_module_get_page_cache_stats(&before);
+        args.reads = 1000000;
+        long long start = bench_now_ns();
+        bench_page_cache_worker(&args);
+        double read_ns = (double)(bench_now_ns() - start) / args.reads;
+        io_module_get_page_cache_stats(&after);
+
+        if (!cached) {
+            printf("Random 4K read without the cache: %.0f ns\n", read_ns);
+            io_module_destory();
+            break;
+        }
+
+        printf("Random 4K read: %.0f ns, hit rate %.4f\n", read_ns,
+            (double)(after.hits - before.hits) / (after.hits - before.hits + after.misses - before.misses));
+
+        // Every 64 random reads, read the next 256K of the scan and only count the random reads' hits and misses
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        args.reads = 64;
+        for (size_t scan = 0; scan < file_size; scan += 1 << 18) {
+            io_module_get_page_cache_stats(&before);
+            bench_page_cache_worker(&args);
+            io_module_get_page_cache_stats(&after);
+            hits += after.hits - before.hits;
+            misses += after.misses - before.misses;
+
+            io_pread(fd, block, 1 << 18, scan);
+        }
+        printf("Random 4K reads during a scan: hit rate %.4f\n", (double)hits / (hits + misses));
+
+        pthread_t threads[8];
+        BenchPageCacheArgs thread_args[8];
+        for (int num_threads = 1; num_threads <= 8; num_threads *= 2) {
+            start = bench_now_ns();
+            for (int i = 0; i < num_threads; i++) {
+                thread_args[i].fd = fd;
+                thread_args[i].reads = 500000;
+                thread_args[i].seed = i + 1;
+                pthread_create(&threads[i], NULL, bench_page_cache_worker, &thread_args[i]);
+            }
+            for (int i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+            double seconds = (double)(bench_now_ns() - start) / 1e9;
+            printf("%d threads: %.2f M reads/s\n", num_threads, 500000.0 * num_threads / seconds / 1e6);
+        }
+
+        io_module_get_page_cache_stats(&after);
+        printf("Totals: %llu hits, %llu misses, %llu evictions, %llu ghost hits\n", (unsigned long long)after.hits,
+            (unsigned long long)after.misses, (unsigned long long)after.evictions, (unsigned long long)after.ghost_hits);
+
+        io_module_destory();
+    }
+
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(block);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/big.bin", root);
+    unlink(path);
+    rmdir(root);
+
+    return 0;
+}
+
+/*
+    Description: Stream a 16MB stored file through 4K io_reads from a store that takes 100us a read, with and without
+                 readahead, then make random 4K reads of it from a cold cache and stream an in-memory file in 64 byte reads
+    Expected Result: Readahead keeps the stream from waiting on most reads, while random reads and small reads of a file
+                     in memory cost the same either way
+*/
+int bench_readahead() {
+    printf("\n===============\nbench_readahead\n===============\n");
+    printf("%10s %14s %14s %14s %12s %12s\n", "readahead", "stream MB/s", "random us", "64B read ns", "pages ahead", "usefulness");
 
-    return bytes_read;
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_slow(fs_store_init_disk(root), 100000, 0);
+    file_system_add_stored_file(fs_module, "stream.bin", store);
+
+    const size_t file_size = 16 << 20;
+    char* block = (char*)malloc(1 << 20);
+    memset(block, 'x', 1 << 20);
+    file_system_add_file(fs_module, "memory.bin", block, 1 << 20);
+    char buffer[4096];
+
+    for (int readahead = 0; readahead < 2; readahead++) {
+        IOModuleConfig config;
+        io_module_default_config(&config);
+        config.readahead_max_window = readahead ? IO_READAHEAD_DEFAULT_MAX_WINDOW : 0;
+        int module_init = io_module_init_with_config(&config);
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        int fd = io_open("stream.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+        if (readahead == 0) {
+            for (size_t offset = 0; offset < file_size; offset += 1 << 20)
+                io_pwrite(fd, block, 1 << 20, offset);
+        }
+
+        // The tracking on every read through the cursor of a file in memory
+        int memory_fd = io_open("memory.bin", IOFILE_MODE_READ);
+        const int small_reads = 2000000;
+        long long start = bench_now_ns();
+        for (int i = 0; i < small_reads; i++) {
+            if (io_read(memory_fd, buffer, 64) < 64) {
+                io_close(memory_fd);
+                memory_fd = io_open("memory.bin", IOFILE_MODE_READ);
+            }
+        }
+        double small_ns = (double)(bench_now_ns() - start) / small_reads;
+        io_close(memory_fd);
+
+        start = bench_now_ns();
+        while (io_read(fd, buffer, sizeof(buffer)) > 0)
+            ;
+        double seconds = (double)(bench_now_ns() - start) / 1e9;
+        io_close(fd);
+
+        IOReadaheadStats stats;
+        io_module_get_readahead_stats(&stats);
+        io_module_destory();
+
+        // Random reads start from a cold cache
+        module_init = io_module_init_with_config(&config);
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        fd = io_open("stream.bin", IOFILE_MODE_READ);
+        unsigned int seed = 1;
+        const int reads = 500;
+        start = bench_now_ns();
+        for (int i = 0; i < reads; i++) {
+            seed = seed * 1103515245 + 12345;
+            io_pread(fd, buffer, sizeof(buffer), (off_t)(seed % (file_size / sizeof(buffer))) * sizeof(buffer));
+        }
+        double random_us = (double)(bench_now_ns() - start) / 1e3 / reads;
+        io_close(fd);
+
+        printf("%10s %14.1f %14.1f %14.1f %12llu %12.4f\n", readahead ? "on" : "off", file_size / seconds / 1e6, random_us,
+            small_ns, (unsigned long long)stats.pages_prefetched, stats.usefulness);
+
+        io_module_destory();
+    }
+
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(block);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stream.bin", root);
+    unlink(path);
+    rmdir(root);
+
+    return 0;
 }
 
-////////////////////////////////////
-/* Some IO Tests                  */
-////////////////////////////////////
 /*
-    Description: 4 file descriptors are requested from the system, 2 are freed and another 2 are requested
-    Expected Result: The file descriptors of the 2 files which were closed should be reused for the new files
+    Description: Time 1M preads of 64 bytes with tracing off and on, then replay the trace as fast as it goes
+    Expected Result: Tracing should add about a clock read, a ring store and the share of writing the trace out per
+                     call, and the replay should run the calls at close to their untraced speed
 */
-int test_reuse() {
-    printf("\n==========\ntest_reuse\n==========\n");
-    // Set up a simple file system environment with a few files store as files in a linked list
+int bench_trace() {
+    printf("\n===========\nbench_trace\n===========\n");
+
     int fs_init = fs_environment_init();
     if (!fs_init) {
         fprintf(stderr, "ERROR: Unable to initialize file system\n");
         return 1;
     }
 
-    // Initialize the IOModule
+    char* data = (char*)calloc(1 << 20, 1);
+    file_system_add_file(fs_module, "hot.bin", data, 1 << 20);
+    free(data);
+
     int module_init = io_module_init();
     if (!module_init) {
         fprintf(stderr, "Unable to initialize IOModule\n");
         return 1;
     }
 
-    // Module API Calls:
-    int fd1 = io_open("file1.txt", IOFILE_MODE_READ);
-    int fd2 = io_open("file1.txt", IOFILE_MODE_READ);
-    int fd3 = io_open("file1.txt", IOFILE_MODE_READ);
-    int fd4 = io_open("file1.txt", IOFILE_MODE_READ);
-
-    int r = io_close(fd2);
-    r = io_close(fd3);
+    char trace_path[] = "/tmp/oshandle_trace_XXXXXX";
+    int trace_fd = mkstemp(trace_path);
+    close(trace_fd);
+
+    const int iterations = 1000000;
+    char buffer[64];
+    int fd = io_open("hot.bin", IOFILE_MODE_READ);
+    double ns[2];
+    IOTraceStats trace_stats;
+    for (int traced = 0; traced < 2; traced++) {
+        if (traced)
+            io_trace_start(trace_path);
+
+        long long start = bench_now_ns();
+        for (int i = 0; i < iterations; i++)
+            io_pread(fd, buffer, 64, ((off_t)i * 4096) & ((1 << 20) - 1));
+        ns[traced] = (double)(bench_now_ns() - start) / iterations;
+
+        if (traced)
+            io_trace_stop(&trace_stats);
+    }
+    io_close(fd);
 
-    int fd5 = io_open("file2.txt", IOFILE_MODE_READ);
-    printf("The fd of the first new file is: %d\n", fd5);
+    printf("pread untraced: %6.1f ns, traced: %6.1f ns\n", ns[0], ns[1]);
+    printf("Events: %llu, stalls: %llu, bytes per event: %.1f\n", (unsigned long long)trace_stats.events,
+           (unsigned long long)trace_stats.stalls, (double)trace_stats.bytes / trace_stats.events);
 
-    int fd6 = io_open("file2.txt", IOFILE_MODE_READ);
-    printf("The fd of the second new file is: %d\n", fd6);
+    IOReplayStats replay_stats;
+    io_trace_replay(trace_path, 0, &replay_stats);
+    printf("Replay: %.2f M calls/s, mismatches: %llu\n", replay_stats.events / replay_stats.seconds / 1e6,
+           (unsigned long long)replay_stats.mismatches);
+    io_replay_write_stats(&replay_stats, stdout);
 
-    // Destroy the IOModule
     io_module_destory();
+    fs_environment_destroy();
+    unlink(trace_path);
+
+    return 0;
+}
+
+typedef struct BenchThreadArgs {
+    int shared_fd;
+    int operations;
+} BenchThreadArgs;
+
+void* bench_threads_worker(void* arg) {
+    BenchThreadArgs* args = (BenchThreadArgs*)arg;
+    char buffer[64];
+    off_t offset = 0;
+    for (int i = 0; i < args->operations; i++) {
+        if (i % 8 == 7) {
+            int fd = io_open("file1.txt", IOFILE_MODE_READ);
+            io_close(fd);
+        } else {
+            io_pread(args->shared_fd, buffer, sizeof(buffer), offset);
+            offset = (offset + 4160) % ((1 << 20) - 64);
+        }
+    }
+
+    return NULL;
+}
+
+int bench_threads() {
+    printf("\n=============\nbench_threads\n=============\n");
+    printf("%8s %14s %14s %10s\n", "threads", "Mops/s", "cached Mops/s", "hit rate");
+
+    int fs_init = fs_environment_init();
+    if (!fs_init) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 1;
+    }
+
+    char* data = (char*)calloc(1 << 20, 1);
+    file_system_add_file(fs_module, "hot.bin", data, 1 << 20);
+    free(data);
+
+    const int operations = 2000000;
+    for (int num_threads = 1; num_threads <= 32; num_threads *= 2) {
+        double mops[2];
+        IOFdCacheStats cache_stats;
+        for (int cached = 0; cached < 2; cached++) {
+            IOModuleConfig config;
+            io_module_default_config(&config);
+            config.fd_cache_enabled = cached;
+            int module_init = io_module_init_with_config(&config);
+            if (!module_init) {
+                fprintf(stderr, "Unable to initialize IOModule\n");
+                return 1;
+            }
+
+            int shared_fd = io_open("hot.bin", IOFILE_MODE_READ);
+
+            pthread_t threads[32];
+            BenchThreadArgs args[32];
+
+            long long start = bench_now_ns();
+            for (int i = 0; i < num_threads; i++) {
+                args[i].shared_fd = shared_fd;
+                args[i].operations = operations;
+                pthread_create(&threads[i], NULL, bench_threads_worker, &args[i]);
+            }
+            for (int i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+            double seconds = (double)(bench_now_ns() - start) / 1e9;
+
+            mops[cached] = (double)operations * num_threads / seconds / 1e6;
+            io_module_get_fd_cache_stats(NULL, &cache_stats);
+            io_module_destory();
+        }
+
+        printf("%8d %14.2f %14.2f %10.4f\n", num_threads, mops[0], mops[1], cache_stats.hit_rate);
+    }
 
-    // Destroy the file system environment
     fs_environment_destroy();
+
+    return 0;
 }
 
 /*
-    Description: Program attempts to close fd that never existed
-    Expected Result: Call to io_close should return -1 and when calling perror(), 
-                     should mention bad file descriptor error 
+    Description: Threads open, pread and close their own file, first all in the default context and then each in a
+                 context of its own with a FileSystem of its own
+    Expected Result: With a context per thread no two threads share the fd lock, the fd table or the filename index, so
+                     throughput should hold up as threads are added where the shared context contends on the fd lock
 */
-int test_ebadf() {
-    printf("\n==========\ntest_ebadf\n==========\n");
+typedef struct BenchContextArgs {
+    IOModule* ctx;
+    char filename[32];
+    int operations;
+} BenchContextArgs;
+
+void* bench_contexts_worker(void* arg) {
+    BenchContextArgs* args = (BenchContextArgs*)arg;
+    char buffer[64];
+    for (int i = 0; i < args->operations; i++) {
+        int fd = io_ctx_open(args->ctx, args->filename, IOFILE_MODE_READ);
+        io_ctx_pread(args->ctx, fd, buffer, sizeof(buffer), 0);
+        io_ctx_close(args->ctx, fd);
+    }
+
+    return NULL;
+}
+
+int bench_contexts() {
+    printf("\n==============\nbench_contexts\n==============\n");
+    printf("%8s %14s %18s\n", "threads", "shared Mops/s", "per thread Mops/s");
 
-    // Set up a simple file system environment with a few files store as files in a linked list
     int fs_init = fs_environment_init();
     if (!fs_init) {
         fprintf(stderr, "ERROR: Unable to initialize file system\n");
         return 1;
     }
 
-    // Initialize the IOModule
     int module_init = io_module_init();
     if (!module_init) {
         fprintf(stderr, "Unable to initialize IOModule\n");
         return 1;
     }
 
-    // Module API Calls:
-    int r = io_close(0);
-    printf("The return code is: %d\n", r);
-    perror("The error is");
+    const int operations = 200000;
+    for (int num_threads = 1; num_threads <= 16; num_threads *= 2) {
+        pthread_t threads[16];
+        BenchContextArgs args[16];
+        FileSystem* file_systems[16];
+        double mops[2];
+        for (int separate = 0; separate < 2; separate++) {
+            for (int i = 0; i < num_threads; i++) {
+                snprintf(args[i].filename, sizeof(args[i].filename), "thread%d.bin", i);
+                args[i].operations = operations;
+                if (separate) {
+                    IOModuleConfig config;
+                    io_module_default_config(&config);
+                    file_systems[i] = file_system_init();
+                    file_system_add_file(file_systems[i], args[i].filename, "data", 4);
+                    args[i].ctx = io_ctx_init(file_systems[i], &config);
+                } else {
+                    if (file_system_find_file(fs_module, args[i].filename) == NULL)
+                        file_system_add_file(fs_module, args[i].filename, "data", 4);
+                    args[i].ctx = io_default_module;
+                }
+            }
 
-    // Destroy the IOModule
-    io_module_destory();
+            long long start = bench_now_ns();
+            for (int i = 0; i < num_threads; i++)
+                pthread_create(&threads[i], NULL, bench_contexts_worker, &args[i]);
+            for (int i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+            double seconds = (double)(bench_now_ns() - start) / 1e9;
+            mops[separate] = (double)operations * 3 * num_threads / seconds / 1e6;
+
+            for (int i = 0; separate && i < num_threads; i++) {
+                io_ctx_destroy(&args[i].ctx);
+                file_system_destroy(&file_systems[i]);
+            }
+        }
 
-    // Destroy the file system environment
+        printf("%8d %14.2f %18.2f\n", num_threads, mops[0], mops[1]);
+    }
+
+    io_module_destory();
     fs_environment_destroy();
+
+    return 0;
 }
 
 /*
-    Description: Program calls io_open to get a handle on file2.txt and reads 5 bytes from the file and then another 7
-    Expected Result: The first read should read the word hello and then second read, the word good bye
+    Description: Read every page of a 16MB stored file once in a shuffled order from a cold cache and a store that takes
+                 200us a read, first with blocking io_preads and then with io_pread_asyncs polled for on 1, 2, 4 and 8
+                 workers
+    Expected Result: Blocking reads wait out the store one at a time, while the workers overlap their waits so the reads
+                     speed up about as many times as there are workers
 */
-int test_read() {
-    printf("\n=========\ntest_read\n=========\n");
+int bench_async() {
+    printf("\n===========\nbench_async\n===========\n");
+    printf("%10s %12s %12s %10s\n", "workers", "reads/s", "us/read", "stolen");
 
-    // Set up a simple file system environment with a few files store as files in a linked list
     int fs_init = fs_environment_init();
     if (!fs_init) {
         fprintf(stderr, "ERROR: Unable to initialize file system\n");
         return 1;
     }
 
-    // Initialize the IOModule
+    char root[] = "/tmp/oshandle_store_XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("ERROR: Unable to create a host directory\n");
+        return 1;
+    }
+
+    FSStore* store = fs_store_init_slow(fs_store_init_disk(root), 200000, 0);
+    file_system_add_stored_file(fs_module, "async.bin", store);
+
+    const int num_pages = (16 << 20) / IO_PAGE_SIZE;
+    char* block = (char*)malloc(1 << 20);
+    memset(block, 'x', 1 << 20);
+    char* buffers = (char*)malloc((size_t)num_pages * IO_PAGE_SIZE);
+    off_t* offsets = (off_t*)malloc(sizeof(off_t) * num_pages);
+    IOAsyncCompletion* completions = (IOAsyncCompletion*)malloc(sizeof(IOAsyncCompletion) * num_pages);
+
+    unsigned int seed = 1;
+    for (int i = 0; i < num_pages; i++)
+        offsets[i] = (off_t)i * IO_PAGE_SIZE;
+    for (int i = num_pages - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        int j = seed % (i + 1);
+        off_t offset = offsets[i];
+        offsets[i] = offsets[j];
+        offsets[j] = offset;
+    }
+
+    // Worker counts of 0 make blocking reads from the calling thread
+    int worker_counts[] = { 0, 1, 2, 4, 8 };
+    for (int w = 0; w < 5; w++) {
+        IOModuleConfig config;
+        io_module_default_config(&config);
+        config.readahead_max_window = 0;
+        config.async_workers = worker_counts[w];
+        int module_init = io_module_init_with_config(&config);
+        if (!module_init) {
+            fprintf(stderr, "Unable to initialize IOModule\n");
+            return 1;
+        }
+
+        int fd = io_open("async.bin", IOFILE_MODE_READ | IOFILE_MODE_WRITE);
+        if (w == 0) {
+            for (off_t offset = 0; offset < (off_t)num_pages * IO_PAGE_SIZE; offset += 1 << 20)
+                io_pwrite(fd, block, 1 << 20, offset);
+
+            // Start the reads from a cold cache
+            io_close(fd);
+            io_module_destory();
+            io_module_init_with_config(&config);
+            fd = io_open("async.bin", IOFILE_MODE_READ);
+        }
+
+        long long start = bench_now_ns();
+        if (worker_counts[w] == 0) {
+            for (int i = 0; i < num_pages; i++)
+                io_pread(fd, buffers + (size_t)i * IO_PAGE_SIZE, IO_PAGE_SIZE, offsets[i]);
+        } else {
+            for (int i = 0; i < num_pages; i++)
+                io_pread_async(fd, buffers + (size_t)i * IO_PAGE_SIZE, IO_PAGE_SIZE, offsets[i], NULL, NULL);
+            for (int taken = 0; taken < num_pages;)
+                taken += io_async_poll(completions, num_pages, num_pages - taken);
+        }
+        double seconds = (double)(bench_now_ns() - start) / 1e9;
+        io_close(fd);
+
+        IOAsyncStats stats;
+        io_module_get_async_stats(&stats);
+        io_module_destory();
+
+        char workers[16];
+        if (worker_counts[w] == 0)
+            snprintf(workers, sizeof(workers), "blocking");
+        else
+            snprintf(workers, sizeof(workers), "%d", worker_counts[w]);
+        printf("%10s %12.0f %12.1f %10llu\n", workers, num_pages / seconds, seconds * 1e6 / num_pages,
+            (unsigned long long)stats.stolen);
+    }
+
+    fs_environment_destroy();
+    fs_store_destroy(&store);
+    free(block);
+    free(buffers);
+    free(offsets);
+    free(completions);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/async.bin", root);
+    unlink(path);
+    rmdir(root);
+
+    return 0;
+}
+
+////////////////////////////////////
+/* Benchmark Suite                */
+////////////////////////////////////
+// Each case times its operation in batches of BENCH_BATCH_OPS operations, first for some warmup repetitions that are
+// thrown away and then for the recorded ones. The ns per operation of every recorded batch make up the percentiles,
+// and each case is written as one CSV line so that runs can be compared and gated by a script
+#define BENCH_BATCH_OPS 64
+#define BENCH_DEFAULT_WARMUP 2
+#define BENCH_DEFAULT_REPETITIONS 10
+#define BENCH_MAX_FILES 1000000
+
+typedef struct BenchSuite {
+    // Only the cases whose name contains filter are run, all of them when it's NULL
+    const char* filter;
+    int warmup;
+    int repetitions;
+    // The ns per operation of each recorded batch of the case being run
+    double* samples;
+    size_t num_samples;
+    size_t samples_capacity;
+} BenchSuite;
+
+// A case runs ops operations per repetition. before and after are optional and run untimed around each batch, so
+// that for example the fds a batch of io_close calls needs can be opened outside of the timing
+typedef struct BenchCase {
+    const char* name;
+    char params[64];
+    size_t ops;
+    // The bytes each operation moves for the throughput column, 0 when it isn't a data operation
+    size_t bytes_per_op;
+    void (*before)(void* arg, size_t num_ops);
+    void (*run)(void* arg, size_t num_ops);
+    void (*after)(void* arg, size_t num_ops);
+    void* arg;
+} BenchCase;
+
+// The environment the cases run against, a namespace of files with some fds held open
+typedef struct BenchSuiteState {
+    char (*filenames)[32];
+    size_t num_files;
+    // The fds of the batch being run
+    int batch_fds[BENCH_BATCH_OPS];
+    // The fds held open for the whole case
+    int* held_fds;
+    size_t num_held_fds;
+    // Walks the namespace or the held fds with a large odd stride to defeat locality
+    size_t next;
+    uint64_t rng;
+    int fd;
+    char* buffer;
+    size_t read_size;
+} BenchSuiteState;
+
+int bench_compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Get the nearest rank percentile p of the sorted samples
+double bench_percentile(const double* sorted, size_t num_samples, double p) {
+    size_t rank = (size_t)(p * num_samples + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+void bench_suite_print_header() {
+    printf("name,params,repetitions,ops,ns_min,ns_p50,ns_p90,ns_p99,ns_max,ns_mean,mops_per_s,mb_per_s\n");
+}
+
+// Run a case and write its CSV line, skipping it if it doesn't match the suite's filter
+int bench_suite_run(BenchSuite* suite, BenchCase* bench_case) {
+    if (suite->filter != NULL && strstr(bench_case->name, suite->filter) == NULL)
+        return 1;
+
+    size_t batches = (bench_case->ops + BENCH_BATCH_OPS - 1) / BENCH_BATCH_OPS;
+    size_t needed = batches * suite->repetitions;
+    if (needed > suite->samples_capacity) {
+        double* samples = (double*)realloc(suite->samples, sizeof(double) * needed);
+        if (samples == NULL) {
+            perror("ERROR: Could not allocate benchmark samples\n");
+            return 0;
+        }
+        suite->samples = samples;
+        suite->samples_capacity = needed;
+    }
+
+    suite->num_samples = 0;
+    long long total_ns = 0;
+    for (int repetition = 0; repetition < suite->warmup + suite->repetitions; repetition++) {
+        for (size_t op = 0; op < bench_case->ops; op += BENCH_BATCH_OPS) {
+            size_t num_ops = bench_case->ops - op < BENCH_BATCH_OPS ? bench_case->ops - op : BENCH_BATCH_OPS;
+            if (bench_case->before != NULL)
+                bench_case->before(bench_case->arg, num_ops);
+
+            long long start = bench_now_ns();
+            bench_case->run(bench_case->arg, num_ops);
+            long long elapsed = bench_now_ns() - start;
+
+            if (bench_case->after != NULL)
+                bench_case->after(bench_case->arg, num_ops);
+
+            if (repetition >= suite->warmup) {
+                suite->samples[suite->num_samples++] = (double)elapsed / num_ops;
+                total_ns += elapsed;
+            }
+        }
+    }
+
+    qsort(suite->samples, suite->num_samples, sizeof(double), bench_compare_doubles);
+    double mean = (double)total_ns / ((double)bench_case->ops * suite->repetitions);
+    double mb_per_s = bench_case->bytes_per_op > 0 ? bench_case->bytes_per_op * 1e3 / mean : 0;
+
+    printf("%s,%s,%d,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.1f\n", bench_case->name, bench_case->params,
+           suite->repetitions, bench_case->ops, suite->samples[0],
+           bench_percentile(suite->samples, suite->num_samples, 0.50),
+           bench_percentile(suite->samples, suite->num_samples, 0.90),
+           bench_percentile(suite->samples, suite->num_samples, 0.99),
+           suite->samples[suite->num_samples - 1], mean, 1e3 / mean, mb_per_s);
+    fflush(stdout);
+
+    return 1;
+}
+
+uint64_t bench_suite_random(BenchSuiteState* state) {
+    state->rng ^= state->rng << 13;
+    state->rng ^= state->rng >> 7;
+    state->rng ^= state->rng << 17;
+    return state->rng;
+}
+
+// Set up a namespace of num_files files and hold num_held_fds fds open on it
+int bench_suite_environment_init(BenchSuiteState* state, size_t num_files, size_t num_held_fds) {
+    fs_module = file_system_init();
+    if (fs_module == NULL) {
+        fprintf(stderr, "ERROR: Unable to initialize file system\n");
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_files; i++)
+        file_system_add_file(fs_module, state->filenames[i], "data", 4);
+
     int module_init = io_module_init();
     if (!module_init) {
         fprintf(stderr, "Unable to initialize IOModule\n");
-        return 1;
+        file_system_destroy(&fs_module);
+        return 0;
     }
 
-    // Module API Calls:
-    int fd = io_open("file2.txt", IOFILE_MODE_READ);
-    if (fd == -1) {
-        printf("Failed to open file\n");
+    state->num_files = num_files;
+    state->num_held_fds = 0;
+    for (size_t i = 0; i < num_held_fds; i++) {
+        state->held_fds[i] = io_open(state->filenames[i % num_files], IOFILE_MODE_READ);
+        if (state->held_fds[i] == -1)
+            break;
+        state->num_held_fds++;
+    }
+    state->next = 0;
+    state->rng = 88172645463325252ULL;
+
+    return 1;
+}
+
+void bench_suite_environment_destroy() {
+    io_module_destory();
+    file_system_destroy(&fs_module);
+}
+
+void bench_suite_open(void* arg, size_t num_ops) {
+    BenchSuiteState* state = (BenchSuiteState*)arg;
+    for (size_t i = 0; i < num_ops; i++) {
+        state->batch_fds[i] = io_open(state->filenames[state->next], IOFILE_MODE_READ);
+        state->next = (state->next + 7919) % state->num_files;
+    }
+}
+
+void bench_suite_close(void* arg, size_t num_ops) {
+    BenchSuiteState* state = (BenchSuiteState*)arg;
+    for (size_t i = 0; i < num_ops; i++)
+        io_close(state->batch_fds[i]);
+}
+
+// Close a random held fd and open a new one in its place, which is what keeps the fd table from being a simple stack
+void bench_suite_churn(void* arg, size_t num_ops) {
+    BenchSuiteState* state = (BenchSuiteState*)arg;
+    for (size_t i = 0; i < num_ops; i++) {
+        size_t slot = bench_suite_random(state) % state->num_held_fds;
+        io_close(state->held_fds[slot]);
+        state->held_fds[slot] = io_open(state->filenames[slot % state->num_files], IOFILE_MODE_READ);
+    }
+}
+
+void bench_suite_read(void* arg, size_t num_ops) {
+    BenchSuiteState* state = (BenchSuiteState*)arg;
+    for (size_t i = 0; i < num_ops; i++) {
+        if (io_read(state->fd, state->buffer, state->read_size) < (ssize_t)state->read_size)
+            io_lseek(state->fd, 0, IO_SEEK_SET);
+    }
+}
+
+void bench_suite_find(void* arg, size_t num_ops) {
+    BenchSuiteState* state = (BenchSuiteState*)arg;
+    for (size_t i = 0; i < num_ops; i++) {
+        FSFile* file = file_system_find_file(fs_module, state->filenames[state->next]);
+        state->next = (state->next + 7919) % state->num_files;
+        __asm__ volatile("" : : "r"(file) : "memory");
+    }
+}
+
+// Run the cases of the suite whose names contain filter, with warmup and repetitions per case
+int bench_suite(const char* filter, int warmup, int repetitions) {
+    BenchSuite suite = { 0 };
+    suite.filter = filter;
+    suite.warmup = warmup;
+    suite.repetitions = repetitions;
+
+    BenchSuiteState state = { 0 };
+    state.filenames = malloc(sizeof(*state.filenames) * BENCH_MAX_FILES);
+    state.held_fds = (int*)malloc(sizeof(int) * BENCH_MAX_FILES);
+    state.buffer = (char*)malloc(1 << 16);
+    if (state.filenames == NULL || state.held_fds == NULL || state.buffer == NULL) {
+        perror("ERROR: Could not allocate the benchmark suite\n");
+        free(state.filenames);
+        free(state.held_fds);
+        free(state.buffer);
         return 1;
     }
 
-    char hello_buffer[6];
-    hello_buffer[5] = '\0';
-    
-    io_read(fd, hello_buffer, 5);
-    printf("Greeting 1: %s\n", hello_buffer);
+    for (int i = 0; i < BENCH_MAX_FILES; i++)
+        sprintf(state.filenames[i], "logs/shard%d/file%d.txt", i % 97, i);
 
-    char goodbye_buffer[8];
-    goodbye_buffer[7] = '\0';
+    bench_suite_print_header();
+    BenchCase bench_case;
 
-    io_read(fd, goodbye_buffer, 7);
-    printf("Greeting 2: %s\n", goodbye_buffer);
+    // io_open and io_close, each timed with the other one run untimed around it
+    const size_t namespace_sizes[] = { 100, 10000, 1000000 };
+    for (int i = 0; i < 3; i++) {
+        if (!bench_suite_environment_init(&state, namespace_sizes[i], 0))
+            break;
 
-    // Destroy the IOModule
-    io_module_destory();
+        bench_case = (BenchCase){ "io_open", "", 1 << 16, 0, NULL, bench_suite_open, bench_suite_close, &state };
+        snprintf(bench_case.params, sizeof(bench_case.params), "files=%zu", namespace_sizes[i]);
+        bench_suite_run(&suite, &bench_case);
 
-    // Destroy the file system environment
-    fs_environment_destroy();
+        bench_case = (BenchCase){ "io_close", "", 1 << 16, 0, bench_suite_open, bench_suite_close, NULL, &state };
+        snprintf(bench_case.params, sizeof(bench_case.params), "files=%zu", namespace_sizes[i]);
+        bench_suite_run(&suite, &bench_case);
+
+        bench_suite_environment_destroy();
+    }
+
+    // Reads of each size from the cursor of one fd, rewinding at the end of the file
+    const size_t read_sizes[] = { 1, 64, 4096, 65536 };
+    for (int i = 0; i < 4; i++) {
+        if (!bench_suite_environment_init(&state, 1, 0))
+            break;
+
+        char* data = (char*)calloc(1 << 23, 1);
+        file_system_add_file(fs_module, "read.bin", data, 1 << 23);
+        free(data);
+        state.fd = io_open("read.bin", IOFILE_MODE_READ);
+        state.read_size = read_sizes[i];
+
+        size_t ops = (1 << 28) / read_sizes[i];
+        bench_case = (BenchCase){ "io_read", "", ops < (1 << 18) ? ops : (1 << 18), read_sizes[i], NULL,
+                                  bench_suite_read, NULL, &state };
+        snprintf(bench_case.params, sizeof(bench_case.params), "size=%zu", read_sizes[i]);
+        bench_suite_run(&suite, &bench_case);
+
+        bench_suite_environment_destroy();
+    }
+
+    // Replacing random fds among the ones held open
+    for (size_t held_fds = 10; held_fds <= 1000000; held_fds *= 100) {
+        if (!bench_suite_environment_init(&state, 100, held_fds))
+            break;
+
+        bench_case = (BenchCase){ "fd_churn", "", 1 << 16, 0, NULL, bench_suite_churn, NULL, &state };
+        snprintf(bench_case.params, sizeof(bench_case.params), "open_fds=%zu", held_fds);
+        bench_suite_run(&suite, &bench_case);
+
+        bench_suite_environment_destroy();
+    }
+
+    // Lookups across the namespace, with and without a full fd table next to it
+    const size_t held_fd_counts[] = { 0, 100000 };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (!bench_suite_environment_init(&state, namespace_sizes[i], held_fd_counts[j]))
+                break;
+
+            bench_case = (BenchCase){ "find_file", "", 1 << 18, 0, NULL, bench_suite_find, NULL, &state };
+            snprintf(bench_case.params, sizeof(bench_case.params), "files=%zu;open_fds=%zu", namespace_sizes[i],
+                     held_fd_counts[j]);
+            bench_suite_run(&suite, &bench_case);
+
+            bench_suite_environment_destroy();
+        }
+    }
+
+    free(suite.samples);
+    free(state.filenames);
+    free(state.held_fds);
+    free(state.buffer);
+
+    return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // Run the benchmarks instead of the tests when asked to
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench_fd_table();
+        bench_fs_open();
+        bench_write();
+        bench_readv();
+        bench_getline();
+        bench_ring();
+        bench_mount();
+        bench_image();
+        bench_paths();
+        bench_fs_layout();
+        bench_clone();
+        bench_sparse();
+        bench_page_cache();
+        bench_readahead();
+        bench_trace();
+        bench_threads();
+        bench_contexts();
+        bench_async();
+        return 0;
+    }
+
+    // Run the benchmark suite, optionally only the cases whose names contain a filter, and write the results as CSV
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        const char* filter = NULL;
+        int warmup = BENCH_DEFAULT_WARMUP;
+        int repetitions = BENCH_DEFAULT_REPETITIONS;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+                warmup = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+                repetitions = atoi(argv[++i]);
+            else
+                filter = argv[i];
+        }
+
+        if (warmup < 0 || repetitions < 1) {
+            fprintf(stderr, "Usage: %s suite [--warmup <n>] [--reps <n>] [filter]\n", argv[0]);
+            return 1;
+        }
+
+        return bench_suite(filter, warmup, repetitions);
+    }
+
+    // Replay a trace against an empty FileSystem, at full speed or with --timed at the pace it was traced at
+    if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+        if (argc < 3 || (argc == 4 && strcmp(argv[3], "--timed") != 0) || argc > 4) {
+            fprintf(stderr, "Usage: %s replay <trace> [--timed]\n", argv[0]);
+            return 1;
+        }
+
+        fs_module = file_system_init();
+        if (fs_module == NULL || !io_module_init()) {
+            fprintf(stderr, "ERROR: Unable to initialize the IOModule\n");
+            return 1;
+        }
+
+        IOReplayStats stats;
+        int replayed = io_trace_replay(argv[2], argc == 4, &stats);
+        if (!replayed)
+            perror("ERROR: Unable to replay the trace");
+        else
+            io_replay_write_stats(&stats, stdout);
+
+        io_module_destory();
+        file_system_destroy(&fs_module);
+        return replayed ? 0 : 1;
+    }
+
+    // Pack a host directory into a FileSystem image
+    if (argc > 1 && strcmp(argv[1], "pack") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: %s pack <host directory> <image>\n", argv[0]);
+            return 1;
+        }
+
+        FileSystem* file_system = file_system_init();
+        int mounted = file_system_mount(file_system, argv[2]);
+        if (mounted == -1 || !file_system_write_image(file_system, argv[3])) {
+            perror("ERROR: Unable to pack the directory");
+            file_system_destroy(&file_system);
+            return 1;
+        }
+
+        printf("Packed %d files into %s\n", mounted, argv[3]);
+        file_system_destroy(&file_system);
+        return 0;
+    }
+
     // test_reuse();
     // test_ebadf();
     test_read();
+    // test_lowest_fd();
+    // test_pool_stats();
+    // test_write();
+    // test_read_view();
+    // test_readv_writev();
+    // test_getdelim();
+    // test_pread_pwrite();
+    // test_threads();
+    // test_fd_cache();
+    // test_stats();
+    // test_trace();
+    // test_contexts();
+    // test_ring();
+    // test_async();
+    // test_mount();
+    // test_image();
+    // test_directories();
+    // test_clone();
+    // test_lseek();
+    // test_page_cache();
+    // test_readahead();
 
     return 0;
-}
\ No newline at end of file
+}